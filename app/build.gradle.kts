@@ -12,6 +12,11 @@ if (localPropertiesFile.exists()) {
     localPropertiesFile.inputStream().use { localProperties.load(it) }
 }
 
+// Optimized native builds, see docs/PGO_LTO_BUILD.md
+// -Pbaseweight.pgo=off|generate|use  -Pbaseweight.lto=true
+val pgoMode = project.findProperty("baseweight.pgo")?.toString() ?: "off"
+val enableLto = project.findProperty("baseweight.lto")?.toString()?.toBoolean() ?: false
+
 android {
     namespace = "ai.baseweight.baseweightsnap"
     compileSdk = 35
@@ -28,7 +33,9 @@ android {
         externalNativeBuild {
             cmake {
                 arguments(
-                    "-DANDROID_STL=c++_shared"
+                    "-DANDROID_STL=c++_shared",
+                    "-DPGO_MODE=$pgoMode",
+                    "-DENABLE_LTO=${if (enableLto) "ON" else "OFF"}"
                 )
             }
         }
@@ -0,0 +1,186 @@
+#include "async_log.h"
+#include <cstdlib>
+#ifdef __ANDROID__
+#include <android/log.h>
+#endif
+
+AsyncLog& AsyncLog::getInstance() {
+    // Never destroyed, other singletons' destructors may still log
+    static AsyncLog* instance = new AsyncLog();
+    return *instance;
+}
+
+AsyncLog::AsyncLog() {
+    slots = new Slot[N_SLOTS];
+    for (size_t i = 0; i < N_SLOTS; i++) {
+        slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+#ifndef __ANDROID__
+    out = stderr;
+    if (const char* path = getenv("BASEWEIGHT_LOG_FILE")) {
+        if (FILE* f = fopen(path, "a")) {
+            out = f;
+        } else {
+            fprintf(stderr, "async_log: can't open %s, logging to stderr\n", path);
+        }
+    }
+#endif
+    worker = std::thread(&AsyncLog::run, this);
+    // Runs before the destructors of statics constructed before us, and
+    // after those of statics constructed later
+    std::atexit([] { getInstance().shutdown(); });
+}
+
+void AsyncLog::shutdown() {
+    stopped.store(true, std::memory_order_seq_cst);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        wake.notify_one();
+    }
+    worker.join();
+    // Published by callers that claimed a slot just before stopped was set
+    char line[1024];
+    while (drainOne(line, sizeof(line))) {
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        drained.notify_all();
+    }
+#ifndef __ANDROID__
+    fflush(out);
+#endif
+}
+
+// Bounded MPSC queue (Vyukov): a slot is free for position pos when its seq
+// equals pos, and holds a record for the reader when seq is pos + 1
+AsyncLog::Slot* AsyncLog::claim() {
+    size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    for (;;) {
+        Slot* slot = &slots[pos & (N_SLOTS - 1)];
+        const size_t seq = slot->seq.load(std::memory_order_acquire);
+        const intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0) {
+            if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                slot->pos = pos;
+                return slot;
+            }
+        } else if (diff < 0) {
+            n_dropped.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        } else {
+            pos = enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+void AsyncLog::publish(Slot* slot) {
+    slot->seq.store(slot->pos + 1, std::memory_order_release);
+    // Pairs with the fence in run(): either the thread sees this slot before
+    // it sleeps, or we see it sleeping and wake it
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> lock(mutex);
+        wake.notify_one();
+    }
+}
+
+void AsyncLog::formatLine(const Slot* slot, char* line, size_t size) {
+    int n = slot->format(line, size, slot->fmt, slot->payload);
+    n = std::min<int>(std::max(n, 0), (int) size - 1);
+    // Some callers end their lines with \n, logcat and our sink add one
+    while (n > 0 && line[n - 1] == '\n') {
+        line[--n] = 0;
+    }
+}
+
+bool AsyncLog::pending() const {
+    const size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+    return slots[pos & (N_SLOTS - 1)].seq.load(std::memory_order_acquire) == pos + 1;
+}
+
+bool AsyncLog::drainOne(char* line, size_t size) {
+    const size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+    Slot* slot = &slots[pos & (N_SLOTS - 1)];
+    if (slot->seq.load(std::memory_order_acquire) != pos + 1) {
+        return false;
+    }
+
+    formatLine(slot, line, size);
+    const int level = slot->level;
+    const char* tag = slot->tag;
+
+    slot->seq.store(pos + N_SLOTS, std::memory_order_release);
+    dequeue_pos.store(pos + 1, std::memory_order_release);
+    emit(level, tag, line);
+    return true;
+}
+
+void AsyncLog::emit(int level, const char* tag, const char* line) {
+#ifdef __ANDROID__
+    static const int priorities[] = {ANDROID_LOG_DEBUG, ANDROID_LOG_INFO, ANDROID_LOG_WARN, ANDROID_LOG_ERROR};
+    __android_log_write(priorities[std::min(std::max(level, 0), 3)], tag, line);
+#else
+    static const char letters[] = "DIWE";
+    fprintf(out, "%c %s: %s\n", letters[std::min(std::max(level, 0), 3)], tag, line);
+    if (level >= BW_LOG_LEVEL_WARN) {
+        fflush(out);
+    }
+#endif
+}
+
+void AsyncLog::emitDirect(const Slot* slot) {
+    char line[1024];
+    formatLine(slot, line, sizeof(line));
+    emit(slot->level, slot->tag, line);
+#ifndef __ANDROID__
+    fflush(out);
+#endif
+}
+
+void AsyncLog::run() {
+    char line[1024];
+    for (;;) {
+        bool wrote = false;
+        while (drainOne(line, sizeof(line))) {
+            wrote = true;
+        }
+
+        const uint64_t dropped_now = n_dropped.load(std::memory_order_relaxed);
+        if (dropped_now != n_reported_dropped) {
+            snprintf(line, sizeof(line), "log ring full, dropped %llu lines",
+                     (unsigned long long) (dropped_now - n_reported_dropped));
+            emit(BW_LOG_LEVEL_WARN, "async_log.cpp", line);
+            n_reported_dropped = dropped_now;
+        }
+
+        if (wrote) {
+            std::lock_guard<std::mutex> lock(mutex);
+            drained.notify_all();
+            continue;
+        }
+        if (stopped.load(std::memory_order_acquire)) {
+            break;
+        }
+#ifndef __ANDROID__
+        fflush(out);
+#endif
+        std::unique_lock<std::mutex> lock(mutex);
+        sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!pending() && !stopped.load(std::memory_order_relaxed)) {
+            wake.wait(lock);
+        }
+        sleeping.store(false, std::memory_order_relaxed);
+    }
+#ifndef __ANDROID__
+    fflush(out);
+#endif
+}
+
+void AsyncLog::flush() {
+    const size_t target = enqueue_pos.load(std::memory_order_acquire);
+    std::unique_lock<std::mutex> lock(mutex);
+    drained.wait(lock, [&] {
+        return dequeue_pos.load(std::memory_order_acquire) >= target || stopped.load(std::memory_order_acquire);
+    });
+}
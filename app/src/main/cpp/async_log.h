@@ -0,0 +1,221 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+/*
+ * Logging that stays off the decode thread.
+ *
+ * LOGi/LOGe (and LOGd) copy the format string pointer and the raw arguments
+ * into a slot of a lock-free ring and return. A background thread does the
+ * printf formatting and writes the line to logcat, or to stderr (or the file
+ * named by BASEWEIGHT_LOG_FILE) off Android. When the ring is full the line
+ * is dropped and counted instead of blocking the caller. The thread sleeps on
+ * a condition variable while the ring is empty, a caller only takes the lock
+ * to wake it.
+ *
+ * The logger is never destroyed. At exit the thread writes what's left and
+ * stops, and lines logged after that (static destructors) are written by the
+ * caller, so it doesn't matter which singleton goes first.
+ *
+ * Levels below BW_LOG_MIN_LEVEL are compiled out, see LOG_LEVEL in
+ * CMakeLists.txt.
+ *
+ * Format strings must be literals. String arguments are copied into the slot
+ * and truncated if they don't fit, anything else has to be trivially
+ * copyable (no std::string, use c_str()).
+ */
+
+#define BW_LOG_LEVEL_DEBUG 0
+#define BW_LOG_LEVEL_INFO  1
+#define BW_LOG_LEVEL_WARN  2
+#define BW_LOG_LEVEL_ERROR 3
+
+#ifndef BW_LOG_MIN_LEVEL
+#define BW_LOG_MIN_LEVEL BW_LOG_LEVEL_INFO
+#endif
+
+// Never called, it's there so the compiler still checks format arguments
+static inline void bw_log_check_format(const char*, ...) __attribute__((format(printf, 1, 2)));
+static inline void bw_log_check_format(const char*, ...) {}
+
+#define BW_LOG(level, tag, ...)                                     \
+    do {                                                            \
+        if ((level) >= BW_LOG_MIN_LEVEL) {                          \
+            if (false) bw_log_check_format(__VA_ARGS__);            \
+            AsyncLog::getInstance().write((level), (tag), __VA_ARGS__); \
+        }                                                           \
+    } while (0)
+
+namespace async_log_detail {
+
+// How one argument is stored in a slot: as itself, or for strings as an
+// offset to a copy further down the payload
+template <typename T>
+struct arg {
+    static_assert(std::is_trivially_copyable<T>::value, "log arguments must be trivially copyable");
+    using stored = T;
+    static stored pack(T v, uint8_t*, size_t&, size_t) { return v; }
+    static T unpack(stored v, const uint8_t*) { return v; }
+};
+
+template <>
+struct arg<const char*> {
+    using stored = uint32_t;
+    static stored pack(const char* s, uint8_t* payload, size_t& used, size_t capacity) {
+        if (!s) {
+            s = "(null)";
+        }
+        // The last byte is always a terminator, an out of room string points at it
+        if (used + 1 >= capacity) {
+            return (stored) (capacity - 1);
+        }
+        const size_t len = strlen(s);
+        const size_t n = std::min(len, capacity - 1 - used);
+        memcpy(payload + used, s, n);
+        payload[used + n] = 0;
+        if (n < len && n >= 3) {
+            memcpy(payload + used + n - 3, "...", 3);
+        }
+        const stored offset = (stored) used;
+        used += n + 1;
+        return offset;
+    }
+    static const char* unpack(stored offset, const uint8_t* payload) {
+        return reinterpret_cast<const char*>(payload + offset);
+    }
+};
+
+template <>
+struct arg<char*> : arg<const char*> {};
+
+template <typename... A>
+using packed = std::tuple<typename arg<A>::stored...>;
+
+template <typename... A, size_t... I>
+static int format_impl(char* out, size_t size, const char* fmt, const uint8_t* payload, std::index_sequence<I...>) {
+    const auto& t = *reinterpret_cast<const packed<A...>*>(payload);
+    return snprintf(out, size, fmt, arg<A>::unpack(std::get<I>(t), payload)...);
+}
+
+template <typename... A>
+static int format(char* out, size_t size, const char* fmt, const uint8_t* payload) {
+    if constexpr (sizeof...(A) == 0) {
+        // Checked at compile time, the only conversion left is %%
+        size_t n = 0;
+        for (const char* c = fmt; *c && n + 1 < size; c++) {
+            if (c[0] == '%' && c[1] == '%') {
+                c++;
+            }
+            out[n++] = *c;
+        }
+        out[n] = 0;
+        return (int) n;
+    } else {
+        return format_impl<A...>(out, size, fmt, payload, std::index_sequence_for<A...>{});
+    }
+}
+
+} // namespace async_log_detail
+
+class AsyncLog {
+public:
+    static AsyncLog& getInstance();
+
+    AsyncLog(const AsyncLog&) = delete;
+    AsyncLog& operator=(const AsyncLog&) = delete;
+
+    template <typename... A>
+    void write(int level, const char* tag, const char* fmt, A... args) {
+        if (stopped.load(std::memory_order_acquire)) {
+            Slot slot;
+            fill(&slot, level, tag, fmt, args...);
+            emitDirect(&slot);
+            return;
+        }
+        Slot* slot = claim();
+        if (!slot) {
+            return;
+        }
+        fill(slot, level, tag, fmt, args...);
+        publish(slot);
+    }
+
+    // Blocks until everything logged so far has been written out
+    void flush();
+
+    uint64_t dropped() const { return n_dropped.load(std::memory_order_relaxed); }
+
+private:
+    AsyncLog();
+    ~AsyncLog() = delete;
+
+    static const size_t N_SLOTS = 512;         // power of two
+    static const size_t PAYLOAD_SIZE = 480;
+
+    typedef int (*format_fn)(char* out, size_t size, const char* fmt, const uint8_t* payload);
+
+    struct Slot {
+        std::atomic<size_t> seq;
+        size_t pos;
+        int level;
+        const char* tag;
+        const char* fmt;
+        format_fn format;
+        alignas(8) uint8_t payload[PAYLOAD_SIZE];
+    };
+
+    template <typename... A>
+    static void fill(Slot* slot, int level, const char* tag, const char* fmt, A... args) {
+        using Packed = async_log_detail::packed<typename std::decay<A>::type...>;
+        static_assert(sizeof(Packed) <= PAYLOAD_SIZE / 2, "too many log arguments");
+
+        slot->level = level;
+        slot->tag = tag;
+        slot->fmt = fmt;
+        slot->format = &async_log_detail::format<typename std::decay<A>::type...>;
+        slot->payload[PAYLOAD_SIZE - 1] = 0;
+        if constexpr (sizeof...(A) > 0) {
+            size_t used = (sizeof(Packed) + 7) & ~size_t(7);
+            // Braced init keeps the strings in argument order
+            new (slot->payload) Packed{
+                async_log_detail::arg<typename std::decay<A>::type>::pack(args, slot->payload, used, PAYLOAD_SIZE)...};
+        }
+    }
+
+    Slot* claim();
+    void publish(Slot* slot);
+    static void formatLine(const Slot* slot, char* line, size_t size);
+    bool drainOne(char* line, size_t size);
+    void emit(int level, const char* tag, const char* line);
+    void emitDirect(const Slot* slot);
+    bool pending() const;
+    void run();
+    // Registered with atexit, drains the ring and stops the thread
+    void shutdown();
+
+    Slot* slots;
+    alignas(64) std::atomic<size_t> enqueue_pos{0};
+    alignas(64) std::atomic<size_t> dequeue_pos{0};
+    std::atomic<uint64_t> n_dropped{0};
+    uint64_t n_reported_dropped = 0;
+    // Set at exit, callers write their own lines from then on
+    std::atomic<bool> stopped{false};
+    // The thread waits on wake while the ring is empty, flush() on drained
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable drained;
+    std::atomic<bool> sleeping{false};
+    FILE* out = nullptr;
+    std::thread worker;
+};
@@ -0,0 +1,222 @@
+#include "audio_stream.h"
+#include "mtmd-helper.h"
+#include "async_log.h"
+#include <algorithm>
+#include <cmath>
+
+#undef TAG
+#define TAG "audio_stream.cpp"
+#define LOGi(...) BW_LOG(BW_LOG_LEVEL_INFO, TAG, __VA_ARGS__)
+#define LOGe(...) BW_LOG(BW_LOG_LEVEL_ERROR, TAG, __VA_ARGS__)
+
+// How much speech goes into one encoder pass. Short enough that the tail left
+// at the end of a question is small, long enough that the per-pass overhead
+// doesn't dominate.
+static const float SEGMENT_SECONDS = 5.0f;
+// We look for the quietest frame in the last second before the target length
+static const float CUT_WINDOW_SECONDS = 1.0f;
+static const float CUT_FRAME_SECONDS = 0.02f;
+// Tails shorter than this are just the recorder stopping, not speech
+static const float MIN_TAIL_SECONDS = 0.1f;
+
+bool AudioStream::begin(mtmd_context* mctx, const llama_model* model, int sample_rate) {
+    clear();
+    if (!mctx || !model) {
+        LOGe("Models not loaded");
+        return false;
+    }
+    if (!mtmd_support_audio(mctx)) {
+        LOGe("Loaded mmproj has no audio encoder");
+        return false;
+    }
+    if (sample_rate <= 0) {
+        LOGe("Invalid sample rate %d", sample_rate);
+        return false;
+    }
+
+    ctx = mctx;
+    n_embd = llama_model_n_embd(model);
+    in_rate = sample_rate;
+    out_rate = mtmd_get_audio_bitrate(mctx);
+    if (out_rate <= 0) {
+        out_rate = 16000;
+    }
+    resample_pos = 1.0;
+    resample_prev = 0.0f;
+    recording = true;
+    LOGi("Audio stream started, %d Hz in, %d Hz to the encoder", in_rate, out_rate);
+    return true;
+}
+
+bool AudioStream::append(const int16_t* pcm, size_t n_samples) {
+    if (!recording) {
+        LOGe("append() without begin()");
+        return false;
+    }
+    if (n_samples == 0) {
+        return true;
+    }
+    total_samples += n_samples;
+
+    // Linear resampling, carrying the last input sample and the fractional
+    // position over to the next call so buffer boundaries don't click
+    std::vector<float> in(n_samples + 1);
+    in[0] = resample_prev;
+    for (size_t i = 0; i < n_samples; i++) {
+        in[i + 1] = pcm[i] / 32768.0f;
+    }
+    const double step = (double) in_rate / out_rate;
+    double pos = resample_pos;
+    while (pos < n_samples) {
+        size_t i = (size_t) pos;
+        float frac = (float) (pos - i);
+        pending.push_back(in[i] * (1.0f - frac) + in[i + 1] * frac);
+        pos += step;
+    }
+    resample_pos = pos - n_samples;
+    resample_prev = in[n_samples];
+
+    const size_t segment_len = (size_t) (SEGMENT_SECONDS * out_rate);
+    while (pending.size() >= segment_len) {
+        const int64_t t0 = ggml_time_us();
+        bool ok = encodeSegment(findCut());
+        stream_encode_us += ggml_time_us() - t0;
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool AudioStream::end() {
+    if (!recording) {
+        LOGe("end() without begin()");
+        return false;
+    }
+    recording = false;
+
+    const int64_t t0 = ggml_time_us();
+    bool ok = true;
+    if (pending.size() >= (size_t) (MIN_TAIL_SECONDS * out_rate) || (segments.empty() && !pending.empty())) {
+        ok = encodeSegment(pending.size());
+    }
+    pending.clear();
+    tail_encode_us = ggml_time_us() - t0;
+
+    LOGi("audio: %.2f s, %zu segments, encoded while recording %.1f ms, tail %.1f ms",
+         (double) total_samples / in_rate, segments.size(), stream_encode_us / 1e3, tail_encode_us / 1e3);
+    return ok && !segments.empty();
+}
+
+void AudioStream::clear() {
+    recording = false;
+    pending.clear();
+    segments.clear();
+    total_samples = 0;
+    stream_encode_us = 0;
+    tail_encode_us = 0;
+}
+
+size_t AudioStream::findCut() const {
+    const size_t segment_len = (size_t) (SEGMENT_SECONDS * out_rate);
+    const size_t window = (size_t) (CUT_WINDOW_SECONDS * out_rate);
+    const size_t frame = std::max<size_t>(1, (size_t) (CUT_FRAME_SECONDS * out_rate));
+
+    size_t best = segment_len;
+    float best_energy = INFINITY;
+    for (size_t start = segment_len - window; start + frame <= segment_len; start += frame) {
+        float energy = 0.0f;
+        for (size_t i = start; i < start + frame; i++) {
+            energy += pending[i] * pending[i];
+        }
+        if (energy < best_energy) {
+            best_energy = energy;
+            best = start + frame / 2;
+        }
+    }
+    return best;
+}
+
+bool AudioStream::encodeSegment(size_t n_samples) {
+    mtmd::bitmap bmp(mtmd_bitmap_init_from_audio(n_samples, pending.data()));
+    pending.erase(pending.begin(), pending.begin() + n_samples);
+    if (!bmp.ptr) {
+        LOGe("Failed to create audio bitmap");
+        return false;
+    }
+
+    // The marker alone gives us the audio chunks plus whatever begin/end
+    // tokens the model wraps audio in
+    mtmd_input_text text;
+    text.text = mtmd_default_marker();
+    text.add_special = false;
+    text.parse_special = true;
+
+    Segment seg;
+    seg.chunks.reset(mtmd_input_chunks_init());
+    const mtmd_bitmap* bitmap = bmp.ptr.get();
+    int32_t res = mtmd_tokenize(ctx, seg.chunks.get(), &text, &bitmap, 1);
+    if (res != 0) {
+        LOGe("Unable to tokenize audio segment, res = %d", res);
+        return false;
+    }
+
+    const size_t n_chunks = mtmd_input_chunks_size(seg.chunks.get());
+    seg.embd.resize(n_chunks);
+    for (size_t i = 0; i < n_chunks; i++) {
+        auto chunk = mtmd_input_chunks_get(seg.chunks.get(), i);
+        if (mtmd_input_chunk_get_type(chunk) != MTMD_INPUT_CHUNK_TYPE_AUDIO) {
+            continue;
+        }
+        res = mtmd_encode_chunk(ctx, chunk);
+        if (res != 0) {
+            LOGe("Failed to encode audio segment %zu, res = %d", segments.size(), res);
+            return false;
+        }
+        // The encoder output buffer is reused by the next encode, keep a copy
+        const float* embd = mtmd_get_output_embd(ctx);
+        seg.embd[i].assign(embd, embd + mtmd_input_chunk_get_n_tokens(chunk) * n_embd);
+    }
+
+    LOGi("Encoded audio segment %zu (%.2f s)", segments.size(), (double) n_samples / out_rate);
+    segments.push_back(std::move(seg));
+    return true;
+}
+
+int32_t AudioStream::decode(llama_context* lctx, llama_pos n_past, llama_seq_id seq_id,
+                            int32_t n_batch, llama_pos* new_n_past) {
+    for (size_t s = 0; s < segments.size(); s++) {
+        auto& seg = segments[s];
+        const size_t n_chunks = mtmd_input_chunks_size(seg.chunks.get());
+        // Every segment was tokenized on its own, so each carries the model's
+        // audio begin/end tokens. The utterance gets the begin tokens of the
+        // first segment and the end tokens of the last one only.
+        size_t first_audio = n_chunks;
+        size_t last_audio = 0;
+        for (size_t i = 0; i < n_chunks; i++) {
+            if (mtmd_input_chunk_get_type(mtmd_input_chunks_get(seg.chunks.get(), i)) == MTMD_INPUT_CHUNK_TYPE_AUDIO) {
+                first_audio = std::min(first_audio, i);
+                last_audio = i;
+            }
+        }
+        for (size_t i = 0; i < n_chunks; i++) {
+            if ((i < first_audio && s > 0) || (i > last_audio && s + 1 < segments.size())) {
+                continue;
+            }
+            auto chunk = mtmd_input_chunks_get(seg.chunks.get(), i);
+            int32_t res;
+            if (mtmd_input_chunk_get_type(chunk) == MTMD_INPUT_CHUNK_TYPE_TEXT) {
+                res = mtmd_helper_eval_chunk_single(ctx, lctx, chunk, n_past, seq_id, n_batch, false, &n_past);
+            } else {
+                res = mtmd_helper_decode_image_chunk(ctx, lctx, chunk, seg.embd[i].data(),
+                                                     n_past, seq_id, n_batch, &n_past);
+            }
+            if (res != 0) {
+                LOGe("Failed to decode audio chunk, res = %d", res);
+                return res;
+            }
+        }
+    }
+    *new_n_past = n_past;
+    return 0;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "llama.h"
+#include "mtmd.h"
+
+// Placeholder for the recorded audio in a prompt, the way <__image__> is for images
+#define AUDIO_MARKER "<__audio__>"
+
+/*
+ * Takes microphone PCM while the user is still talking and runs the mtmd
+ * audio encoder on each segment as soon as it is complete, so when recording
+ * stops only the tail is left to encode.
+ *
+ * Segments are cut at the quietest frame near the target length so words
+ * don't get split across two encoder passes. Each segment keeps its own
+ * tokenized chunks and a copy of the encoder output, which evalMessage()
+ * later decodes in place of AUDIO_MARKER, wrapped once in the model's audio
+ * begin/end tokens for the whole utterance.
+ */
+class AudioStream {
+public:
+    // Starts a new recording, dropping whatever was there before.
+    // sample_rate is what the recorder delivers, we resample to the model's rate.
+    bool begin(mtmd_context* ctx, const llama_model* model, int sample_rate);
+
+    // 16-bit mono PCM, encodes every segment this completes
+    bool append(const int16_t* pcm, size_t n_samples);
+
+    // Encodes the tail, after this the segments are ready for decoding
+    bool end();
+
+    void clear();
+
+    bool isRecording() const { return recording; }
+    bool isReady() const { return !recording && !segments.empty(); }
+    size_t segmentCount() const { return segments.size(); }
+
+    // Decodes every segment into lctx, in order, at n_past
+    int32_t decode(llama_context* lctx, llama_pos n_past, llama_seq_id seq_id,
+                   int32_t n_batch, llama_pos* new_n_past);
+
+private:
+    struct Segment {
+        mtmd::input_chunks_ptr chunks;
+        std::vector<std::vector<float>> embd;  // per chunk, empty for text chunks
+    };
+
+    bool encodeSegment(size_t n_samples);
+    size_t findCut() const;
+
+    mtmd_context* ctx = nullptr;
+    int n_embd = 0;
+    bool recording = false;
+
+    int in_rate = 16000;
+    int out_rate = 16000;
+    double resample_pos = 0.0;  // fractional read position into the next input sample
+    float resample_prev = 0.0f;
+
+    std::vector<float> pending;  // resampled samples not encoded yet
+    std::vector<Segment> segments;
+
+    int64_t total_samples = 0;
+    int64_t stream_encode_us = 0;
+    int64_t tail_encode_us = 0;
+};
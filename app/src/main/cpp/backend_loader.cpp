@@ -0,0 +1,151 @@
+#include "backend_loader.h"
+#include "async_log.h"
+#include <dirent.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+
+#undef TAG
+#define TAG "backend_loader.cpp"
+#define LOGi(...) BW_LOG(BW_LOG_LEVEL_INFO, TAG, __VA_ARGS__)
+#define LOGe(...) BW_LOG(BW_LOG_LEVEL_ERROR, TAG, __VA_ARGS__)
+
+static const char* PLUGIN_PREFIX = "libggml-";
+static const char* PLUGIN_SUFFIX = ".so";
+
+std::vector<std::string> BackendLoader::discover() {
+    std::vector<std::string> names;
+    const int64_t t_start_us = ggml_time_us();
+
+    DIR* dir = lib_dir.empty() ? nullptr : opendir(lib_dir.c_str());
+    if (!dir) {
+        discover_us = ggml_time_us() - t_start_us;
+        return names;
+    }
+
+    const size_t prefix_len = strlen(PLUGIN_PREFIX);
+    const size_t suffix_len = strlen(PLUGIN_SUFFIX);
+    while (dirent* ent = readdir(dir)) {
+        std::string file = ent->d_name;
+        if (file.size() <= prefix_len + suffix_len ||
+            file.compare(0, prefix_len, PLUGIN_PREFIX) != 0 ||
+            file.compare(file.size() - suffix_len, suffix_len, PLUGIN_SUFFIX) != 0) {
+            continue;
+        }
+        std::string name = file.substr(prefix_len, file.size() - prefix_len - suffix_len);
+        // libggml-base.so is a plain dependency, libggml-htp-v*.so are DSP
+        // skeletons that the hexagon backend hands to the DSP itself
+        if (name == "base" || name.compare(0, 4, "htp-") == 0) {
+            continue;
+        }
+        names.push_back(name);
+    }
+    closedir(dir);
+
+    // CPU first, it has to be there for host buffers no matter what else loads
+    std::sort(names.begin(), names.end(), [](const std::string& a, const std::string& b) {
+        if ((a == "cpu") != (b == "cpu")) return a == "cpu";
+        return a < b;
+    });
+
+    discover_us = ggml_time_us() - t_start_us;
+    return names;
+}
+
+bool BackendLoader::loadOne(const std::string& name) {
+    for (const auto& e : entries) {
+        if (e.name == name) {
+            return e.loaded || e.builtin;
+        }
+    }
+
+    Entry entry;
+    entry.name = name;
+
+    // Statically linked backends are already in the registry
+    entry.reg = ggml_backend_reg_by_name(name.c_str());
+    if (entry.reg) {
+        entry.builtin = true;
+        entries.push_back(entry);
+        return true;
+    }
+
+    std::string path = lib_dir + "/" + PLUGIN_PREFIX + name + PLUGIN_SUFFIX;
+    if (access(path.c_str(), R_OK) != 0) {
+        LOGe("Backend plugin %s not found at %s", name.c_str(), path.c_str());
+        entries.push_back(entry);
+        return false;
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+    ggml_backend_reg_t reg = ggml_backend_load(path.c_str());
+    entry.load_us = ggml_time_us() - t_start_us;
+    entry.reg = reg;
+    entry.loaded = reg != nullptr;
+    if (!entry.loaded) {
+        LOGe("Failed to load backend plugin %s", path.c_str());
+    } else {
+        LOGi("Loaded backend %s (%s, %zu devices) in %.1f ms", name.c_str(),
+             ggml_backend_reg_name(reg), ggml_backend_reg_dev_count(reg), entry.load_us / 1e3);
+    }
+    entries.push_back(entry);
+    return entry.loaded;
+}
+
+bool BackendLoader::load(const std::vector<std::string>& names) {
+    bool all_loaded = true;
+    for (const auto& name : names) {
+        all_loaded = loadOne(name) && all_loaded;
+    }
+    return all_loaded;
+}
+
+void BackendLoader::loadRemaining() {
+    for (const auto& name : discover()) {
+        loadOne(name);
+    }
+}
+
+std::vector<std::string> BackendLoader::registeredBackends() const {
+    std::vector<std::string> names;
+    for (size_t i = 0; i < ggml_backend_reg_count(); i++) {
+        ggml_backend_reg_t reg = ggml_backend_reg_get(i);
+        if (ggml_backend_reg_dev_count(reg) == 0) {
+            continue;
+        }
+        // Report our plugin name when we loaded it, so it can go straight
+        // back into load() on the next start
+        std::string name = ggml_backend_reg_name(reg);
+        for (const auto& e : entries) {
+            if (e.reg == reg) {
+                name = e.name;
+            }
+        }
+        names.push_back(name);
+    }
+    return names;
+}
+
+std::string BackendLoader::report() const {
+    char buf[128];
+    int64_t total_us = discover_us + init_us;
+    std::string out = "backend init:";
+
+    snprintf(buf, sizeof(buf), " discover %.1f ms", discover_us / 1e3);
+    out += buf;
+    for (const auto& e : entries) {
+        if (e.builtin) {
+            snprintf(buf, sizeof(buf), " | %s built in", e.name.c_str());
+        } else if (e.loaded) {
+            snprintf(buf, sizeof(buf), " | %s %.1f ms", e.name.c_str(), e.load_us / 1e3);
+        } else {
+            snprintf(buf, sizeof(buf), " | %s failed", e.name.c_str());
+        }
+        out += buf;
+        total_us += e.load_us;
+    }
+    snprintf(buf, sizeof(buf), " | llama_backend_init %.1f ms | total %.1f ms",
+             init_us / 1e3, total_us / 1e3);
+    out += buf;
+    return out;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "ggml-backend.h"
+
+/*
+ * Loads ggml backend plugins (libggml-<name>.so in the app's native library
+ * directory) by name, instead of letting the runtime scan and dlopen every
+ * plugin that got packaged into jniLibs.
+ *
+ * Startup only loads the backends the persisted device profile asks for.
+ * If the model then fails to load with them, loadRemaining() pulls in the
+ * rest as a fallback.
+ *
+ * On builds where the backends are linked in (Vulkan flavor) there is nothing
+ * to dlopen, and every name is reported as built in.
+ */
+class BackendLoader {
+public:
+    BackendLoader(const BackendLoader&) = delete;
+    BackendLoader& operator=(const BackendLoader&) = delete;
+
+    static BackendLoader& getInstance() {
+        static BackendLoader instance;
+        return instance;
+    }
+
+    void setLibraryDir(const char* dir) { lib_dir = dir ? dir : ""; }
+
+    // Plugin names (cpu, opencl, hexagon, ...) found in the library directory
+    std::vector<std::string> discover();
+
+    // Loads the named plugins, returns false if any of them is unavailable
+    bool load(const std::vector<std::string>& names);
+
+    // Loads every discovered plugin that isn't loaded yet
+    void loadRemaining();
+
+    // Names of the backends that are registered and have at least one device
+    std::vector<std::string> registeredBackends() const;
+
+    // Records how long llama_backend_init() took, for the report
+    void setInitTime(int64_t us) { init_us = us; }
+
+    // One line per plugin with its load time, plus totals
+    std::string report() const;
+
+private:
+    BackendLoader() = default;
+
+    bool loadOne(const std::string& name);
+
+    struct Entry {
+        std::string name;
+        ggml_backend_reg_t reg = nullptr;
+        int64_t load_us = 0;
+        bool loaded = false;
+        bool builtin = false;
+    };
+
+    std::string lib_dir;
+    std::vector<Entry> entries;
+    int64_t discover_us = 0;
+    int64_t init_us = 0;
+};
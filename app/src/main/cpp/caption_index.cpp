@@ -0,0 +1,1063 @@
+#include "caption_index.h"
+#include "metrics.h"
+#include "async_log.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <iterator>
+
+#undef TAG
+#define TAG "caption_index.cpp"
+#define LOGi(...) BW_LOG(BW_LOG_LEVEL_INFO, TAG, __VA_ARGS__)
+#define LOGe(...) BW_LOG(BW_LOG_LEVEL_ERROR, TAG, __VA_ARGS__)
+
+// steady_clock rather than ggml_time_us, the index doesn't need ggml
+static int64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static const char SEGMENT_MAGIC[8] = {'B', 'W', 'C', 'A', 'P', 'I', 'X', '1'};
+static const char* LOG_FILE = "pending.log";
+
+// A few thousand captions is a few hundred KB of postings, written in a
+// couple of ms on the thread that finished the caption
+static const size_t FLUSH_DOCS = 4096;
+// Segments of the same size tier merged at once. Queries look at up to
+// this many segments per tier, merges rewrite each caption log8(n) times.
+static const size_t MERGE_FACTOR = 8;
+// Terms a prefix can expand to, "s" shouldn't union half the dictionary
+static const size_t MAX_PREFIX_TERMS = 64;
+// Log record length of a removal
+static const uint32_t REMOVED = 0xffffffff;
+
+static const char* STOPWORDS[] = {
+    "an", "and", "are", "as", "at", "be", "by", "for", "from", "has", "have", "in", "into", "is", "it", "its",
+    "of", "on", "onto", "or", "that", "the", "their", "there", "these", "this", "those", "to", "under", "was",
+    "were", "while", "with",
+};
+
+struct SegmentHeader {
+    char magic[8];
+    uint32_t n_docs;
+    uint32_t n_terms;
+    uint64_t docs_off;      // uint64_t doc ids, ascending, the index is the ordinal
+    uint64_t postings_off;
+    uint64_t terms_off;     // TermEntry, sorted by term bytes
+    uint64_t strings_off;
+    uint64_t file_size;
+    uint64_t sources_off;   // merged segments: count, then the gens it replaced
+};
+
+struct TermEntry {
+    uint32_t str_off;
+    uint32_t str_len;
+    uint32_t df;
+    uint32_t reserved;
+    uint64_t post_off;
+    uint64_t post_len;
+};
+
+static_assert(sizeof(SegmentHeader) == 64, "segment header layout");
+static_assert(sizeof(TermEntry) == 32, "term entry layout");
+
+// Terms
+
+static bool is_word_byte(unsigned char c) {
+    // Bytes of multi-byte UTF-8 stay in the word, so non-Latin scripts index
+    // as whole words, just without case folding
+    return c >= 0x80 || (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+static bool ends_with(const std::string& s, const char* suffix) {
+    const size_t n = strlen(suffix);
+    return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+static bool is_stopword(const std::string& word) {
+    if (word.size() == 1 && !(word[0] >= '0' && word[0] <= '9')) {
+        return true;  // "a", and the "s" of "dog's"
+    }
+    for (const char* s : STOPWORDS) {
+        if (word == s) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Plurals folded to the singular, so "dogs" finds "a dog". Captions and
+// queries go through the same rules, which matters more than getting
+// English right.
+static std::string fold(const std::string& word) {
+    if (word.size() <= 3 || word.back() != 's' || (unsigned char) word[0] >= 0x80) {
+        return word;
+    }
+    if (ends_with(word, "sses") || ends_with(word, "ches") || ends_with(word, "shes") || ends_with(word, "xes") ||
+        ends_with(word, "zes")) {
+        return word.substr(0, word.size() - 2);
+    }
+    if (word.size() > 4 && ends_with(word, "ies")) {
+        return word.substr(0, word.size() - 3) + "y";
+    }
+    if (ends_with(word, "ss") || ends_with(word, "us") || ends_with(word, "is")) {
+        return word;
+    }
+    return word.substr(0, word.size() - 1);
+}
+
+// Lowercased words, before folding and stopwords
+static std::vector<std::string> split_words(const std::string& text) {
+    std::vector<std::string> words;
+    std::string word;
+    for (unsigned char c : text) {
+        if (is_word_byte(c)) {
+            word += (char) (c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c);
+        } else if (!word.empty()) {
+            words.push_back(std::move(word));
+            word.clear();
+        }
+    }
+    if (!word.empty()) {
+        words.push_back(std::move(word));
+    }
+    return words;
+}
+
+std::vector<std::string> caption_terms(const std::string& text) {
+    std::vector<std::string> terms;
+    for (const std::string& word : split_words(text)) {
+        if (!is_stopword(word)) {
+            terms.push_back(fold(word));
+        }
+    }
+    return terms;
+}
+
+// Postings
+
+static void put_varint(std::string& out, uint32_t v) {
+    while (v >= 0x80) {
+        out += (char) (v | 0x80);
+        v >>= 7;
+    }
+    out += (char) v;
+}
+
+static void encode_postings(const std::vector<uint32_t>& ords, std::string& out) {
+    out.clear();
+    uint32_t prev = 0;
+    for (uint32_t ord : ords) {
+        put_varint(out, ord - prev);
+        prev = ord;
+    }
+}
+
+static std::vector<uint32_t> intersect(const std::vector<uint32_t>& a, const std::vector<uint32_t>& b) {
+    std::vector<uint32_t> out;
+    std::set_intersection(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(out));
+    return out;
+}
+
+static void sort_unique(std::vector<uint32_t>& v) {
+    std::sort(v.begin(), v.end());
+    v.erase(std::unique(v.begin(), v.end()), v.end());
+}
+
+// Segments
+
+static std::string segment_stem(const std::string& dir, uint64_t gen) {
+    return dir + "/seg-" + std::to_string(gen);
+}
+
+struct CaptionIndex::Segment {
+    uint64_t gen = 0;
+    std::string stem;
+    const uint8_t* base = nullptr;
+    size_t size = 0;
+    const SegmentHeader* header = nullptr;
+    const uint64_t* docs = nullptr;
+    const TermEntry* terms = nullptr;
+    const char* strings = nullptr;
+    const uint64_t* sources = nullptr;
+    uint64_t n_sources = 0;
+    std::vector<uint8_t> deleted;   // bit per ordinal
+    size_t n_deleted = 0;
+    bool deletes_dirty = false;
+
+    ~Segment() {
+        if (base) {
+            munmap((void*) base, size);
+        }
+    }
+
+    static std::shared_ptr<Segment> open(const std::string& dir, uint64_t gen);
+
+    uint32_t docCount() const { return header->n_docs; }
+    size_t liveCount() const { return header->n_docs - n_deleted; }
+
+    int compareTerm(uint32_t i, const char* term, size_t len, bool prefix) const {
+        const TermEntry& e = terms[i];
+        const size_t n = std::min((size_t) e.str_len, len);
+        const int c = memcmp(strings + e.str_off, term, n);
+        if (c != 0 || (prefix && e.str_len >= len)) {
+            return c;
+        }
+        return e.str_len < len ? -1 : (e.str_len > len ? 1 : 0);
+    }
+
+    // First term not below term (with prefix, first one that isn't below
+    // it and doesn't start with it)
+    uint32_t lowerBound(const std::string& term, bool past_prefix) const {
+        uint32_t lo = 0, hi = header->n_terms;
+        while (lo < hi) {
+            const uint32_t mid = lo + (hi - lo) / 2;
+            const int c = compareTerm(mid, term.data(), term.size(), past_prefix);
+            if (c < 0 || (past_prefix && c == 0)) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+    int64_t find(const std::string& term) const {
+        const uint32_t i = lowerBound(term, false);
+        return i < header->n_terms && compareTerm(i, term.data(), term.size(), false) == 0 ? (int64_t) i : -1;
+    }
+
+    bool decode(uint32_t i, std::vector<uint32_t>& out) const {
+        const TermEntry& e = terms[i];
+        if (e.post_off > size || e.post_len > size - e.post_off) {
+            return false;
+        }
+        const uint8_t* p = base + e.post_off;
+        const uint8_t* end = p + e.post_len;
+        uint32_t ord = 0;
+        while (p < end) {
+            uint32_t delta = 0;
+            int shift = 0;
+            while (p < end && (*p & 0x80) && shift < 28) {
+                delta |= (uint32_t) (*p++ & 0x7f) << shift;
+                shift += 7;
+            }
+            if (p == end) {
+                return false;
+            }
+            delta |= (uint32_t) *p++ << shift;
+            ord += delta;
+            if (ord >= header->n_docs) {
+                return false;
+            }
+            out.push_back(ord);
+        }
+        return true;
+    }
+
+    int64_t ordinalOf(uint64_t doc_id) const {
+        const uint64_t* end = docs + header->n_docs;
+        const uint64_t* it = std::lower_bound(docs, end, doc_id);
+        return it != end && *it == doc_id ? it - docs : -1;
+    }
+
+    bool isDeleted(uint32_t ord) const { return deleted[ord >> 3] & (1 << (ord & 7)); }
+
+    void markDeleted(uint32_t ord) {
+        if (!isDeleted(ord)) {
+            deleted[ord >> 3] |= (uint8_t) (1 << (ord & 7));
+            n_deleted++;
+            deletes_dirty = true;
+        }
+    }
+
+    bool saveDeletes() {
+        if (!deletes_dirty) {
+            return true;
+        }
+        const std::string tmp = stem + ".del.tmp";
+        FILE* f = fopen(tmp.c_str(), "wb");
+        bool ok = f && fwrite(deleted.data(), 1, deleted.size(), f) == deleted.size();
+        ok = f && fflush(f) == 0 && fsync(fileno(f)) == 0 && ok;
+        if (f) fclose(f);
+        if (!ok || rename(tmp.c_str(), (stem + ".del").c_str()) != 0) {
+            LOGe("Failed to save deletions of %s", stem.c_str());
+            unlink(tmp.c_str());
+            return false;
+        }
+        deletes_dirty = false;
+        return true;
+    }
+};
+
+std::shared_ptr<CaptionIndex::Segment> CaptionIndex::Segment::open(const std::string& dir, uint64_t gen) {
+    auto seg = std::make_shared<Segment>();
+    seg->gen = gen;
+    seg->stem = segment_stem(dir, gen);
+    const std::string path = seg->stem + ".idx";
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(SegmentHeader)) {
+        if (fd >= 0) ::close(fd);
+        LOGe("Failed to open caption segment %s", path.c_str());
+        return nullptr;
+    }
+    void* addr = mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        LOGe("Failed to map caption segment %s", path.c_str());
+        return nullptr;
+    }
+    seg->base = (const uint8_t*) addr;
+    seg->size = (size_t) st.st_size;
+    seg->header = (const SegmentHeader*) addr;
+
+    const SegmentHeader& h = *seg->header;
+    const uint64_t size = seg->size;
+    if (memcmp(h.magic, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC)) != 0 || h.file_size != size ||
+        h.docs_off % 8 != 0 || h.terms_off % 8 != 0 ||
+        h.docs_off > size || (uint64_t) h.n_docs * 8 > size - h.docs_off ||
+        h.terms_off > size || (uint64_t) h.n_terms * sizeof(TermEntry) > size - h.terms_off ||
+        h.strings_off > size || h.sources_off % 8 != 0 || h.sources_off > size - 8) {
+        LOGe("Caption segment %s is damaged, skipping it", path.c_str());
+        return nullptr;
+    }
+    if (h.sources_off > 0) {
+        seg->n_sources = *(const uint64_t*) (seg->base + h.sources_off);
+        seg->sources = (const uint64_t*) (seg->base + h.sources_off + 8);
+        if (seg->n_sources > (size - h.sources_off - 8) / 8) {
+            LOGe("Caption segment %s is damaged, skipping it", path.c_str());
+            return nullptr;
+        }
+    }
+    seg->docs = (const uint64_t*) (seg->base + h.docs_off);
+    seg->terms = (const TermEntry*) (seg->base + h.terms_off);
+    seg->strings = (const char*) (seg->base + h.strings_off);
+    for (uint32_t i = 0; i < h.n_terms; i++) {
+        const TermEntry& e = seg->terms[i];
+        if (e.str_off > size - h.strings_off || e.str_len > size - h.strings_off - e.str_off) {
+            LOGe("Caption segment %s is damaged, skipping it", path.c_str());
+            return nullptr;
+        }
+    }
+
+    seg->deleted.assign((h.n_docs + 7) / 8, 0);
+    FILE* f = fopen((seg->stem + ".del").c_str(), "rb");
+    if (f) {
+        if (fread(seg->deleted.data(), 1, seg->deleted.size(), f) != seg->deleted.size()) {
+            std::fill(seg->deleted.begin(), seg->deleted.end(), 0);
+        }
+        fclose(f);
+        for (uint32_t ord = 0; ord < h.n_docs; ord++) {
+            seg->n_deleted += seg->isDeleted(ord);
+        }
+    }
+    return seg;
+}
+
+// Writes a segment: doc ids up front, then postings as terms are added in
+// order, then the dictionary, the merged segments' gens and the header
+class SegmentWriter {
+public:
+    bool begin(const std::string& path, const std::vector<uint64_t>& docs) {
+        f = fopen(path.c_str(), "wb");
+        if (!f) {
+            return false;
+        }
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC));
+        header.n_docs = (uint32_t) docs.size();
+        header.docs_off = sizeof(SegmentHeader);
+        ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+             fwrite(docs.data(), sizeof(uint64_t), docs.size(), f) == docs.size();
+        offset = sizeof(SegmentHeader) + docs.size() * sizeof(uint64_t);
+        header.postings_off = offset;
+        return ok;
+    }
+
+    // Segments this one replaces, they go when it's there
+    void setSources(const std::vector<uint64_t>& gens) { sources = gens; }
+
+    void addTerm(const std::string& term, const std::vector<uint32_t>& ords) {
+        encode_postings(ords, buf);
+        TermEntry e = {};
+        e.str_off = (uint32_t) strings.size();
+        e.str_len = (uint32_t) term.size();
+        e.df = (uint32_t) ords.size();
+        e.post_off = offset;
+        e.post_len = buf.size();
+        entries.push_back(e);
+        strings += term;
+        ok = ok && fwrite(buf.data(), 1, buf.size(), f) == buf.size();
+        offset += buf.size();
+    }
+
+    bool finish() {
+        static const char zeros[8] = {};
+        const size_t pad = (8 - offset % 8) % 8;
+        ok = ok && fwrite(zeros, 1, pad, f) == pad;
+        offset += pad;
+        header.n_terms = (uint32_t) entries.size();
+        header.terms_off = offset;
+        ok = ok && fwrite(entries.data(), sizeof(TermEntry), entries.size(), f) == entries.size();
+        offset += entries.size() * sizeof(TermEntry);
+        header.strings_off = offset;
+        ok = ok && fwrite(strings.data(), 1, strings.size(), f) == strings.size();
+        offset += strings.size();
+        if (!sources.empty()) {
+            const size_t pad_sources = (8 - offset % 8) % 8;
+            const uint64_t n_sources = sources.size();
+            ok = ok && fwrite(zeros, 1, pad_sources, f) == pad_sources;
+            header.sources_off = offset + pad_sources;
+            ok = ok && fwrite(&n_sources, sizeof(n_sources), 1, f) == 1 &&
+                 fwrite(sources.data(), sizeof(uint64_t), sources.size(), f) == sources.size();
+            offset = header.sources_off + (1 + sources.size()) * sizeof(uint64_t);
+        }
+        header.file_size = offset;
+        ok = ok && fseek(f, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, f) == 1;
+        ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+        fclose(f);
+        f = nullptr;
+        return ok;
+    }
+
+    ~SegmentWriter() {
+        if (f) fclose(f);
+    }
+
+private:
+    FILE* f = nullptr;
+    bool ok = false;
+    uint64_t offset = 0;
+    SegmentHeader header;
+    std::vector<TermEntry> entries;
+    std::string strings;
+    std::vector<uint64_t> sources;
+    std::string buf;
+};
+
+// Size tier of a segment, in powers of MERGE_FACTOR flushes
+static int tier_of(size_t n_docs) {
+    int tier = 0;
+    for (size_t n = n_docs / FLUSH_DOCS; n >= MERGE_FACTOR; n /= MERGE_FACTOR) {
+        tier++;
+    }
+    return tier;
+}
+
+// Index
+
+CaptionIndex& CaptionIndex::getInstance() {
+    static CaptionIndex instance;
+    return instance;
+}
+
+CaptionIndex::~CaptionIndex() {
+    // Only the merge to stop. The log has every caption, and the logger and
+    // metrics may be gone by now.
+    {
+        std::lock_guard<std::mutex> merge_lock(merge_mutex);
+        stopping = true;
+        merge_cv.notify_one();
+    }
+    if (merger.joinable()) {
+        merger.join();
+    }
+    if (log) {
+        fclose(log);
+    }
+}
+
+bool CaptionIndex::isOpen() const {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    return log != nullptr;
+}
+
+bool CaptionIndex::open(const std::string& index_dir) {
+    close();
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    const int64_t t_start_us = now_us();
+    mkdir(index_dir.c_str(), 0755);
+    DIR* d = opendir(index_dir.c_str());
+    if (!d) {
+        LOGe("Failed to open caption index at %s", index_dir.c_str());
+        return false;
+    }
+    dir = index_dir;
+    next_gen = 1;
+
+    std::vector<uint64_t> gens;
+    while (dirent* ent = readdir(d)) {
+        const std::string name = ent->d_name;
+        unsigned long long gen = 0;
+        char ext[8] = {};
+        if (sscanf(name.c_str(), "seg-%llu.%7s", &gen, ext) != 2) {
+            continue;
+        }
+        const std::string e = ext;
+        if (e == "idx") {
+            gens.push_back(gen);
+        } else if (ends_with(name, ".tmp")) {
+            unlink((dir + "/" + name).c_str());
+        }
+        next_gen = std::max(next_gen, (uint64_t) gen + 1);
+    }
+    closedir(d);
+
+    std::sort(gens.begin(), gens.end());
+    std::map<uint64_t, std::shared_ptr<Segment>> opened;
+    for (uint64_t gen : gens) {
+        if (auto seg = Segment::open(dir, gen)) {
+            opened[gen] = seg;
+        }
+    }
+    // A merged segment that opens is complete, it was renamed into place
+    // only once written. The app may have died before the segments it
+    // replaced were removed. Deletions that reached them after the merge
+    // started are carried over before they go.
+    for (auto& kv : opened) {
+        Segment& merged = *kv.second;
+        for (uint64_t i = 0; i < merged.n_sources; i++) {
+            auto it = opened.find(merged.sources[i]);
+            if (it == opened.end()) {
+                continue;
+            }
+            const Segment& source = *it->second;
+            for (uint32_t ord = 0; ord < source.docCount(); ord++) {
+                const int64_t to = source.isDeleted(ord) ? merged.ordinalOf(source.docs[ord]) : -1;
+                if (to >= 0) {
+                    merged.markDeleted((uint32_t) to);
+                }
+            }
+            LOGi("Removing caption segment %llu, merged into %llu", (unsigned long long) source.gen,
+                 (unsigned long long) merged.gen);
+            merged.saveDeletes();
+            unlink((source.stem + ".idx").c_str());
+            unlink((source.stem + ".del").c_str());
+            opened.erase(it);
+        }
+    }
+    segments.clear();
+    for (auto& kv : opened) {
+        segments.push_back(kv.second);
+    }
+    mem = MemTable();
+    if (!replayLog()) {
+        segments.clear();
+        return false;
+    }
+    LOGi("Caption index opened in %.1f ms: %zu segments, %zu pending captions",
+         (now_us() - t_start_us) / 1e3, segments.size(), mem.live);
+    if (mem.docs.size() >= FLUSH_DOCS) {
+        flushLocked();
+    }
+    publish();
+
+    {
+        std::lock_guard<std::mutex> merge_lock(merge_mutex);
+        stopping = false;
+        merge_requested = true;
+    }
+    merger = std::thread(&CaptionIndex::mergeLoop, this);
+    return true;
+}
+
+bool CaptionIndex::replayLog() {
+    const std::string path = dir + "/" + LOG_FILE;
+    FILE* f = fopen(path.c_str(), "rb");
+    long good = 0;
+    if (f) {
+        std::string text;
+        for (;;) {
+            uint64_t doc_id = 0;
+            uint32_t len = 0;
+            if (fread(&doc_id, sizeof(doc_id), 1, f) != 1 || fread(&len, sizeof(len), 1, f) != 1) {
+                break;
+            }
+            if (len == REMOVED) {
+                apply(doc_id, nullptr);
+            } else {
+                text.resize(len);
+                if (len > 0 && fread(&text[0], 1, len, f) != len) {
+                    break;
+                }
+                apply(doc_id, &text);
+            }
+            good = ftell(f);
+        }
+        fclose(f);
+    }
+    // A record cut short by a crash is dropped, appending after it would
+    // garble everything that follows
+    log = fopen(path.c_str(), "ab");
+    if (!log || ftruncate(fileno(log), good) != 0) {
+        LOGe("Failed to open the caption log at %s", path.c_str());
+        if (log) fclose(log);
+        log = nullptr;
+        return false;
+    }
+    return true;
+}
+
+bool CaptionIndex::logRecord(uint64_t doc_id, const std::string* text) {
+    const uint32_t len = text ? (uint32_t) text->size() : REMOVED;
+    bool ok = fwrite(&doc_id, sizeof(doc_id), 1, log) == 1 && fwrite(&len, sizeof(len), 1, log) == 1;
+    ok = ok && (!text || text->empty() || fwrite(text->data(), 1, text->size(), log) == text->size());
+    // Flushed to the kernel, which keeps it if the app dies. The next
+    // segment write is the fsync.
+    ok = fflush(log) == 0 && ok;
+    if (!ok) {
+        LOGe("Failed to log caption %llu", (unsigned long long) doc_id);
+    }
+    return ok;
+}
+
+void CaptionIndex::supersede(uint64_t doc_id) {
+    auto it = mem.ordinal.find(doc_id);
+    if (it != mem.ordinal.end()) {
+        mem.deleted[it->second] = 1;
+        mem.ordinal.erase(it);
+        mem.live--;
+    }
+    for (auto& seg : segments) {
+        const int64_t ord = seg->ordinalOf(doc_id);
+        if (ord >= 0) {
+            seg->markDeleted((uint32_t) ord);
+        }
+    }
+}
+
+void CaptionIndex::apply(uint64_t doc_id, const std::string* text) {
+    supersede(doc_id);
+    if (!text) {
+        return;
+    }
+    std::vector<std::string> terms = caption_terms(*text);
+    std::sort(terms.begin(), terms.end());
+    terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+
+    const uint32_t ord = (uint32_t) mem.docs.size();
+    mem.docs.push_back(doc_id);
+    mem.deleted.push_back(0);
+    mem.ordinal[doc_id] = ord;
+    mem.live++;
+    for (const std::string& term : terms) {
+        mem.postings[term].push_back(ord);
+    }
+}
+
+void CaptionIndex::add(uint64_t doc_id, const std::string& text) {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    if (!log) {
+        return;
+    }
+    logRecord(doc_id, &text);
+    apply(doc_id, &text);
+    if (mem.docs.size() >= FLUSH_DOCS) {
+        flushLocked();
+    }
+    publish();
+}
+
+void CaptionIndex::remove(uint64_t doc_id) {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    if (!log) {
+        return;
+    }
+    logRecord(doc_id, nullptr);
+    apply(doc_id, nullptr);
+    publish();
+}
+
+void CaptionIndex::flush() {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    if (log) {
+        flushLocked();
+        publish();
+    }
+}
+
+void CaptionIndex::flushLocked() {
+    const int64_t t_start_us = now_us();
+    if (mem.live > 0) {
+        // Ordinals follow doc ids, so lookups by id are a binary search
+        std::vector<std::pair<uint64_t, uint32_t>> live;
+        for (uint32_t ord = 0; ord < mem.docs.size(); ord++) {
+            if (!mem.deleted[ord]) {
+                live.emplace_back(mem.docs[ord], ord);
+            }
+        }
+        std::sort(live.begin(), live.end());
+        std::vector<int64_t> remap(mem.docs.size(), -1);
+        std::vector<uint64_t> ids;
+        for (uint32_t i = 0; i < live.size(); i++) {
+            remap[live[i].second] = i;
+            ids.push_back(live[i].first);
+        }
+
+        const uint64_t gen = next_gen++;
+        const std::string stem = segment_stem(dir, gen);
+        SegmentWriter writer;
+        bool ok = writer.begin(stem + ".idx.tmp", ids);
+        std::vector<uint32_t> ords;
+        for (const auto& kv : mem.postings) {
+            ords.clear();
+            for (uint32_t ord : kv.second) {
+                if (remap[ord] >= 0) {
+                    ords.push_back((uint32_t) remap[ord]);
+                }
+            }
+            if (!ords.empty()) {
+                std::sort(ords.begin(), ords.end());
+                writer.addTerm(kv.first, ords);
+            }
+        }
+        ok = writer.finish() && ok && rename((stem + ".idx.tmp").c_str(), (stem + ".idx").c_str()) == 0;
+        auto seg = ok ? Segment::open(dir, gen) : nullptr;
+        if (!seg) {
+            // The log still has them, the next flush or open tries again
+            LOGe("Failed to write caption segment %s", stem.c_str());
+            unlink((stem + ".idx.tmp").c_str());
+            return;
+        }
+        segments.push_back(seg);
+        // In the segment now. The log keeps them until it's truncated below,
+        // replaying it would only replace them with themselves.
+        mem = MemTable();
+        LOGi("Wrote caption segment %llu: %zu captions, %u terms in %.1f ms", (unsigned long long) gen, ids.size(),
+             seg->header->n_terms, (now_us() - t_start_us) / 1e3);
+    }
+
+    // Deletions the log recorded have to be on disk before it's emptied
+    for (auto& seg : segments) {
+        if (!seg->saveDeletes()) {
+            return;
+        }
+    }
+    if (ftruncate(fileno(log), 0) != 0) {
+        LOGe("Failed to truncate the caption log");
+    }
+    mem = MemTable();
+
+    std::lock_guard<std::mutex> merge_lock(merge_mutex);
+    merge_requested = true;
+    merge_cv.notify_one();
+}
+
+std::vector<uint64_t> CaptionIndex::search(const std::string& query, size_t limit) {
+    const int64_t t_start_us = now_us();
+    std::vector<uint64_t> results;
+
+    // Complete words match exactly. The one being typed matches as a prefix,
+    // unless it's a stopword, which would only narrow the results to noise.
+    std::vector<std::string> words = split_words(query);
+    std::string prefix;
+    if (!words.empty() && is_word_byte((unsigned char) query.back())) {
+        if (!is_stopword(words.back())) {
+            prefix = words.back();
+        }
+        words.pop_back();
+    }
+    std::vector<std::string> exact;
+    for (const std::string& word : words) {
+        if (!is_stopword(word)) {
+            exact.push_back(fold(word));
+        }
+    }
+    if (exact.empty() && prefix.empty()) {
+        return results;
+    }
+
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    std::vector<uint32_t> acc, list;
+    for (const auto& seg : segments) {
+        // Rarest term first, the intersection only shrinks from there
+        std::vector<std::pair<uint32_t, uint32_t>> found;  // df, term
+        bool missing = false;
+        for (const std::string& term : exact) {
+            const int64_t i = seg->find(term);
+            if (i < 0) {
+                missing = true;
+                break;
+            }
+            found.emplace_back(seg->terms[i].df, (uint32_t) i);
+        }
+        if (missing) {
+            continue;
+        }
+        std::sort(found.begin(), found.end());
+        acc.clear();
+        bool first = true, ok = true;
+        for (const auto& f : found) {
+            list.clear();
+            ok = seg->decode(f.second, list) && ok;
+            acc = first ? list : intersect(acc, list);
+            first = false;
+            if (acc.empty()) {
+                break;
+            }
+        }
+        if (!prefix.empty() && (first || !acc.empty())) {
+            const uint32_t lo = seg->lowerBound(prefix, false);
+            const uint32_t hi = std::min(seg->lowerBound(prefix, true), (uint32_t) (lo + MAX_PREFIX_TERMS));
+            list.clear();
+            for (uint32_t i = lo; i < hi; i++) {
+                ok = seg->decode(i, list) && ok;
+            }
+            sort_unique(list);
+            acc = first ? list : intersect(acc, list);
+        }
+        if (!ok) {
+            LOGe("Caption segment %llu has damaged postings", (unsigned long long) seg->gen);
+        }
+        for (uint32_t ord : acc) {
+            if (!seg->isDeleted(ord)) {
+                results.push_back(seg->docs[ord]);
+            }
+        }
+    }
+
+    // Captions not in a segment yet
+    acc.clear();
+    bool first = true;
+    for (const std::string& term : exact) {
+        auto it = mem.postings.find(term);
+        if (it == mem.postings.end()) {
+            acc.clear();
+            first = false;
+            break;
+        }
+        acc = first ? it->second : intersect(acc, it->second);
+        first = false;
+    }
+    if (!prefix.empty() && (first || !acc.empty())) {
+        list.clear();
+        size_t n = 0;
+        for (auto it = mem.postings.lower_bound(prefix);
+             it != mem.postings.end() && n < MAX_PREFIX_TERMS && it->first.compare(0, prefix.size(), prefix) == 0;
+             ++it, ++n) {
+            list.insert(list.end(), it->second.begin(), it->second.end());
+        }
+        sort_unique(list);
+        acc = first ? list : intersect(acc, list);
+    }
+    for (uint32_t ord : acc) {
+        if (!mem.deleted[ord]) {
+            results.push_back(mem.docs[ord]);
+        }
+    }
+    lock.unlock();
+
+    std::sort(results.begin(), results.end(), std::greater<uint64_t>());
+    if (results.size() > limit) {
+        results.resize(limit);
+    }
+    Metrics::getInstance().caption_search_seconds.observe((now_us() - t_start_us) / 1e6);
+    return results;
+}
+
+bool CaptionIndex::mergeOnce() {
+    // Oldest MERGE_FACTOR segments of the first tier that has that many
+    SegmentList sources;
+    std::vector<std::vector<uint8_t>> seen_deleted;
+    uint64_t gen = 0;
+    std::string stem;
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        std::map<int, SegmentList> tiers;
+        for (const auto& seg : segments) {
+            tiers[tier_of(seg->liveCount())].push_back(seg);
+        }
+        for (auto& kv : tiers) {
+            if (kv.second.size() >= MERGE_FACTOR) {
+                sources.assign(kv.second.begin(), kv.second.begin() + MERGE_FACTOR);
+                break;
+            }
+        }
+        if (sources.empty()) {
+            return false;
+        }
+        for (const auto& seg : sources) {
+            seen_deleted.push_back(seg->deleted);
+        }
+        gen = next_gen++;
+        stem = segment_stem(dir, gen);
+    }
+    const int64_t t_start_us = now_us();
+
+    // Live captions of all sources, in doc id order
+    std::vector<std::vector<int64_t>> remap(sources.size());
+    std::vector<std::pair<uint64_t, std::pair<size_t, uint32_t>>> live;
+    for (size_t s = 0; s < sources.size(); s++) {
+        const Segment& seg = *sources[s];
+        remap[s].assign(seg.docCount(), -1);
+        for (uint32_t ord = 0; ord < seg.docCount(); ord++) {
+            if (!(seen_deleted[s][ord >> 3] & (1 << (ord & 7)))) {
+                live.push_back({seg.docs[ord], {s, ord}});
+            }
+        }
+    }
+    std::sort(live.begin(), live.end());
+    std::vector<uint64_t> ids;
+    for (uint32_t i = 0; i < live.size(); i++) {
+        remap[live[i].second.first][live[i].second.second] = i;
+        ids.push_back(live[i].first);
+    }
+
+    // The dictionaries are sorted, so terms come out in order walking all
+    // of them at once
+    SegmentWriter writer;
+    bool ok = writer.begin(stem + ".idx.tmp", ids);
+    std::vector<uint64_t> source_gens;
+    for (const auto& seg : sources) {
+        source_gens.push_back(seg->gen);
+    }
+    writer.setSources(source_gens);
+    std::vector<uint32_t> pos(sources.size(), 0);
+    std::vector<uint32_t> ords, list;
+    for (;;) {
+        int min_s = -1;
+        for (size_t s = 0; s < sources.size(); s++) {
+            if (pos[s] >= sources[s]->header->n_terms) {
+                continue;
+            }
+            const TermEntry& e = sources[s]->terms[pos[s]];
+            if (min_s < 0 || sources[min_s]->compareTerm(pos[min_s], sources[s]->strings + e.str_off, e.str_len,
+                                                         false) > 0) {
+                min_s = (int) s;
+            }
+        }
+        if (min_s < 0) {
+            break;
+        }
+        const TermEntry& me = sources[min_s]->terms[pos[min_s]];
+        const std::string term(sources[min_s]->strings + me.str_off, me.str_len);
+        ords.clear();
+        for (size_t s = 0; s < sources.size(); s++) {
+            if (pos[s] < sources[s]->header->n_terms &&
+                sources[s]->compareTerm(pos[s], term.data(), term.size(), false) == 0) {
+                list.clear();
+                ok = sources[s]->decode(pos[s], list) && ok;
+                for (uint32_t ord : list) {
+                    if (remap[s][ord] >= 0) {
+                        ords.push_back((uint32_t) remap[s][ord]);
+                    }
+                }
+                pos[s]++;
+            }
+        }
+        if (!ords.empty()) {
+            std::sort(ords.begin(), ords.end());
+            writer.addTerm(term, ords);
+        }
+        std::lock_guard<std::mutex> merge_lock(merge_mutex);
+        if (stopping) {
+            ok = false;
+            break;
+        }
+    }
+    ok = writer.finish() && ok;
+
+    // The merged segment lists its sources and is fsynced before the rename,
+    // so from the moment it's there open() knows to drop them. Until then
+    // the sources are untouched, and a leftover .tmp is just deleted.
+    const bool renamed = ok && rename((stem + ".idx.tmp").c_str(), (stem + ".idx").c_str()) == 0;
+    auto merged = renamed ? Segment::open(dir, gen) : nullptr;
+    if (!merged) {
+        unlink((stem + ".idx.tmp").c_str());
+        if (renamed) {
+            unlink((stem + ".idx").c_str());
+        }
+        {
+            std::lock_guard<std::mutex> merge_lock(merge_mutex);
+            if (stopping) {
+                return false;
+            }
+        }
+        LOGe("Failed to merge %zu caption segments", sources.size());
+        return false;
+    }
+
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        // Captions replaced or removed while the merge ran
+        for (size_t s = 0; s < sources.size(); s++) {
+            const Segment& seg = *sources[s];
+            for (uint32_t ord = 0; ord < seg.docCount(); ord++) {
+                if (seg.isDeleted(ord) && remap[s][ord] >= 0) {
+                    merged->markDeleted((uint32_t) remap[s][ord]);
+                }
+            }
+        }
+        merged->saveDeletes();
+        SegmentList next;
+        for (const auto& seg : segments) {
+            if (std::find(sources.begin(), sources.end(), seg) == sources.end()) {
+                next.push_back(seg);
+            }
+        }
+        next.push_back(merged);
+        segments = std::move(next);
+        publish();
+    }
+    // Queries still holding the sources keep their mappings until they're done
+    for (const auto& seg : sources) {
+        unlink((seg->stem + ".idx").c_str());
+        unlink((seg->stem + ".del").c_str());
+    }
+    Metrics::getInstance().caption_index_merges.inc();
+    LOGi("Merged %zu caption segments into %llu: %zu captions in %.1f ms", sources.size(),
+         (unsigned long long) gen, ids.size(), (now_us() - t_start_us) / 1e3);
+    return true;
+}
+
+void CaptionIndex::mergeLoop() {
+    std::unique_lock<std::mutex> lock(merge_mutex);
+    while (!stopping) {
+        merge_cv.wait(lock, [this] { return stopping || merge_requested; });
+        if (stopping) {
+            break;
+        }
+        merge_requested = false;
+        lock.unlock();
+        while (mergeOnce()) {
+        }
+        lock.lock();
+    }
+}
+
+void CaptionIndex::close() {
+    {
+        std::lock_guard<std::mutex> merge_lock(merge_mutex);
+        stopping = true;
+        merge_cv.notify_one();
+    }
+    if (merger.joinable()) {
+        merger.join();
+    }
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    if (!log) {
+        return;
+    }
+    flushLocked();
+    fclose(log);
+    log = nullptr;
+    segments.clear();
+    mem = MemTable();
+    publish();
+}
+
+void CaptionIndex::publish() const {
+    size_t docs = mem.live;
+    for (const auto& seg : segments) {
+        docs += seg->liveCount();
+    }
+    Metrics::getInstance().caption_index_docs.set((int64_t) docs);
+    Metrics::getInstance().caption_index_segments.set((int64_t) segments.size());
+}
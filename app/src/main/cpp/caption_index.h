@@ -0,0 +1,98 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Keyword search over generated captions, without scanning them.
+ *
+ * Captions are split into terms (lowercased words, plurals folded, common
+ * function words dropped) and indexed by a caller-chosen id, usually the
+ * image's. New captions go to an in-memory table and a log next to the
+ * index, so nothing is lost if the app dies. Every few thousand captions
+ * the table is written out as an immutable segment:
+ *
+ *   header | doc ids, ascending | postings | term dictionary | term bytes
+ *          | gens of the segments it was merged from
+ *
+ * The dictionary is sorted and fixed-width, so a term is a binary search in
+ * the mapped file. A term's postings are the ordinals of the docs that have
+ * it, as varint deltas. Replacing or removing a caption sets a bit in the
+ * old segment's deletion bitmap, kept in a .del file beside it.
+ *
+ * A helper thread merges segments of similar size, a few at a time, so a
+ * query looks at a handful of segments however big the library gets.
+ * Queries take a shared lock and see the index as of when they started.
+ */
+class CaptionIndex {
+public:
+    static CaptionIndex& getInstance();
+
+    CaptionIndex(const CaptionIndex&) = delete;
+    CaptionIndex& operator=(const CaptionIndex&) = delete;
+    ~CaptionIndex();
+
+    // Opens the index in dir, creating it, and replays captions that
+    // hadn't made it into a segment
+    bool open(const std::string& dir);
+    bool isOpen() const;
+
+    // Indexes text under doc_id, replacing what the id had before
+    void add(uint64_t doc_id, const std::string& text);
+    void remove(uint64_t doc_id);
+
+    // Ids whose caption has every term of query, highest id first. The last
+    // word matches as a prefix while it's being typed (no trailing space).
+    std::vector<uint64_t> search(const std::string& query, size_t limit);
+
+    // Writes the in-memory captions out as a segment
+    void flush();
+    void close();
+
+private:
+    CaptionIndex() = default;
+
+    struct Segment;
+    struct MemTable {
+        std::vector<uint64_t> docs;      // by ordinal, in arrival order
+        std::vector<uint8_t> deleted;
+        std::unordered_map<uint64_t, uint32_t> ordinal;  // live docs only
+        std::map<std::string, std::vector<uint32_t>> postings;
+        size_t live = 0;
+    };
+    using SegmentList = std::vector<std::shared_ptr<Segment>>;
+
+    void apply(uint64_t doc_id, const std::string* text);
+    void supersede(uint64_t doc_id);
+    bool logRecord(uint64_t doc_id, const std::string* text);
+    bool replayLog();
+    void flushLocked();
+    bool mergeOnce();
+    void mergeLoop();
+    void publish() const;
+
+    mutable std::shared_mutex mutex;
+    std::string dir;
+    FILE* log = nullptr;
+    MemTable mem;
+    SegmentList segments;
+    uint64_t next_gen = 1;
+
+    std::mutex merge_mutex;
+    std::condition_variable merge_cv;
+    bool merge_requested = false;
+    bool stopping = false;
+    std::thread merger;
+};
+
+// The terms text is indexed under, in order, with repeats
+std::vector<std::string> caption_terms(const std::string& text);
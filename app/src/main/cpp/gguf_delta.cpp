@@ -0,0 +1,289 @@
+#include "gguf_delta.h"
+#include "gguf_layout.h"
+#include "sha256.h"
+#include "async_log.h"
+#include "ggml.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+
+#undef TAG
+#define TAG "gguf_delta.cpp"
+#define LOGi(...) BW_LOG(BW_LOG_LEVEL_INFO, TAG, __VA_ARGS__)
+#define LOGe(...) BW_LOG(BW_LOG_LEVEL_ERROR, TAG, __VA_ARGS__)
+
+static const char* MANIFEST_MAGIC = "gguf-tensor-manifest 1";
+
+static const size_t HASH_CHUNK = 8 << 20;
+// Fetched ranges closer than this become one request. The gap is padding
+// or small tensors we'd otherwise have copied, both cheaper than a round trip.
+static const uint64_t FETCH_MERGE_GAP = 64 << 10;
+
+static std::string sidecar_path(const std::string& path) {
+    return path + ".tensors.sha256";
+}
+
+std::string TensorManifest::toText() const {
+    std::ostringstream out;
+    out << MANIFEST_MAGIC << "\n";
+    out << "file " << file_size << " " << file_sha256 << "\n";
+    out << "header " << data_offset << " " << header_sha256 << "\n";
+    for (const auto& t : tensors) {
+        out << "tensor " << t.offset << " " << t.size << " " << t.sha256 << " " << t.name << "\n";
+    }
+    return out.str();
+}
+
+bool TensorManifest::parse(const std::string& text) {
+    std::istringstream in(text);
+    std::string line;
+    if (!std::getline(in, line) || line != MANIFEST_MAGIC) {
+        return false;
+    }
+    tensors.clear();
+    bool have_file = false;
+    bool have_header = false;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string kind;
+        fields >> kind;
+        if (kind == "file") {
+            have_file = static_cast<bool>(fields >> file_size >> file_sha256);
+        } else if (kind == "header") {
+            have_header = static_cast<bool>(fields >> data_offset >> header_sha256);
+        } else if (kind == "tensor") {
+            Entry e;
+            if (!(fields >> e.offset >> e.size >> e.sha256 >> e.name) || e.offset + e.size > file_size) {
+                return false;
+            }
+            tensors.push_back(std::move(e));
+        }
+    }
+    return have_file && have_header && data_offset <= file_size;
+}
+
+// One sequential pass over the file, feeding the whole-file hash and the
+// hash of whichever span the bytes belong to
+static bool hash_file(const std::string& path, TensorManifest& manifest) {
+    GgufLayout layout;
+    if (!read_gguf_layout(path.c_str(), layout)) {
+        return false;
+    }
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGe("Can't open %s to hash it", path.c_str());
+        return false;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // The header is span 0, tensors by file offset after it
+    std::vector<GgufTensorSpan> spans = layout.tensors;
+    std::sort(spans.begin(), spans.end(), [](const auto& a, const auto& b) { return a.begin < b.begin; });
+    spans.insert(spans.begin(), {"", 0, layout.data_offset});
+    std::vector<std::string> digests(spans.size());
+
+    Sha256 file_hash;
+    Sha256 span_hash;
+    size_t span = 0;
+    std::vector<char> buf(HASH_CHUNK);
+    uint64_t pos = 0;
+    bool ok = true;
+    while (pos < layout.file_size) {
+        const ssize_t n = pread(fd, buf.data(), (size_t) std::min<uint64_t>(buf.size(), layout.file_size - pos), (off_t) pos);
+        if (n <= 0) {
+            ok = false;
+            break;
+        }
+        const uint64_t end = pos + (uint64_t) n;
+        file_hash.update(buf.data(), (size_t) n);
+        while (span < spans.size() && spans[span].begin < end) {
+            const uint64_t from = std::max(spans[span].begin, pos);
+            const uint64_t to = std::min(spans[span].end, end);
+            if (to > from) {
+                span_hash.update(buf.data() + (from - pos), (size_t) (to - from));
+            }
+            if (spans[span].end > end) {
+                break;
+            }
+            digests[span++] = span_hash.hexDigest();
+            span_hash = Sha256();
+        }
+        pos = end;
+    }
+    close(fd);
+    // Zero sized spans at the very end
+    for (; ok && span < spans.size(); span++) {
+        digests[span] = Sha256().hexDigest();
+    }
+    if (!ok) {
+        LOGe("Failed to read %s while hashing it", path.c_str());
+        return false;
+    }
+
+    manifest.file_size = layout.file_size;
+    manifest.file_sha256 = file_hash.hexDigest();
+    manifest.data_offset = layout.data_offset;
+    manifest.header_sha256 = digests[0];
+    manifest.tensors.clear();
+    for (size_t i = 1; i < spans.size(); i++) {
+        manifest.tensors.push_back({spans[i].name, spans[i].begin, spans[i].end - spans[i].begin, digests[i]});
+    }
+    return true;
+}
+
+// Which file a cached manifest was computed from. Rewrites (a delta commit,
+// the layout optimization) rename a new file into place, so the inode tells
+// them apart even when the mtime doesn't move past the sidecar's.
+static std::string file_stamp(const struct stat& st) {
+    return "source " + std::to_string((uint64_t) st.st_ino) + " " + std::to_string((uint64_t) st.st_size) + " " +
+           std::to_string((int64_t) st.st_mtim.tv_sec) + "." + std::to_string((int64_t) st.st_mtim.tv_nsec);
+}
+
+static bool write_sidecar(const std::string& path, const TensorManifest& manifest) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return false;
+    }
+    const std::string tmp = sidecar_path(path) + ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::trunc);
+        out << manifest.toText() << file_stamp(st) << "\n";
+        if (!out) {
+            return false;
+        }
+    }
+    return rename(tmp.c_str(), sidecar_path(path).c_str()) == 0;
+}
+
+bool build_tensor_manifest(const std::string& path, TensorManifest& manifest) {
+    struct stat model_st;
+    if (stat(path.c_str(), &model_st) != 0) {
+        return false;
+    }
+    {
+        std::ifstream in(sidecar_path(path));
+        std::stringstream text;
+        text << in.rdbuf();
+        const std::string cached = text.str();
+        if (cached.find("\n" + file_stamp(model_st) + "\n") != std::string::npos && manifest.parse(cached) &&
+            manifest.file_size == (uint64_t) model_st.st_size) {
+            return true;
+        }
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+    if (!hash_file(path, manifest)) {
+        return false;
+    }
+    LOGi("Hashed %zu tensors of %s (%.1f MB) in %.1f s", manifest.tensors.size(), path.c_str(),
+         manifest.file_size / 1e6, (ggml_time_us() - t_start_us) / 1e6);
+    if (!write_sidecar(path, manifest)) {
+        LOGe("Couldn't cache the tensor manifest of %s", path.c_str());
+    }
+    return true;
+}
+
+bool delta_prepare(const std::string& local_path, const TensorManifest& remote,
+                   const std::string& out_path, std::vector<DeltaRange>& fetch) {
+    fetch.clear();
+    TensorManifest local;
+    if (!build_tensor_manifest(local_path, local)) {
+        return false;
+    }
+    std::unordered_map<std::string, const TensorManifest::Entry*> by_hash;
+    for (const auto& t : local.tensors) {
+        by_hash.emplace(t.sha256, &t);
+    }
+
+    struct statvfs vfs;
+    if (statvfs(local_path.c_str(), &vfs) == 0 && (uint64_t) vfs.f_bavail * vfs.f_frsize < remote.file_size + (64 << 20)) {
+        LOGe("Not enough free space to patch %s", local_path.c_str());
+        return false;
+    }
+
+    int in = open(local_path.c_str(), O_RDONLY | O_CLOEXEC);
+    int out = open(out_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool ok = in >= 0 && out >= 0 && ftruncate(out, (off_t) remote.file_size) == 0;
+
+    // The header always changes (it has the offsets), copy everything else we can
+    std::vector<DeltaRange> missing = {{0, remote.data_offset}};
+    std::vector<char> buf(HASH_CHUNK);
+    uint64_t reused = 0;
+    for (const auto& t : remote.tensors) {
+        auto it = by_hash.find(t.sha256);
+        if (ok && it != by_hash.end() && it->second->size == t.size) {
+            ok = copy_file_bytes(in, out, it->second->offset, t.offset, t.size, buf);
+            reused += t.size;
+        } else if (t.size > 0) {
+            missing.push_back({t.offset, t.size});
+        }
+    }
+    ok = ok && fsync(out) == 0;
+    if (in >= 0) close(in);
+    if (out >= 0) close(out);
+    if (!ok) {
+        LOGe("Failed to copy unchanged tensors of %s", local_path.c_str());
+        unlink(out_path.c_str());
+        return false;
+    }
+
+    std::sort(missing.begin(), missing.end(), [](const auto& a, const auto& b) { return a.offset < b.offset; });
+    uint64_t to_fetch = 0;
+    for (const auto& r : missing) {
+        if (!fetch.empty() && r.offset <= fetch.back().offset + fetch.back().length + FETCH_MERGE_GAP) {
+            fetch.back().length = std::max(fetch.back().offset + fetch.back().length, r.offset + r.length) - fetch.back().offset;
+        } else {
+            fetch.push_back(r);
+        }
+    }
+    for (const auto& r : fetch) {
+        to_fetch += r.length;
+    }
+    LOGi("Delta for %s: reusing %.1f MB, fetching %.1f MB in %zu ranges (of %.1f MB)",
+         local_path.c_str(), reused / 1e6, to_fetch / 1e6, fetch.size(), remote.file_size / 1e6);
+    return true;
+}
+
+bool delta_commit(const std::string& local_path, const TensorManifest& remote, const std::string& out_path) {
+    TensorManifest patched;
+    bool ok = hash_file(out_path, patched);
+    const char* mismatch = nullptr;
+    if (ok && patched.file_size != remote.file_size) {
+        mismatch = "file size";
+    } else if (ok && patched.header_sha256 != remote.header_sha256) {
+        mismatch = "header";
+    } else if (ok && patched.tensors.size() != remote.tensors.size()) {
+        mismatch = "tensor count";
+    }
+    for (size_t i = 0; ok && !mismatch && i < remote.tensors.size(); i++) {
+        const auto& a = patched.tensors[i];
+        const auto& b = remote.tensors[i];
+        if (a.name != b.name || a.offset != b.offset || a.size != b.size || a.sha256 != b.sha256) {
+            LOGe("Patched tensor %s doesn't match the manifest", b.name.c_str());
+            mismatch = "tensor";
+        }
+    }
+    // Publisher manifests always have it, it's the hash the hub lists for the file
+    if (ok && !mismatch && patched.file_sha256 != remote.file_sha256) {
+        mismatch = "file SHA-256";
+    }
+    if (!ok || mismatch) {
+        LOGe("Patched %s failed verification (%s), discarding it", out_path.c_str(), mismatch ? mismatch : "unreadable");
+        unlink(out_path.c_str());
+        return false;
+    }
+    if (rename(out_path.c_str(), local_path.c_str()) != 0) {
+        LOGe("Couldn't replace %s with the patched copy", local_path.c_str());
+        unlink(out_path.c_str());
+        return false;
+    }
+    write_sidecar(local_path, patched);
+    LOGi("Updated %s to %s", local_path.c_str(), patched.file_sha256.c_str());
+    return true;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * Tensor level delta updates of a GGUF between two revisions of a repo.
+ *
+ * A revision publishes <file>.tensors.sha256 next to the GGUF (see
+ * scripts/gguf-tensor-manifest.py). The local file's manifest is computed
+ * once and cached beside it. Tensors whose hash the local file already has
+ * are copied from it, wherever they sit, and only the header and the
+ * changed tensors are fetched. The patched copy is checked against every
+ * hash in the remote manifest, including the whole-file SHA-256 that the
+ * hub reports for the file, before it replaces the local one.
+ */
+
+struct TensorManifest {
+    struct Entry {
+        std::string name;
+        uint64_t offset;   // absolute
+        uint64_t size;
+        std::string sha256;
+    };
+
+    uint64_t file_size = 0;
+    std::string file_sha256;
+    uint64_t data_offset = 0;   // the header is everything before this
+    std::string header_sha256;
+    std::vector<Entry> tensors;
+
+    std::string toText() const;
+    bool parse(const std::string& text);
+};
+
+// Hashes the file, or reads the cached <path>.tensors.sha256 if it was
+// computed from this very file (same inode, size and mtime)
+bool build_tensor_manifest(const std::string& path, TensorManifest& manifest);
+
+struct DeltaRange {
+    uint64_t offset;
+    uint64_t length;
+};
+
+// Creates out_path at the remote size, copies every tensor the local file
+// already has into place, and returns the ranges still to be fetched
+bool delta_prepare(const std::string& local_path, const TensorManifest& remote,
+                   const std::string& out_path, std::vector<DeltaRange>& fetch);
+
+// Checks out_path against the remote manifest and renames it over
+// local_path. The patched copy is removed if it doesn't match.
+bool delta_commit(const std::string& local_path, const TensorManifest& remote, const std::string& out_path);
@@ -0,0 +1,72 @@
+#include "gguf_layout.h"
+#include "gguf.h"
+#include "async_log.h"
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+
+#undef TAG
+#define TAG "gguf_layout.cpp"
+#define LOGi(...) BW_LOG(BW_LOG_LEVEL_INFO, TAG, __VA_ARGS__)
+#define LOGe(...) BW_LOG(BW_LOG_LEVEL_ERROR, TAG, __VA_ARGS__)
+
+bool read_gguf_layout(const char* path, GgufLayout& layout) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        LOGe("Can't stat %s", path);
+        return false;
+    }
+
+    gguf_init_params params = {/*no_alloc =*/ true, /*ctx =*/ nullptr};
+    gguf_context* ctx = gguf_init_from_file(path, params);
+    if (!ctx) {
+        LOGe("Failed to read GGUF header of %s", path);
+        return false;
+    }
+
+    layout.file_size = (uint64_t) st.st_size;
+    layout.data_offset = gguf_get_data_offset(ctx);
+    layout.alignment = gguf_get_alignment(ctx);
+    layout.tensors.clear();
+    const int64_t n_tensors = gguf_get_n_tensors(ctx);
+    for (int64_t i = 0; i < n_tensors; i++) {
+        const uint64_t begin = layout.data_offset + gguf_get_tensor_offset(ctx, i);
+        layout.tensors.push_back({gguf_get_tensor_name(ctx, i), begin, begin + gguf_get_tensor_size(ctx, i)});
+    }
+    gguf_free(ctx);
+    return true;
+}
+
+bool is_projector_tensor(const std::string& name) {
+    // clip's tensor names: v.* vision encoder, a.* audio encoder, mm.* and
+    // resampler.* projectors
+    static const char* prefixes[] = {"v.", "a.", "mm.", "resampler."};
+    for (const char* prefix : prefixes) {
+        if (name.compare(0, strlen(prefix), prefix) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool copy_file_bytes(int in, int out, uint64_t src, uint64_t dst, uint64_t size, std::vector<char>& buf) {
+    while (size > 0) {
+        const size_t n = (size_t) std::min<uint64_t>(size, buf.size());
+        ssize_t r = pread(in, buf.data(), n, (off_t) src);
+        if (r <= 0) {
+            return false;
+        }
+        for (ssize_t done = 0; done < r;) {
+            ssize_t w = pwrite(out, buf.data() + done, (size_t) (r - done), (off_t) (dst + done));
+            if (w <= 0) {
+                return false;
+            }
+            done += w;
+        }
+        src += r;
+        dst += r;
+        size -= r;
+    }
+    return true;
+}
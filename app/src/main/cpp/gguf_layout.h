@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * Where each tensor's data sits in a GGUF file, read from the header only
+ * (no tensor data is loaded).
+ */
+
+struct GgufTensorSpan {
+    std::string name;
+    uint64_t begin;   // absolute file offsets
+    uint64_t end;
+};
+
+struct GgufLayout {
+    uint64_t file_size = 0;
+    uint64_t data_offset = 0;   // start of the tensor data section
+    size_t alignment = 0;
+    std::vector<GgufTensorSpan> tensors;   // in tensor table order
+};
+
+bool read_gguf_layout(const char* path, GgufLayout& layout);
+
+// Tensors clip loads (vision/audio encoder and projector) rather than llama
+bool is_projector_tensor(const std::string& name);
+
+// pread/pwrite copy between two open files, buf sets the chunk size
+bool copy_file_bytes(int in, int out, uint64_t src, uint64_t dst, uint64_t size, std::vector<char>& buf);
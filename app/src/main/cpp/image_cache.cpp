@@ -0,0 +1,334 @@
+#include "image_cache.h"
+#include "common.h"
+#include "async_log.h"
+#include "metrics.h"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+
+#undef TAG
+#define TAG "image_cache.cpp"
+#define LOGi(...) BW_LOG(BW_LOG_LEVEL_INFO, TAG, __VA_ARGS__)
+#define LOGe(...) BW_LOG(BW_LOG_LEVEL_ERROR, TAG, __VA_ARGS__)
+
+void ImageCache::clear() {
+    source_id.clear();
+    source.reset();
+    entries.clear();
+    source_tail.clear();
+    n_mapped = 0;
+    current.clear();
+    clearRegion();
+}
+
+void ImageCache::clearRegion() {
+    region = false;
+    parts.clear();
+    tail.clear();
+}
+
+void ImageCache::beginImage(mtmd::bitmap& bmp) {
+    clear();
+    // Chunks carry their bitmap's id, that's how the cache tells the source
+    // image apart from anything else in the prompt
+    source_id = "snap-" + std::to_string(++n_images);
+    bmp.set_id(source_id.c_str());
+    whole = {0, 0, (int) bmp.nx(), (int) bmp.ny()};
+}
+
+// Text between two image chunks with the digits taken out, so "<row_1_col_2>"
+// and "<row_1_col_3>" count as the same separator
+static void append_separator(std::string& out, const mtmd_input_chunk* chunk, const llama_vocab* vocab) {
+    size_t n_tokens = 0;
+    const llama_token* tokens = mtmd_input_chunk_get_tokens_text(chunk, &n_tokens);
+    for (size_t i = 0; i < n_tokens; i++) {
+        for (char c : common_token_to_piece(vocab, tokens[i], true)) {
+            if (!isdigit((unsigned char) c)) {
+                out += c;
+            }
+        }
+        out += '\x1f';
+    }
+}
+
+// Whether n tiles, cols to a row, explain the separators between them, which
+// start at seps[first]. The separators inside a row are all the same, so are
+// the ones between rows, and those two and the overview's differ.
+static bool grid_matches(const std::vector<std::string>& seps, size_t first, int n, int cols,
+                         const std::string& overview_sep) {
+    const std::string* in_row = nullptr;
+    const std::string* row_end = nullptr;
+    for (int j = 1; j < n; j++) {
+        const std::string& sep = seps[first + j - 1];
+        const std::string*& kind = j % cols == 0 ? row_end : in_row;
+        if (!kind) {
+            kind = &sep;
+        } else if (*kind != sep) {
+            return false;
+        }
+    }
+    if (in_row && row_end && *in_row == *row_end) {
+        return false;
+    }
+    return (!in_row || *in_row != overview_sep) && (!row_end || *row_end != overview_sep);
+}
+
+bool ImageCache::findLayout(const mtmd_input_chunks* chunks, const llama_vocab* vocab, const std::string& id,
+                            const Rect& whole, Layout& layout) {
+    // The image's chunks and the text between each one and the next
+    std::vector<std::string> seps;
+    std::string sep;
+    for (size_t i = 0; i < mtmd_input_chunks_size(chunks); i++) {
+        const mtmd_input_chunk* chunk = mtmd_input_chunks_get(chunks, i);
+        const char* chunk_id = mtmd_input_chunk_get_id(chunk);
+        if (mtmd_input_chunk_get_type(chunk) == MTMD_INPUT_CHUNK_TYPE_TEXT) {
+            if (!layout.images.empty()) {
+                append_separator(sep, chunk, vocab);
+            }
+        } else if (id.empty() || (chunk_id && id == chunk_id)) {
+            if (!layout.images.empty()) {
+                seps.push_back(sep);
+            }
+            layout.images.push_back(chunk);
+            layout.index.push_back(i);
+            sep.clear();
+        } else if (!layout.images.empty()) {
+            break;
+        }
+    }
+    const std::vector<const mtmd_input_chunk*>& images = layout.images;
+    if (images.empty()) {
+        return false;
+    }
+    if (images.size() == 1) {
+        layout.rects.push_back(whole);
+        layout.overview = 0;
+        return true;
+    }
+
+    // Every grid the separators allow, with the overview first or last. When
+    // both a row and a column fit, the one closer to the image's aspect ratio
+    // is what the slicer picked.
+    const int n_tiles = (int) images.size() - 1;
+    const double aspect = (double) (whole.x1 - whole.x0) / (whole.y1 - whole.y0);
+    int layouts = 0;
+    bool overview_first = false;
+    int cols = 0;
+    for (bool ov_first : {true, false}) {
+        const std::string& overview_sep = ov_first ? seps.front() : seps.back();
+        int best_cols = 0;
+        double best = INFINITY;
+        for (int c = 1; c <= n_tiles; c++) {
+            if (n_tiles % c != 0 || !grid_matches(seps, ov_first ? 1 : 0, n_tiles, c, overview_sep)) {
+                continue;
+            }
+            const double err = std::fabs(std::log((double) c * c / n_tiles / aspect));
+            if (err < best) {
+                best = err;
+                best_cols = c;
+            }
+        }
+        if (best_cols > 0) {
+            layouts++;
+            overview_first = ov_first;
+            cols = best_cols;
+        }
+    }
+    if (layouts != 1) {
+        return false;
+    }
+
+    const int rows = n_tiles / cols;
+    const int w = whole.x1 - whole.x0;
+    const int h = whole.y1 - whole.y0;
+    layout.overview = overview_first ? 0 : n_tiles;
+    layout.rects.resize(images.size(), whole);
+    for (int k = 0; k < n_tiles; k++) {
+        const int r = k / cols;
+        const int c = k % cols;
+        Rect& rect = layout.rects[overview_first ? k + 1 : k];
+        rect.x0 = whole.x0 + c * w / cols;
+        rect.x1 = whole.x0 + (c + 1) * w / cols;
+        rect.y0 = whole.y0 + r * h / rows;
+        rect.y1 = whole.y0 + (r + 1) * h / rows;
+    }
+    return true;
+}
+
+// Tokens of the text chunk at i, less skip_front at the start and skip_back
+// at the end, appended to out
+static void append_text(std::vector<llama_token>& out, const mtmd_input_chunks* chunks, size_t i,
+                        size_t skip_front, size_t skip_back) {
+    if (i >= mtmd_input_chunks_size(chunks)) {
+        return;
+    }
+    const mtmd_input_chunk* chunk = mtmd_input_chunks_get(chunks, i);
+    size_t n_tokens = 0;
+    const llama_token* tokens = mtmd_input_chunk_get_type(chunk) == MTMD_INPUT_CHUNK_TYPE_TEXT
+                                    ? mtmd_input_chunk_get_tokens_text(chunk, &n_tokens)
+                                    : nullptr;
+    if (tokens && n_tokens >= skip_front + skip_back) {
+        out.insert(out.end(), tokens + skip_front, tokens + n_tokens - skip_back);
+    }
+}
+
+void ImageCache::mapChunks(const mtmd_input_chunks* chunks, const llama_vocab* vocab, size_t n_before,
+                           size_t n_after) {
+    current.clear();
+    if (source_id.empty()) {
+        return;
+    }
+    Layout layout;
+    if (!findLayout(chunks, vocab, source_id, whole, layout)) {
+        if (!layout.images.empty()) {
+            LOGi("Image %s: %d chunks in no clear grid, none will be reused", source_id.c_str(),
+                 (int) layout.images.size());
+        }
+        return;
+    }
+
+    // What the model puts in front of each chunk, from the end of the prompt
+    // text to the first one and between the others
+    for (size_t k = 0; k < layout.images.size(); k++) {
+        Mapped& mapped = current[layout.images[k]];
+        mapped.rect = layout.rects[k];
+        mapped.overview = (int) k == layout.overview;
+        if (k == 0) {
+            if (layout.index[0] > 0) {
+                append_text(mapped.lead, chunks, layout.index[0] - 1, n_before, 0);
+            }
+        } else {
+            for (size_t i = layout.index[k - 1] + 1; i < layout.index[k]; i++) {
+                append_text(mapped.lead, chunks, i, 0, 0);
+            }
+        }
+    }
+    append_text(source_tail, chunks, layout.index.back() + 1, 0, n_after);
+    n_mapped = layout.images.size();
+    LOGi("Image %s: %zu chunks, overview %s", source_id.c_str(), n_mapped,
+         n_mapped == 1 ? "only" : layout.overview == 0 ? "first" : "last");
+}
+
+const mtmd_input_chunk* ImageCache::wholeChunk(const mtmd_input_chunks* chunks, const llama_vocab* vocab,
+                                                int width, int height) {
+    Layout layout;
+    if (!findLayout(chunks, vocab, "", {0, 0, width, height}, layout)) {
+        return nullptr;
+    }
+    return layout.images[layout.overview];
+}
+
+void ImageCache::storeChunk(const mtmd_input_chunk* chunk, const float* embd, int n_embd) {
+    auto it = current.find(chunk);
+    if (it == current.end() || !embd) {
+        return;
+    }
+    Entry entry;
+    entry.n_tokens = mtmd_input_chunk_get_n_tokens(chunk);
+    entry.embd.assign(embd, embd + entry.n_tokens * n_embd);
+    entry.where = std::move(it->second);
+    entries.push_back(std::move(entry));
+    current.erase(it);
+}
+
+void ImageCache::keepSource(mtmd::bitmap&& bmp) {
+    const char* id = bmp.ptr ? mtmd_bitmap_get_id(bmp.ptr.get()) : nullptr;
+    if (source_id.empty() || !id || source_id != id) {
+        return;
+    }
+    source.reset(bmp.ptr.release());
+}
+
+bool ImageCache::cropSource(const Rect& rect, mtmd::bitmap& crop) const {
+    const int src_w = (int) mtmd_bitmap_get_nx(source.get());
+    const int crop_w = rect.x1 - rect.x0;
+    const int crop_h = rect.y1 - rect.y0;
+    const unsigned char* src = mtmd_bitmap_get_data(source.get());
+    std::vector<unsigned char> rgb((size_t) crop_w * crop_h * 3);
+    for (int row = 0; row < crop_h; row++) {
+        std::copy(src + ((size_t) (rect.y0 + row) * src_w + rect.x0) * 3,
+                  src + ((size_t) (rect.y0 + row) * src_w + rect.x1) * 3,
+                  rgb.begin() + (size_t) row * crop_w * 3);
+    }
+    crop.ptr.reset(mtmd_bitmap_init(crop_w, crop_h, rgb.data()));
+    return crop.ptr != nullptr;
+}
+
+bool ImageCache::prepareRegion(float left, float top, float right, float bottom, mtmd::bitmap& crop) {
+    clearRegion();
+    if (!hasImage()) {
+        Metrics::getInstance().region_misses.inc();
+        LOGe("No cached image to take a region from");
+        return false;
+    }
+
+    const int src_w = (int) mtmd_bitmap_get_nx(source.get());
+    const int src_h = (int) mtmd_bitmap_get_ny(source.get());
+    Rect rect;
+    rect.x0 = std::max(0, (int) std::floor(left * src_w));
+    rect.y0 = std::max(0, (int) std::floor(top * src_h));
+    rect.x1 = std::min(src_w, (int) std::ceil(right * src_w));
+    rect.y1 = std::min(src_h, (int) std::ceil(bottom * src_h));
+    if (rect.x1 <= rect.x0 || rect.y1 <= rect.y0) {
+        LOGe("Region %.2f,%.2f - %.2f,%.2f is empty", left, top, right, bottom);
+        return false;
+    }
+
+    // The earlier image's chunks in their order, with what the region makes
+    // of each. Less than half a tile either way is left to the region's
+    // overview, stretched to a whole tile it would be mostly distortion.
+    size_t n_cached = 0;
+    if (n_mapped > 1 && entries.size() == n_mapped) {
+        for (Entry& e : entries) {
+            const Rect& tile = e.where.rect;
+            Part part;
+            part.lead = e.where.lead;
+            if (e.where.overview) {
+                cropSource(rect, part.crop);
+            } else if (tile.x0 >= rect.x0 && tile.x1 <= rect.x1 && tile.y0 >= rect.y0 && tile.y1 <= rect.y1) {
+                part.embd = e.embd.data();
+                part.n_tokens = e.n_tokens;
+                n_cached++;
+            } else {
+                Rect piece;
+                piece.x0 = std::max(tile.x0, rect.x0);
+                piece.y0 = std::max(tile.y0, rect.y0);
+                piece.x1 = std::min(tile.x1, rect.x1);
+                piece.y1 = std::min(tile.y1, rect.y1);
+                if ((piece.x1 - piece.x0) * 2 < tile.x1 - tile.x0 || (piece.y1 - piece.y0) * 2 < tile.y1 - tile.y0) {
+                    continue;
+                }
+                cropSource(piece, part.crop);
+            }
+            parts.push_back(std::move(part));
+        }
+    }
+    region = true;
+    n_reused = n_cached;
+    Metrics::getInstance().region_hits.inc();
+
+    if (n_cached == 0) {
+        // Nothing to reuse, the crop goes through mtmd like any image
+        parts.clear();
+        if (!cropSource(rect, crop)) {
+            region = false;
+            return false;
+        }
+        crop.set_id(("region-" + std::to_string(n_images)).c_str());
+        LOGi("region %d,%d %dx%d of %s holds no whole tile, sent as a new image", rect.x0, rect.y0,
+             rect.x1 - rect.x0, rect.y1 - rect.y0, source_id.c_str());
+        return true;
+    }
+    tail = source_tail;
+    LOGi("region %d,%d %dx%d of %s: %zu cached tiles, %zu parts to encode", rect.x0, rect.y0,
+         rect.x1 - rect.x0, rect.y1 - rect.y0, source_id.c_str(), n_cached, parts.size() - n_cached);
+    return true;
+}
+
+void ImageCache::endRequest() {
+    if (!parts.empty()) {
+        Metrics::getInstance().region_chunks_reused.inc(n_reused);
+        LOGi("region: %zu of %zu parts from the cache, the rest encoded", n_reused, parts.size());
+    }
+    current.clear();
+}
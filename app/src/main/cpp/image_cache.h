@@ -0,0 +1,125 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+#include "llama.h"
+#include "mtmd.h"
+
+/*
+ * Keeps the encoder output of the last described image around, so follow-up
+ * questions about part of it ("what does the sign in the corner say?") don't
+ * re-encode what was already encoded.
+ *
+ * When an image is tokenized, mapChunks works out which part of it each image
+ * chunk covers. Slicing models emit the tiles row by row plus an overview of
+ * the whole image, with text between the chunks. The text between two tiles
+ * of a row and between the last tile of a row and the next row's first tile
+ * differ, which gives the grid; the overview is the chunk whose text matches
+ * neither. When the layout is ambiguous nothing is mapped and nothing reused.
+ *
+ * A region request is laid out on that grid. Tiles fully inside the region
+ * are decoded from the cache. A tile the region covers at least half of
+ * either way is replaced by the covered part, zoomed to a whole tile, and
+ * the overview by the whole region. Those are cropped from the source and
+ * encoded as one chunk each. Every part keeps the text the image had in
+ * front of its tile, row and column markers included. A region that holds
+ * no whole tile, or an image that wasn't tiled, is cropped and sent as a new
+ * image instead.
+ *
+ * The source is the bitmap as ingested. That's full resolution unless
+ * ingestion scaled it down (thermal tile cap, set_max_ingest_edge), in which
+ * case regions are cut from the reduced pixels.
+ */
+class ImageCache {
+public:
+    // A new image is about to be encoded, forget the previous one
+    void beginImage(mtmd::bitmap& bmp);
+
+    // Called once the prompt with the current image is tokenized, maps its
+    // chunks onto the image. n_before and n_after are the prompt's own tokens
+    // before and after the image, what's left of the text around its chunks
+    // is the framing the model puts there.
+    void mapChunks(const mtmd_input_chunks* chunks, const llama_vocab* vocab, size_t n_before, size_t n_after);
+
+    // Called for every image chunk right after it's encoded
+    void storeChunk(const mtmd_input_chunk* chunk, const float* embd, int n_embd);
+
+    // Keeps the source pixels for cropping
+    void keepSource(mtmd::bitmap&& bmp);
+
+    bool hasImage() const { return source != nullptr; }
+
+    // A piece of a region laid out on the earlier image's tiles
+    struct Part {
+        std::vector<llama_token> lead;  // text in front of it
+        const float* embd = nullptr;    // a cached tile, null if crop needs encoding
+        size_t n_tokens = 0;
+        mtmd::bitmap crop;
+    };
+
+    // Takes the region (fractions of the image width and height, so callers
+    // don't care how big the ingested copy was). Either fills regionParts(),
+    // or leaves them empty and puts the region in crop to be sent as the next
+    // image.
+    bool prepareRegion(float left, float top, float right, float bottom, mtmd::bitmap& crop);
+    bool hasRegion() const { return region; }
+    std::vector<Part>& regionParts() { return parts; }
+    // Framing after the last part
+    const std::vector<llama_token>& regionTail() const { return tail; }
+    void clearRegion();
+
+    // The chunk of a tokenized image that shows all of it: the overview, or
+    // the only chunk. Null if the layout is ambiguous.
+    static const mtmd_input_chunk* wholeChunk(const mtmd_input_chunks* chunks, const llama_vocab* vocab,
+                                              int width, int height);
+
+    // The request's chunks are gone, logs what a region request reused
+    void endRequest();
+
+    void clear();
+
+private:
+    struct Rect {
+        int x0 = 0, y0 = 0, x1 = 0, y1 = 0;  // source pixels
+    };
+    struct Layout {
+        // The image's chunks in order, their index in the prompt and the
+        // part of the image each covers
+        std::vector<const mtmd_input_chunk*> images;
+        std::vector<size_t> index;
+        std::vector<Rect> rects;
+        int overview = -1;
+    };
+    struct Mapped {
+        Rect rect;
+        bool overview = false;
+        std::vector<llama_token> lead;
+    };
+    struct Entry {
+        std::vector<float> embd;
+        size_t n_tokens = 0;
+        Mapped where;
+    };
+
+    static bool findLayout(const mtmd_input_chunks* chunks, const llama_vocab* vocab, const std::string& id,
+                           const Rect& whole, Layout& layout);
+    bool cropSource(const Rect& rect, mtmd::bitmap& crop) const;
+
+    std::string source_id;
+    mtmd::bitmap_ptr source;
+    Rect whole;
+    std::vector<Entry> entries;
+    std::vector<llama_token> source_tail;
+    size_t n_mapped = 0;
+
+    // Chunks of the image being tokenized, until they're stored
+    std::unordered_map<const mtmd_input_chunk*, Mapped> current;
+
+    bool region = false;
+    std::vector<Part> parts;
+    std::vector<llama_token> tail;
+    size_t n_reused = 0;
+    int n_images = 0;
+};
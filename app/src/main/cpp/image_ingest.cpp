@@ -0,0 +1,429 @@
+#include "image_ingest.h"
+#include <android/bitmap.h>
+#include <android/hardware_buffer.h>
+#include "async_log.h"
+#include "proc_status.h"
+#include "ggml.h"
+#include <dlfcn.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <thread>
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#undef TAG
+#define TAG "image_ingest.cpp"
+#define LOGi(...) BW_LOG(BW_LOG_LEVEL_INFO, TAG, __VA_ARGS__)
+#define LOGe(...) BW_LOG(BW_LOG_LEVEL_ERROR, TAG, __VA_ARGS__)
+
+// Both are API 30, we're minSdk 28, so they're looked up at runtime
+typedef int (*get_hardware_buffer_fn)(JNIEnv*, jobject, AHardwareBuffer**);
+typedef int32_t (*get_data_space_fn)(JNIEnv*, jobject);
+static const int32_t DATASPACE_SCRGB_LINEAR = 406913024;  // ADATASPACE_SCRGB_LINEAR
+
+// Above this, highlights get compressed instead of clipped
+static const float KNEE = 0.8f;
+
+void convert_rgba8888(const uint8_t* src, size_t stride, int width, int height, uint8_t* dst) {
+    for (int y = 0; y < height; y++) {
+        const uint8_t* s = src + y * stride;
+        uint8_t* d = dst + (size_t) y * width * 3;
+        int x = 0;
+#if defined(__aarch64__)
+        for (; x + 16 <= width; x += 16) {
+            uint8x16x4_t px = vld4q_u8(s + x * 4);
+            uint8x16x3_t out = {{px.val[0], px.val[1], px.val[2]}};
+            vst3q_u8(d + x * 3, out);
+        }
+#endif
+        for (; x < width; x++) {
+            d[x * 3 + 0] = s[x * 4 + 0];
+            d[x * 3 + 1] = s[x * 4 + 1];
+            d[x * 3 + 2] = s[x * 4 + 2];
+        }
+    }
+}
+
+void convert_rgb565(const uint8_t* src, size_t stride, int width, int height, uint8_t* dst) {
+    for (int y = 0; y < height; y++) {
+        const uint16_t* s = reinterpret_cast<const uint16_t*>(src + y * stride);
+        uint8_t* d = dst + (size_t) y * width * 3;
+        int x = 0;
+#if defined(__aarch64__)
+        for (; x + 8 <= width; x += 8) {
+            uint16x8_t p = vld1q_u16(s + x);
+            uint8x8_t r = vmovn_u16(vshrq_n_u16(p, 11));
+            uint8x8_t g = vmovn_u16(vandq_u16(vshrq_n_u16(p, 5), vdupq_n_u16(0x3F)));
+            uint8x8_t b = vmovn_u16(vandq_u16(p, vdupq_n_u16(0x1F)));
+            // Replicate the top bits into the bottom so 0x1F maps to 0xFF
+            uint8x8x3_t out;
+            out.val[0] = vorr_u8(vshl_n_u8(r, 3), vshr_n_u8(r, 2));
+            out.val[1] = vorr_u8(vshl_n_u8(g, 2), vshr_n_u8(g, 4));
+            out.val[2] = vorr_u8(vshl_n_u8(b, 3), vshr_n_u8(b, 2));
+            vst3_u8(d + x * 3, out);
+        }
+#endif
+        for (; x < width; x++) {
+            const uint16_t p = s[x];
+            const uint8_t r = p >> 11;
+            const uint8_t g = (p >> 5) & 0x3F;
+            const uint8_t b = p & 0x1F;
+            d[x * 3 + 0] = (r << 3) | (r >> 2);
+            d[x * 3 + 1] = (g << 2) | (g >> 4);
+            d[x * 3 + 2] = (b << 3) | (b >> 2);
+        }
+    }
+}
+
+static float half_to_float(uint16_t h) {
+    const uint32_t sign = (uint32_t) (h & 0x8000) << 16;
+    const uint32_t exp = (h >> 10) & 0x1F;
+    const uint32_t mant = h & 0x3FF;
+    float f;
+    if (exp == 0) {
+        f = std::ldexp((float) mant, -24);
+    } else if (exp == 31) {
+        f = mant ? NAN : INFINITY;
+    } else {
+        uint32_t bits = ((exp + 112) << 23) | (mant << 13);
+        memcpy(&f, &bits, sizeof(f));
+    }
+    return sign ? -f : f;
+}
+
+// Soft roll-off above KNEE, then optionally the sRGB curve, to 8 bits.
+// Indexed by the raw half, so samples are never converted to float.
+struct F16Luts {
+    uint8_t encoded[65536];  // already sRGB encoded
+    uint8_t linear[65536];   // linear, needs the sRGB curve
+
+    F16Luts() {
+        for (uint32_t h = 0; h < 65536; h++) {
+            float v = half_to_float((uint16_t) h);
+            // Negatives and NaN are black, +inf rolls off to white
+            v = v > 0.0f ? v : 0.0f;
+            if (v > KNEE) {
+                v = KNEE + (1.0f - KNEE) * (1.0f - std::exp(-(v - KNEE) / (1.0f - KNEE)));
+            }
+            float enc = v <= 0.0031308f ? v * 12.92f : 1.055f * std::pow(v, 1.0f / 2.4f) - 0.055f;
+            encoded[h] = (uint8_t) std::lround(std::min(1.0f, v) * 255.0f);
+            linear[h] = (uint8_t) std::lround(std::min(1.0f, enc) * 255.0f);
+        }
+    }
+};
+
+static const uint8_t* f16_lut(bool linear) {
+    static const F16Luts luts;
+    return linear ? luts.linear : luts.encoded;
+}
+
+void convert_rgba_f16(const uint8_t* src, size_t stride, int width, int height, bool linear, uint8_t* dst) {
+    const uint8_t* lut = f16_lut(linear);
+    for (int y = 0; y < height; y++) {
+        const uint16_t* s = reinterpret_cast<const uint16_t*>(src + y * stride);
+        uint8_t* d = dst + (size_t) y * width * 3;
+        for (int x = 0; x < width; x++) {
+            d[x * 3 + 0] = lut[s[x * 4 + 0]];
+            d[x * 3 + 1] = lut[s[x * 4 + 1]];
+            d[x * 3 + 2] = lut[s[x * 4 + 2]];
+        }
+    }
+}
+
+static void convert_rows(PixelFormat format, const uint8_t* src, size_t stride, int width, int height, uint8_t* dst) {
+    switch (format) {
+        case PixelFormat::RGBA8888: convert_rgba8888(src, stride, width, height, dst); break;
+        case PixelFormat::RGB565:   convert_rgb565(src, stride, width, height, dst); break;
+        case PixelFormat::RGBA_F16: convert_rgba_f16(src, stride, width, height, false, dst); break;
+        case PixelFormat::RGBA_F16_LINEAR: convert_rgba_f16(src, stride, width, height, true, dst); break;
+    }
+}
+
+// Below this many source pixels threads cost more than they save
+static const int64_t MIN_PIXELS_PER_THREAD = 256 * 1024;
+
+static int ingest_threads(int64_t n_pixels) {
+    const int hw = (int) std::thread::hardware_concurrency();
+    const int by_size = (int) std::max<int64_t>(1, n_pixels / MIN_PIXELS_PER_THREAD);
+    return std::max(1, std::min({4, hw, by_size}));
+}
+
+static int parallel_rows(int n_rows, int n_threads, const std::function<void(int, int)>& fn) {
+    n_threads = std::max(1, std::min(n_threads, n_rows));
+    if (n_threads == 1) {
+        fn(0, n_rows);
+        return 1;
+    }
+    std::vector<std::thread> workers;
+    for (int t = 1; t < n_threads; t++) {
+        workers.emplace_back(fn, n_rows * t / n_threads, n_rows * (t + 1) / n_threads);
+    }
+    fn(0, n_rows / n_threads);
+    for (auto& w : workers) {
+        w.join();
+    }
+    return n_threads;
+}
+
+// Area average of the source pixels under each output pixel. Each source row
+// goes through the format's row kernel once and is summed into the output
+// row it falls in.
+static void ingest_rows(PixelFormat format, const uint8_t* src, size_t stride, int sw, int sh,
+                        uint8_t* dst, int dw, int dh, int y_begin, int y_end) {
+    if (sw == dw && sh == dh) {
+        convert_rows(format, src + y_begin * stride, stride, sw, y_end - y_begin, dst + (size_t) y_begin * dw * 3);
+        return;
+    }
+
+    std::vector<int> x0(dw), x1(dw);
+    for (int dx = 0; dx < dw; dx++) {
+        x0[dx] = (int) ((int64_t) dx * sw / dw);
+        x1[dx] = std::max(x0[dx] + 1, (int) ((int64_t) (dx + 1) * sw / dw));
+    }
+    std::vector<uint8_t> row((size_t) sw * 3);
+    std::vector<uint32_t> acc((size_t) dw * 3);
+    for (int dy = y_begin; dy < y_end; dy++) {
+        const int y0 = (int) ((int64_t) dy * sh / dh);
+        const int y1 = std::max(y0 + 1, (int) ((int64_t) (dy + 1) * sh / dh));
+        std::fill(acc.begin(), acc.end(), 0);
+        for (int sy = y0; sy < y1; sy++) {
+            convert_rows(format, src + sy * stride, stride, sw, 1, row.data());
+            for (int dx = 0; dx < dw; dx++) {
+                uint32_t r = 0, g = 0, b = 0;
+                for (int sx = x0[dx]; sx < x1[dx]; sx++) {
+                    r += row[sx * 3 + 0];
+                    g += row[sx * 3 + 1];
+                    b += row[sx * 3 + 2];
+                }
+                acc[dx * 3 + 0] += r;
+                acc[dx * 3 + 1] += g;
+                acc[dx * 3 + 2] += b;
+            }
+        }
+        uint8_t* d = dst + (size_t) dy * dw * 3;
+        for (int dx = 0; dx < dw; dx++) {
+            const uint32_t n = (uint32_t) ((x1[dx] - x0[dx]) * (y1 - y0));
+            for (int c = 0; c < 3; c++) {
+                d[dx * 3 + c] = (uint8_t) ((acc[dx * 3 + c] + n / 2) / n);
+            }
+        }
+    }
+}
+
+void ingest_pixels(PixelFormat format, const uint8_t* src, size_t stride, int sw, int sh,
+                   uint8_t* dst, int dw, int dh) {
+    parallel_rows(dh, ingest_threads((int64_t) sw * sh), [&](int y0, int y1) {
+        ingest_rows(format, src, stride, sw, sh, dst, dw, dh, y0, y1);
+    });
+}
+
+std::vector<uint8_t> resize_rgb(const uint8_t* src, int sw, int sh, int dw, int dh) {
+    std::vector<uint8_t> dst((size_t) dw * dh * 3);
+    const float sx = (float) sw / dw;
+    const float sy = (float) sh / dh;
+    for (int y = 0; y < dh; y++) {
+        float fy = std::max(0.0f, (y + 0.5f) * sy - 0.5f);
+        int y0 = std::min((int) fy, sh - 1);
+        int y1 = std::min(y0 + 1, sh - 1);
+        float wy = fy - y0;
+        for (int x = 0; x < dw; x++) {
+            float fx = std::max(0.0f, (x + 0.5f) * sx - 0.5f);
+            int x0 = std::min((int) fx, sw - 1);
+            int x1 = std::min(x0 + 1, sw - 1);
+            float wx = fx - x0;
+            for (int c = 0; c < 3; c++) {
+                float top = src[((size_t) y0 * sw + x0) * 3 + c] * (1 - wx) + src[((size_t) y0 * sw + x1) * 3 + c] * wx;
+                float bot = src[((size_t) y1 * sw + x0) * 3 + c] * (1 - wx) + src[((size_t) y1 * sw + x1) * 3 + c] * wx;
+                dst[((size_t) y * dw + x) * 3 + c] = (uint8_t) (top * (1 - wy) + bot * wy + 0.5f);
+            }
+        }
+    }
+    return dst;
+}
+
+static bool is_linear(JNIEnv* env, jobject bitmap) {
+    static auto get_data_space = (get_data_space_fn) dlsym(RTLD_DEFAULT, "AndroidBitmap_getDataSpace");
+    // RGBA_F16 bitmaps are linear extended sRGB unless they say otherwise
+    return get_data_space ? get_data_space(env, bitmap) == DATASPACE_SCRGB_LINEAR : true;
+}
+
+static const char* format_name(PixelFormat format) {
+    switch (format) {
+        case PixelFormat::RGBA8888:        return "RGBA_8888";
+        case PixelFormat::RGB565:          return "RGB_565";
+        case PixelFormat::RGBA_F16:        return "RGBA_F16";
+        case PixelFormat::RGBA_F16_LINEAR: return "RGBA_F16 linear";
+    }
+    return "unknown";
+}
+
+typedef std::function<void(PixelFormat, const uint8_t*, size_t, int, int)> pixels_fn;
+
+static bool with_hardware_buffer(AHardwareBuffer* hb, bool linear, const pixels_fn& fn) {
+    AHardwareBuffer_Desc desc;
+    AHardwareBuffer_describe(hb, &desc);
+    PixelFormat format;
+    size_t bpp;
+    switch (desc.format) {
+        case AHARDWAREBUFFER_FORMAT_R8G8B8A8_UNORM:
+        case AHARDWAREBUFFER_FORMAT_R8G8B8X8_UNORM:
+            format = PixelFormat::RGBA8888;
+            bpp = 4;
+            break;
+        case AHARDWAREBUFFER_FORMAT_R5G6B5_UNORM:
+            format = PixelFormat::RGB565;
+            bpp = 2;
+            break;
+        case AHARDWAREBUFFER_FORMAT_R16G16B16A16_FLOAT:
+            format = linear ? PixelFormat::RGBA_F16_LINEAR : PixelFormat::RGBA_F16;
+            bpp = 8;
+            break;
+        default:
+            LOGe("Unsupported hardware buffer format %u", desc.format);
+            return false;
+    }
+
+    // Buffers allocated for the GPU only (the usual HARDWARE bitmap from
+    // ImageDecoder) can't be locked for reading. The caller copies those.
+    if ((desc.usage & AHARDWAREBUFFER_USAGE_CPU_READ_MASK) == 0) {
+        LOGi("Hardware buffer has no CPU read usage, copying the bitmap instead");
+        return false;
+    }
+    void* pixels = nullptr;
+    if (AHardwareBuffer_lock(hb, AHARDWAREBUFFER_USAGE_CPU_READ_OFTEN, -1, nullptr, &pixels) != 0) {
+        LOGi("Failed to lock hardware buffer, copying the bitmap instead");
+        return false;
+    }
+    // desc.stride is in pixels
+    fn(format, static_cast<const uint8_t*>(pixels), desc.stride * bpp, (int) desc.width, (int) desc.height);
+    AHardwareBuffer_unlock(hb, nullptr);
+    return true;
+}
+
+// Locks the bitmap's pixels (or its hardware buffer) for the duration of fn
+static bool with_bitmap_pixels(JNIEnv* env, jobject bitmap, const pixels_fn& fn) {
+    AndroidBitmapInfo info;
+    if (AndroidBitmap_getInfo(env, bitmap, &info) != ANDROID_BITMAP_RESULT_SUCCESS) {
+        LOGe("AndroidBitmap_getInfo failed");
+        return false;
+    }
+    const bool linear = info.format == ANDROID_BITMAP_FORMAT_RGBA_F16 && is_linear(env, bitmap);
+
+    void* pixels = nullptr;
+    if (AndroidBitmap_lockPixels(env, bitmap, &pixels) != ANDROID_BITMAP_RESULT_SUCCESS) {
+        // HARDWARE bitmaps can't be locked, their pixels live in a
+        // HardwareBuffer we can map for reading instead
+        static auto get_hardware_buffer = (get_hardware_buffer_fn) dlsym(RTLD_DEFAULT, "AndroidBitmap_getHardwareBuffer");
+        AHardwareBuffer* hb = nullptr;
+        if (!get_hardware_buffer || get_hardware_buffer(env, bitmap, &hb) != ANDROID_BITMAP_RESULT_SUCCESS || !hb) {
+            LOGe("Bitmap can't be locked and has no hardware buffer");
+            return false;
+        }
+        bool ok = with_hardware_buffer(hb, linear, fn);
+        AHardwareBuffer_release(hb);
+        return ok;
+    }
+
+    bool ok = true;
+    switch (info.format) {
+        case ANDROID_BITMAP_FORMAT_RGBA_8888:
+            fn(PixelFormat::RGBA8888, static_cast<const uint8_t*>(pixels), info.stride, info.width, info.height);
+            break;
+        case ANDROID_BITMAP_FORMAT_RGB_565:
+            fn(PixelFormat::RGB565, static_cast<const uint8_t*>(pixels), info.stride, info.width, info.height);
+            break;
+        case ANDROID_BITMAP_FORMAT_RGBA_F16:
+            fn(linear ? PixelFormat::RGBA_F16_LINEAR : PixelFormat::RGBA_F16,
+               static_cast<const uint8_t*>(pixels), info.stride, info.width, info.height);
+            break;
+        default:
+            LOGi("Bitmap format %d not converted natively", info.format);
+            ok = false;
+    }
+    AndroidBitmap_unlockPixels(env, bitmap);
+    return ok;
+}
+
+static void target_size(ingest_scale_fn scale_for, int sw, int sh, int& dw, int& dh) {
+    const float scale = scale_for ? std::min(1.0f, scale_for(sw, sh)) : 1.0f;
+    dw = std::max(1, (int) (sw * scale));
+    dh = std::max(1, (int) (sh * scale));
+}
+
+bool ingest_android_bitmap(JNIEnv* env, jobject bitmap, ingest_scale_fn scale_for,
+                           std::vector<uint8_t>& rgb, int& width, int& height) {
+    return with_bitmap_pixels(env, bitmap, [&](PixelFormat format, const uint8_t* src, size_t stride, int sw, int sh) {
+        const int64_t t_start_us = ggml_time_us();
+        target_size(scale_for, sw, sh, width, height);
+        rgb.resize((size_t) width * height * 3);
+        ingest_pixels(format, src, stride, sw, sh, rgb.data(), width, height);
+        LOGi("ingest: %dx%d %s -> %dx%d RGB in %.1f ms on %d threads, %.1f MB buffer",
+             sw, sh, format_name(format), width, height, (ggml_time_us() - t_start_us) / 1e3,
+             ingest_threads((int64_t) sw * sh), rgb.size() / 1e6);
+    });
+}
+
+// Starts a peak RSS measurement by setting VmHWM back to VmRSS, returns
+// that RSS, or -1 if the kernel won't reset it
+static int64_t begin_peak_rss() {
+    FILE* f = fopen("/proc/self/clear_refs", "w");
+    if (!f) {
+        return -1;
+    }
+    const bool written = fputs("5", f) >= 0;
+    if (fclose(f) != 0 || !written) {
+        return -1;
+    }
+    return proc_status_bytes("VmRSS");
+}
+
+// How far VmHWM rose above the RSS begin_peak_rss returned
+static int64_t peak_rss_growth(int64_t base) {
+    const int64_t peak = base < 0 ? -1 : proc_status_bytes("VmHWM");
+    return peak < 0 ? -1 : std::max<int64_t>(0, peak - base);
+}
+
+bool benchmark_ingest(JNIEnv* env, jobject bitmap, ingest_scale_fn scale_for) {
+    return with_bitmap_pixels(env, bitmap, [&](PixelFormat format, const uint8_t* src, size_t stride, int sw, int sh) {
+        int dw, dh;
+        target_size(scale_for, sw, sh, dw, dh);
+
+        // What we did before: convert everything, then resize the copy. Each
+        // path's buffers are freed before the next one is measured.
+        int64_t two_pass_us, two_pass_peak;
+        {
+            const int64_t base = begin_peak_rss();
+            const int64_t t0 = ggml_time_us();
+            std::vector<uint8_t> full((size_t) sw * sh * 3);
+            ingest_rows(format, src, stride, sw, sh, full.data(), sw, sh, 0, sh);
+            std::vector<uint8_t> two_pass = (dw == sw && dh == sh) ? full : resize_rgb(full.data(), sw, sh, dw, dh);
+            two_pass_us = ggml_time_us() - t0;
+            two_pass_peak = peak_rss_growth(base);
+        }
+
+        int64_t fused_us, fused_peak;
+        {
+            const int64_t base = begin_peak_rss();
+            const int64_t t0 = ggml_time_us();
+            std::vector<uint8_t> fused((size_t) dw * dh * 3);
+            ingest_pixels(format, src, stride, sw, sh, fused.data(), dw, dh);
+            fused_us = ggml_time_us() - t0;
+            fused_peak = peak_rss_growth(base);
+        }
+
+        if (two_pass_peak < 0 || fused_peak < 0) {
+            LOGi("ingest benchmark %dx%d %s -> %dx%d: two-pass %.1f ms | fused %.1f ms on %d threads (peak RSS can't be reset here)",
+                 sw, sh, format_name(format), dw, dh, two_pass_us / 1e3,
+                 fused_us / 1e3, ingest_threads((int64_t) sw * sh));
+            return;
+        }
+        LOGi("ingest benchmark %dx%d %s -> %dx%d: two-pass %.1f ms, peak RSS +%.1f MB | fused %.1f ms on %d threads, peak RSS +%.1f MB",
+             sw, sh, format_name(format), dw, dh,
+             two_pass_us / 1e3, two_pass_peak / 1e6,
+             fused_us / 1e3, ingest_threads((int64_t) sw * sh), fused_peak / 1e6);
+    });
+}
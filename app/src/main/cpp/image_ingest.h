@@ -0,0 +1,48 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <jni.h>
+
+/*
+ * Turns an android.graphics.Bitmap into the packed RGB buffer we hand to
+ * mtmd, in one pass and without a Java-side copy(ARGB_8888) first.
+ *
+ * Handles ARGB_8888, RGB_565 and RGBA_F16, plus HARDWARE bitmaps of those
+ * formats through their AHardwareBuffer. F16 (HDR) values go through a soft
+ * highlight roll-off and, when the bitmap is linear, the sRGB curve, since the
+ * vision encoders were all trained on 8-bit sRGB.
+ *
+ * When the image has to shrink (the thermal tile cap, or an opt-in maximum
+ * edge), the conversion and the downscale happen in the same pass (area average straight
+ * from the source pixels), split across threads by output rows. The full
+ * resolution RGB copy is never made.
+ */
+
+enum class PixelFormat { RGBA8888, RGB565, RGBA_F16, RGBA_F16_LINEAR };
+
+// Picks the scale (<= 1) to ingest a width x height image at
+typedef float (*ingest_scale_fn)(int width, int height);
+
+// Returns false for formats we don't convert (ALPHA_8, RGBA_1010102, ...)
+// and for HARDWARE bitmaps the CPU can't read, the caller falls back to
+// copying the bitmap to ARGB_8888
+bool ingest_android_bitmap(JNIEnv* env, jobject bitmap, ingest_scale_fn scale_for,
+                           std::vector<uint8_t>& rgb, int& width, int& height);
+
+// Converts src (sw x sh) into packed RGB dst (dw x dh), multithreaded
+void ingest_pixels(PixelFormat format, const uint8_t* src, size_t stride, int sw, int sh,
+                   uint8_t* dst, int dw, int dh);
+
+// Times the fused pass against converting at full size and resizing after,
+// and logs both with how far each raised the process's peak RSS
+bool benchmark_ingest(JNIEnv* env, jobject bitmap, ingest_scale_fn scale_for);
+
+// Bilinear resize of packed RGB, the second pass of the unfused path
+std::vector<uint8_t> resize_rgb(const uint8_t* src, int sw, int sh, int dw, int dh);
+
+// The per-format kernels, strides in bytes, dst is width * height * 3
+void convert_rgba8888(const uint8_t* src, size_t stride, int width, int height, uint8_t* dst);
+void convert_rgb565(const uint8_t* src, size_t stride, int width, int height, uint8_t* dst);
+void convert_rgba_f16(const uint8_t* src, size_t stride, int width, int height, bool linear, uint8_t* dst);
@@ -0,0 +1,337 @@
+#include "knob_tuner.h"
+#include "metrics.h"
+#include "async_log.h"
+#include <sys/stat.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#undef TAG
+#define TAG "knob_tuner.cpp"
+#define LOGi(...) BW_LOG(BW_LOG_LEVEL_INFO, TAG, __VA_ARGS__)
+#define LOGe(...) BW_LOG(BW_LOG_LEVEL_ERROR, TAG, __VA_ARGS__)
+
+static const char* STATE_HEADER = "knob-tuner 1";
+
+// Chance of trying something on a request, starts at the max and decays
+// towards the min, which keeps following slow drift once converged
+static const float MAX_EXPLORE = 0.25f;
+static const float MIN_EXPLORE = 0.05f;
+
+// A value takes over as best after this many rewards, when it's this much better
+static const int MIN_SAMPLES = 2;
+static const float BEST_MARGIN = 0.03f;
+static const float REWARD_EMA_ALPHA = 0.3f;
+
+// Requests this short say more about overhead than the knobs
+static const int32_t MIN_DECODE_TOKENS = 16;
+static const int32_t MIN_PREFILL_TOKENS = 64;
+
+// Slower than this fraction of the best arm and we go back to it, and
+// don't try that value again for a while
+static const float SAFETY_RATIO = 0.75f;
+static const int COOLDOWN_REQUESTS = 50;
+
+static const int SMALLEST_CHUNK = 128;
+static const int FLUSH_MS_ARMS[] = {0, 16, 32, 64};
+
+bool KnobTuner::affects(int a, int b) {
+    const bool prefill_a = a == BATCH_THREADS || a == PREFILL_CHUNK;
+    const bool prefill_b = b == BATCH_THREADS || b == PREFILL_CHUNK;
+    // The loop rate the flush interval is judged by includes decode
+    return a == b || (prefill_a && prefill_b) || (a == DECODE_THREADS && b == FLUSH_MS);
+}
+
+void KnobTuner::begin(const std::string& model_path, int max_threads_, int max_chunk_) {
+    started = false;
+    if (!enabled() || model_path.empty()) {
+        return;
+    }
+    max_threads = std::max(1, max_threads_);
+    max_chunk = std::max(1, max_chunk_);
+
+    // Fewer threads than half the cores never wins on the phones we've
+    // measured, and each arm is a request or two of learning
+    knob[DECODE_THREADS] = {"decode_threads", {}, 0};
+    knob[BATCH_THREADS] = {"batch_threads", {}, 0};
+    for (int n = std::max(1, max_threads / 2); n <= max_threads; n++) {
+        knob[DECODE_THREADS].arms.push_back({n});
+        knob[BATCH_THREADS].arms.push_back({n});
+    }
+    knob[PREFILL_CHUNK] = {"prefill_chunk", {}, 0};
+    for (int c = SMALLEST_CHUNK; c < max_chunk; c *= 2) {
+        knob[PREFILL_CHUNK].arms.push_back({c});
+    }
+    knob[PREFILL_CHUNK].arms.push_back({max_chunk});
+    knob[FLUSH_MS] = {"flush_ms", {}, 0};
+    for (int ms : FLUSH_MS_ARMS) {
+        knob[FLUSH_MS].arms.push_back({ms});
+    }
+    // What we ran with before there was a tuner
+    knob[DECODE_THREADS].best = (int) knob[DECODE_THREADS].arms.size() - 1;
+    knob[BATCH_THREADS].best = (int) knob[BATCH_THREADS].arms.size() - 1;
+    knob[PREFILL_CHUNK].best = (int) knob[PREFILL_CHUNK].arms.size() - 1;
+    knob[FLUSH_MS].best = 0;
+
+    const char* slash = strrchr(model_path.c_str(), '/');
+    mkdir(state_dir.c_str(), 0755);
+    state_path = state_dir + "/" + (slash ? slash + 1 : model_path.c_str()) + ".tuner";
+    requests = 0;
+    const bool loaded = load();
+    since_load = 0;
+    exploring = -1;
+    reverted = false;
+    started = true;
+    for (int k = 0; k < N_KNOBS; k++) {
+        apply(k, knob[k].best);
+    }
+    publish();
+    LOGi("Tuner %s: %d threads decode, %d prefill, chunks of %d, text flushed every %d ms",
+         loaded ? "resumed" : "starting", knobs.decode_threads, knobs.batch_threads, knobs.prefill_chunk, knobs.flush_ms);
+}
+
+void KnobTuner::apply(int k, int arm) {
+    const int value = knob[k].arms[arm].value;
+    switch (k) {
+        case DECODE_THREADS: knobs.decode_threads = value; break;
+        case BATCH_THREADS:  knobs.batch_threads = value; break;
+        case PREFILL_CHUNK:  knobs.prefill_chunk = value; break;
+        case FLUSH_MS:       knobs.flush_ms = value; break;
+    }
+}
+
+int KnobTuner::pickNeighbour(int k, int ceiling) {
+    const Knob& kn = knob[k];
+    const bool threads = k == DECODE_THREADS || k == BATCH_THREADS;
+    int pick = -1;
+    for (int arm : {kn.best - 1, kn.best + 1}) {
+        if (arm < 0 || arm >= (int) kn.arms.size() || kn.arms[arm].cooldown_until > requests) {
+            continue;
+        }
+        if (threads && ceiling > 0 && kn.arms[arm].value > ceiling) {
+            continue;
+        }
+        // The one we know least about, a coin decides between equals
+        if (pick < 0 || kn.arms[arm].n < kn.arms[pick].n ||
+            (kn.arms[arm].n == kn.arms[pick].n && (rng() & 1))) {
+            pick = arm;
+        }
+    }
+    return pick;
+}
+
+KnobTuner::Knobs KnobTuner::choose(int ceiling, bool probe) {
+    if (!started) {
+        return knobs;
+    }
+    requests++;
+    since_load++;
+    exploring = -1;
+    reverted = false;
+    for (int k = 0; k < N_KNOBS; k++) {
+        apply(k, knob[k].best);
+    }
+
+    // The governor is shedding heat and its thread count caps ours: it
+    // stands, and says nothing about how the device does when it's cool.
+    // A ceiling that only rules out counts above our best holds nothing
+    // back. The governor compares each count against its own past rate, so
+    // our trials of fewer threads don't read as throttling there.
+    throttled = probe || (ceiling > 0 && (ceiling < knob[DECODE_THREADS].arms[knob[DECODE_THREADS].best].value ||
+                                          ceiling < knob[BATCH_THREADS].arms[knob[BATCH_THREADS].best].value));
+    if (throttled) {
+        knobs.decode_threads = std::min(knobs.decode_threads, ceiling);
+        knobs.batch_threads = std::min(knobs.batch_threads, ceiling);
+        return knobs;
+    }
+
+    // The first request after a load runs on cold caches
+    const float rate = std::max(MIN_EXPLORE, MAX_EXPLORE / std::sqrt(1.0f + requests / 20.0f));
+    if (since_load > 1 && std::uniform_real_distribution<float>(0.0f, 1.0f)(rng) < rate) {
+        for (int i = 0; i < N_KNOBS && exploring < 0; i++) {
+            const int k = next_knob;
+            next_knob = (next_knob + 1) % N_KNOBS;
+            const int arm = pickNeighbour(k, ceiling);
+            if (arm >= 0) {
+                exploring = k;
+                explored_arm = arm;
+                apply(k, arm);
+                Metrics::getInstance().tuner_explorations.inc();
+                LOGi("Tuner trying %s %d (best %d)", knob[k].name, knob[k].arms[arm].value,
+                     knob[k].arms[knob[k].best].value);
+            }
+        }
+    }
+    return knobs;
+}
+
+float KnobTuner::reward(int k, int32_t n_prefill, int64_t prefill_us, int32_t n_decode, int64_t decode_us,
+                        int64_t loop_us) const {
+    switch (k) {
+        case DECODE_THREADS:
+            return n_decode >= MIN_DECODE_TOKENS && decode_us > 0 ? 1e6f * n_decode / decode_us : 0.0f;
+        case FLUSH_MS:
+            return n_decode >= MIN_DECODE_TOKENS && loop_us > 0 ? 1e6f * n_decode / loop_us : 0.0f;
+        default:
+            return n_prefill >= MIN_PREFILL_TOKENS && prefill_us > 0 ? 1e6f * n_prefill / prefill_us : 0.0f;
+    }
+}
+
+void KnobTuner::learn(int k, int arm, float r) {
+    Knob& kn = knob[k];
+    Arm& a = kn.arms[arm];
+    a.n++;
+    // A plain average for the first few, so one odd request doesn't decide
+    a.mean = a.n <= 3 ? a.mean + (r - a.mean) / a.n : a.mean + REWARD_EMA_ALPHA * (r - a.mean);
+
+    int best = kn.best;
+    for (int i = 0; i < (int) kn.arms.size(); i++) {
+        const Arm& c = kn.arms[i];
+        const Arm& b = kn.arms[best];
+        if (i != best && c.n >= MIN_SAMPLES && (b.n == 0 || c.mean > b.mean * (1.0f + BEST_MARGIN))) {
+            best = i;
+        }
+    }
+    if (best != kn.best) {
+        LOGi("Tuner: %s %d is now best, %.1f tok/s against %.1f for %d", kn.name, kn.arms[best].value,
+             kn.arms[best].mean, kn.arms[kn.best].mean, kn.arms[kn.best].value);
+        kn.best = best;
+    }
+}
+
+bool KnobTuner::checkDecode(int32_t n_decode, int64_t decode_us, int64_t loop_us) {
+    if ((exploring != DECODE_THREADS && exploring != FLUSH_MS) || n_decode < MIN_DECODE_TOKENS) {
+        return false;
+    }
+    Knob& kn = knob[exploring];
+    const Arm& best = kn.arms[kn.best];
+    const float r = reward(exploring, 0, 0, n_decode, decode_us, loop_us);
+    if (best.n == 0 || r >= SAFETY_RATIO * best.mean) {
+        return false;
+    }
+    LOGi("Tuner: %s %d runs at %.1f tok/s against %.1f, back to %d", kn.name, kn.arms[explored_arm].value, r,
+         best.mean, best.value);
+    learn(exploring, explored_arm, r);
+    kn.arms[explored_arm].cooldown_until = requests + COOLDOWN_REQUESTS;
+    apply(exploring, kn.best);
+    Metrics::getInstance().tuner_reverts.inc();
+    exploring = -1;
+    reverted = true;
+    return true;
+}
+
+void KnobTuner::report(int32_t n_prefill, int64_t prefill_us, int32_t n_decode, int64_t decode_us, int64_t loop_us) {
+    if (!started) {
+        return;
+    }
+    // A hot device's rates would land on the best arms only, and make the
+    // neighbours, learned cool, look better than they are
+    for (int k = 0; k < N_KNOBS && !throttled; k++) {
+        // The rate after going back is part bad arm, part best
+        if (reverted && (k == DECODE_THREADS || k == FLUSH_MS)) {
+            continue;
+        }
+        if (exploring >= 0 && k != exploring && affects(exploring, k)) {
+            continue;
+        }
+        const float r = reward(k, n_prefill, prefill_us, n_decode, decode_us, loop_us);
+        if (r <= 0.0f) {
+            continue;
+        }
+        const int arm = k == exploring ? explored_arm : knob[k].best;
+        const Arm& best = knob[k].arms[knob[k].best];
+        if (k == exploring && best.n > 0 && r < SAFETY_RATIO * best.mean) {
+            knob[k].arms[arm].cooldown_until = requests + COOLDOWN_REQUESTS;
+        }
+        learn(k, arm, r);
+    }
+    exploring = -1;
+    reverted = false;
+    save();
+    publish();
+}
+
+bool KnobTuner::load() {
+    FILE* f = fopen(state_path.c_str(), "r");
+    if (!f) {
+        return false;
+    }
+    char line[128];
+    int version = 0;
+    int threads = 0;
+    int chunk = 0;
+    int saved_requests = 0;
+    // Learned for another core count or context, start over
+    if (!fgets(line, sizeof(line), f) || strncmp(line, STATE_HEADER, strlen(STATE_HEADER)) != 0 ||
+        sscanf(line, "knob-tuner %d %d %d %d", &version, &threads, &chunk, &saved_requests) != 4 ||
+        threads != max_threads || chunk != max_chunk) {
+        fclose(f);
+        LOGi("Tuner state in %s is for another setup, starting over", state_path.c_str());
+        return false;
+    }
+    requests = saved_requests;
+    char name[32];
+    int value;
+    int n;
+    float mean;
+    int cooldown_until;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%31s %d %d %f %d", name, &value, &n, &mean, &cooldown_until) != 5 || n < 0 || mean < 0.0f) {
+            continue;
+        }
+        for (Knob& kn : knob) {
+            if (strcmp(kn.name, name) != 0) {
+                continue;
+            }
+            for (Arm& a : kn.arms) {
+                if (a.value == value) {
+                    a.n = n;
+                    a.mean = mean;
+                    a.cooldown_until = cooldown_until;
+                }
+            }
+        }
+    }
+    fclose(f);
+
+    for (Knob& kn : knob) {
+        for (int i = 0; i < (int) kn.arms.size(); i++) {
+            const Arm& b = kn.arms[kn.best];
+            if (kn.arms[i].n >= MIN_SAMPLES && (b.n < MIN_SAMPLES || kn.arms[i].mean > b.mean)) {
+                kn.best = i;
+            }
+        }
+    }
+    return true;
+}
+
+void KnobTuner::save() const {
+    const std::string tmp = state_path + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "w");
+    if (!f) {
+        LOGe("Failed to save tuner state to %s", state_path.c_str());
+        return;
+    }
+    fprintf(f, "%s %d %d %d\n", STATE_HEADER, max_threads, max_chunk, requests);
+    for (const Knob& kn : knob) {
+        for (const Arm& a : kn.arms) {
+            if (a.n > 0) {
+                fprintf(f, "%s %d %d %.3f %d\n", kn.name, a.value, a.n, a.mean, a.cooldown_until);
+            }
+        }
+    }
+    const bool ok = fclose(f) == 0;
+    if (!ok || rename(tmp.c_str(), state_path.c_str()) != 0) {
+        remove(tmp.c_str());
+        LOGe("Failed to save tuner state to %s", state_path.c_str());
+    }
+}
+
+void KnobTuner::publish() const {
+    Metrics& metrics = Metrics::getInstance();
+    metrics.tuner_decode_threads.set(knob[DECODE_THREADS].arms[knob[DECODE_THREADS].best].value);
+    metrics.tuner_batch_threads.set(knob[BATCH_THREADS].arms[knob[BATCH_THREADS].best].value);
+    metrics.tuner_prefill_chunk.set(knob[PREFILL_CHUNK].arms[knob[PREFILL_CHUNK].best].value);
+    metrics.tuner_flush_ms.set(knob[FLUSH_MS].arms[knob[FLUSH_MS].best].value);
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+/*
+ * Tunes the runtime knobs on the requests the user actually makes, so the
+ * settings follow the device as it ages, gets OS updates or runs warm.
+ *
+ * Each knob is a small bandit of its own, its arms the values it may take:
+ *   - decode threads, rewarded with decode tok/s
+ *   - prefill (batch) threads and the prefill chunk size, with prefill tok/s
+ *   - how long generated text is collected before the Java callback runs,
+ *     with tok/s of the whole decode loop, callbacks included
+ * Most requests run every knob at its best arm. Now and then one knob tries
+ * a value next to its best one, less often the more requests we've seen.
+ *
+ * Exploring never strays far: only neighbouring values, never while the
+ * thermal governor holds threads below the best ones, never on the first
+ * request after a load. A decode that runs well below the best arm's rate
+ * goes back to the best arm mid-request, and a value that did that is left
+ * alone for a while.
+ *
+ * State is kept per model in a small text file, and thrown away when the
+ * thread ceiling or batch size it was learned for changes.
+ */
+class KnobTuner {
+public:
+    struct Knobs {
+        int decode_threads = 0;
+        int batch_threads = 0;
+        int prefill_chunk = 0;
+        int flush_ms = 0;
+    };
+
+    // Directory for the state files, empty turns tuning off.
+    // Read when the context is created.
+    void setStateDir(const std::string& dir) { state_dir = dir; }
+    bool enabled() const { return !state_dir.empty(); }
+
+    // Loads what was learned for this model, or starts from max_threads
+    // threads, chunks of max_chunk and no text buffering
+    void begin(const std::string& model_path, int max_threads, int max_chunk);
+
+    // Knobs for the next request. ceiling is the governor's thread count,
+    // while it's below the best thread counts nothing is explored or learned.
+    // Neither is anything on a request where the governor probes whether
+    // the device has recovered.
+    Knobs choose(int ceiling, bool probe = false);
+
+    // Called after each decode step. True when the value being tried was
+    // abandoned for the best one, current() then has the knobs to go on with.
+    bool checkDecode(int32_t n_decode, int64_t decode_us, int64_t loop_us);
+    const Knobs& current() const { return knobs; }
+
+    // Called when the request is done, learns from it and saves the state
+    void report(int32_t n_prefill, int64_t prefill_us, int32_t n_decode, int64_t decode_us, int64_t loop_us);
+
+private:
+    enum { DECODE_THREADS, BATCH_THREADS, PREFILL_CHUNK, FLUSH_MS, N_KNOBS };
+
+    struct Arm {
+        int value = 0;
+        int n = 0;             // rewards seen
+        float mean = 0.0f;     // tok/s, an EMA once there are a few
+        int cooldown_until = 0;  // not tried again before this many requests
+    };
+    struct Knob {
+        const char* name;
+        std::vector<Arm> arms;
+        int best = 0;
+    };
+
+    // Whether trying a value for knob a changes the reward of knob b
+    static bool affects(int a, int b);
+    void learn(int k, int arm, float reward);
+    int pickNeighbour(int k, int ceiling);
+    void apply(int k, int arm);
+    float reward(int k, int32_t n_prefill, int64_t prefill_us, int32_t n_decode, int64_t decode_us, int64_t loop_us) const;
+    bool load();
+    void save() const;
+    void publish() const;
+
+    std::string state_dir;
+    std::string state_path;
+    Knob knob[N_KNOBS];
+    bool started = false;
+    int max_threads = 0;
+    int max_chunk = 0;
+
+    int requests = 0;          // all time, for the exploration rate
+    int since_load = 0;
+    int next_knob = 0;
+    int exploring = -1;        // knob trying another value this request
+    int explored_arm = -1;
+    bool reverted = false;     // a decode knob went back to its best mid-request
+    bool throttled = false;
+    Knobs knobs;
+    std::minstd_rand rng{std::random_device{}()};
+};
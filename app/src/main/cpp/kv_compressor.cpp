@@ -0,0 +1,191 @@
+#include "kv_compressor.h"
+#include "ggml-backend.h"
+#include "async_log.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#undef TAG
+#define TAG "kv_compressor.cpp"
+#define LOGi(...) BW_LOG(BW_LOG_LEVEL_INFO, TAG, __VA_ARGS__)
+#define LOGe(...) BW_LOG(BW_LOG_LEVEL_ERROR, TAG, __VA_ARGS__)
+
+// llama.cpp names the roped queries and keys "Qcur-<layer>" and "Kcur-<layer>"
+static const char* Q_CUR = "Qcur-";
+static const char* K_CUR = "Kcur-";
+
+// Layers the scores come from, spread over the depth. More would copy more
+// keys out for little change in which tokens score lowest.
+static const int OBSERVED_LAYERS = 4;
+
+// SnapKV pools the scores so neighbouring tokens of an important region
+// survive together instead of leaving a checkerboard
+static const int POOL_RADIUS = 2;
+
+void KvCompressor::attach(const llama_model* model) {
+    layer_stride = std::max(1, llama_model_n_layer(model) / OBSERVED_LAYERS);
+    supported = !llama_model_is_recurrent(model) && !llama_model_is_hybrid(model);
+    if (!supported && keep_ratio > 0.0f && keep_ratio < 1.0f) {
+        LOGi("KV compression off, the model's cache can't drop tokens from the middle");
+    }
+}
+
+void KvCompressor::reset() {
+    mode = Mode::NONE;
+    layers.assign(OBSERVED_LAYERS, Layer());
+    positions.clear();
+}
+
+void KvCompressor::addImageSpan(llama_pos p0, llama_pos p1) {
+    for (llama_pos p = p0; p < p1; p++) {
+        positions.push_back(p);
+    }
+}
+
+int KvCompressor::observedSlot(const char* name, const char* prefix) const {
+    const size_t len = strlen(prefix);
+    if (strncmp(name, prefix, len) != 0) {
+        return -1;
+    }
+    const int il = atoi(name + len);
+    const int slot = il / layer_stride;
+    return il % layer_stride == layer_stride - 1 && slot < (int) layers.size() ? slot : -1;
+}
+
+bool KvCompressor::observe(struct ggml_tensor* t, bool ask) {
+    const char* prefix = mode == Mode::KEYS ? K_CUR : mode == Mode::QUERIES ? Q_CUR : nullptr;
+    // Models name the pre-rope projections the same, the rope output is the one
+    const int slot = prefix && t->op == GGML_OP_ROPE && t->type == GGML_TYPE_F32 && ggml_is_contiguous(t)
+                     ? observedSlot(t->name, prefix) : -1;
+    if (ask) {
+        return slot >= 0;
+    }
+    if (slot < 0) {
+        return true;
+    }
+
+    // [head_dim, n_head, n_tokens]
+    Layer& layer = layers[slot];
+    layer.head_dim = t->ne[0];
+    scratch.resize(ggml_nelements(t));
+    ggml_backend_tensor_get(t, scratch.data(), 0, scratch.size() * sizeof(float));
+    std::vector<ggml_fp16_t>& out = mode == Mode::KEYS ? layer.keys : layer.queries;
+    if (mode == Mode::KEYS) {
+        layer.n_head_kv = t->ne[1];
+    } else {
+        layer.n_head = t->ne[1];
+    }
+    const size_t n = out.size();
+    out.resize(n + scratch.size());
+    ggml_fp32_to_fp16_row(scratch.data(), out.data() + n, (int64_t) scratch.size());
+    return true;
+}
+
+// Adds each image token's attention from every query head of the trailing
+// text. The softmax is over the image tokens only, the text keys aren't kept.
+bool KvCompressor::score(const Layer& layer, std::vector<float>& scores) const {
+    const int64_t hd = layer.head_dim;
+    const int64_t n_img = (int64_t) positions.size();
+    if (hd == 0 || layer.n_head == 0 || layer.n_head_kv == 0 || layer.n_head % layer.n_head_kv != 0 ||
+        (int64_t) layer.keys.size() != n_img * layer.n_head_kv * hd) {
+        return false;
+    }
+    std::vector<float> keys(layer.keys.size());
+    ggml_fp16_to_fp32_row(layer.keys.data(), keys.data(), (int64_t) keys.size());
+    std::vector<float> q(hd);
+    std::vector<float> logits(n_img);
+    const int64_t n_query = (int64_t) layer.queries.size() / (layer.n_head * hd);
+    const int64_t group = layer.n_head / layer.n_head_kv;
+    const float scale = 1.0f / std::sqrt((float) hd);
+
+    for (int64_t i = 0; i < n_query * layer.n_head; i++) {
+        ggml_fp16_to_fp32_row(layer.queries.data() + i * hd, q.data(), hd);
+        const int64_t kh = (i % layer.n_head) / group;
+        float max_logit = -INFINITY;
+        for (int64_t k = 0; k < n_img; k++) {
+            const float* key = keys.data() + (k * layer.n_head_kv + kh) * hd;
+            float dot = 0.0f;
+            for (int64_t d = 0; d < hd; d++) {
+                dot += q[d] * key[d];
+            }
+            logits[k] = dot * scale;
+            max_logit = std::max(max_logit, logits[k]);
+        }
+        float sum = 0.0f;
+        for (int64_t k = 0; k < n_img; k++) {
+            logits[k] = std::exp(logits[k] - max_logit);
+            sum += logits[k];
+        }
+        for (int64_t k = 0; k < n_img; k++) {
+            scores[k] += logits[k] / sum;
+        }
+    }
+    return n_query > 0;
+}
+
+int KvCompressor::compress(llama_context* lctx, llama_seq_id seq_id) {
+    if (!enabled() || positions.empty()) {
+        return 0;
+    }
+    const int64_t t_start_us = ggml_time_us();
+
+    std::vector<float> scores(positions.size(), 0.0f);
+    int n_scored = 0;
+    for (const Layer& layer : layers) {
+        n_scored += score(layer, scores) ? 1 : 0;
+    }
+    if (n_scored == 0) {
+        LOGi("kv compression: no image keys and text queries seen, nothing evicted");
+        reset();
+        return 0;
+    }
+
+    // Neighbours in decode order, which is the image's patch order
+    std::vector<float> pooled(scores.size());
+    for (size_t i = 0; i < scores.size(); i++) {
+        size_t lo = i >= POOL_RADIUS ? i - POOL_RADIUS : 0;
+        size_t hi = std::min(scores.size() - 1, i + POOL_RADIUS);
+        pooled[i] = *std::max_element(scores.begin() + lo, scores.begin() + hi + 1);
+    }
+
+    std::vector<std::pair<float, llama_pos>> candidates;
+    for (size_t i = 0; i < positions.size(); i++) {
+        candidates.push_back({pooled[i], positions[i]});
+    }
+
+    const size_t n_image = candidates.size();
+    const size_t n_keep = std::max<size_t>(1, (size_t) std::ceil(keep_ratio * n_image));
+    const size_t n_evict = n_image - n_keep;
+    std::partial_sort(candidates.begin(), candidates.begin() + n_evict, candidates.end());
+
+    std::vector<llama_pos> evict;
+    for (size_t i = 0; i < n_evict; i++) {
+        evict.push_back(candidates[i].second);
+    }
+    std::sort(evict.begin(), evict.end());
+
+    // Remove runs of consecutive positions in one call each
+    llama_memory_t mem = llama_get_memory(lctx);
+    int n_evicted = 0;
+    for (size_t i = 0; i < evict.size();) {
+        size_t j = i + 1;
+        while (j < evict.size() && evict[j] == evict[j - 1] + 1) {
+            j++;
+        }
+        if (!llama_memory_seq_rm(mem, seq_id, evict[i], evict[j - 1] + 1)) {
+            LOGe("KV cache refused to remove positions %d-%d, stopping", evict[i], evict[j - 1]);
+            break;
+        }
+        n_evicted += (int) (j - i);
+        i = j;
+    }
+
+    LOGi("kv compression: scored on %d layers, kept %zu of %zu image tokens "
+         "(evicted %d, keep ratio %.2f) in %.1f ms",
+         n_scored, n_image - n_evicted, n_image, n_evicted, keep_ratio,
+         (ggml_time_us() - t_start_us) / 1e3);
+
+    reset();
+    return n_evicted;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include "ggml.h"
+#include "llama.h"
+
+/*
+ * SnapKV-style eviction of image tokens from the KV cache after prefill.
+ *
+ * While the image chunks are decoded we copy their keys out of a few layers
+ * (the roped "Kcur" nodes, through the eval callback), and while the text
+ * after the image is prefilled we copy its queries. compress() works out how
+ * much attention each image token gets from that text, and the image tokens
+ * with the lowest scores are dropped with llama_memory_seq_rm, so every
+ * decode step attends to fewer cells.
+ *
+ * Scores are kept by position, in the order the image tokens were decoded,
+ * so they don't depend on which KV cells the tokens landed in. Flash
+ * attention can stay on, nothing reads the attention probabilities.
+ *
+ * The eval callback is installed when the context is created, so the keep
+ * ratio has to be set before the models are loaded.
+ */
+class KvCompressor {
+public:
+    // Fraction of image tokens to keep, anything outside (0, 1) disables it
+    void setKeepRatio(float ratio) { keep_ratio = ratio; }
+    float keepRatio() const { return keep_ratio; }
+    bool enabled() const { return supported && keep_ratio > 0.0f && keep_ratio < 1.0f; }
+
+    // Called when a context is created, turns compression off for models
+    // whose cache can't drop tokens from the middle
+    void attach(const llama_model* model);
+
+    // Called once per request, before the prompt is evaluated
+    void reset();
+
+    // Keys are collected between these, around the decode of an image chunk
+    void beginImage() { mode = Mode::KEYS; }
+    void endImage() { mode = Mode::NONE; }
+
+    // KV positions [p0, p1) hold the image embeddings just decoded
+    void addImageSpan(llama_pos p0, llama_pos p1);
+    bool hasImageSpans() const { return !positions.empty(); }
+
+    // Queries are collected between these, around the trailing text
+    void beginObservation() { mode = Mode::QUERIES; }
+    void endObservation() { mode = Mode::NONE; }
+
+    // ggml_backend_sched_eval_callback, routed here by ModelManager
+    bool observe(struct ggml_tensor* t, bool ask);
+
+    // Drops the lowest scoring image tokens, returns how many were evicted
+    int compress(llama_context* lctx, llama_seq_id seq_id);
+
+private:
+    enum class Mode { NONE, KEYS, QUERIES };
+
+    // One observed layer's roped keys (image tokens) and queries (trailing
+    // text), token major, kept as f16 to bound memory
+    struct Layer {
+        int64_t head_dim = 0;
+        int64_t n_head = 0;
+        int64_t n_head_kv = 0;
+        std::vector<ggml_fp16_t> keys;
+        std::vector<ggml_fp16_t> queries;
+    };
+
+    int observedSlot(const char* name, const char* prefix) const;
+    bool score(const Layer& layer, std::vector<float>& scores) const;
+
+    float keep_ratio = 0.0f;
+    bool supported = true;
+    int layer_stride = 1;
+    Mode mode = Mode::NONE;
+    std::vector<Layer> layers;
+    std::vector<llama_pos> positions;  // of the image tokens, in decode order
+    std::vector<float> scratch;
+};
@@ -0,0 +1,249 @@
+#include "layer_stream.h"
+#include "async_log.h"
+#include "ggml.h"
+#include "ggml-backend.h"
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+
+#undef TAG
+#define TAG "layer_stream.cpp"
+#define LOGi(...) BW_LOG(BW_LOG_LEVEL_INFO, TAG, __VA_ARGS__)
+#define LOGe(...) BW_LOG(BW_LOG_LEVEL_ERROR, TAG, __VA_ARGS__)
+
+#ifndef MADV_PAGEOUT
+#define MADV_PAGEOUT 21
+#endif
+
+// Don't page anything out if the blocks fit in this much of MemAvailable
+static const double RESIDENT_MEM_FRACTION = 0.5;
+
+static uint64_t mem_available_bytes() {
+    FILE* f = fopen("/proc/meminfo", "r");
+    if (!f) {
+        return 0;
+    }
+    char line[256];
+    unsigned long long kb = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return (uint64_t) kb * 1024;
+}
+
+// Block of a weight, -1 if it isn't an mmapped block weight
+static int weight_layer(const ggml_tensor* t) {
+    if (!t->buffer || ggml_backend_buffer_get_usage(t->buffer) != GGML_BACKEND_BUFFER_USAGE_WEIGHTS ||
+        !ggml_backend_buffer_is_host(t->buffer)) {
+        return -1;
+    }
+    int layer = -1;
+    return sscanf(t->name, "blk.%d.", &layer) == 1 ? layer : -1;
+}
+
+LayerStreamer::~LayerStreamer() {
+    stop();
+}
+
+void LayerStreamer::start(int n) {
+    stop();
+    n_layer = n;
+    layers.assign(n, {});
+    seen.clear();
+    current = -1;
+    pending_start = -1;
+    learning = true;
+    dropping = false;
+    prefetched_layer = -1;
+    stopping = false;
+    worker = std::thread(&LayerStreamer::run, this);
+}
+
+void LayerStreamer::ready() {
+    if (!worker.joinable()) {
+        return;
+    }
+    learning = false;
+    const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    uint64_t total = 0;
+    int n_found = 0;
+    for (auto& ranges : layers) {
+        // Weights of a block sit next to each other in the file, and so in
+        // the mapping. Merge them into page aligned spans.
+        std::sort(ranges.begin(), ranges.end(), [](const Range& a, const Range& b) { return a.begin < b.begin; });
+        std::vector<Range> merged;
+        for (const Range& r : ranges) {
+            const uintptr_t begin = r.begin & ~(page - 1);
+            const uintptr_t end = (r.begin + r.size + page - 1) & ~(page - 1);
+            if (!merged.empty() && begin <= merged.back().begin + merged.back().size) {
+                merged.back().size = std::max(merged.back().begin + merged.back().size, end) - merged.back().begin;
+            } else {
+                merged.push_back({begin, end - begin});
+            }
+        }
+        ranges = merged;
+        for (const Range& r : ranges) {
+            total += r.size;
+        }
+        n_found += ranges.empty() ? 0 : 1;
+    }
+    const uint64_t available = mem_available_bytes();
+    dropping = total > available * RESIDENT_MEM_FRACTION;
+    LOGi("Layer streaming: %d of %d blocks mapped, %.1f MB, %.1f MB available, %s", n_found, n_layer,
+         total / 1e6, available / 1e6, dropping ? "paging out used blocks" : "prefetch only");
+    report();
+}
+
+void LayerStreamer::stop() {
+    if (worker.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            jobs.clear();
+        }
+        cv.notify_one();
+        worker.join();
+    }
+    layers.clear();
+    seen.clear();
+}
+
+bool LayerStreamer::observe(struct ggml_tensor* t, bool ask) {
+    if (!worker.joinable()) {
+        return !ask;
+    }
+    if (learning) {
+        if (ask) {
+            learn(t);
+        }
+        return !ask;
+    }
+    if (!ask) {
+        if (pending_start < 0) {
+            return true;
+        }
+        // The first node of the block has been computed, the previous block is done
+        const int layer = pending_start;
+        pending_start = -1;
+        const int previous = current;
+        current = layer;
+        n_blocks++;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (prefetched_layer != layer && !layers[layer].empty()) {
+                n_late++;
+            }
+        }
+        enqueue(Op::Prefetch, (layer + 1) % n_layer);
+        if (dropping && previous >= 0 && previous != layer) {
+            enqueue(Op::Drop, previous);
+        }
+        return true;
+    }
+
+    // Ask for the node that enters a new block, computing stops right after it
+    const int layer = node_layer(t);
+    if (layer >= 0 && layer != current && layer != pending_start) {
+        pending_start = layer;
+        return true;
+    }
+    return false;
+}
+
+int LayerStreamer::node_layer(const ggml_tensor* t) const {
+    for (int i = 0; i < GGML_MAX_SRC && t->src[i]; i++) {
+        const ggml_tensor* src = t->src[i]->view_src ? t->src[i]->view_src : t->src[i];
+        const int l = weight_layer(src);
+        if (l >= 0 && l < n_layer) {
+            return l;
+        }
+    }
+    return -1;
+}
+
+void LayerStreamer::learn(const ggml_tensor* t) {
+    for (int i = 0; i < GGML_MAX_SRC && t->src[i]; i++) {
+        const ggml_tensor* src = t->src[i]->view_src ? t->src[i]->view_src : t->src[i];
+        const int l = weight_layer(src);
+        if (l >= 0 && l < n_layer && seen.insert(src->data).second) {
+            layers[l].push_back({(uintptr_t) src->data, ggml_nbytes(src)});
+        }
+    }
+}
+
+void LayerStreamer::enqueue(Op op, int layer) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back({op, layer});
+    }
+    cv.notify_one();
+}
+
+void LayerStreamer::run() {
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this] { return stopping || !jobs.empty(); });
+            if (stopping) {
+                return;
+            }
+            job = jobs.front();
+            jobs.pop_front();
+        }
+        if (job.op == Op::Prefetch) {
+            prefetch(job.layer);
+        } else {
+            drop(job.layer);
+        }
+    }
+}
+
+void LayerStreamer::prefetch(int layer) {
+    const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    uint64_t bytes = 0;
+    for (const Range& r : layers[layer]) {
+        // Start the reads for the whole block, then fault it into our page
+        // tables here so the compute threads don't have to
+        madvise((void*) r.begin, r.size, MADV_WILLNEED);
+    }
+    for (const Range& r : layers[layer]) {
+        for (uintptr_t p = r.begin; p < r.begin + r.size; p += page) {
+            (void) *(volatile const char*) p;
+        }
+        bytes += r.size;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    prefetched_layer = layer;
+    bytes_prefetched += bytes;
+}
+
+void LayerStreamer::drop(int layer) {
+    uint64_t bytes = 0;
+    for (const Range& r : layers[layer]) {
+        // Reclaim right away where the kernel can (5.4+), otherwise just
+        // unmap so the pages are first in line for reclaim
+        if (madvise((void*) r.begin, r.size, MADV_PAGEOUT) != 0) {
+            madvise((void*) r.begin, r.size, MADV_DONTNEED);
+        }
+        bytes += r.size;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    bytes_dropped += bytes;
+}
+
+void LayerStreamer::report() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (n_blocks > 0) {
+        LOGi("Layer streaming: %d blocks, %d reached before their prefetch finished, %.1f MB prefetched, %.1f MB paged out",
+             n_blocks, n_late, bytes_prefetched / 1e6, bytes_dropped / 1e6);
+    }
+    n_blocks = 0;
+    n_late = 0;
+    bytes_prefetched = 0;
+    bytes_dropped = 0;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+struct ggml_tensor;
+
+/*
+ * Runs a language model bigger than RAM from its mmap without thrashing.
+ *
+ * Left alone, the kernel's LRU evicts exactly the pages of the layer that's
+ * needed next, since it was used longest ago. The streamer takes over:
+ * when the graph reaches block N, a helper thread reads block N+1 in (and
+ * maps it, so compute doesn't fault) while N computes, and pages out block
+ * N-1 which this pass is done with. Everything outside the blocks
+ * (embeddings, output head) stays resident.
+ *
+ * The weight ranges of every block are learned from the graph through the
+ * eval callback during the warmup decode. The callback asks for the first
+ * node of each block, so the scheduler computes one block per call and
+ * tells us when the next begins.
+ *
+ * Needs the weights on the CPU backend and mmapped, ModelManager loads the
+ * model that way while streaming is on. If all the blocks fit in half of
+ * the available memory nothing is paged out, they're only prefetched.
+ */
+class LayerStreamer {
+public:
+    ~LayerStreamer();
+
+    // Read when the model is loaded
+    void setEnabled(bool on) { enabled_ = on; }
+    bool enabled() const { return enabled_; }
+
+    // Starts the helper thread, n_layer blocks
+    void start(int n_layer);
+    // After the warmup decode has shown us every block
+    void ready();
+    void stop();
+
+    // ggml_backend_sched_eval_callback, routed here by ModelManager
+    bool observe(struct ggml_tensor* t, bool ask);
+
+    // Logs and resets the counters of the request that just finished
+    void report();
+
+private:
+    struct Range {
+        uintptr_t begin;
+        size_t size;
+    };
+    enum class Op { Prefetch, Drop };
+    struct Job {
+        Op op;
+        int layer;
+    };
+
+    int node_layer(const ggml_tensor* t) const;
+    void learn(const ggml_tensor* t);
+    void run();
+    void enqueue(Op op, int layer);
+    void prefetch(int layer);
+    void drop(int layer);
+
+    bool enabled_ = false;
+    bool learning = false;     // until ready(), the worker gets no jobs meanwhile
+    bool dropping = false;
+    int n_layer = 0;
+    int current = -1;          // block the graph is in, -1 before the first
+    int pending_start = -1;    // block whose first node we asked for
+
+    // Page aligned weight ranges per block, learned from the graph
+    std::vector<std::vector<Range>> layers;
+    std::unordered_set<const void*> seen;
+
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<Job> jobs;
+    bool stopping = false;
+    int prefetched_layer = -1;   // last block the worker finished reading in
+
+    // Per request
+    uint64_t bytes_prefetched = 0;
+    uint64_t bytes_dropped = 0;
+    int n_blocks = 0;
+    int n_late = 0;              // blocks compute reached before their prefetch finished
+};
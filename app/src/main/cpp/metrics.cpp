@@ -0,0 +1,352 @@
+#include "metrics.h"
+#include "async_log.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+
+#undef TAG
+#define TAG "metrics.cpp"
+#define LOGi(...) BW_LOG(BW_LOG_LEVEL_INFO, TAG, __VA_ARGS__)
+#define LOGe(...) BW_LOG(BW_LOG_LEVEL_ERROR, TAG, __VA_ARGS__)
+
+Histogram::Histogram(std::vector<double> upper_bounds)
+    : upper(std::move(upper_bounds)), counts(new std::atomic<uint64_t>[upper.size() + 1]) {
+    for (size_t i = 0; i <= upper.size(); i++) {
+        counts[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+void Histogram::observe(double v) {
+    size_t i = 0;
+    while (i < upper.size() && v > upper[i]) {
+        i++;
+    }
+    counts[i].fetch_add(1, std::memory_order_relaxed);
+    sum_micros.fetch_add((uint64_t) (v * 1e6), std::memory_order_relaxed);
+}
+
+Metrics& Metrics::getInstance() {
+    static Metrics instance;
+    return instance;
+}
+
+Metrics::Metrics()
+    : ttft_seconds({0.1, 0.25, 0.5, 1, 2, 4, 8, 16, 32}),
+      prefill_tokens_per_second({10, 25, 50, 100, 200, 400, 800, 1600, 3200}),
+      decode_tokens_per_second({1, 2, 5, 10, 15, 20, 30, 50, 100}),
+      lm_ready_seconds({0.05, 0.1, 0.25, 0.5, 1, 2, 4, 8, 16}),
+      model_switch_hit_seconds({0.05, 0.1, 0.25, 0.5, 1, 2, 4, 8, 16}),
+      model_switch_miss_seconds({0.05, 0.1, 0.25, 0.5, 1, 2, 4, 8, 16}),
+      caption_search_seconds({0.0005, 0.001, 0.002, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25}) {}
+
+Metrics::~Metrics() {
+    stopping.store(true);
+    if (server_fd >= 0) {
+        shutdown(server_fd, SHUT_RDWR);
+        close(server_fd);
+    }
+    if (server.joinable()) {
+        server.join();
+    }
+    if (file_writer.joinable()) {
+        file_writer.join();
+    }
+}
+
+// smaps shows the resolved path of a mapping
+static std::string resolved(const std::string& path) {
+    char buf[PATH_MAX];
+    return realpath(path.c_str(), buf) ? std::string(buf) : path;
+}
+
+void Metrics::setModelPaths(const std::string& model, const std::string& mmproj) {
+    std::lock_guard<std::mutex> lock(paths_mutex);
+    if (!model.empty()) {
+        model_path = resolved(model);
+    }
+    if (!mmproj.empty()) {
+        mmproj_path = resolved(mmproj);
+    }
+}
+
+// Resident bytes per kind of mapping, from /proc/self/smaps
+static std::map<std::string, uint64_t> rss_by_component(const std::string& model, const std::string& mmproj) {
+    std::map<std::string, uint64_t> rss = {{"model", 0}, {"mmproj", 0}, {"heap", 0}, {"code", 0}, {"other", 0}};
+    FILE* f = fopen("/proc/self/smaps", "r");
+    if (!f) {
+        return rss;
+    }
+    char line[1024];
+    std::string component = "other";
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long long kb;
+        if (sscanf(line, "Rss: %llu kB", &kb) == 1) {
+            rss[component] += kb * 1024;
+            continue;
+        }
+        // Mapping headers start with "start-end perms", field lines with "Name:"
+        const char* dash = strchr(line, '-');
+        const char* space = strchr(line, ' ');
+        if (!dash || !space || dash > space) {
+            continue;
+        }
+        std::string path;
+        int fields = 0;
+        for (const char* p = line; *p && *p != '\n'; p++) {
+            if (*p == ' ' && p[1] != ' ') {
+                if (++fields == 5) {
+                    path.assign(p + 1, strcspn(p + 1, "\n"));
+                    break;
+                }
+            }
+        }
+        // A model in the tensor store is a directory of splits
+        const bool in_model = !model.empty() && (path == model || path.compare(0, model.size() + 1, model + "/") == 0);
+        if (in_model) {
+            component = "model";
+        } else if (!mmproj.empty() && path == mmproj) {
+            component = "mmproj";
+        } else if (path.empty() || path == "[heap]" || path.rfind("[anon", 0) == 0) {
+            component = "heap";
+        } else if (space[3] == 'x' || path.find(".so") != std::string::npos) {
+            // Executable text and the rest of each shared library
+            component = "code";
+        } else {
+            component = "other";
+        }
+    }
+    fclose(f);
+    return rss;
+}
+
+static void append_metric(std::string& out, const char* name, const char* type, const char* help) {
+    out += "# HELP ";
+    out += name;
+    out += " ";
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += " ";
+    out += type;
+    out += "\n";
+}
+
+static void append_value(std::string& out, const char* name, const char* labels, double v) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s%s %.17g\n", name, labels, v);
+    out += buf;
+}
+
+static void append_counter(std::string& out, const char* name, const char* help, const Counter& c) {
+    append_metric(out, name, "counter", help);
+    append_value(out, name, "", (double) c.get());
+}
+
+static void append_gauge(std::string& out, const char* name, const char* help, double v) {
+    append_metric(out, name, "gauge", help);
+    append_value(out, name, "", v);
+}
+
+static void append_histogram(std::string& out, const char* name, const char* help, const Histogram& h) {
+    append_metric(out, name, "histogram", help);
+    const std::string bucket = std::string(name) + "_bucket";
+    uint64_t cumulative = 0;
+    char labels[64];
+    for (size_t i = 0; i < h.bounds().size(); i++) {
+        cumulative += h.bucketCount(i);
+        snprintf(labels, sizeof(labels), "{le=\"%g\"}", h.bounds()[i]);
+        append_value(out, bucket.c_str(), labels, (double) cumulative);
+    }
+    cumulative += h.bucketCount(h.bounds().size());
+    append_value(out, bucket.c_str(), "{le=\"+Inf\"}", (double) cumulative);
+    append_value(out, (std::string(name) + "_sum").c_str(), "", h.sum());
+    append_value(out, (std::string(name) + "_count").c_str(), "", (double) cumulative);
+}
+
+std::string Metrics::render() const {
+    std::string out;
+    append_counter(out, "baseweight_requests_total", "Generation requests started", requests);
+    append_counter(out, "baseweight_request_errors_total", "Generation requests that failed", request_errors);
+    append_counter(out, "baseweight_prefill_tokens_total", "Prompt and media tokens prefilled", tokens_prefilled);
+    append_counter(out, "baseweight_decode_tokens_total", "Tokens generated", tokens_decoded);
+    append_counter(out, "baseweight_image_cache_hits_total", "Region follow-ups served from the image cache", region_hits);
+    append_counter(out, "baseweight_image_cache_misses_total", "Region follow-ups with no cached image", region_misses);
+    append_counter(out, "baseweight_image_cache_chunks_reused_total",
+                   "Image chunks decoded from cached embeddings instead of encoded", region_chunks_reused);
+    append_gauge(out, "baseweight_requests_pending", "Requests waiting for or running on the inference loop",
+                 (double) requests_pending.get());
+
+    const int64_t kv_total = kv_cells_total.get();
+    append_gauge(out, "baseweight_kv_cells_used", "KV cache cells holding tokens after the last request",
+                 (double) kv_cells_used.get());
+    append_gauge(out, "baseweight_kv_cells_total", "KV cache size in cells", (double) kv_total);
+    append_gauge(out, "baseweight_kv_utilization_ratio", "Used over total KV cache cells",
+                 kv_total > 0 ? (double) kv_cells_used.get() / kv_total : 0.0);
+    append_counter(out, "baseweight_model_switch_hits_total", "Model loads served by a pair that was still resident",
+                   model_switch_hits);
+    append_counter(out, "baseweight_model_switch_misses_total", "Model loads that read the weights again",
+                   model_switch_misses);
+    append_gauge(out, "baseweight_models_parked", "Model pairs kept loaded besides the active one",
+                 (double) models_parked.get());
+    append_gauge(out, "baseweight_models_parked_bytes", "Memory held by the parked model pairs",
+                 (double) models_parked_bytes.get());
+    append_counter(out, "baseweight_prefix_cache_hits_total", "Prompts that started from cached KV cells",
+                   prefix_cache_hits);
+    append_counter(out, "baseweight_prefix_cache_misses_total", "Prompts with no cached prefix", prefix_cache_misses);
+    append_counter(out, "baseweight_prefix_cache_cells_reused_total", "Prompt KV cells taken from the cache instead of prefilled",
+                   prefix_cache_cells_reused);
+    append_gauge(out, "baseweight_prefix_cache_cells", "KV cells held by cached prompts",
+                 (double) prefix_cache_cells.get());
+    append_counter(out, "baseweight_tuner_explorations_total", "Requests that tried another value for a tuned knob",
+                   tuner_explorations);
+    append_counter(out, "baseweight_tuner_reverts_total", "Tried values abandoned mid-request for running too slow",
+                   tuner_reverts);
+    append_metric(out, "baseweight_tuner_knob", "gauge", "Best value found for each tuned knob");
+    append_value(out, "baseweight_tuner_knob", "{knob=\"decode_threads\"}", (double) tuner_decode_threads.get());
+    append_value(out, "baseweight_tuner_knob", "{knob=\"batch_threads\"}", (double) tuner_batch_threads.get());
+    append_value(out, "baseweight_tuner_knob", "{knob=\"prefill_chunk\"}", (double) tuner_prefill_chunk.get());
+    append_value(out, "baseweight_tuner_knob", "{knob=\"flush_ms\"}", (double) tuner_flush_ms.get());
+    append_gauge(out, "baseweight_caption_index_docs", "Captions in the search index",
+                 (double) caption_index_docs.get());
+    append_gauge(out, "baseweight_caption_index_segments", "Segment files in the caption index",
+                 (double) caption_index_segments.get());
+    append_counter(out, "baseweight_caption_index_merges_total", "Background merges of caption index segments",
+                   caption_index_merges);
+
+    append_histogram(out, "baseweight_ttft_seconds", "Request start to first sampled token", ttft_seconds);
+    append_histogram(out, "baseweight_prefill_tokens_per_second", "Prefill throughput per request",
+                     prefill_tokens_per_second);
+    append_histogram(out, "baseweight_decode_tokens_per_second", "Decode throughput per request",
+                     decode_tokens_per_second);
+    append_histogram(out, "baseweight_lm_ready_seconds", "load_models start until text requests can run",
+                     lm_ready_seconds);
+    append_histogram(out, "baseweight_model_switch_hit_seconds", "load_models time with the pair still resident",
+                     model_switch_hit_seconds);
+    append_histogram(out, "baseweight_model_switch_miss_seconds", "load_models time loading the pair from storage",
+                     model_switch_miss_seconds);
+    append_histogram(out, "baseweight_caption_search_seconds", "Caption keyword search latency",
+                     caption_search_seconds);
+
+    std::string model, mmproj;
+    {
+        std::lock_guard<std::mutex> lock(paths_mutex);
+        model = model_path;
+        mmproj = mmproj_path;
+    }
+    append_metric(out, "baseweight_rss_bytes", "gauge", "Resident memory by component");
+    for (const auto& kv : rss_by_component(model, mmproj)) {
+        append_value(out, "baseweight_rss_bytes", ("{component=\"" + kv.first + "\"}").c_str(), (double) kv.second);
+    }
+    return out;
+}
+
+bool Metrics::startServer(int port) {
+    if (server.joinable()) {
+        LOGe("Metrics server already running");
+        return false;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        LOGe("Metrics socket failed: %s", strerror(errno));
+        return false;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    // Local only, whatever scrapes us runs on the same host
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t) port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (sockaddr*) &addr, sizeof(addr)) != 0 || listen(fd, 4) != 0) {
+        LOGe("Metrics server can't listen on 127.0.0.1:%d: %s", port, strerror(errno));
+        close(fd);
+        return false;
+    }
+    server_fd = fd;
+    server = std::thread(&Metrics::serve, this, fd);
+    LOGi("Serving metrics on 127.0.0.1:%d", port);
+    return true;
+}
+
+void Metrics::serve(int fd) {
+    while (!stopping.load()) {
+        int client = accept(fd, nullptr, nullptr);
+        if (client < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        // Whatever was asked for, the answer is the metrics page
+        char request[1024];
+        (void) recv(client, request, sizeof(request), 0);
+
+        const std::string body = render();
+        char header[256];
+        int n = snprintf(header, sizeof(header),
+                         "HTTP/1.1 200 OK\r\n"
+                         "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                         "Content-Length: %zu\r\n"
+                         "Connection: close\r\n\r\n", body.size());
+        std::string response(header, n);
+        response += body;
+        for (size_t sent = 0; sent < response.size();) {
+            ssize_t w = send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (w <= 0) {
+                break;
+            }
+            sent += (size_t) w;
+        }
+        close(client);
+    }
+}
+
+bool Metrics::startFileWriter(const std::string& path, int interval_ms) {
+    if (file_writer.joinable()) {
+        LOGe("Metrics file writer already running");
+        return false;
+    }
+    file_writer = std::thread(&Metrics::writeFiles, this, path, std::max(interval_ms, 1000));
+    LOGi("Writing metrics to %s every %d ms", path.c_str(), std::max(interval_ms, 1000));
+    return true;
+}
+
+void Metrics::writeFiles(std::string path, int interval_ms) {
+    // Write then rename, so the collector never reads half a file
+    const std::string tmp = path + ".tmp";
+    while (!stopping.load()) {
+        const std::string body = render();
+        if (FILE* f = fopen(tmp.c_str(), "w")) {
+            fwrite(body.data(), 1, body.size(), f);
+            fclose(f);
+            rename(tmp.c_str(), path.c_str());
+        } else {
+            LOGe("Can't write metrics to %s", tmp.c_str());
+        }
+        for (int waited = 0; waited < interval_ms && !stopping.load(); waited += 100) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    }
+}
+
+void Metrics::startFromEnv() {
+    if (env_checked.exchange(true)) {
+        return;
+    }
+    if (const char* port = getenv("BASEWEIGHT_METRICS_PORT")) {
+        startServer(atoi(port));
+    }
+    if (const char* path = getenv("BASEWEIGHT_METRICS_FILE")) {
+        startFileWriter(path, 15000);
+    }
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Counters, gauges and histograms for scraping by Prometheus.
+ *
+ * Updating one is a single relaxed atomic add or store, so they're safe to
+ * bump from the decode loop. Everything else (cumulative buckets, RSS from
+ * /proc/self/smaps, text formatting) happens in render(), on whichever
+ * thread serves the scrape.
+ *
+ * The text is served on 127.0.0.1:<port> or rewritten into a file for the
+ * node_exporter textfile collector. On Linux hosts BASEWEIGHT_METRICS_PORT
+ * or BASEWEIGHT_METRICS_FILE start either when the models are loaded.
+ */
+
+class Counter {
+public:
+    void inc(uint64_t n = 1) { value.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+private:
+    std::atomic<uint64_t> value{0};
+};
+
+class Gauge {
+public:
+    void set(int64_t v) { value.store(v, std::memory_order_relaxed); }
+    void add(int64_t n) { value.fetch_add(n, std::memory_order_relaxed); }
+    int64_t get() const { return value.load(std::memory_order_relaxed); }
+private:
+    std::atomic<int64_t> value{0};
+};
+
+class Histogram {
+public:
+    explicit Histogram(std::vector<double> upper_bounds);
+
+    // v must not be negative
+    void observe(double v);
+
+    const std::vector<double>& bounds() const { return upper; }
+    // Per bucket, not cumulative; the last one is +Inf
+    uint64_t bucketCount(size_t i) const { return counts[i].load(std::memory_order_relaxed); }
+    double sum() const { return sum_micros.load(std::memory_order_relaxed) / 1e6; }
+
+private:
+    std::vector<double> upper;
+    std::unique_ptr<std::atomic<uint64_t>[]> counts;
+    std::atomic<uint64_t> sum_micros{0};   // fixed point keeps the add a single atomic op
+};
+
+class Metrics {
+public:
+    static Metrics& getInstance();
+
+    Metrics(const Metrics&) = delete;
+    Metrics& operator=(const Metrics&) = delete;
+    ~Metrics();
+
+    Counter requests;
+    Counter request_errors;
+    Counter tokens_prefilled;
+    Counter tokens_decoded;
+    Counter region_hits;            // region follow-ups served from the image cache
+    Counter region_misses;          // region follow-ups with nothing cached
+    Counter region_chunks_reused;   // image chunks decoded from cache instead of encoded
+    Gauge requests_pending;         // waiting for or running on the inference loop
+    Gauge kv_cells_used;
+    Gauge kv_cells_total;
+    Counter model_switch_hits;      // loads served by a pair that was still resident
+    Counter model_switch_misses;
+    Gauge models_parked;            // resident pairs other than the active one
+    Gauge models_parked_bytes;
+    Counter prefix_cache_hits;      // prompts that started from cached KV cells
+    Counter prefix_cache_misses;
+    Counter prefix_cache_cells_reused;
+    Gauge prefix_cache_cells;       // KV cells the cached prompts hold
+    Counter tuner_explorations;     // requests that tried another value for a knob
+    Counter tuner_reverts;          // ...and went back to the best one mid-request
+    Gauge tuner_decode_threads;     // best value of each tuned knob
+    Gauge tuner_batch_threads;
+    Gauge tuner_prefill_chunk;
+    Gauge tuner_flush_ms;
+    Gauge caption_index_docs;       // captions search can find
+    Gauge caption_index_segments;
+    Counter caption_index_merges;
+    Histogram ttft_seconds;
+    Histogram prefill_tokens_per_second;
+    Histogram decode_tokens_per_second;
+    Histogram lm_ready_seconds;     // load_models start until text requests can run
+    Histogram model_switch_hit_seconds;
+    Histogram model_switch_miss_seconds;
+    Histogram caption_search_seconds;
+
+    // Lets render() attribute mapped model files in the RSS breakdown
+    void setModelPaths(const std::string& model, const std::string& mmproj);
+
+    // Prometheus text exposition format 0.0.4
+    std::string render() const;
+
+    bool startServer(int port);
+    bool startFileWriter(const std::string& path, int interval_ms);
+    // Starts whichever of BASEWEIGHT_METRICS_PORT / _FILE is set, once
+    void startFromEnv();
+
+private:
+    Metrics();
+
+    void serve(int fd);
+    void writeFiles(std::string path, int interval_ms);
+
+    mutable std::mutex paths_mutex;
+    std::string model_path;
+    std::string mmproj_path;
+
+    std::atomic<bool> stopping{false};
+    std::atomic<bool> env_checked{false};
+    int server_fd = -1;
+    std::thread server;
+    std::thread file_writer;
+};
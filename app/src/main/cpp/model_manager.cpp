@@ -3,9 +3,18 @@
 #include "mtmd-helper.h"
 #include "clip.h"
 #include "model_manager.h"
-#include <android/log.h>
+#include "thermal_governor.h"
+#include "metrics.h"
+#include "tensor_store.h"
+#include "sha256.h"
+#include "caption_index.h"
+#include "async_log.h"
 #include <jni.h>
 #include <chrono>
+#include <cmath>
+#include <cstring>
+#include <strings.h>
+#include <unordered_map>
 
 // Global flag to control generation
 std::atomic<bool> g_should_stop{false};
@@ -15,26 +24,89 @@ JavaVM* ModelManager::javaVM = nullptr;
 
 #undef TAG
 #define TAG "model_manager.cpp"
-#define LOGi(...) __android_log_print(ANDROID_LOG_INFO, TAG, __VA_ARGS__)
-#define LOGe(...) __android_log_print(ANDROID_LOG_ERROR, TAG, __VA_ARGS__)
+#define LOGi(...) BW_LOG(BW_LOG_LEVEL_INFO, TAG, __VA_ARGS__)
+#define LOGd(...) BW_LOG(BW_LOG_LEVEL_DEBUG, TAG, __VA_ARGS__)
+#define LOGe(...) BW_LOG(BW_LOG_LEVEL_ERROR, TAG, __VA_ARGS__)
 
 static jmethodID method_onTextGenerated = nullptr;
 static jmethodID method_onGenerationComplete = nullptr;
 static jmethodID method_onGenerationError = nullptr;
 
+void PhaseTimings::log() const {
+    auto per_sec = [](int32_t n, int64_t us) { return us > 0 ? 1e6 * n / us : 0.0; };
+    LOGi("timings: ingest %.1f ms | encode %.1f ms | prefill %d tok %.1f ms (%.1f tok/s) | "
+         "ttft %.1f ms | decode %d tok %.1f ms (%.1f tok/s)",
+         ingest_us / 1e3, encode_us / 1e3,
+         n_prefill, prefill_us / 1e3, per_sec(n_prefill, prefill_us),
+         ttft_us / 1e3,
+         n_decode, decode_us / 1e3, per_sec(n_decode, decode_us));
+}
+
+// Same pixels, same hash, whatever bitmap object they came in
+static std::string hash_bitmap(mtmd::bitmap& bmp) {
+    Sha256 hash;
+    const uint32_t size[2] = {bmp.nx(), bmp.ny()};
+    hash.update(size, sizeof(size));
+    hash.update(bmp.data(), bmp.n_bytes());
+    return hash.hexDigest();
+}
+
+// Per-request numbers into the exported histograms and counters
+static void record_metrics(const PhaseTimings& timings, llama_pos n_cells, uint32_t n_ctx) {
+    auto& metrics = Metrics::getInstance();
+    metrics.tokens_prefilled.inc(timings.n_prefill);
+    metrics.tokens_decoded.inc(timings.n_decode);
+    if (timings.ttft_us > 0) {
+        metrics.ttft_seconds.observe(timings.ttft_us / 1e6);
+    }
+    if (timings.prefill_us > 0) {
+        metrics.prefill_tokens_per_second.observe(1e6 * timings.n_prefill / timings.prefill_us);
+    }
+    if (timings.decode_us > 0) {
+        metrics.decode_tokens_per_second.observe(1e6 * timings.n_decode / timings.decode_us);
+    }
+    metrics.kv_cells_used.set(n_cells);
+    metrics.kv_cells_total.set(n_ctx);
+}
+
 ModelManager::~ModelManager() {
     cleanup();
+    residency.clear();
 }
 
-void ModelManager::cleanup() {
+void ModelManager::cleanup(bool keep_resident) {
+    // Its thread touches the model's mapping
+    layer_stream.stop();
+    // Never loaded, so the pair can't be parked either
+    pending_vision.clear();
     if (sampler) {
         common_sampler_free(sampler);
         sampler = nullptr;
     }
+    if (greedy_sampler) {
+        llama_sampler_free(greedy_sampler);
+        greedy_sampler = nullptr;
+    }
+    vocab_subset.clear();
     if (lctx) {
+        prefix_cache.detach();
         llama_free(lctx);
         lctx = nullptr;
     }
+    if (model && ctx_vision && keep_resident && !layer_stream.enabled()) {
+        // Kept loaded for switching back, or freed if the budget says so
+        ModelResidency::Pair pair;
+        pair.language_path = model_path;
+        pair.mmproj_path = mmproj_path;
+        pair.language_id = model_file_id;
+        pair.mmproj_id = mmproj_file_id;
+        pair.bytes = ModelResidency::pairBytes(model, model_path, mmproj_path);
+        pair.model = model;
+        pair.vision = std::move(ctx_vision);
+        residency.park(std::move(pair));
+        model = nullptr;
+    }
+    ctx_vision.reset();
     if (model) {
         llama_model_free(model);
         model = nullptr;
@@ -42,6 +114,8 @@ void ModelManager::cleanup() {
     vocab = nullptr;
     n_past = 0;
     bitmaps.entries.clear();
+    image_cache.clear();
+    audio.clear();
 }
 
 void ModelManager::onTextGenerated(const std::string& text, JNIEnv* env, jobject callback) {
@@ -56,7 +130,16 @@ void ModelManager::onTextGenerated(const std::string& text, JNIEnv* env, jobject
     env->DeleteLocalRef(jtext);
 }
 
+void ModelManager::flushText(JNIEnv* env, jobject callback) {
+    if (!pending_text.empty()) {
+        onTextGenerated(pending_text, env, callback);
+        pending_text.clear();
+    }
+    last_flush_us = ggml_time_us();
+}
+
 void ModelManager::onGenerationComplete(JNIEnv* env, jobject callback) {
+    flushText(env, callback);
     if (!method_onGenerationComplete) {
         jclass callbackClass = env->GetObjectClass(callback);
         method_onGenerationComplete = env->GetMethodID(callbackClass, "onGenerationComplete", "()V");
@@ -83,27 +166,103 @@ bool ModelManager::loadLanguageModel(const char* model_path) {
     llama_model_params model_params = llama_model_default_params();
     // Let's try something here
     model_params.n_gpu_layers = gpu_layers;
-    model = llama_model_load_from_file(model_path, model_params);
+    // Also settable on Linux hosts, for measuring under a cgroup memory limit.
+    // Set, it wins over setLayerStreaming, and "", "0" or "false" turn it off
+    if (const char* env = getenv("BASEWEIGHT_LAYER_STREAMING")) {
+        layer_stream.setEnabled(*env != '\0' && strcmp(env, "0") != 0 && strcasecmp(env, "false") != 0);
+    }
+    if (layer_stream.enabled()) {
+        // The streamer pages the weights in and out of llama's mmap, so
+        // they have to stay in it: CPU only, and no repacked copies
+        model_params.n_gpu_layers = 0;
+        model_params.use_mmap = true;
+        model_params.use_extra_bufts = false;
+        LOGi("Layer streaming on, loading %s on the CPU from its mapping", model_path);
+    }
+    // Models kept in the tensor store are a directory of split GGUFs
+    const std::vector<std::string> splits = stored_model_splits(model_path);
+    if (!splits.empty()) {
+        std::vector<const char*> split_paths;
+        for (const auto& split : splits) {
+            split_paths.push_back(split.c_str());
+        }
+        model = llama_model_load_from_splits(split_paths.data(), split_paths.size(), model_params);
+    } else {
+        model = llama_model_load_from_file(model_path, model_params);
+    }
     if (!model) {
         LOGe("Failed to load language model from %s", model_path);
         return false;
     }
     vocab = llama_model_get_vocab(model);
+    this->model_path = model_path;
+    model_file_id = ModelResidency::fileId(model_path);
+    Metrics::getInstance().setModelPaths(model_path, "");
     return true;
 }
 
-bool ModelManager::loadVisionModel(const char* mmproj_path) {
+static mtmd_context* init_vision(const char* mmproj_path, const llama_model* model) {
     mtmd_context_params mparams = mtmd_context_params_default();
     mparams.use_gpu = true;  // Enable GPU by default
 
     mparams.print_timings = true;
     mparams.n_threads = 1;
 
-    ctx_vision.reset(mtmd_init_from_file(mmproj_path, model, mparams));
-    if (!ctx_vision.get()) {
+    mtmd_context* ctx = mtmd_init_from_file(mmproj_path, model, mparams);
+    if (!ctx) {
         LOGe("Failed to load vision model from %s", mmproj_path);
+    }
+    return ctx;
+}
+
+bool ModelManager::loadVisionModel(const char* mmproj_path) {
+    ctx_vision.reset(init_vision(mmproj_path, model));
+    if (!ctx_vision.get()) {
         return false;
     }
+    this->mmproj_path = mmproj_path;
+    mmproj_file_id = ModelResidency::fileId(mmproj_path);
+    Metrics::getInstance().setModelPaths("", mmproj_path);
+    return true;
+}
+
+void ModelManager::deferVisionModel(const char* mmproj_path) {
+    ctx_vision.reset();
+    this->mmproj_path = mmproj_path;
+    mmproj_file_id = ModelResidency::fileId(mmproj_path);
+    Metrics::getInstance().setModelPaths("", mmproj_path);
+    pending_vision = mmproj_path;
+}
+
+// Always called on the inference loop, so clip sets up its backend while
+// nothing is decoding
+bool ModelManager::loadPendingVision() {
+    if (!pending_vision.empty()) {
+        const int64_t t0 = ggml_time_us();
+        ctx_vision.reset(init_vision(pending_vision.c_str(), model));
+        pending_vision.clear();
+        if (ctx_vision) {
+            LOGi("Projector loaded in %.1f ms", (ggml_time_us() - t0) / 1e3);
+        }
+    }
+    return ctx_vision != nullptr;
+}
+
+bool ModelManager::resumeModels(const char* language_path, const char* mmproj_path) {
+    cleanup();
+    // Streaming loads the weights differently, a parked pair wouldn't match
+    ModelResidency::Pair pair;
+    if (layer_stream.enabled() || !residency.take(language_path, mmproj_path, pair)) {
+        return false;
+    }
+    model = pair.model;
+    ctx_vision = std::move(pair.vision);
+    vocab = llama_model_get_vocab(model);
+    model_path = language_path;
+    this->mmproj_path = mmproj_path;
+    model_file_id = pair.language_id;
+    mmproj_file_id = pair.mmproj_id;
+    Metrics::getInstance().setModelPaths(language_path, mmproj_path);
     return true;
 }
 
@@ -112,6 +271,33 @@ bool ModelManager::initializeContext() {
     ctx_params.n_ctx = 4096;  // Adjust based on your needs
     ctx_params.n_batch = n_batch;
     ctx_params.swa_full = false;  // Match CLI behavior
+    kv_compressor.attach(model);
+    if (kv_compressor.enabled()) {
+        // The compressor scores image tokens from keys and queries it copies
+        // out of the graph
+        ctx_params.cb_eval = evalCallback;
+        ctx_params.cb_eval_user_data = this;
+        LOGi("KV compression on, keeping %.0f%% of image tokens", kv_compressor.keepRatio() * 100);
+    }
+    if (tensor_order.isArmed() || layer_stream.enabled()) {
+        ctx_params.cb_eval = evalCallback;
+        ctx_params.cb_eval_user_data = this;
+    }
+    if (prefix_cache.enabled()) {
+        // Cells can't be shared by sequences of recurrent state, and sliding
+        // window layers drop the early cells a cached prefix would need
+        if (llama_model_is_recurrent(model) || llama_model_is_hybrid(model) || llama_model_n_swa(model) > 0) {
+            LOGi("Prefix cache off, the model's cache can't share prefixes");
+        } else if (kv_compressor.enabled()) {
+            // The compressor evicts image cells from seq 0, cells a cached
+            // prompt would share
+            LOGi("Prefix cache off, KV compression is on");
+        } else {
+            // One cache shared by every sequence, so copying a prefix copies no cells
+            ctx_params.n_seq_max = 1 + prefix_cache.slots();
+            ctx_params.kv_unified = true;
+        }
+    }
 
     lctx = llama_init_from_model(model, ctx_params);
     if (!lctx) {
@@ -122,6 +308,11 @@ bool ModelManager::initializeContext() {
     // Warmup: let backends compile and validate compute graphs before real data.
     // Without this, the Hexagon backend can crash on the first real decode.
     llama_set_warmup(lctx, true);
+    // The warmup graph reads every layer's weights, which is how the layer
+    // streamer finds them
+    if (layer_stream.enabled()) {
+        layer_stream.start(llama_model_n_layer(model));
+    }
     {
         llama_token bos = llama_vocab_bos(vocab);
         llama_token eos = llama_vocab_eos(vocab);
@@ -133,12 +324,28 @@ bool ModelManager::initializeContext() {
             LOGe("Warmup decode failed");
         }
     }
+    layer_stream.ready();
     llama_set_warmup(lctx, false);
     llama_memory_clear(llama_get_memory(lctx), true);
+    prefix_cache.attach(lctx);
+
+    // Whatever the context picked is our ceiling, the governor only goes down from it
+    ThermalGovernor::getInstance().setMaxThreads(llama_n_threads(lctx));
+    tuner.begin(model_path, llama_n_threads(lctx), n_batch);
 
     return true;
 }
 
+bool ModelManager::evalCallback(struct ggml_tensor* t, bool ask, void* user_data) {
+    auto* self = static_cast<ModelManager*>(user_data);
+    // The recorder never asks for data, only the compressor does
+    self->tensor_order.observe(t, ask);
+    // Either may ask to see a node. Once it's computed, false would abort the graph.
+    const bool compressor = self->kv_compressor.observe(t, ask);
+    const bool streamer = self->layer_stream.observe(t, ask);
+    return ask ? compressor || streamer : compressor && streamer;
+}
+
 bool ModelManager::initializeBatch() {
     // This is a struct, I have no idea how this could realistically fail
     batch = llama_batch_init(n_batch, 0, 1);
@@ -150,6 +357,10 @@ bool ModelManager::initializeSampler() {
     sampling_params.temp = 0.2f;  // Lower temperature for better quality
     
     sampler = common_sampler_init(model, sampling_params);
+    vocab_subset.setSampling(sampling_params, llama_model_n_ctx_train(model));
+    if (!greedy_sampler) {
+        greedy_sampler = llama_sampler_init_greedy();
+    }
     if (!sampler) {
         LOGe("Failed to initialize sampler");
         return false;
@@ -157,8 +368,49 @@ bool ModelManager::initializeSampler() {
     return true;
 }
 
+void ModelManager::keepFirstTopK() {
+    const float* logits = llama_get_logits_ith(lctx, -1);
+    std::vector<llama_token_data> cur;
+    if (vocab_subset.active()) {
+        for (const llama_token id : vocab_subset.tokens()) {
+            cur.push_back({id, logits[id], 0.0f});
+        }
+    } else {
+        const int32_t n_vocab = llama_vocab_n_tokens(vocab);
+        cur.reserve(n_vocab);
+        for (llama_token id = 0; id < n_vocab; id++) {
+            cur.push_back({id, logits[id], 0.0f});
+        }
+    }
+    if (cur.empty()) {
+        return;
+    }
+
+    // Probabilities are over every candidate, not just the k kept
+    float max_logit = cur[0].logit;
+    for (const auto& c : cur) {
+        max_logit = std::max(max_logit, c.logit);
+    }
+    double sum = 0.0;
+    for (const auto& c : cur) {
+        sum += std::exp(c.logit - max_logit);
+    }
+
+    llama_token_data_array cur_p = {cur.data(), cur.size(), -1, false};
+    llama_sampler* top_k = llama_sampler_init_top_k(greedy_k);
+    llama_sampler_apply(top_k, &cur_p);
+    llama_sampler_free(top_k);
+
+    first_top_k.assign(cur_p.data, cur_p.data + cur_p.size);
+    std::sort(first_top_k.begin(), first_top_k.end(),
+              [](const llama_token_data& a, const llama_token_data& b) { return a.logit > b.logit; });
+    for (auto& c : first_top_k) {
+        c.p = (float) (std::exp(c.logit - max_logit) / sum);
+    }
+}
+
 bool ModelManager::processImage(const char* image_path) {
-    mtmd::bitmap bmp(mtmd_helper_bitmap_init_from_file(ctx_vision.get(), image_path));
+    mtmd::bitmap bmp(mtmd_helper_bitmap_init_from_file(getVisionContext(), image_path));
     if (!bmp.ptr) {
         LOGe("Failed to load image from %s", image_path);
         return false;
@@ -172,6 +424,19 @@ void ModelManager::addBitmap(mtmd::bitmap&& bmp) {
     bitmaps.entries.push_back(std::move(bmp));
 }
 
+bool ModelManager::processRegion(float left, float top, float right, float bottom) {
+    mtmd::bitmap crop;
+    if (!image_cache.prepareRegion(left, top, right, bottom, crop)) {
+        return false;
+    }
+    bitmaps.entries.clear();
+    // Laid out on the cached tiles, or sent as an image of its own
+    if (crop.ptr) {
+        bitmaps.entries.push_back(std::move(crop));
+    }
+    return true;
+}
+
 void ModelManager::setCurrentCallback(JNIEnv* env, jobject callback) {
     // Store JavaVM pointer if not already stored
     if (!javaVM) {
@@ -216,32 +481,81 @@ void ModelManager::generateResponseAsync(const char* prompt, int max_tokens, JNI
     // Store the callback
     setCurrentCallback(env, callback);
 
+    // May sleep a bit first if we're hot and the last request just finished
+    auto& governor = ThermalGovernor::getInstance();
+    ThermalGovernor::Decision decision = governor.beforeRequest();
+    llama_set_n_threads(lctx, decision.n_threads, decision.n_threads);
+    // With tuning on, threads come from the tuner, within the governor's count
+    KnobTuner::Knobs knobs = tuner.choose(decision.n_threads, decision.probe);
+    if (tuner.enabled() && knobs.decode_threads > 0) {
+        llama_set_n_threads(lctx, knobs.decode_threads, knobs.batch_threads);
+    }
+    prefill_chunk = knobs.prefill_chunk;
+    pending_text.clear();
+    const int64_t doc_id = caption_doc;
+    caption_doc = -1;
+    std::string caption;
+    const int64_t t_start_us = ggml_time_us();
+    int64_t t_first_token_us = 0;
+    Metrics::getInstance().requests.inc();
+
     // Reset context for a fresh generation with the new image.
     // Without this, the KV cache accumulates tokens from all previous
     // generations and n_past grows unbounded, causing stale context.
     n_past = 0;
-    llama_memory_clear(llama_get_memory(lctx), true);
+    if (prefix_cache.active()) {
+        // The other sequences are the cached prompts
+        llama_memory_seq_rm(llama_get_memory(lctx), 0, -1, -1);
+    } else {
+        llama_memory_clear(llama_get_memory(lctx), true);
+    }
+    n_predict_reserve = max_tokens;
     common_sampler_reset(sampler);
+    vocab_subset.reset();
+    kv_compressor.reset();
 
     // This ate up literal days of my life
     std::string str_prompt(prompt);
-    if(str_prompt.find("<__image__>") == std::string::npos) {
+    // Without an image the request is text only and never touches mtmd
+    if ((!bitmaps.entries.empty() || image_cache.hasRegion()) && str_prompt.find("<__image__>") == std::string::npos) {
         str_prompt = " <__image__> " + str_prompt;
     }
+    // A recorded question goes after whatever text the UI sent along
+    if (audio.isReady() && str_prompt.find(AUDIO_MARKER) == std::string::npos) {
+        str_prompt += " " AUDIO_MARKER;
+    }
 
     // Create chat message
     common_chat_msg msg;
     msg.role = "user";
     msg.content = str_prompt;
 
-    if (!evalMessage(msg, true)) {  // Add BOS token for first message
+    bool evaluated = evalMessage(msg, true);  // Add BOS token for first message
+    if (!evaluated && prefix_cache.cachedCells() > 0) {
+        // Cells the cached prompts hold may be what the prompt didn't fit in
+        LOGi("Prompt failed with cached prompts in the KV cache, retrying without them");
+        prefix_cache.clear();
+        llama_memory_seq_rm(llama_get_memory(lctx), 0, -1, -1);
+        n_past = 0;
+        kv_compressor.reset();
+        evaluated = evalMessage(msg, true);
+    }
+    image_cache.clearRegion();
+    if (!evaluated) {
         onGenerationError("Failed to evaluate message", env, callback);
+        Metrics::getInstance().request_errors.inc();
         clearCurrentCallback(env);
+        timings.reset();
         return;
     }
 
+    // Everything the image had to say has been read by the prompt tokens by
+    // now, drop the image tokens the prompt barely looked at
+    const int n_evicted = kv_compressor.compress(lctx, 0);
+
     llama_tokens generated_tokens;
     int n_predict = max_tokens;
+    first_top_k.clear();
 
     for (int i = 0; i < n_predict; i++) {
         // Check if we should stop
@@ -250,11 +564,32 @@ void ModelManager::generateResponseAsync(const char* prompt, int max_tokens, JNI
             break;
         }
 
-        llama_token token_id = common_sampler_sample(sampler, lctx, -1);
+        llama_token token_id;
+        if (greedy) {
+            if (i == 0 && greedy_k > 0) {
+                keepFirstTopK();
+            }
+            token_id = vocab_subset.active() ? vocab_subset.sample(lctx, -1, greedy_sampler)
+                                             : llama_sampler_sample(greedy_sampler, lctx, -1);
+        } else if (vocab_subset.active()) {
+            token_id = vocab_subset.sample(lctx, -1);
+        } else {
+            token_id = common_sampler_sample(sampler, lctx, -1);
+        }
+        if (i == 0) {
+            t_first_token_us = ggml_time_us();
+            timings.ttft_us = t_first_token_us - t_start_us;
+            last_flush_us = t_first_token_us;
+        }
         generated_tokens.push_back(token_id);
         common_sampler_accept(sampler, token_id, true);
+        vocab_subset.accept(token_id);
 
         if (llama_vocab_is_eog(vocab, token_id) || checkAntiprompt(generated_tokens)) {
+            // Indexed before Java hears it's done, a search right after finds it
+            if (doc_id >= 0) {
+                CaptionIndex::getInstance().add((uint64_t) doc_id, caption);
+            }
             onGenerationComplete(env, callback);
             break;
         }
@@ -262,11 +597,21 @@ void ModelManager::generateResponseAsync(const char* prompt, int max_tokens, JNI
         // Convert token to text
         std::string token_text = common_token_to_piece(lctx, token_id);
         if (!token_text.empty()) {
-            onTextGenerated(token_text, env, callback);
+            // Text can wait a few ms and go to Java with what follows it
+            pending_text += token_text;
+            if (doc_id >= 0) {
+                caption += token_text;
+            }
+            if (knobs.flush_ms <= 0 || ggml_time_us() - last_flush_us >= knobs.flush_ms * 1000LL) {
+                flushText(env, callback);
+            }
         }
 
         // Check if we've generated enough tokens
         if (i >= n_predict - 1) {
+            if (doc_id >= 0) {
+                CaptionIndex::getInstance().add((uint64_t) doc_id, caption);
+            }
             onGenerationComplete(env, callback);
             break;
         }
@@ -278,15 +623,44 @@ void ModelManager::generateResponseAsync(const char* prompt, int max_tokens, JNI
         }
 
         // Evaluate the token
+        const int64_t t_decode_us = ggml_time_us();
         common_batch_clear(batch);
         common_batch_add(batch, token_id, n_past++, {0}, true);
-        if (llama_decode(lctx, batch)) {
+        // The first decode after the prompt touches every weight, in the order
+        // a cold start wants them on disk
+        const bool record_order = i == 0 && tensor_order.isArmed();
+        if (record_order) {
+            tensor_order.begin();
+        }
+        const int32_t decode_rc = llama_decode(lctx, batch);
+        if (record_order) {
+            tensor_order.finish(model_path + ".order");
+        }
+        if (decode_rc) {
             LOGe("failed to decode token");
+            flushText(env, callback);
             onGenerationError("Failed to decode token", env, callback);
+            Metrics::getInstance().request_errors.inc();
             break;
         }
+        timings.decode_us += ggml_time_us() - t_decode_us;
+        timings.n_decode++;
+
+        // A value the tuner is trying that runs far too slow is dropped now
+        if (tuner.checkDecode(timings.n_decode, timings.decode_us, ggml_time_us() - t_first_token_us)) {
+            knobs = tuner.current();
+            llama_set_n_threads(lctx, knobs.decode_threads, knobs.batch_threads);
+        }
     }
 
+    timings.log();
+    record_metrics(timings, n_past - n_evicted, llama_n_ctx(lctx));
+    governor.afterRequest(timings.n_decode, timings.decode_us, llama_n_threads(lctx));
+    tuner.report(timings.n_prefill, timings.prefill_us, timings.n_decode, timings.decode_us,
+                 t_first_token_us > 0 ? ggml_time_us() - t_first_token_us : 0);
+    layer_stream.report();
+    timings.reset();
+
     // Clean up the callback at the end
     clearCurrentCallback(env);
 }
@@ -303,53 +677,173 @@ bool ModelManager::evalMessage(common_chat_msg& msg, bool add_bos) {
     tmpl_inputs.add_generation_prompt = true;
     tmpl_inputs.use_jinja = false;  // jinja is buggy here
     auto formatted_chat = common_chat_templates_apply(tmpls.get(), tmpl_inputs);
-    LOGi("formatted_chat.prompt: %s", formatted_chat.prompt.c_str());
-
-    mtmd_input_text text;
-    text.text = formatted_chat.prompt.c_str();
-    text.add_special = add_bos;
-    text.parse_special = true;
+    LOGd("formatted_chat.prompt: %s", formatted_chat.prompt.c_str());
 
-    mtmd::input_chunks chunks(mtmd_input_chunks_init());
+    std::string prompt = formatted_chat.prompt;
     auto& bitmaps = getBitmaps();
-    auto bitmaps_c_ptr = bitmaps.c_ptr();
 
-    // Get JNIEnv for the current thread
-    JNIEnv* env = getJNIEnv();
-    
-    // Send progress update for tokenization
-    if (env && currentCallback) {
-        onTextGenerated("PROGRESS:Tokenizing input...:10", env, currentCallback);
+    const bool region_request = image_cache.hasRegion();
+    if (!region_request && bitmaps.entries.empty() && !audio.isReady()) {
+        // Text only, the projector doesn't even have to be loaded yet
+        return evalText(prompt, add_bos, true);
     }
-    
-    int32_t res = mtmd_tokenize(ctx_vision.get(),
-                               chunks.ptr.get(),
-                               &text,
-                               bitmaps_c_ptr.data(),
-                               bitmaps_c_ptr.size());
-
-    if (res != 0) {
-        LOGe("Unable to tokenize prompt, res = %d", res);
+    if (!loadPendingVision()) {
+        LOGe("No projector for an image or audio request");
         return false;
     }
 
-    // Send progress update for evaluation
-    if (env && currentCallback) {
-        onTextGenerated("PROGRESS:Evaluating chunks...:30", env, currentCallback);
+    // A region follow-up either goes on the earlier image's tiles or is a
+    // crop that goes through mtmd like any image, but not as a new source
+    if (!region_request && !bitmaps.entries.empty()) {
+        image_cache.beginImage(bitmaps.entries.front());
+    }
+
+    // Recorded audio was encoded while the user spoke, so instead of going
+    // through mtmd_tokenize it gets decoded between the text before and after
+    // its marker
+    std::string prompt_tail;
+    const size_t audio_pos = audio.isReady() ? prompt.find(AUDIO_MARKER) : std::string::npos;
+    if (audio_pos != std::string::npos) {
+        prompt_tail = prompt.substr(audio_pos + strlen(AUDIO_MARKER));
+        prompt.resize(audio_pos);
     }
+    const bool has_audio = audio_pos != std::string::npos;
+
+    // Get JNIEnv for the current thread
+    JNIEnv* env = getJNIEnv();
 
     llama_pos new_n_past;
-    // This is our method, it sends progress updates, which is Android-specific
-    if (evalChunksWithProgress(ctx_vision.get(),
-                               lctx,
-                               chunks.ptr.get(),
-                               n_past,
-                               0,  // seq_id
-                               n_batch,
-                               true,  // logits_last
-                               &new_n_past)) {
-        LOGe("Unable to eval prompt");
-        return false;
+    if (region_request && !image_cache.regionParts().empty()) {
+        if (!evalRegion(prompt, add_bos, !has_audio, &new_n_past)) {
+            LOGe("Unable to eval region");
+            return false;
+        }
+    } else {
+        mtmd_input_text text;
+        text.text = prompt.c_str();
+        text.add_special = add_bos;
+        text.parse_special = true;
+
+        // Images are keyed by their pixels in the prefix cache, their chunks
+        // find the hash through the bitmap id
+        const bool cache_prompt = prefix_cache.active() && n_past == 0 && !region_request && !has_audio;
+        std::unordered_map<std::string, std::string> image_hashes;
+        if (cache_prompt) {
+            for (size_t i = 0; i < bitmaps.entries.size(); i++) {
+                mtmd::bitmap& bmp = bitmaps.entries[i];
+                if (bmp.id().empty()) {
+                    bmp.set_id(("img-" + std::to_string(i)).c_str());
+                }
+                image_hashes[bmp.id()] = hash_bitmap(bmp);
+            }
+        }
+
+        mtmd::input_chunks chunks(mtmd_input_chunks_init());
+        auto bitmaps_c_ptr = bitmaps.c_ptr();
+
+        // Send progress update for tokenization
+        if (env && currentCallback) {
+            onTextGenerated("PROGRESS:Tokenizing input...:10", env, currentCallback);
+        }
+    
+        int32_t res = mtmd_tokenize(ctx_vision.get(),
+                                   chunks.ptr.get(),
+                                   &text,
+                                   bitmaps_c_ptr.data(),
+                                   bitmaps_c_ptr.size());
+
+        if (res != 0) {
+            LOGe("Unable to tokenize prompt, res = %d", res);
+            return false;
+        }
+        // With M-RoPE an image's positions depend on its grid, cached tiles
+        // can't be decoded on their own
+        if (!region_request && !bitmaps.entries.empty() && !mtmd_decode_use_mrope(ctx_vision.get())) {
+            // The prompt's own tokens around the image, the rest of the text
+            // between them is the model's framing of it
+            const std::string marker = mtmd_default_marker();
+            const size_t pos = prompt.find(marker);
+            if (pos != std::string::npos) {
+                const size_t end = prompt.find(marker, pos + marker.size());
+                const std::string after = prompt.substr(pos + marker.size(),
+                                                        end == std::string::npos ? end : end - pos - marker.size());
+                image_cache.mapChunks(chunks.ptr.get(), vocab,
+                                      common_tokenize(vocab, prompt.substr(0, pos), add_bos, true).size(),
+                                      common_tokenize(vocab, after, false, true).size());
+            }
+        }
+
+        // Send progress update for evaluation
+        if (env && currentCallback) {
+            onTextGenerated("PROGRESS:Evaluating chunks...:30", env, currentCallback);
+        }
+
+        PrefixCache::Prompt units;
+        size_t n_reused = 0;
+        if (cache_prompt) {
+            std::unordered_map<std::string, int> n_image_chunks;
+            for (size_t i = 0; i < mtmd_input_chunks_size(chunks.ptr.get()); i++) {
+                const mtmd_input_chunk* chunk = mtmd_input_chunks_get(chunks.ptr.get(), i);
+                if (mtmd_input_chunk_get_type(chunk) == MTMD_INPUT_CHUNK_TYPE_TEXT) {
+                    size_t n_text = 0;
+                    const llama_token* tokens = mtmd_input_chunk_get_tokens_text(chunk, &n_text);
+                    for (size_t j = 0; j < n_text; j++) {
+                        units.add(tokens[j], 1, 1);
+                    }
+                    continue;
+                }
+                const char* id = mtmd_input_chunk_get_id(chunk);
+                auto it = id ? image_hashes.find(id) : image_hashes.end();
+                if (it == image_hashes.end()) {
+                    // Nothing to key it by, the prompt is cached up to here
+                    break;
+                }
+                units.add(prefix_cache.imageKey(it->second, n_image_chunks[it->first]++),
+                          mtmd_input_chunk_get_n_pos(chunk), (int32_t) mtmd_input_chunk_get_n_tokens(chunk));
+            }
+            llama_pos restored = 0;
+            n_reused = prefix_cache.restore(units, &restored);
+            prefix_cache.makeRoom((int64_t) mtmd_helper_get_n_tokens(chunks.ptr.get()) + n_predict_reserve);
+        }
+
+        // This is our method, it sends progress updates, which is Android-specific
+        if (evalChunksWithProgress(ctx_vision.get(),
+                                   lctx,
+                                   chunks.ptr.get(),
+                                   n_past,
+                                   0,  // seq_id
+                                   prefillChunk(),
+                                   !has_audio,  // logits_last
+                                   &new_n_past,
+                                   n_reused)) {
+            LOGe("Unable to eval prompt");
+            return false;
+        }
+        if (cache_prompt) {
+            prefix_cache.store(units);
+        }
+    }
+
+    if (has_audio) {
+        const int64_t t0 = ggml_time_us();
+        if (audio.decode(lctx, new_n_past, 0, prefillChunk(), &new_n_past)) {
+            LOGe("Unable to eval audio");
+            return false;
+        }
+        timings.prefill_us += ggml_time_us() - t0;
+
+        mtmd_input_text tail;
+        tail.text = prompt_tail.c_str();
+        tail.add_special = false;
+        tail.parse_special = true;
+        mtmd::input_chunks tail_chunks(mtmd_input_chunks_init());
+        if (mtmd_tokenize(ctx_vision.get(), tail_chunks.ptr.get(), &tail, nullptr, 0) != 0 ||
+            evalChunksWithProgress(ctx_vision.get(), lctx, tail_chunks.ptr.get(), new_n_past,
+                                   0, prefillChunk(), true, &new_n_past)) {
+            LOGe("Unable to eval prompt after audio");
+            return false;
+        }
+        audio.clear();
     }
 
     // Send progress update for completion
@@ -358,12 +852,200 @@ bool ModelManager::evalMessage(common_chat_msg& msg, bool add_bos) {
     }
 
     n_past = new_n_past;
+    image_cache.endRequest();
+
+    // The source image stays around for region follow-ups, crops don't
+    if (!region_request && !bitmaps.entries.empty()) {
+        image_cache.keepSource(std::move(bitmaps.entries.front()));
+    }
 
     // Live dangerously
     bitmaps.entries.clear();
     return true;
 }
 
+bool ModelManager::evalText(const std::string& prompt_text, bool add_bos, bool logits_last) {
+    const llama_tokens tokens = common_tokenize(vocab, prompt_text, add_bos, true);
+    if (tokens.empty()) {
+        return true;
+    }
+
+    // A whole text-only prompt can start from a cached prefix
+    const bool cache_prompt = prefix_cache.active() && n_past == 0 && logits_last;
+    PrefixCache::Prompt units;
+    size_t n_reused = 0;
+    if (cache_prompt) {
+        for (llama_token token : tokens) {
+            units.add(token, 1, 1);
+        }
+        n_reused = prefix_cache.restore(units, &n_past);
+        prefix_cache.makeRoom(units.n_cells + n_predict_reserve);
+    }
+
+    const int64_t t0 = ggml_time_us();
+    if (!decodeTokens(tokens.data() + n_reused, tokens.size() - n_reused, n_past, logits_last, prefillChunk())) {
+        LOGe("Unable to eval text");
+        return false;
+    }
+    timings.prefill_us += ggml_time_us() - t0;
+    timings.n_prefill += tokens.size() - n_reused;
+    if (cache_prompt) {
+        prefix_cache.store(units);
+    }
+    return true;
+}
+
+bool ModelManager::decodeTokens(const llama_token* tokens, size_t n_tokens, llama_pos& pos, bool logits_last,
+                                size_t chunk) {
+    for (size_t i = 0; i < n_tokens; i += chunk) {
+        const size_t n = std::min(n_tokens - i, chunk);
+        common_batch_clear(batch);
+        for (size_t j = 0; j < n; j++) {
+            const bool last = i + j == n_tokens - 1;
+            common_batch_add(batch, tokens[i + j], pos + (llama_pos) j, {0}, last && logits_last);
+        }
+        if (llama_decode(lctx, batch)) {
+            return false;
+        }
+        pos += (llama_pos) n;
+    }
+    return true;
+}
+
+bool ModelManager::decodeEmbd(const float* embd, size_t n_tokens, llama_pos& pos, size_t chunk) {
+    const int n_embd = llama_model_n_embd(model);
+    // Some projectors want their image tokens to see each other, which only
+    // works within one batch
+    const bool non_causal = mtmd_decode_use_non_causal(ctx_vision.get());
+    if (non_causal) {
+        chunk = std::max(chunk, n_tokens);
+        llama_set_causal_attn(lctx, false);
+    }
+    llama_batch embd_batch = llama_batch_init((int32_t) chunk, n_embd, 1);
+    bool ok = true;
+    for (size_t i = 0; i < n_tokens && ok; i += chunk) {
+        const size_t n = std::min(n_tokens - i, chunk);
+        std::copy(embd + i * n_embd, embd + (i + n) * n_embd, embd_batch.embd);
+        embd_batch.n_tokens = (int32_t) n;
+        for (size_t j = 0; j < n; j++) {
+            embd_batch.pos[j] = pos + (llama_pos) j;
+            embd_batch.n_seq_id[j] = 1;
+            embd_batch.seq_id[j][0] = 0;
+            embd_batch.logits[j] = false;
+        }
+        ok = llama_decode(lctx, embd_batch) == 0;
+        pos += (llama_pos) n;
+    }
+    if (non_causal) {
+        llama_set_causal_attn(lctx, true);
+    }
+    llama_batch_free(embd_batch);
+    return ok;
+}
+
+bool ModelManager::evalRegion(const std::string& prompt, bool add_bos, bool logits_last, llama_pos* new_n_past) {
+    const std::string marker = mtmd_default_marker();
+    const size_t marker_pos = prompt.find(marker);
+    if (marker_pos == std::string::npos) {
+        LOGe("No image marker in the region prompt");
+        return false;
+    }
+    mtmd_context* ctx = ctx_vision.get();
+    const size_t chunk = (size_t) prefillChunk();
+    const bool compress = kv_compressor.enabled();
+
+    // Text up to the image
+    const std::string head_text = prompt.substr(0, marker_pos);
+    mtmd_input_text head;
+    head.text = head_text.c_str();
+    head.add_special = add_bos;
+    head.parse_special = true;
+    mtmd::input_chunks head_chunks(mtmd_input_chunks_init());
+    if (mtmd_tokenize(ctx, head_chunks.ptr.get(), &head, nullptr, 0) != 0 ||
+        evalChunksWithProgress(ctx, lctx, head_chunks.ptr.get(), n_past, 0, chunk, false, &n_past)) {
+        return false;
+    }
+
+    // Each part behind the framing the earlier image had in front of its tile
+    for (ImageCache::Part& part : image_cache.regionParts()) {
+        int64_t t0 = ggml_time_us();
+        if (!decodeTokens(part.lead.data(), part.lead.size(), n_past, false, chunk)) {
+            return false;
+        }
+        timings.prefill_us += ggml_time_us() - t0;
+        timings.n_prefill += part.lead.size();
+
+        const float* embd = part.embd;
+        size_t n_tokens = part.n_tokens;
+        mtmd::input_chunks crop_chunks(mtmd_input_chunks_init());
+        if (!embd) {
+            // Encoded as one chunk at the model's tile size, whatever it
+            // would slice the crop into as an image of its own
+            mtmd_input_text text;
+            text.text = marker.c_str();
+            text.add_special = false;
+            text.parse_special = true;
+            const mtmd_bitmap* crop = part.crop.ptr.get();
+            if (mtmd_tokenize(ctx, crop_chunks.ptr.get(), &text, &crop, 1) != 0) {
+                return false;
+            }
+            const mtmd_input_chunk* whole = ImageCache::wholeChunk(crop_chunks.ptr.get(), vocab,
+                                                                   (int) part.crop.nx(), (int) part.crop.ny());
+            if (!whole) {
+                // No telling which chunk that is, so all of them
+                if (evalChunksWithProgress(ctx, lctx, crop_chunks.ptr.get(), n_past, 0, chunk, false, &n_past)) {
+                    return false;
+                }
+                continue;
+            }
+            t0 = ggml_time_us();
+            if (mtmd_encode_chunk(ctx, whole) != 0) {
+                return false;
+            }
+            timings.encode_us += ggml_time_us() - t0;
+            embd = mtmd_get_output_embd(ctx);
+            n_tokens = mtmd_input_chunk_get_n_tokens(whole);
+        }
+
+        const llama_pos part_start = n_past;
+        if (compress) {
+            kv_compressor.beginImage();
+        }
+        t0 = ggml_time_us();
+        const bool decoded = decodeEmbd(embd, n_tokens, n_past, chunk);
+        timings.prefill_us += ggml_time_us() - t0;
+        timings.n_prefill += n_tokens;
+        kv_compressor.endImage();
+        if (!decoded) {
+            return false;
+        }
+        if (compress) {
+            kv_compressor.addImageSpan(part_start, n_past);
+        }
+    }
+
+    // The image's closing framing and the rest of the prompt
+    std::vector<llama_token> tail = image_cache.regionTail();
+    const std::string rest = prompt.substr(marker_pos + marker.size());
+    mtmd_input_text text;
+    text.text = rest.c_str();
+    text.add_special = false;
+    text.parse_special = true;
+    mtmd::input_chunks rest_chunks(mtmd_input_chunks_init());
+    const int64_t t0 = ggml_time_us();
+    if (!decodeTokens(tail.data(), tail.size(), n_past, false, chunk)) {
+        return false;
+    }
+    timings.prefill_us += ggml_time_us() - t0;
+    timings.n_prefill += tail.size();
+    if (mtmd_tokenize(ctx, rest_chunks.ptr.get(), &text, nullptr, 0) != 0 ||
+        evalChunksWithProgress(ctx, lctx, rest_chunks.ptr.get(), n_past, 0, chunk, logits_last, &n_past)) {
+        return false;
+    }
+    *new_n_past = n_past;
+    return true;
+}
+
 bool ModelManager::initializeChatTemplate(const char* template_name) {
     if (!model) {
         LOGe("Model not loaded");
@@ -423,7 +1105,8 @@ int32_t ModelManager::evalChunksWithProgress(mtmd_context * ctx,
                                 llama_seq_id seq_id,
                                 int32_t n_batch,
                                 bool logits_last,
-                                llama_pos * new_n_past) {
+                                llama_pos * new_n_past,
+                                size_t n_reused) {
     size_t n_chunks = mtmd_input_chunks_size(chunks);
     if (n_chunks == 0) {
         LOGe("no chunks to eval\n");
@@ -438,7 +1121,7 @@ int32_t ModelManager::evalChunksWithProgress(mtmd_context * ctx,
 
     // Process chunks sequentially
     for (size_t i = 0; i < n_chunks; i++) {
-        LOGi("Processing chunk %zu/%zu", i+1, n_chunks);
+        LOGd("Processing chunk %zu/%zu", i+1, n_chunks);
         bool chunk_logits_last = (i == n_chunks - 1) && logits_last;
         auto chunk = mtmd_input_chunks_get(chunks, i);
 
@@ -447,16 +1130,80 @@ int32_t ModelManager::evalChunksWithProgress(mtmd_context * ctx,
         const char* type_name = (chunk_type == MTMD_INPUT_CHUNK_TYPE_TEXT) ? "TEXT" :
                                (chunk_type == MTMD_INPUT_CHUNK_TYPE_IMAGE) ? "IMAGE" :
                                (chunk_type == MTMD_INPUT_CHUNK_TYPE_AUDIO) ? "AUDIO" : "UNKNOWN";
-        LOGi("Chunk %zu type: %s", i+1, type_name);
-
-        int32_t res = mtmd_helper_eval_chunk_single(ctx, lctx, chunk, n_past, seq_id,
-                                                     n_batch, chunk_logits_last, &n_past);
+        LOGd("Chunk %zu type: %s", i+1, type_name);
+
+        // Media chunks are encoded and decoded in two steps (instead of
+        // mtmd_helper_eval_chunk_single) so the encoder shows up in the timings
+        int32_t res;
+        const size_t n_tokens = mtmd_input_chunk_get_n_tokens(chunk);
+        const llama_pos chunk_start = n_past;
+        if (chunk_type == MTMD_INPUT_CHUNK_TYPE_TEXT) {
+            size_t n_text = 0;
+            const llama_token* text_tokens = mtmd_input_chunk_get_tokens_text(chunk, &n_text);
+
+            // Tokens the prefix cache put in the KV cache already
+            const size_t n_cached = std::min(n_reused, n_text);
+            n_reused -= n_cached;
+            if (n_cached == n_text) {
+                n_past += (llama_pos) n_text;
+                *new_n_past = n_past;
+                continue;
+            }
+
+            // The text after the image is what decides which image tokens matter
+            const bool observe = i == n_chunks - 1 && kv_compressor.enabled() && kv_compressor.hasImageSpans();
+            if (observe) {
+                kv_compressor.beginObservation();
+            }
+            const int64_t t0 = ggml_time_us();
+            if (n_cached > 0) {
+                n_past += (llama_pos) n_cached;
+                res = decodeTokens(text_tokens + n_cached, n_text - n_cached, n_past, chunk_logits_last, n_batch) ? 0 : 1;
+            } else {
+                res = mtmd_helper_eval_chunk_single(ctx, lctx, chunk, n_past, seq_id,
+                                                    n_batch, chunk_logits_last, &n_past);
+            }
+            timings.prefill_us += ggml_time_us() - t0;
+            timings.n_prefill -= n_cached;
+            kv_compressor.endObservation();
+        } else if (n_reused > 0) {
+            // An image the prefix cache has, nothing to encode
+            n_reused--;
+            n_past += mtmd_input_chunk_get_n_pos(chunk);
+            *new_n_past = n_past;
+            continue;
+        } else {
+            int64_t t0 = ggml_time_us();
+            res = mtmd_encode_chunk(ctx, chunk);
+            timings.encode_us += ggml_time_us() - t0;
+            // With M-RoPE an image's positions don't map one to one onto its
+            // tokens, so those models are left alone
+            const bool compress = chunk_type == MTMD_INPUT_CHUNK_TYPE_IMAGE && kv_compressor.enabled() &&
+                                  !mtmd_decode_use_mrope(ctx);
+            if (res == 0) {
+                if (compress) {
+                    kv_compressor.beginImage();
+                }
+                t0 = ggml_time_us();
+                res = mtmd_helper_decode_image_chunk(ctx, lctx, chunk, mtmd_get_output_embd(ctx),
+                                                     n_past, seq_id, n_batch, &n_past);
+                timings.prefill_us += ggml_time_us() - t0;
+                kv_compressor.endImage();
+            }
+            if (res == 0 && chunk_type == MTMD_INPUT_CHUNK_TYPE_IMAGE) {
+                image_cache.storeChunk(chunk, mtmd_get_output_embd(ctx), llama_model_n_embd(model));
+            }
+            if (res == 0 && compress) {
+                kv_compressor.addImageSpan(chunk_start, n_past);
+            }
+        }
+        timings.n_prefill += n_tokens;
         if (res != 0) {
             LOGe("failed to eval chunk %zu\n", i);
             return res;
         }
         *new_n_past = n_past;
-        LOGi("Completed chunk %zu/%zu", i+1, n_chunks);
+        LOGd("Completed chunk %zu/%zu", i+1, n_chunks);
 
     }
 
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <memory>
 #include <vector>
 #include <string>
@@ -9,15 +10,41 @@
 #include "chat.h"
 #include "common.h"
 #include "sampling.h"
+#include "audio_stream.h"
+#include "kv_compressor.h"
+#include "vocab_subset.h"
+#include "image_cache.h"
+#include "tensor_order.h"
+#include "layer_stream.h"
+#include "model_residency.h"
+#include "knob_tuner.h"
+#include "prefix_cache.h"
+#include "async_log.h"
 
 
 #define TAG "model_manager.h"
-#define LOGi(...) __android_log_print(ANDROID_LOG_INFO, TAG, __VA_ARGS__)
-#define LOGe(...) __android_log_print(ANDROID_LOG_ERROR, TAG, __VA_ARGS__)
+#define LOGi(...) BW_LOG(BW_LOG_LEVEL_INFO, TAG, __VA_ARGS__)
+#define LOGd(...) BW_LOG(BW_LOG_LEVEL_DEBUG, TAG, __VA_ARGS__)
+#define LOGe(...) BW_LOG(BW_LOG_LEVEL_ERROR, TAG, __VA_ARGS__)
 
 // Global flag to control generation
 extern std::atomic<bool> g_should_stop;
 
+// Per-phase timings for one request, logged when generation finishes.
+// ingest is filled in by the JNI image entry points, the rest by generation.
+struct PhaseTimings {
+    int64_t ingest_us = 0;   // bitmap conversion into an mtmd::bitmap
+    int64_t encode_us = 0;   // vision/audio encoder
+    int64_t prefill_us = 0;  // llama_decode of prompt text and media embeddings
+    int32_t n_prefill = 0;
+    int64_t ttft_us = 0;     // request start to first sampled token
+    int64_t decode_us = 0;   // every decode step after the first token
+    int32_t n_decode = 0;
+
+    void reset() { *this = PhaseTimings(); }
+    void log() const;
+};
+
 class ModelManager {
 public:
     // Delete copy constructor and assignment operator
@@ -30,22 +57,36 @@ public:
         return instance;
     }
 
-    // Cleanup existing models
-    void cleanup();
+    // Cleanup existing models. The pair is parked for switching back
+    // unless keep_resident is false.
+    void cleanup(bool keep_resident = true);
 
     // Model loading
     bool loadLanguageModel(const char* model_path);
     bool loadVisionModel(const char* mmproj_path);
+    // Only notes the projector, the language model can be used meanwhile.
+    // loadPendingVision() loads it on the inference loop between requests,
+    // or getVisionContext() does when a request needs it first.
+    void deferVisionModel(const char* mmproj_path);
+    bool loadPendingVision();
     bool initializeContext();
     bool initializeBatch();
     bool initializeSampler();
     bool initializeChatTemplate(const char* template_name = nullptr);
 
+    // Takes the pair back if it's still resident from an earlier load
+    bool resumeModels(const char* language_path, const char* mmproj_path);
+
     // Image processing
     bool processImage(const char* image_path);
     void addBitmap(mtmd::bitmap&& bmp);
     void clearBitmaps() { bitmaps.entries.clear(); }
-    bool areModelsLoaded() const { return model != nullptr && ctx_vision != nullptr && lctx != nullptr; }
+    // Follow-up on part of the last image, edges as fractions of its size
+    bool processRegion(float left, float top, float right, float bottom);
+    AudioStream& getAudio() { return audio; }
+    bool areModelsLoaded() const {
+        return model != nullptr && lctx != nullptr && (ctx_vision != nullptr || !pending_vision.empty());
+    }
 
     // Text generation
     std::string generateResponse(const char* prompt, int max_tokens);
@@ -53,7 +94,8 @@ public:
     bool evalMessage(common_chat_msg& msg, bool add_bos = false);
 
     // Getters
-    mtmd_context* getVisionContext() const { return ctx_vision.get(); }
+    // Loads a deferred projector first
+    mtmd_context* getVisionContext() { loadPendingVision(); return ctx_vision.get(); }
     llama_context* getLanguageContext() const { return lctx; }
     llama_model* getModel() const { return model; }
     const llama_vocab* getVocab() const { return vocab; }
@@ -64,6 +106,23 @@ public:
     void setNPast(llama_pos past) { n_past = past; }
     common_sampler* getSampler() const { return sampler; }
     mtmd::bitmaps& getBitmaps() { return bitmaps; }
+    PhaseTimings& getTimings() { return timings; }
+    KvCompressor& getKvCompressor() { return kv_compressor; }
+    VocabSubset& getVocabSubset() { return vocab_subset; }
+
+    // Argmax decoding (llama's greedy sampler) for deterministic modes,
+    // top_k > 0 also keeps the k best candidates of the first generated
+    // token with their probabilities
+    void setGreedy(bool enabled, int top_k) { greedy = enabled; greedy_k = top_k; }
+    const std::vector<llama_token_data>& getFirstTopK() const { return first_top_k; }
+    TensorOrderRecorder& getTensorOrder() { return tensor_order; }
+    LayerStreamer& getLayerStreamer() { return layer_stream; }
+    ModelResidency& getResidency() { return residency; }
+    KnobTuner& getTuner() { return tuner; }
+    PrefixCache& getPrefixCache() { return prefix_cache; }
+    // The next request's text goes into the caption index under id when it
+    // finishes, -1 = it doesn't. Only lasts one request.
+    void setCaptionDoc(int64_t id) { caption_doc = id; }
 
 private:
     // Private constructor for singleton
@@ -74,6 +133,10 @@ private:
     void onTextGenerated(const std::string& text, JNIEnv* env, jobject callback);
     void onGenerationComplete(JNIEnv* env, jobject callback);
     void onGenerationError(const std::string& error, JNIEnv* env, jobject callback);
+    // Generated text not handed to Java yet, see KnobTuner's flush interval
+    std::string pending_text;
+    int64_t last_flush_us = 0;
+    void flushText(JNIEnv* env, jobject callback);
 
     // Custom eval chunks
     int32_t evalChunksWithProgress(mtmd_context * ctx,
@@ -83,10 +146,13 @@ private:
                                 llama_seq_id seq_id,
                                 int32_t n_batch,
                                 bool logits_last,
-                                llama_pos * new_n_past);
+                                llama_pos * new_n_past,
+                                size_t n_reused = 0);
 
     // Vision context
     mtmd::context_ptr ctx_vision;
+    // Projector path from deferVisionModel, empty once it's loaded
+    std::string pending_vision;
     
     // Language model
     llama_model* model = nullptr;
@@ -94,14 +160,71 @@ private:
     const llama_vocab* vocab = nullptr;
     llama_batch batch;
     int n_batch = 1024;  // Default to a larger batch size for better performance
+    // Prompt chunk handed to llama_decode, at most n_batch
+    int prefill_chunk = 0;
+    int prefillChunk() const { return prefill_chunk > 0 ? std::min(prefill_chunk, n_batch) : n_batch; }
     llama_pos n_past = 0;
     int gpu_layers = 512;
     
     // Sampler
     common_sampler* sampler = nullptr;
+    // When active, tokens are sampled from this subset instead of through sampler
+    VocabSubset vocab_subset;
+    bool greedy = false;
+    int greedy_k = 0;
+    llama_sampler* greedy_sampler = nullptr;
+    int64_t caption_doc = -1;
+    std::vector<llama_token_data> first_top_k;
+    // Fills first_top_k from the logits of the last decoded token
+    void keepFirstTopK();
     
     // Image processing
     mtmd::bitmaps bitmaps;
+    ImageCache image_cache;
+    // Text without media markers, tokenized and decoded without mtmd
+    bool evalText(const std::string& text, bool add_bos, bool logits_last = false);
+    // Decodes tokens in chunks at pos onwards, advancing pos
+    bool decodeTokens(const llama_token* tokens, size_t n_tokens, llama_pos& pos, bool logits_last, size_t chunk);
+    // Image embeddings, n_tokens rows of the model's width
+    bool decodeEmbd(const float* embd, size_t n_tokens, llama_pos& pos, size_t chunk);
+    // A region follow-up laid out on the cached image's tiles
+    bool evalRegion(const std::string& prompt, bool add_bos, bool logits_last, llama_pos* new_n_past);
+
+    // Spoken question, encoded while it's being recorded
+    AudioStream audio;
+
+    // Timings for the request in flight
+    PhaseTimings timings;
+
+    // Optional image token eviction after prefill
+    KvCompressor kv_compressor;
+
+    // Records which weights the first decode touches, in order
+    TensorOrderRecorder tensor_order;
+    std::string model_path;
+    std::string mmproj_path;
+    // What the paths were when loaded, a parked pair is only reused for these
+    ModelResidency::FileId model_file_id;
+    ModelResidency::FileId mmproj_file_id;
+
+    // Recently used pairs, cleanup() parks the current one here
+    ModelResidency residency;
+
+    // Prefetches the next block and pages out the last one, for models
+    // bigger than RAM
+    LayerStreamer layer_stream;
+
+    // Picks threads, prompt chunk and text flush interval per request
+    KnobTuner tuner;
+
+    // Earlier prompts in spare sequences, new ones start from their longest
+    // shared prefix
+    PrefixCache prefix_cache;
+    // Cells the request in flight may still generate, kept free of cached prompts
+    int n_predict_reserve = 0;
+
+    // cb_eval for the language context, hands tensors to whoever asked for them
+    static bool evalCallback(struct ggml_tensor* t, bool ask, void* user_data);
 
     // Chat template handling
     common_chat_templates_ptr tmpls;
@@ -0,0 +1,143 @@
+#include "model_residency.h"
+#include "metrics.h"
+#include "tensor_store.h"
+#include "async_log.h"
+#include <sys/stat.h>
+#include <iterator>
+
+#undef TAG
+#define TAG "model_residency.cpp"
+#define LOGi(...) BW_LOG(BW_LOG_LEVEL_INFO, TAG, __VA_ARGS__)
+#define LOGe(...) BW_LOG(BW_LOG_LEVEL_ERROR, TAG, __VA_ARGS__)
+
+static uint64_t file_size(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? (uint64_t) st.st_size : 0;
+}
+
+static void free_pair(ModelResidency::Pair& pair) {
+    // The projector context refers to the language model, it goes first
+    pair.vision.reset();
+    if (pair.model) {
+        llama_model_free(pair.model);
+        pair.model = nullptr;
+    }
+}
+
+uint64_t ModelResidency::pairBytes(llama_model* model, const std::string& language_path, const std::string& mmproj_path) {
+    uint64_t weights = model ? llama_model_size(model) : file_size(language_path);
+    if (!model) {
+        for (const auto& split : stored_model_splits(language_path)) {
+            weights += file_size(split);
+        }
+    }
+    const uint64_t mmproj = file_size(mmproj_path);
+    // A unified file holds both, only its projector part is extra
+    if (mmproj_path == language_path) {
+        return mmproj > weights ? mmproj : weights;
+    }
+    return weights + mmproj;
+}
+
+ModelResidency::FileId ModelResidency::fileId(const std::string& path) {
+    FileId id;
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0) {
+        id.dev = (uint64_t) st.st_dev;
+        id.ino = (uint64_t) st.st_ino;
+        id.size = (uint64_t) st.st_size;
+        id.mtime_ns = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    }
+    return id;
+}
+
+void ModelResidency::setBudget(uint64_t bytes) {
+    budget_bytes = bytes;
+    while (!parked.empty() && parked_bytes > budget_bytes) {
+        evictOldest();
+    }
+    updateGauges();
+}
+
+void ModelResidency::park(Pair&& pair) {
+    if (!pair.model) {
+        free_pair(pair);
+        return;
+    }
+    if (pair.bytes > budget_bytes) {
+        if (budget_bytes > 0) {
+            LOGi("%s is %.1f MB, over the %.1f MB budget, not keeping it", pair.language_path.c_str(),
+                 pair.bytes / 1e6, budget_bytes / 1e6);
+        }
+        free_pair(pair);
+        return;
+    }
+    while (!parked.empty() && parked_bytes + pair.bytes > budget_bytes) {
+        evictOldest();
+    }
+    LOGi("Keeping %s loaded (%.1f MB)", pair.language_path.c_str(), pair.bytes / 1e6);
+    parked_bytes += pair.bytes;
+    parked.push_front(std::move(pair));
+    updateGauges();
+}
+
+bool ModelResidency::take(const std::string& language_path, const std::string& mmproj_path, Pair& out) {
+    for (auto it = parked.begin(); it != parked.end(); ++it) {
+        if (it->language_path == language_path && it->mmproj_path == mmproj_path) {
+            // Same paths, other files: a delta update or a new download
+            if (!(fileId(language_path) == it->language_id) || !(fileId(mmproj_path) == it->mmproj_id)) {
+                evict(it, "changed on disk");
+                updateGauges();
+                return false;
+            }
+            parked_bytes -= it->bytes;
+            out = std::move(*it);
+            parked.erase(it);
+            updateGauges();
+            return true;
+        }
+    }
+    return false;
+}
+
+void ModelResidency::evict(const std::string& path) {
+    for (auto it = parked.begin(); it != parked.end();) {
+        auto next = std::next(it);
+        if (it->language_path == path || it->mmproj_path == path) {
+            evict(it, "its file is going away");
+        }
+        it = next;
+    }
+    updateGauges();
+}
+
+void ModelResidency::makeRoom(uint64_t bytes) {
+    while (!parked.empty() && parked_bytes + bytes > budget_bytes) {
+        evictOldest();
+    }
+    updateGauges();
+}
+
+void ModelResidency::clear() {
+    while (!parked.empty()) {
+        evictOldest();
+    }
+    updateGauges();
+}
+
+void ModelResidency::evictOldest() {
+    evict(std::prev(parked.end()), "least recently used");
+}
+
+void ModelResidency::evict(std::list<Pair>::iterator it, const char* why) {
+    LOGi("Unloading %s (%.1f MB), %s", it->language_path.c_str(), it->bytes / 1e6, why);
+    parked_bytes -= it->bytes;
+    free_pair(*it);
+    parked.erase(it);
+}
+
+void ModelResidency::updateGauges() const {
+    auto& metrics = Metrics::getInstance();
+    metrics.models_parked.set((int64_t) parked.size());
+    metrics.models_parked_bytes.set((int64_t) parked_bytes);
+}
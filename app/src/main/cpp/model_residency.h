@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <string>
+#include "llama.h"
+#include "mtmd.h"
+
+/*
+ * Keeps recently used model pairs loaded after the app switches away from
+ * them, so switching back only has to create a new context instead of
+ * loading the weights again.
+ *
+ * ModelManager parks its language model and projector here instead of
+ * freeing them, and takes them back when the same files are loaded again:
+ * same paths, and still the same inode, size and mtime, so a file replaced
+ * by a delta update or a new download isn't served from the old weights.
+ * Parked pairs are freed least recently used first when they and the pair
+ * being loaded would go over the budget, counting the weights (wherever the
+ * backend put them) and the projector clip copied into memory. A pair that
+ * alone is over the budget is never parked. Budget 0 turns parking off.
+ *
+ * Mapped CPU weights of a parked pair aren't pinned, the kernel can still
+ * reclaim their pages under pressure; they come back from the page cache
+ * or flash on the next use.
+ */
+class ModelResidency {
+public:
+    // What a path pointed to when the pair was loaded
+    struct FileId {
+        uint64_t dev = 0;
+        uint64_t ino = 0;
+        uint64_t size = 0;
+        int64_t mtime_ns = 0;
+        bool operator==(const FileId& o) const {
+            return dev == o.dev && ino == o.ino && size == o.size && mtime_ns == o.mtime_ns;
+        }
+    };
+    static FileId fileId(const std::string& path);
+
+    struct Pair {
+        std::string language_path;
+        std::string mmproj_path;
+        FileId language_id;
+        FileId mmproj_id;
+        llama_model* model = nullptr;
+        mtmd::context_ptr vision;
+        uint64_t bytes = 0;
+    };
+
+    ~ModelResidency() { clear(); }
+
+    void setBudget(uint64_t bytes);
+    uint64_t budget() const { return budget_bytes; }
+
+    // Takes the pair, evicting older pairs to stay within the budget. Frees
+    // it right away when parking is off or it doesn't fit at all.
+    void park(Pair&& pair);
+
+    // Moves the parked pair for these files into out, false if there isn't
+    // one. A pair whose files changed since it was parked is freed.
+    bool take(const std::string& language_path, const std::string& mmproj_path, Pair& out);
+
+    // Frees the parked pairs that use path, before it's deleted or replaced
+    void evict(const std::string& path);
+
+    // Evicts parked pairs until a new pair of this size fits next to them
+    void makeRoom(uint64_t bytes);
+
+    void clear();
+
+    size_t size() const { return parked.size(); }
+    uint64_t parkedBytes() const { return parked_bytes; }
+
+    // Weights plus what clip keeps of the projector. Before the model is
+    // loaded (model null) the file sizes stand in for it.
+    static uint64_t pairBytes(llama_model* model, const std::string& language_path, const std::string& mmproj_path);
+
+private:
+    void evictOldest();
+    void evict(std::list<Pair>::iterator it, const char* why);
+    void updateGauges() const;
+
+    uint64_t budget_bytes = 0;
+    uint64_t parked_bytes = 0;
+    std::list<Pair> parked;   // most recently used first
+};
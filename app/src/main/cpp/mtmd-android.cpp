@@ -6,24 +6,41 @@
  * as well as the initialization and cleanup of the MTMD context.
  */
 
-#include <android/log.h>
+#include "async_log.h"
 #include <jni.h>
 #include <iomanip>
 #include <math.h>
 #include <string>
 #include <unistd.h>
 #include <cstdlib>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include "llama.h"
 #include "common.h"
 #include "mtmd.h"
 #include "mtmd-helper.h"
 #include "clip.h"
 #include "model_manager.h"
+#include "backend_loader.h"
+#include "thermal_governor.h"
+#include "image_ingest.h"
+#include "metrics.h"
+#include "gguf_layout.h"
+#include "proc_status.h"
+#include "tensor_order.h"
+#include "gguf_delta.h"
+#include "tensor_store.h"
+#include "caption_index.h"
 
 #undef TAG
 #define TAG "mtmd-android.cpp"
-#define LOGi(...) __android_log_print(ANDROID_LOG_INFO, TAG, __VA_ARGS__)
-#define LOGe(...) __android_log_print(ANDROID_LOG_ERROR, TAG, __VA_ARGS__)
+#define LOGi(...) BW_LOG(BW_LOG_LEVEL_INFO, TAG, __VA_ARGS__)
+#define LOGd(...) BW_LOG(BW_LOG_LEVEL_DEBUG, TAG, __VA_ARGS__)
+#define LOGe(...) BW_LOG(BW_LOG_LEVEL_ERROR, TAG, __VA_ARGS__)
 
 jclass la_int_var;
 jmethodID la_int_var_value;
@@ -92,11 +109,33 @@ bool is_valid_utf8(const char * string) {
     return true;
 }
 
-static void log_callback(ggml_log_level level, const char * fmt, void * data) {
-    if (level == GGML_LOG_LEVEL_ERROR)     __android_log_print(ANDROID_LOG_ERROR, TAG, fmt, data);
-    else if (level == GGML_LOG_LEVEL_INFO) __android_log_print(ANDROID_LOG_INFO, TAG, fmt, data);
-    else if (level == GGML_LOG_LEVEL_WARN) __android_log_print(ANDROID_LOG_WARN, TAG, fmt, data);
-    else __android_log_print(ANDROID_LOG_DEFAULT, TAG, fmt, data);
+// ggml hands us finished lines, CONT continues the previous one
+static void log_callback(ggml_log_level level, const char * text, void * /*user_data*/) {
+    switch (level) {
+        case GGML_LOG_LEVEL_ERROR: BW_LOG(BW_LOG_LEVEL_ERROR, TAG, "%s", text); break;
+        case GGML_LOG_LEVEL_WARN:  BW_LOG(BW_LOG_LEVEL_WARN, TAG, "%s", text); break;
+        case GGML_LOG_LEVEL_DEBUG: LOGd("%s", text); break;
+        default:                   LOGi("%s", text); break;
+    }
+}
+
+// Makes the language model usable first and leaves the projector for
+// load_pending_projector, on the inference loop
+static bool g_lazy_projector = false;
+
+// Why path can't be loaded whatever the backends, empty if it looks like a GGUF
+static std::string model_file_error(const char* path) {
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return std::string(path) + ": " + strerror(errno);
+    }
+    char magic[4] = {};
+    const ssize_t n = read(fd, magic, sizeof(magic));
+    close(fd);
+    if (n != (ssize_t) sizeof(magic) || memcmp(magic, "GGUF", sizeof(magic)) != 0) {
+        return std::string(path) + ": not a GGUF file";
+    }
+    return "";
 }
 
 extern "C"
@@ -111,24 +150,76 @@ Java_ai_baseweight_baseweightsnap_MTMD_1Android_load_1models(
     
     const char *lang_model_path = env->GetStringUTFChars(language_model_path, 0);
     const char *mmproj_model_path = env->GetStringUTFChars(mmproj_path, 0);
-    
-    bool success = manager.loadLanguageModel(lang_model_path) &&
-                  manager.loadVisionModel(mmproj_model_path) &&
+
+    // A missing or broken file is an IOException, so the caller doesn't
+    // mistake it for the backends failing and widen the backend profile
+    std::string file_error = model_file_error(lang_model_path);
+    if (file_error.empty()) {
+        file_error = model_file_error(mmproj_model_path);
+    }
+    if (!file_error.empty()) {
+        LOGe("Failed to initialize models, %s", file_error.c_str());
+        env->ReleaseStringUTFChars(language_model_path, lang_model_path);
+        env->ReleaseStringUTFChars(mmproj_path, mmproj_model_path);
+        env->ThrowNew(env->FindClass("java/io/IOException"), file_error.c_str());
+        return JNI_FALSE;
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+    const int64_t rss_before = process_rss_bytes();
+    // Switching back to a pair that's still resident skips the loading
+    const bool resumed = manager.resumeModels(lang_model_path, mmproj_model_path);
+    bool loaded = resumed;
+    if (!resumed) {
+        manager.getResidency().makeRoom(ModelResidency::pairBytes(nullptr, lang_model_path, mmproj_model_path));
+        // Unified repos pass the same file for both, llama and clip each open it
+        loaded = manager.loadLanguageModel(lang_model_path) &&
+                 (g_lazy_projector || manager.loadVisionModel(mmproj_model_path));
+    }
+    if (loaded) {
+        const int64_t rss_after = process_rss_bytes();
+        LOGi("Model load (%s): %.1f ms, RSS %+.1f MB to %.1f MB",
+             resumed ? "resident" : "from files",
+             (ggml_time_us() - t_start_us) / 1e3, (rss_after - rss_before) / 1e6, rss_after / 1e6);
+    }
+
+    bool success = loaded &&
                   manager.initializeContext() &&
                   manager.initializeBatch() &&
                   manager.initializeSampler() &&
                   manager.initializeChatTemplate("vicuna");  // Use vicuna template by default
+    // Text requests can run from here on
+    const double lm_ready_seconds = (ggml_time_us() - t_start_us) / 1e6;
+    const bool projector_pending = success && g_lazy_projector && !resumed;
+    if (projector_pending) {
+        manager.deferVisionModel(mmproj_model_path);
+    }
 
+    if (!success) {
+        LOGe("Failed to initialize models. Language model: %s, Vision model: %s", lang_model_path, mmproj_model_path);
+    }
     env->ReleaseStringUTFChars(language_model_path, lang_model_path);
     env->ReleaseStringUTFChars(mmproj_path, mmproj_model_path);
 
     if (!success) {
-        LOGe("Failed to initialize models. Language model: %s, Vision model: %s", lang_model_path, mmproj_model_path);
         env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "Failed to initialize models");
         return JNI_FALSE;
     }
 
-    LOGi("Successfully initialized models");
+    auto& metrics = Metrics::getInstance();
+    const double seconds = (ggml_time_us() - t_start_us) / 1e6;
+    metrics.lm_ready_seconds.observe(lm_ready_seconds);
+    if (resumed) {
+        metrics.model_switch_hits.inc();
+        metrics.model_switch_hit_seconds.observe(seconds);
+    } else {
+        metrics.model_switch_misses.inc();
+        metrics.model_switch_miss_seconds.observe(seconds);
+    }
+    LOGi("Successfully initialized models in %.1f ms (%s, %zu other pairs resident)%s", seconds * 1e3,
+         resumed ? "hit" : "miss", manager.getResidency().size(),
+         projector_pending ? ", language model ready, projector deferred" : "");
+    metrics.startFromEnv();
     return JNI_TRUE;
 }
 
@@ -137,56 +228,93 @@ JNIEXPORT void JNICALL
 Java_ai_baseweight_baseweightsnap_MTMD_1Android_free_1models(
         JNIEnv *,
         jobject) {
-    ModelManager::getInstance().cleanup();
+    // Switching models parks the current pair in load_models, unloading
+    // means the memory is wanted back
+    ModelManager::getInstance().cleanup(false);
 }
 
 extern "C"
-JNIEXPORT jboolean JNICALL
-Java_ai_baseweight_baseweightsnap_MTMD_1Android_process_1image(
-        JNIEnv *env,
-        jobject,
-        jstring image_path) {
-
-    auto& manager = ModelManager::getInstance();
-    
-    // Check if models are loaded
-    if (!manager.areModelsLoaded()) {
-        LOGe("process_image(): models not loaded");
-        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "Models not loaded");
-        return JNI_FALSE;
-    }
-
-    auto path_to_image = env->GetStringUTFChars(image_path, 0);
-    LOGi("Processing image from %s", path_to_image);
+JNIEXPORT void JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_set_1model_1cache_1budget(JNIEnv *, jobject, jlong bytes) {
+    ModelManager::getInstance().getResidency().setBudget(bytes > 0 ? (uint64_t) bytes : 0);
+}
 
-    // Clear any existing bitmaps
-    manager.clearBitmaps();
+extern "C"
+JNIEXPORT void JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_clear_1model_1cache(JNIEnv *, jobject) {
+    // Only the parked pairs, the active one stays loaded
+    ModelManager::getInstance().getResidency().clear();
+}
 
-    mtmd::bitmap bmp(mtmd_helper_bitmap_init_from_file(manager.getVisionContext(), path_to_image));
-    env->ReleaseStringUTFChars(image_path, path_to_image);
+extern "C"
+JNIEXPORT void JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_evict_1model(JNIEnv *env, jobject, jstring path) {
+    const char* p = env->GetStringUTFChars(path, 0);
+    ModelManager::getInstance().getResidency().evict(p);
+    env->ReleaseStringUTFChars(path, p);
+}
 
-    if (!bmp.ptr) {
-        LOGe("Failed to load image from %s", path_to_image);
-        return JNI_FALSE;
+static jobjectArray to_jstring_array(JNIEnv *env, const std::vector<std::string> &values) {
+    jclass string_class = env->FindClass("java/lang/String");
+    jobjectArray result = env->NewObjectArray(values.size(), string_class, nullptr);
+    for (size_t i = 0; i < values.size(); i++) {
+        jstring value = env->NewStringUTF(values[i].c_str());
+        env->SetObjectArrayElement(result, i, value);
+        env->DeleteLocalRef(value);
     }
-
-    // Store the bitmap in the manager
-    manager.addBitmap(std::move(bmp));
-    LOGi("Successfully processed image");
-
-    return JNI_TRUE;
+    env->DeleteLocalRef(string_class);
+    return result;
 }
 
+/*
+ * Loads the backend plugins listed in `backends` (the persisted device
+ * profile), or every plugin in native_lib_dir when there is no profile yet.
+ * Returns the backends that ended up with at least one device.
+ */
 extern "C"
-JNIEXPORT void JNICALL
-Java_ai_baseweight_baseweightsnap_MTMD_1Android_backend_1init(JNIEnv *env, jobject, jstring native_lib_dir) {
+JNIEXPORT jobjectArray JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_backend_1init(JNIEnv *env, jobject, jstring native_lib_dir, jobjectArray backends) {
+    auto& loader = BackendLoader::getInstance();
     if (native_lib_dir) {
         const char *path = env->GetStringUTFChars(native_lib_dir, nullptr);
         LOGi("Setting ADSP_LIBRARY_PATH=%s", path);
         setenv("ADSP_LIBRARY_PATH", path, 1);
+        loader.setLibraryDir(path);
         env->ReleaseStringUTFChars(native_lib_dir, path);
     }
+
+    if (backends) {
+        std::vector<std::string> names;
+        for (jsize i = 0; i < env->GetArrayLength(backends); i++) {
+            auto name = (jstring) env->GetObjectArrayElement(backends, i);
+            const char *c_name = env->GetStringUTFChars(name, nullptr);
+            names.emplace_back(c_name);
+            env->ReleaseStringUTFChars(name, c_name);
+            env->DeleteLocalRef(name);
+        }
+        if (!loader.load(names)) {
+            LOGe("Not every profiled backend loaded, the rest load on fallback");
+        }
+    } else {
+        loader.load(loader.discover());
+    }
+
+    const int64_t t_start_us = ggml_time_us();
     llama_backend_init();
+    loader.setInitTime(ggml_time_us() - t_start_us);
+
+    LOGi("%s", loader.report().c_str());
+    return to_jstring_array(env, loader.registeredBackends());
+}
+
+// Fallback when the model fails to load with the profiled backends
+extern "C"
+JNIEXPORT jobjectArray JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_backend_1load_1remaining(JNIEnv *env, jobject) {
+    auto& loader = BackendLoader::getInstance();
+    loader.loadRemaining();
+    LOGi("%s", loader.report().c_str());
+    return to_jstring_array(env, loader.registeredBackends());
 }
 
 extern "C"
@@ -201,6 +329,45 @@ Java_ai_baseweight_baseweightsnap_MTMD_1Android_log_1to_1android(JNIEnv *, jobje
     llama_log_set(log_callback, NULL);
 }
 
+#ifdef BASEWEIGHT_PGO_GENERATE
+// Provided by the clang profile runtime that -fprofile-generate links in
+extern "C" void __llvm_profile_set_filename(const char * filename);
+extern "C" int __llvm_profile_write_file(void);
+#endif
+
+/*
+ * Android never lets the process exit normally, so the profile runtime's
+ * atexit hook would never run. Instrumented builds (PGO_MODE=generate) get
+ * their output directory here and flush after every request instead.
+ * Both are no-ops in regular builds.
+ */
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_pgo_1set_1profile_1dir(JNIEnv *env, jobject, jstring profile_dir) {
+#ifdef BASEWEIGHT_PGO_GENERATE
+    const char *dir = env->GetStringUTFChars(profile_dir, nullptr);
+    mkdir(dir, 0755);
+    // %p keeps profiles from separate app launches apart, llvm-profdata merges them
+    std::string pattern = std::string(dir) + "/baseweightsnap-%p.profraw";
+    env->ReleaseStringUTFChars(profile_dir, dir);
+    __llvm_profile_set_filename(pattern.c_str());
+    LOGi("PGO instrumented build, writing profiles to %s", pattern.c_str());
+    return JNI_TRUE;
+#else
+    return JNI_FALSE;
+#endif
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_pgo_1flush_1profile(JNIEnv *, jobject) {
+#ifdef BASEWEIGHT_PGO_GENERATE
+    if (__llvm_profile_write_file() != 0) {
+        LOGe("Failed to write PGO profile");
+    }
+#endif
+}
+
 extern "C"
 JNIEXPORT jstring JNICALL
 Java_ai_baseweight_baseweightsnap_MTMD_1Android_system_1info(JNIEnv *env, jobject) {
@@ -223,61 +390,11 @@ Java_ai_baseweight_baseweightsnap_MTMD_1Android_generate_1response(
         return;
     }
 
-    if (manager.getBitmaps().entries.empty()) {
-        LOGe("generate_response(): no image processed");
-        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "No image processed");
-        return;
-    }
-
     const char* c_prompt = env->GetStringUTFChars(prompt, nullptr);
     ModelManager::getInstance().generateResponseAsync(c_prompt, max_tokens, env, callback);
     env->ReleaseStringUTFChars(prompt, c_prompt);
 }
 
-extern "C"
-JNIEXPORT jint JNICALL
-Java_ai_baseweight_baseweightsnap_MTMD_1Android_get_1token_1count(
-        JNIEnv *env,
-        jobject,
-        jstring text) {
-
-    auto& manager = ModelManager::getInstance();
-    if (!manager.areModelsLoaded()) {
-        LOGe("get_token_count(): models not loaded");
-        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "Models not loaded");
-        return -1;
-    }
-
-    const char* text_str = env->GetStringUTFChars(text, 0);
-    
-    // Create input text
-    mtmd_input_text input_text;
-    input_text.text = text_str;
-    input_text.add_special = false;
-    input_text.parse_special = true;
-
-    // Tokenize the input
-    mtmd::input_chunks chunks(mtmd_input_chunks_init());
-    auto& bitmaps = manager.getBitmaps();  // Use non-const reference since c_ptr() isn't const
-    auto bitmaps_c_ptr = bitmaps.c_ptr();
-    int32_t res = mtmd_tokenize(manager.getVisionContext(),
-                               chunks.ptr.get(),
-                               &input_text,
-                               bitmaps_c_ptr.data(),
-                               bitmaps_c_ptr.size());
-
-    env->ReleaseStringUTFChars(text, text_str);
-
-    if (res != 0) {
-        LOGe("Unable to tokenize text, res = %d", res);
-        env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), "Failed to tokenize text");
-        return -1;
-    }
-
-    // For now, just return 0 since token counting isn't part of mtmd-cli.cpp
-    return 0;
-}
-
 extern "C"
 JNIEXPORT void JNICALL
 Java_ai_baseweight_baseweightsnap_MTMD_1Android_stop_1generation(
@@ -295,6 +412,34 @@ Java_ai_baseweight_baseweightsnap_MTMD_1Android_reset_1stop_1flag(
 }
 
 
+// Longest image edge set with set_max_ingest_edge, 0 keeps full size.
+// Images are converted from the bitmap's own thread, hence atomic.
+static std::atomic<int> g_max_ingest_edge{0};
+
+// Shrinks when the thermal governor is capping tiles, every tile is a full
+// encoder pass plus its share of prefill, and past the opt-in maximum edge
+static float ingest_scale(int width, int height) {
+    float scale = tile_cap_scale(width, height, ThermalGovernor::getInstance().maxTiles(), 512);
+    const int max_edge = g_max_ingest_edge.load();
+    if (max_edge > 0) {
+        scale = std::min(scale, (float) max_edge / std::max(width, height));
+    }
+    return scale;
+}
+
+// Hands a packed RGB image to the manager
+static void add_rgb_image(std::vector<uint8_t>& rgb, int width, int height, int64_t t_start_us) {
+    // mtmd copies the pixels, this is better than copying to file or
+    // messing around with PNG decoding
+    mtmd::bitmap bmp(width, height, rgb.data());
+
+    // Store the bitmap in the manager
+    auto& manager = ModelManager::getInstance();
+    manager.addBitmap(std::move(bmp));
+    manager.getTimings().ingest_us = ggml_time_us() - t_start_us;
+    LOGi("Successfully processed image");
+}
+
 extern "C"
 JNIEXPORT jboolean JNICALL
 Java_ai_baseweight_baseweightsnap_MTMD_1Android_process_1image_1from_1byteBuff(JNIEnv *env,
@@ -303,6 +448,7 @@ Java_ai_baseweight_baseweightsnap_MTMD_1Android_process_1image_1from_1byteBuff(J
                                                                                jint width,
                                                                                jint height) {
     // TODO: implement process_image_from_byteBuff()
+    const int64_t t_start_us = ggml_time_us();
     jbyte* buff = (jbyte*)env->GetDirectBufferAddress(arr);
     jlong buff_len = env->GetDirectBufferCapacity(arr);
     if (buff_len != (jlong)(width * height * 4)) {
@@ -310,28 +456,359 @@ Java_ai_baseweight_baseweightsnap_MTMD_1Android_process_1image_1from_1byteBuff(J
         return JNI_FALSE;
     }
 
-    size_t len = width * height * 3;
-    // Allocate memory for RGB buffer (raw pointer since mtmd takes ownership)
-    uint8_t* rgb_buffer = new uint8_t[len];
-    
-    // Convert BGRA to RGB
-    for (size_t i = 0; i < width * height; ++i) {
-        size_t src_idx = i * 4;
-        size_t dst_idx = i * 3;
-        
-        // Skip alpha channel (BGR -> RGB)
-        rgb_buffer[dst_idx + 0] = buff[src_idx + 0]; // R
-        rgb_buffer[dst_idx + 1] = buff[src_idx + 1]; // G
-        rgb_buffer[dst_idx + 2] = buff[src_idx + 2]; // B;
+    float scale = ingest_scale(width, height);
+    int dw = std::max(1, (int) (width * scale));
+    int dh = std::max(1, (int) (height * scale));
+    std::vector<uint8_t> rgb((size_t) dw * dh * 3);
+    ingest_pixels(PixelFormat::RGBA8888, (const uint8_t*) buff, (size_t) width * 4, width, height, rgb.data(), dw, dh);
+    add_rgb_image(rgb, dw, dh, t_start_us);
+    return JNI_TRUE;
+}
+
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_process_1bitmap(JNIEnv *env, jobject thiz, jobject bitmap) {
+    const int64_t t_start_us = ggml_time_us();
+    std::vector<uint8_t> rgb;
+    int width = 0;
+    int height = 0;
+    if (!ingest_android_bitmap(env, bitmap, ingest_scale, rgb, width, height)) {
+        return JNI_FALSE;
     }
+    add_rgb_image(rgb, width, height, t_start_us);
+    return JNI_TRUE;
+}
 
-    // We load directly from the buffer since mtmd takes ownership
-    // this is better than copying to file or messing around with PNG decoding
-    mtmd::bitmap bmp(width, height, rgb_buffer);
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_audio_1begin(JNIEnv *env, jobject thiz, jint sample_rate) {
+    auto& manager = ModelManager::getInstance();
+    return manager.getAudio().begin(manager.getVisionContext(), manager.getModel(), sample_rate) ? JNI_TRUE : JNI_FALSE;
+}
 
-    // Store the bitmap in the manager
-    ModelManager::getInstance().addBitmap(std::move(bmp));
-    LOGi("Successfully processed image");
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_audio_1append(JNIEnv *env, jobject thiz, jshortArray pcm, jint length) {
+    if (length < 0 || length > env->GetArrayLength(pcm)) {
+        LOGe("Invalid PCM length %d", length);
+        return JNI_FALSE;
+    }
+    std::vector<int16_t> samples(length);
+    env->GetShortArrayRegion(pcm, 0, length, samples.data());
+    return ModelManager::getInstance().getAudio().append(samples.data(), samples.size()) ? JNI_TRUE : JNI_FALSE;
+}
 
-    return JNI_TRUE;
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_audio_1end(JNIEnv *env, jobject thiz) {
+    return ModelManager::getInstance().getAudio().end() ? JNI_TRUE : JNI_FALSE;
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_audio_1cancel(JNIEnv *env, jobject thiz) {
+    ModelManager::getInstance().getAudio().clear();
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_set_1kv_1compression(JNIEnv *env, jobject thiz, jfloat keep_ratio) {
+    // Only read when the context is created, so this applies from the next load_models
+    ModelManager::getInstance().getKvCompressor().setKeepRatio(keep_ratio);
+}
+
+extern "C"
+JNIEXPORT jint JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_restrict_1vocab_1scripts(JNIEnv *env, jobject thiz, jobjectArray scripts) {
+    std::vector<std::string> names;
+    for (jsize i = 0; i < env->GetArrayLength(scripts); i++) {
+        auto jname = (jstring) env->GetObjectArrayElement(scripts, i);
+        const char *name = env->GetStringUTFChars(jname, 0);
+        names.push_back(name);
+        env->ReleaseStringUTFChars(jname, name);
+        env->DeleteLocalRef(jname);
+    }
+    auto& manager = ModelManager::getInstance();
+    return (jint) manager.getVocabSubset().buildFromScripts(manager.getVocab(), names);
+}
+
+extern "C"
+JNIEXPORT jint JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_restrict_1vocab_1corpus(JNIEnv *env, jobject thiz, jstring corpus) {
+    const char *text = env->GetStringUTFChars(corpus, 0);
+    auto& manager = ModelManager::getInstance();
+    size_t n = manager.getVocabSubset().buildFromCorpus(manager.getVocab(), text);
+    env->ReleaseStringUTFChars(corpus, text);
+    return (jint) n;
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_clear_1vocab_1restriction(JNIEnv *env, jobject thiz) {
+    ModelManager::getInstance().getVocabSubset().clear();
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_set_1greedy(JNIEnv *env, jobject thiz, jboolean enabled, jint top_k) {
+    ModelManager::getInstance().setGreedy(enabled == JNI_TRUE, top_k);
+}
+
+// Candidates for the first token, best first. The probabilities come from
+// first_token_top_k_probs, in the same order.
+extern "C"
+JNIEXPORT jobjectArray JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_first_1token_1top_1k_1pieces(JNIEnv *env, jobject thiz) {
+    auto& manager = ModelManager::getInstance();
+    std::vector<std::string> pieces;
+    for (const auto& td : manager.getFirstTopK()) {
+        pieces.push_back(common_token_to_piece(manager.getLanguageContext(), td.id));
+    }
+    return to_jstring_array(env, pieces);
+}
+
+extern "C"
+JNIEXPORT jfloatArray JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_first_1token_1top_1k_1probs(JNIEnv *env, jobject thiz) {
+    std::vector<jfloat> values;
+    for (const auto& td : ModelManager::getInstance().getFirstTopK()) {
+        values.push_back(td.p);
+    }
+    jfloatArray out = env->NewFloatArray((jsize) values.size());
+    env->SetFloatArrayRegion(out, 0, (jsize) values.size(), values.data());
+    return out;
+}
+
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_process_1region(JNIEnv *env, jobject thiz,
+                                                                jfloat left, jfloat top, jfloat right, jfloat bottom) {
+    return ModelManager::getInstance().processRegion(left, top, right, bottom) ? JNI_TRUE : JNI_FALSE;
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_set_1max_1ingest_1edge(JNIEnv *env, jobject thiz, jint edge) {
+    g_max_ingest_edge = std::max(0, (int) edge);
+}
+
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_benchmark_1ingest(JNIEnv *env, jobject thiz, jobject bitmap) {
+    return benchmark_ingest(env, bitmap, ingest_scale) ? JNI_TRUE : JNI_FALSE;
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_metrics_1pending(JNIEnv *env, jobject thiz, jint delta) {
+    Metrics::getInstance().requests_pending.add(delta);
+}
+
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_start_1metrics_1server(JNIEnv *env, jobject thiz, jint port) {
+    return Metrics::getInstance().startServer(port) ? JNI_TRUE : JNI_FALSE;
+}
+
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_start_1metrics_1file(JNIEnv *env, jobject thiz, jstring path, jint interval_ms) {
+    const char* c_path = env->GetStringUTFChars(path, nullptr);
+    bool ok = Metrics::getInstance().startFileWriter(c_path, interval_ms);
+    env->ReleaseStringUTFChars(path, c_path);
+    return ok ? JNI_TRUE : JNI_FALSE;
+}
+
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_render_1metrics(JNIEnv *env, jobject thiz) {
+    return env->NewStringUTF(Metrics::getInstance().render().c_str());
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_set_1lazy_1projector(JNIEnv *env, jobject thiz, jboolean enabled) {
+    g_lazy_projector = enabled == JNI_TRUE;
+}
+
+// Queued on the inference loop after load_models, a no-op without a
+// deferred projector
+extern "C"
+JNIEXPORT void JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_load_1pending_1projector(JNIEnv *env, jobject thiz) {
+    ModelManager::getInstance().loadPendingVision();
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_set_1tensor_1order_1recording(JNIEnv *env, jobject thiz, jboolean enabled) {
+    // Picked up by the next load_models
+    ModelManager::getInstance().getTensorOrder().setArmed(enabled == JNI_TRUE);
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_set_1layer_1streaming(JNIEnv *env, jobject thiz, jboolean enabled) {
+    // Decides how the next load_models places the weights
+    ModelManager::getInstance().getLayerStreamer().setEnabled(enabled == JNI_TRUE);
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_set_1prefix_1cache(JNIEnv *env, jobject thiz, jint slots) {
+    // Sizes the next context, 0 turns the cache off
+    ModelManager::getInstance().getPrefixCache().setSlots(slots);
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_set_1tuner_1dir(JNIEnv *env, jobject thiz, jstring dir) {
+    // Read when the context is created, null runs with the fixed defaults
+    std::string tuner_dir;
+    if (dir) {
+        const char *c_dir = env->GetStringUTFChars(dir, 0);
+        tuner_dir = c_dir;
+        env->ReleaseStringUTFChars(dir, c_dir);
+    }
+    ModelManager::getInstance().getTuner().setStateDir(tuner_dir);
+}
+
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_optimize_1model_1layout(JNIEnv *env, jobject thiz, jstring path) {
+    const char *c_path = env->GetStringUTFChars(path, 0);
+    const std::string model_path(c_path);
+    env->ReleaseStringUTFChars(path, c_path);
+
+    // A recorded trace beats the canonical guess
+    std::vector<std::string> order = load_tensor_order(model_path + ".order");
+    const char* source = "trace";
+    if (order.empty()) {
+        GgufLayout layout;
+        if (!read_gguf_layout(model_path.c_str(), layout)) {
+            return JNI_FALSE;
+        }
+        order = canonical_tensor_order(layout);
+        source = "canonical";
+    }
+    return reorder_gguf(model_path, order, source) ? JNI_TRUE : JNI_FALSE;
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_drop_1file_1cache(JNIEnv *env, jobject thiz, jstring path) {
+    // For measuring cold starts without a reboot
+    const char *c_path = env->GetStringUTFChars(path, 0);
+    int fd = open(c_path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    } else {
+        LOGe("Can't open %s to drop it from the page cache", c_path);
+    }
+    env->ReleaseStringUTFChars(path, c_path);
+}
+
+static std::string jstring_to_string(JNIEnv *env, jstring s) {
+    const char *chars = env->GetStringUTFChars(s, 0);
+    std::string out(chars);
+    env->ReleaseStringUTFChars(s, chars);
+    return out;
+}
+
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_tensor_1manifest(JNIEnv *env, jobject thiz, jstring path) {
+    TensorManifest manifest;
+    if (!build_tensor_manifest(jstring_to_string(env, path), manifest)) {
+        return nullptr;
+    }
+    return env->NewStringUTF(manifest.toText().c_str());
+}
+
+extern "C"
+JNIEXPORT jlongArray JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_delta_1prepare(JNIEnv *env, jobject thiz, jstring local_path,
+                                                               jstring manifest_text, jstring out_path) {
+    TensorManifest remote;
+    if (!remote.parse(jstring_to_string(env, manifest_text))) {
+        LOGe("Malformed tensor manifest");
+        return nullptr;
+    }
+    std::vector<DeltaRange> fetch;
+    if (!delta_prepare(jstring_to_string(env, local_path), remote, jstring_to_string(env, out_path), fetch)) {
+        return nullptr;
+    }
+    // offset, length pairs
+    std::vector<jlong> values;
+    for (const auto& r : fetch) {
+        values.push_back((jlong) r.offset);
+        values.push_back((jlong) r.length);
+    }
+    jlongArray out = env->NewLongArray((jsize) values.size());
+    env->SetLongArrayRegion(out, 0, (jsize) values.size(), values.data());
+    return out;
+}
+
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_delta_1commit(JNIEnv *env, jobject thiz, jstring local_path,
+                                                              jstring manifest_text, jstring out_path) {
+    TensorManifest remote;
+    if (!remote.parse(jstring_to_string(env, manifest_text))) {
+        return JNI_FALSE;
+    }
+    return delta_commit(jstring_to_string(env, local_path), remote, jstring_to_string(env, out_path)) ? JNI_TRUE : JNI_FALSE;
+}
+
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_store_1model(JNIEnv *env, jobject thiz, jstring path,
+                                                             jboolean split, jstring blobs_dir) {
+    TensorStore store(jstring_to_string(env, blobs_dir));
+    const std::string stored = store.store(jstring_to_string(env, path), split == JNI_TRUE);
+    return stored.empty() ? nullptr : env->NewStringUTF(stored.c_str());
+}
+
+extern "C"
+JNIEXPORT jlong JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_collect_1blobs(JNIEnv *env, jobject thiz, jstring blobs_dir) {
+    TensorStore store(jstring_to_string(env, blobs_dir));
+    return (jlong) store.collect();
+}
+
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_open_1caption_1index(JNIEnv *env, jobject thiz, jstring dir) {
+    return CaptionIndex::getInstance().open(jstring_to_string(env, dir)) ? JNI_TRUE : JNI_FALSE;
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_set_1caption_1doc(JNIEnv *env, jobject thiz, jlong doc_id) {
+    // Read by the next generate_response
+    ModelManager::getInstance().setCaptionDoc(doc_id);
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_index_1caption(JNIEnv *env, jobject thiz, jlong doc_id, jstring text) {
+    CaptionIndex::getInstance().add((uint64_t) doc_id, jstring_to_string(env, text));
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_remove_1caption(JNIEnv *env, jobject thiz, jlong doc_id) {
+    CaptionIndex::getInstance().remove((uint64_t) doc_id);
+}
+
+extern "C"
+JNIEXPORT jlongArray JNICALL
+Java_ai_baseweight_baseweightsnap_MTMD_1Android_search_1captions(JNIEnv *env, jobject thiz, jstring query, jint limit) {
+    const std::vector<uint64_t> ids =
+        CaptionIndex::getInstance().search(jstring_to_string(env, query), limit > 0 ? (size_t) limit : 0);
+    std::vector<jlong> values(ids.begin(), ids.end());
+    jlongArray out = env->NewLongArray((jsize) values.size());
+    env->SetLongArrayRegion(out, 0, (jsize) values.size(), values.data());
+    return out;
 }
@@ -0,0 +1,277 @@
+#include "prefix_cache.h"
+#include "metrics.h"
+#include "async_log.h"
+#include <numeric>
+
+#undef TAG
+#define TAG "prefix_cache.cpp"
+#define LOGi(...) BW_LOG(BW_LOG_LEVEL_INFO, TAG, __VA_ARGS__)
+#define LOGe(...) BW_LOG(BW_LOG_LEVEL_ERROR, TAG, __VA_ARGS__)
+
+static int64_t sum_cells(const std::vector<int32_t>& cells, size_t n) {
+    return std::accumulate(cells.begin(), cells.begin() + n, (int64_t) 0);
+}
+
+void PrefixCache::Prompt::add(int64_t key, llama_pos unit_pos, int32_t unit_cells) {
+    n_pos += unit_pos;
+    n_cells += unit_cells;
+    keys.push_back(key);
+    pos.push_back(n_pos);
+    cells.push_back(unit_cells);
+}
+
+PrefixCache::~PrefixCache() {
+    detach();
+}
+
+void PrefixCache::attach(llama_context* lctx) {
+    detach();
+    if (!enabled() || !lctx || llama_n_seq_max(lctx) <= (uint32_t) n_slots) {
+        return;
+    }
+    ctx = lctx;
+    slot_table.assign(n_slots, Slot());
+    for (int i = 0; i < n_slots; i++) {
+        slot_table[i].seq = i + 1;
+    }
+    LOGi("Prefix cache on, %d cached prompts in %u KV cells", n_slots, llama_n_ctx(ctx));
+}
+
+void PrefixCache::detach() {
+    // The context goes with the cells, only the tree is left to drop
+    root.children.clear();
+    slot_table.clear();
+    image_keys.clear();
+    n_cached_cells = 0;
+    ctx = nullptr;
+    publish();
+}
+
+void PrefixCache::clear() {
+    for (int i = 0; i < (int) slot_table.size(); i++) {
+        if (slot_table[i].end) {
+            evict(i);
+        }
+    }
+    image_keys.clear();
+}
+
+int64_t PrefixCache::imageKey(const std::string& image_hash, int index) {
+    // Below zero, token ids are never negative. Keys aren't handed out
+    // twice, so dropping the map only costs hits, never a wrong match.
+    const std::string name = image_hash + "#" + std::to_string(index);
+    auto it = image_keys.find(name);
+    if (it == image_keys.end()) {
+        it = image_keys.emplace(name, next_image_key--).first;
+    }
+    return it->second;
+}
+
+PrefixCache::Node* PrefixCache::match(const Prompt& prompt, size_t& n) const {
+    const Node* node = &root;
+    n = 0;
+    while (n < prompt.keys.size()) {
+        auto it = node->children.find(prompt.keys[n]);
+        if (it == node->children.end()) {
+            break;
+        }
+        const Node* child = it->second.get();
+        size_t j = 0;
+        while (j < child->keys.size() && n < prompt.keys.size() && child->keys[j] == prompt.keys[n]) {
+            j++;
+            n++;
+        }
+        // Part way along an edge still counts, every prompt below it has those units
+        node = child;
+        if (j < child->keys.size()) {
+            break;
+        }
+    }
+    return const_cast<Node*>(node);
+}
+
+size_t PrefixCache::restore(const Prompt& prompt, llama_pos* n_past) {
+    if (!ctx || prompt.keys.empty()) {
+        return 0;
+    }
+    size_t n = 0;
+    Node* node = match(prompt, n);
+    // The last unit is decoded again for its logits
+    n = std::min(n, prompt.keys.size() - 1);
+    if (n == 0) {
+        Metrics::getInstance().prefix_cache_misses.inc();
+        return 0;
+    }
+    // Any prompt cached below the node has the same first n units
+    while (node->slot < 0) {
+        node = node->children.begin()->second.get();
+    }
+    Slot& slot = slot_table[node->slot];
+    slot.last_used = ++tick;
+    *n_past = prompt.pos[n - 1];
+    llama_memory_seq_cp(llama_get_memory(ctx), slot.seq, 0, 0, *n_past);
+
+    const int64_t reused = sum_cells(prompt.cells, n);
+    Metrics::getInstance().prefix_cache_hits.inc();
+    Metrics::getInstance().prefix_cache_cells_reused.inc((uint64_t) reused);
+    LOGi("Prefix cache: %lld of %lld cells reused from seq %d", (long long) reused, (long long) prompt.n_cells,
+         slot.seq);
+    return n;
+}
+
+PrefixCache::Node* PrefixCache::split(Node* node, size_t at) {
+    Node* parent = node->parent;
+    std::unique_ptr<Node>& link = parent->children[node->keys[0]];
+    std::unique_ptr<Node> mid(new Node());
+    mid->keys.assign(node->keys.begin(), node->keys.begin() + at);
+    mid->pos.assign(node->pos.begin(), node->pos.begin() + at);
+    mid->cells.assign(node->cells.begin(), node->cells.begin() + at);
+    mid->parent = parent;
+    node->keys.erase(node->keys.begin(), node->keys.begin() + at);
+    node->pos.erase(node->pos.begin(), node->pos.begin() + at);
+    node->cells.erase(node->cells.begin(), node->cells.begin() + at);
+    node->parent = mid.get();
+    mid->children[node->keys[0]] = std::move(link);
+    link = std::move(mid);
+    return link.get();
+}
+
+PrefixCache::Node* PrefixCache::insert(const Prompt& prompt) {
+    Node* node = &root;
+    size_t n = 0;
+    while (n < prompt.keys.size()) {
+        auto it = node->children.find(prompt.keys[n]);
+        if (it == node->children.end()) {
+            std::unique_ptr<Node> leaf(new Node());
+            leaf->keys.assign(prompt.keys.begin() + n, prompt.keys.end());
+            leaf->pos.assign(prompt.pos.begin() + n, prompt.pos.end());
+            leaf->cells.assign(prompt.cells.begin() + n, prompt.cells.end());
+            leaf->parent = node;
+            n_cached_cells += sum_cells(leaf->cells, leaf->cells.size());
+            Node* added = leaf.get();
+            node->children[prompt.keys[n]] = std::move(leaf);
+            return added;
+        }
+        Node* child = it->second.get();
+        size_t j = 0;
+        while (j < child->keys.size() && n < prompt.keys.size() && child->keys[j] == prompt.keys[n]) {
+            j++;
+            n++;
+        }
+        if (j < child->keys.size()) {
+            child = split(child, j);
+        }
+        node = child;
+    }
+    return node;
+}
+
+void PrefixCache::prune(Node* node) {
+    // Nodes no cached prompt goes through are gone, and a node left with
+    // one child and nothing ending in it merges with that child
+    while (node != &root && node->slot < 0 && node->children.empty()) {
+        Node* parent = node->parent;
+        n_cached_cells -= sum_cells(node->cells, node->cells.size());
+        parent->children.erase(node->keys[0]);
+        node = parent;
+    }
+    if (node != &root && node->slot < 0 && node->children.size() == 1) {
+        std::unique_ptr<Node> child = std::move(node->children.begin()->second);
+        node->children.clear();
+        node->keys.insert(node->keys.end(), child->keys.begin(), child->keys.end());
+        node->pos.insert(node->pos.end(), child->pos.begin(), child->pos.end());
+        node->cells.insert(node->cells.end(), child->cells.begin(), child->cells.end());
+        node->children = std::move(child->children);
+        for (auto& kv : node->children) {
+            kv.second->parent = node;
+        }
+        node->slot = child->slot;
+        if (node->slot >= 0) {
+            slot_table[node->slot].end = node;
+        }
+    }
+}
+
+void PrefixCache::evict(int i) {
+    Slot& slot = slot_table[i];
+    llama_memory_seq_rm(llama_get_memory(ctx), slot.seq, -1, -1);
+    Node* end = slot.end;
+    end->slot = -1;
+    slot.end = nullptr;
+    prune(end);
+    if (root.children.empty()) {
+        image_keys.clear();
+    }
+    publish();
+}
+
+void PrefixCache::makeRoom(int64_t n_cells) {
+    if (!ctx) {
+        return;
+    }
+    const int64_t n_ctx = (int64_t) llama_n_ctx(ctx);
+    while (n_cached_cells > 0 && n_cached_cells + n_cells > n_ctx) {
+        int lru = -1;
+        for (int i = 0; i < (int) slot_table.size(); i++) {
+            if (slot_table[i].end && (lru < 0 || slot_table[i].last_used < slot_table[lru].last_used)) {
+                lru = i;
+            }
+        }
+        if (lru < 0) {
+            break;
+        }
+        LOGi("Prefix cache full, dropping the prompt in seq %d", slot_table[lru].seq);
+        evict(lru);
+    }
+}
+
+void PrefixCache::store(const Prompt& prompt) {
+    if (!ctx || prompt.keys.empty()) {
+        return;
+    }
+    Node* end = insert(prompt);
+    if (end->slot >= 0) {
+        // Cached already, the cells it has are as good as ours
+        slot_table[end->slot].last_used = ++tick;
+        return;
+    }
+
+    // A cached prompt ours extends makes room for it, otherwise take a
+    // free slot, otherwise the least recently used one
+    int pick = -1;
+    for (Node* n = end->parent; n && pick < 0; n = n->parent) {
+        pick = n->slot;
+    }
+    for (int i = 0; i < (int) slot_table.size() && pick < 0; i++) {
+        if (!slot_table[i].end) {
+            pick = i;
+        }
+    }
+    if (pick < 0) {
+        pick = 0;
+        for (int i = 1; i < (int) slot_table.size(); i++) {
+            if (slot_table[i].last_used < slot_table[pick].last_used) {
+                pick = i;
+            }
+        }
+    }
+    Slot& slot = slot_table[pick];
+    if (slot.end) {
+        Node* old_end = slot.end;
+        llama_memory_seq_rm(llama_get_memory(ctx), slot.seq, -1, -1);
+        old_end->slot = -1;
+        slot.end = nullptr;
+        prune(old_end);
+        // Pruning may have merged the node we ended at into its parent
+        end = insert(prompt);
+    }
+    llama_memory_seq_cp(llama_get_memory(ctx), 0, slot.seq, 0, prompt.pos.back());
+    end->slot = pick;
+    slot.end = end;
+    slot.last_used = ++tick;
+    publish();
+}
+
+void PrefixCache::publish() const {
+    Metrics::getInstance().prefix_cache_cells.set(n_cached_cells);
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "llama.h"
+
+/*
+ * Keeps the KV cells of recent prompts, so a request that starts the same
+ * way as an earlier one (chat template header, preset question, the same
+ * image) only prefills what's new.
+ *
+ * Cached prompts live in spare sequences of the language context: a
+ * request runs in seq 0, and after prefill its cells are copied into a
+ * cache sequence with llama_memory_seq_cp. The KV cache is unified, so the
+ * copy only tags the cells with one more sequence, nothing is duplicated.
+ *
+ * A radix tree over the prompts' units (text tokens, and image chunks keyed
+ * by their pixels) finds the longest cached prefix of a new prompt. Its
+ * cells are copied into seq 0 before prefill, and prefill starts after
+ * them. When the cells the cache holds and the request needs no longer fit
+ * the context, the least recently used prompts are dropped.
+ */
+class PrefixCache {
+public:
+    // The units of one prompt, in order
+    struct Prompt {
+        std::vector<int64_t> keys;    // token id, or an imageKey
+        std::vector<llama_pos> pos;   // position after the unit
+        std::vector<int32_t> cells;   // KV cells the unit takes
+        llama_pos n_pos = 0;
+        int64_t n_cells = 0;
+
+        void add(int64_t key, llama_pos unit_pos, int32_t unit_cells);
+    };
+
+    ~PrefixCache();
+
+    // Cache sequences, 0 turns it off. Read when the context is created.
+    void setSlots(int n) { n_slots = n > 0 ? n : 0; }
+    int slots() const { return n_slots; }
+    bool enabled() const { return n_slots > 0; }
+
+    // Called with the context created with n_seq_max > slots(), and before it's freed
+    void attach(llama_context* lctx);
+    void detach();
+    bool active() const { return ctx != nullptr; }
+
+    // Key of chunk index of the image whose pixels hash to image_hash
+    int64_t imageKey(const std::string& image_hash, int index);
+
+    // Copies the longest cached prefix of prompt, short of its last unit,
+    // into seq 0. Returns how many units it covers, n_past is set to the
+    // position after them.
+    size_t restore(const Prompt& prompt, llama_pos* n_past);
+
+    // Drops least recently used prompts until n_cells more fit next to
+    // the ones still cached
+    void makeRoom(int64_t n_cells);
+
+    // Keeps the cells of prompt, which seq 0 holds after prefill
+    void store(const Prompt& prompt);
+
+    void clear();
+    int64_t cachedCells() const { return n_cached_cells; }
+
+private:
+    struct Node {
+        std::vector<int64_t> keys;    // edge from the parent
+        std::vector<llama_pos> pos;
+        std::vector<int32_t> cells;
+        std::unordered_map<int64_t, std::unique_ptr<Node>> children;  // by their first key
+        Node* parent = nullptr;
+        int slot = -1;                // slot whose prompt ends here
+    };
+    struct Slot {
+        llama_seq_id seq = 0;
+        Node* end = nullptr;          // nullptr = free
+        uint64_t last_used = 0;
+    };
+
+    // Deepest node the prompt's first n units reach, n is how many match
+    Node* match(const Prompt& prompt, size_t& n) const;
+    Node* insert(const Prompt& prompt);
+    Node* split(Node* node, size_t at);
+    void evict(int slot);
+    void prune(Node* node);
+    void publish() const;
+
+    int n_slots = 0;
+    llama_context* ctx = nullptr;
+    Node root;
+    std::vector<Slot> slot_table;
+    uint64_t tick = 0;
+    int64_t n_cached_cells = 0;
+    std::unordered_map<std::string, int64_t> image_keys;
+    int64_t next_image_key = -1;
+};
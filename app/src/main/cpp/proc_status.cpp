@@ -0,0 +1,22 @@
+#include "proc_status.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+int64_t proc_status_bytes(const char* field) {
+    FILE* f = fopen("/proc/self/status", "r");
+    if (!f) {
+        return -1;
+    }
+    char line[256];
+    long long kb = -1;
+    const size_t len = strlen(field);
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, field, len) == 0 && line[len] == ':') {
+            kb = atoll(line + len + 1);
+            break;
+        }
+    }
+    fclose(f);
+    return kb < 0 ? -1 : kb * 1024;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <cstdint>
+
+// A kB field of /proc/self/status ("VmRSS", "VmHWM", ...) in bytes, -1 if it
+// can't be read
+int64_t proc_status_bytes(const char* field);
+
+// VmRSS of this process, -1 if it can't be read
+inline int64_t process_rss_bytes() {
+    return proc_status_bytes("VmRSS");
+}
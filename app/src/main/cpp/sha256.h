@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// FIPS 180-4 SHA-256, for checking model files against their published hashes
+class Sha256 {
+public:
+    Sha256();
+    void update(const void* data, size_t len);
+    // Lowercase hex digest, the hasher can't be updated afterwards
+    std::string hexDigest();
+
+private:
+    void block(const uint8_t* p);
+
+    uint32_t h[8];
+    uint8_t buf[64];
+    size_t buf_len = 0;
+    uint64_t total = 0;
+};
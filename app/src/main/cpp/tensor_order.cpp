@@ -0,0 +1,253 @@
+#include "tensor_order.h"
+#include "gguf_layout.h"
+#include "gguf.h"
+#include "ggml-backend.h"
+#include "async_log.h"
+#include <fcntl.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <unordered_map>
+
+#undef TAG
+#define TAG "tensor_order.cpp"
+#define LOGi(...) BW_LOG(BW_LOG_LEVEL_INFO, TAG, __VA_ARGS__)
+#define LOGe(...) BW_LOG(BW_LOG_LEVEL_ERROR, TAG, __VA_ARGS__)
+
+// Written into rewritten files: "trace" or "canonical"
+static const char* ORDER_KEY = "baseweight.tensor_order";
+
+static const size_t COPY_CHUNK = 8 << 20;
+
+void TensorOrderRecorder::begin() {
+    order.clear();
+    seen.clear();
+    recording = true;
+}
+
+size_t TensorOrderRecorder::finish(const std::string& path) {
+    recording = false;
+    armed = false;
+    if (order.empty()) {
+        LOGe("No weights seen while recording tensor order");
+        return 0;
+    }
+    std::ofstream out(path, std::ios::trunc);
+    for (const auto& name : order) {
+        out << name << "\n";
+    }
+    if (!out) {
+        LOGe("Failed to write tensor order to %s", path.c_str());
+        return 0;
+    }
+    LOGi("Recorded first-use order of %zu tensors to %s", order.size(), path.c_str());
+    return order.size();
+}
+
+bool TensorOrderRecorder::observe(struct ggml_tensor* t, bool ask) {
+    if (!recording || !ask) {
+        return false;
+    }
+    for (int i = 0; i < GGML_MAX_SRC && t->src[i]; i++) {
+        const ggml_tensor* src = t->src[i]->view_src ? t->src[i]->view_src : t->src[i];
+        if (!src->buffer || ggml_backend_buffer_get_usage(src->buffer) != GGML_BACKEND_BUFFER_USAGE_WEIGHTS) {
+            continue;
+        }
+        if (seen.insert(src->name).second) {
+            order.push_back(src->name);
+        }
+    }
+    return false;
+}
+
+std::vector<std::string> load_tensor_order(const std::string& path) {
+    std::vector<std::string> order;
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty()) {
+            order.push_back(line);
+        }
+    }
+    return order;
+}
+
+// Position of a tensor within a transformer block, in the order llama.cpp's
+// graphs use them
+static int block_role_rank(const std::string& role) {
+    static const char* roles[] = {
+        "attn_norm", "attn_qkv", "attn_q", "attn_q_norm", "attn_k", "attn_k_norm", "attn_v",
+        "attn_output", "attn_post_norm", "ffn_norm", "ffn_gate_inp", "ffn_gate", "ffn_up",
+        "ffn_gate_exps", "ffn_up_exps", "ffn_down", "ffn_down_exps", "ffn_post_norm", "layer_output_norm",
+    };
+    const std::string base = role.substr(0, role.find('.'));
+    for (size_t i = 0; i < sizeof(roles) / sizeof(roles[0]); i++) {
+        if (base == roles[i]) {
+            return (int) i;
+        }
+    }
+    return (int) (sizeof(roles) / sizeof(roles[0]));
+}
+
+std::vector<std::string> canonical_tensor_order(const GgufLayout& layout) {
+    struct Key {
+        int group;   // 0 embeddings, 1 blocks, 2 output head, 3 other, 4 projector
+        int block;
+        int rank;
+        size_t index;
+    };
+    std::vector<std::pair<Key, std::string>> keyed;
+    for (size_t i = 0; i < layout.tensors.size(); i++) {
+        const std::string& name = layout.tensors[i].name;
+        Key key = {3, 0, 0, i};
+        int block = -1;
+        int n_chars = 0;
+        if (is_projector_tensor(name)) {
+            key.group = 4;
+        } else if (name.rfind("token_embd", 0) == 0 || name.rfind("rope_", 0) == 0) {
+            key.group = 0;
+        } else if (sscanf(name.c_str(), "blk.%d.%n", &block, &n_chars) == 1 && n_chars > 0) {
+            key = {1, block, block_role_rank(name.substr(n_chars)), i};
+        } else if (name.rfind("output", 0) == 0) {
+            key.group = 2;
+            key.rank = name.rfind("output_norm", 0) == 0 ? 0 : 1;
+        }
+        keyed.push_back({key, name});
+    }
+    std::stable_sort(keyed.begin(), keyed.end(), [](const auto& a, const auto& b) {
+        const Key& x = a.first;
+        const Key& y = b.first;
+        if (x.group != y.group) return x.group < y.group;
+        if (x.block != y.block) return x.block < y.block;
+        if (x.rank != y.rank) return x.rank < y.rank;
+        return x.index < y.index;
+    });
+    std::vector<std::string> order;
+    for (auto& k : keyed) {
+        order.push_back(std::move(k.second));
+    }
+    return order;
+}
+
+bool reorder_gguf(const std::string& path, const std::vector<std::string>& order, const char* source) {
+    const int64_t t_start_us = ggml_time_us();
+
+    ggml_context* meta = nullptr;
+    gguf_init_params params = {/*no_alloc =*/ true, /*ctx =*/ &meta};
+    gguf_context* src = gguf_init_from_file(path.c_str(), params);
+    if (!src) {
+        LOGe("Failed to read GGUF header of %s", path.c_str());
+        return false;
+    }
+
+    auto fail = [&](const char* why) {
+        LOGe("Not reordering %s: %s", path.c_str(), why);
+        gguf_free(src);
+        ggml_free(meta);
+        return false;
+    };
+
+    const int64_t marker = gguf_find_key(src, ORDER_KEY);
+    if (marker >= 0 && (strcmp(gguf_get_val_str(src, marker), "trace") == 0 || strcmp(source, "canonical") == 0)) {
+        return fail("already reordered");
+    }
+    // gguf's writer pads with its own default alignment whatever the key
+    // says, so a file with a custom one would come out unreadable
+    if (gguf_get_alignment(src) != GGUF_DEFAULT_ALIGNMENT) {
+        return fail("custom general.alignment");
+    }
+
+    const int64_t n_tensors = gguf_get_n_tensors(src);
+    std::unordered_map<std::string, int64_t> index;
+    for (int64_t i = 0; i < n_tensors; i++) {
+        index[gguf_get_tensor_name(src, i)] = i;
+    }
+    std::vector<int64_t> new_order;
+    std::vector<bool> placed(n_tensors, false);
+    for (const auto& name : order) {
+        auto it = index.find(name);
+        if (it != index.end() && !placed[it->second]) {
+            new_order.push_back(it->second);
+            placed[it->second] = true;
+        }
+    }
+    const size_t n_ordered = new_order.size();
+    for (int64_t i = 0; i < n_tensors; i++) {
+        if (!placed[i]) {
+            new_order.push_back(i);
+        }
+    }
+
+    // Nothing to gain if the data is already in this order
+    bool in_order = true;
+    for (int64_t i = 1; i < n_tensors && in_order; i++) {
+        in_order = gguf_get_tensor_offset(src, new_order[i]) > gguf_get_tensor_offset(src, new_order[i - 1]);
+    }
+    if (in_order) {
+        return fail("tensor data is already in first-use order");
+    }
+
+    gguf_context* dst = gguf_init_empty();
+    gguf_set_kv(dst, src);
+    gguf_set_val_str(dst, ORDER_KEY, source);
+    std::vector<std::string> names;
+    for (int64_t i : new_order) {
+        names.push_back(gguf_get_tensor_name(src, i));
+        gguf_add_tensor(dst, ggml_get_tensor(meta, names.back().c_str()));
+    }
+
+    std::vector<char> header(gguf_get_meta_size(dst));
+    gguf_get_meta_data(dst, header.data());
+    const uint64_t src_data = gguf_get_data_offset(src);
+    const uint64_t dst_data = header.size();
+    const uint64_t last = (uint64_t) (n_tensors - 1);
+    const uint64_t dst_size = n_tensors > 0
+        ? dst_data + gguf_get_tensor_offset(dst, last) + gguf_get_tensor_size(dst, last) : dst_data;
+
+    struct statvfs vfs;
+    const std::string tmp = path + ".reorder";
+    if (statvfs(path.c_str(), &vfs) == 0 && (uint64_t) vfs.f_bavail * vfs.f_frsize < dst_size + (64 << 20)) {
+        gguf_free(dst);
+        return fail("not enough free space for the rewritten copy");
+    }
+
+    int in = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    int out = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool ok = in >= 0 && out >= 0;
+    if (ok) {
+        posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+        ok = ftruncate(out, (off_t) dst_size) == 0 && pwrite(out, header.data(), header.size(), 0) == (ssize_t) header.size();
+    }
+    std::vector<char> buf(COPY_CHUNK);
+    for (int64_t i = 0; ok && i < n_tensors; i++) {
+        const int64_t s = new_order[i];
+        ok = copy_file_bytes(in, out, src_data + gguf_get_tensor_offset(src, s), dst_data + gguf_get_tensor_offset(dst, i),
+                        gguf_get_tensor_size(src, s), buf);
+    }
+    ok = ok && fsync(out) == 0;
+    if (in >= 0) close(in);
+    if (out >= 0) close(out);
+    gguf_free(dst);
+    gguf_free(src);
+    ggml_free(meta);
+
+    // Read the copy back before trusting it with the only model file we have
+    GgufLayout check;
+    ok = ok && read_gguf_layout(tmp.c_str(), check) && check.tensors.size() == (size_t) n_tensors &&
+         check.file_size == dst_size;
+    for (size_t i = 0; ok && i < check.tensors.size(); i++) {
+        ok = check.tensors[i].name == names[i] && (i == 0 || check.tensors[i].begin >= check.tensors[i - 1].end);
+    }
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        LOGe("Rewriting %s failed, keeping the original", path.c_str());
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    LOGi("Reordered %s (%s order, %zu of %lld tensors placed) in %.1f s",
+         path.c_str(), source, n_ordered, (long long) n_tensors, (ggml_time_us() - t_start_us) / 1e6);
+    return true;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+struct ggml_tensor;
+struct GgufLayout;
+
+/*
+ * Cold start reads the weights in the order the decode graph first touches
+ * them, but a downloaded GGUF stores them in whatever order the converter
+ * wrote them. On UFS/eMMC every jump between the two defeats readahead.
+ *
+ * TensorOrderRecorder watches one decode through the eval callback and notes
+ * the order weights are used in, saved next to the model as <model>.order.
+ * reorder_gguf() then rewrites the file once with the tensor data in that
+ * order (or a canonical layer by layer order when there's no trace yet),
+ * so loading and the first decode read it front to back.
+ */
+class TensorOrderRecorder {
+public:
+    // Has to be set before the context is created, like KV compression
+    void setArmed(bool on) { armed = on; }
+    bool isArmed() const { return armed; }
+
+    void begin();
+    // Stops recording and writes the trace to path, returns the tensor count
+    size_t finish(const std::string& path);
+    bool isRecording() const { return recording; }
+
+    // ggml_backend_sched_eval_callback, routed here by ModelManager. Only
+    // looks at the ask phase, never asks for data.
+    bool observe(struct ggml_tensor* t, bool ask);
+
+private:
+    bool armed = false;
+    bool recording = false;
+    std::vector<std::string> order;
+    std::unordered_set<std::string> seen;
+};
+
+// One name per line, empty if the file doesn't exist
+std::vector<std::string> load_tensor_order(const std::string& path);
+
+// Embeddings, then each block in graph order, then the output head, then
+// projector tensors; anything unrecognized keeps its table position within
+// its block
+std::vector<std::string> canonical_tensor_order(const GgufLayout& layout);
+
+// Rewrites the GGUF at path with tensor data in the given order (tensors not
+// listed follow in their original order). Writes a copy next to it and
+// renames it over the original, so a failure leaves the original alone.
+// Returns false if nothing was rewritten.
+bool reorder_gguf(const std::string& path, const std::vector<std::string>& order, const char* source);
@@ -0,0 +1,283 @@
+#include "tensor_store.h"
+#include "gguf_layout.h"
+#include "sha256.h"
+#include "gguf.h"
+#include "async_log.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#undef TAG
+#define TAG "tensor_store.cpp"
+#define LOGi(...) BW_LOG(BW_LOG_LEVEL_INFO, TAG, __VA_ARGS__)
+#define LOGe(...) BW_LOG(BW_LOG_LEVEL_ERROR, TAG, __VA_ARGS__)
+
+static const char* PARTS_SUFFIX = ".parts";
+// Non-block tensors bigger than this (embeddings, output head) get a split
+// of their own, fine-tunes often leave them alone
+static const uint64_t OWN_SPLIT_BYTES = 1 << 20;
+static const size_t COPY_CHUNK = 8 << 20;
+
+static std::string hash_file(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return "";
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    Sha256 hash;
+    std::vector<char> buf(COPY_CHUNK);
+    ssize_t n;
+    while ((n = read(fd, buf.data(), buf.size())) > 0) {
+        hash.update(buf.data(), (size_t) n);
+    }
+    close(fd);
+    return n == 0 ? hash.hexDigest() : "";
+}
+
+static bool same_inode(const std::string& a, const std::string& b) {
+    struct stat sa;
+    struct stat sb;
+    return stat(a.c_str(), &sa) == 0 && stat(b.c_str(), &sb) == 0 && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+static void remove_dir(const std::string& dir) {
+    if (DIR* d = opendir(dir.c_str())) {
+        while (dirent* e = readdir(d)) {
+            if (e->d_name[0] != '.') {
+                unlink((dir + "/" + e->d_name).c_str());
+            }
+        }
+        closedir(d);
+    }
+    rmdir(dir.c_str());
+}
+
+std::vector<std::string> stored_model_splits(const std::string& path) {
+    std::vector<std::string> splits;
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+        return splits;
+    }
+    if (DIR* d = opendir(path.c_str())) {
+        while (dirent* e = readdir(d)) {
+            const size_t len = strlen(e->d_name);
+            if (len > 5 && strcmp(e->d_name + len - 5, ".gguf") == 0) {
+                splits.push_back(path + "/" + e->d_name);
+            }
+        }
+        closedir(d);
+    }
+    // Zero padded, split 0 with the metadata first
+    std::sort(splits.begin(), splits.end());
+    return splits;
+}
+
+std::string TensorStore::adopt(const std::string& tmp, bool& existed) {
+    const std::string sha = hash_file(tmp);
+    if (sha.empty()) {
+        unlink(tmp.c_str());
+        return "";
+    }
+    const std::string blob = root + "/" + sha + ".gguf";
+    existed = access(blob.c_str(), F_OK) == 0;
+    if (existed) {
+        unlink(tmp.c_str());
+    } else if (rename(tmp.c_str(), blob.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return "";
+    }
+    return blob;
+}
+
+bool TensorStore::storeWhole(const std::string& path) {
+    const std::string sha = hash_file(path);
+    if (sha.empty()) {
+        LOGe("Can't read %s to store it", path.c_str());
+        return false;
+    }
+    const std::string blob = root + "/" + sha + ".gguf";
+    if (access(blob.c_str(), F_OK) != 0) {
+        // First copy of these bytes, the model file itself becomes the blob
+        return link(path.c_str(), blob.c_str()) == 0;
+    }
+    if (same_inode(path, blob)) {
+        return true;
+    }
+    // Same bytes as a blob we have, swap our copy for a link to it
+    const std::string tmp = path + ".link";
+    unlink(tmp.c_str());
+    if (link(blob.c_str(), tmp.c_str()) != 0 || rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    LOGi("%s is identical to a stored model, sharing it", path.c_str());
+    return true;
+}
+
+// Which split a tensor goes in: 0 for metadata and small tensors, then one
+// per large non-block tensor and one per block
+static std::vector<std::vector<int64_t>> split_groups(gguf_context* ctx) {
+    std::vector<std::vector<int64_t>> groups(1);
+    std::vector<std::pair<int, int64_t>> blocks;
+    const int64_t n_tensors = gguf_get_n_tensors(ctx);
+    for (int64_t i = 0; i < n_tensors; i++) {
+        const char* name = gguf_get_tensor_name(ctx, i);
+        int block = -1;
+        if (sscanf(name, "blk.%d.", &block) == 1) {
+            blocks.push_back({block, i});
+        } else if (gguf_get_tensor_size(ctx, i) > OWN_SPLIT_BYTES) {
+            groups.push_back({i});
+        } else {
+            groups[0].push_back(i);
+        }
+    }
+    std::stable_sort(blocks.begin(), blocks.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+    for (size_t i = 0; i < blocks.size(); i++) {
+        if (i == 0 || blocks[i].first != blocks[i - 1].first) {
+            groups.emplace_back();
+        }
+        groups.back().push_back(blocks[i].second);
+    }
+    return groups;
+}
+
+std::string TensorStore::storeSplit(const std::string& path) {
+    ggml_context* meta = nullptr;
+    gguf_init_params params = {/*no_alloc =*/ true, /*ctx =*/ &meta};
+    gguf_context* src = gguf_init_from_file(path.c_str(), params);
+    if (!src) {
+        LOGe("Failed to read GGUF header of %s", path.c_str());
+        return "";
+    }
+    // Already split models, and custom alignments gguf's writer can't reproduce
+    if (gguf_find_key(src, "split.count") >= 0 || gguf_get_alignment(src) != GGUF_DEFAULT_ALIGNMENT) {
+        gguf_free(src);
+        ggml_free(meta);
+        return storeWhole(path) ? path : "";
+    }
+
+    const std::vector<std::vector<int64_t>> groups = split_groups(src);
+    const int64_t n_tensors = gguf_get_n_tensors(src);
+    const uint64_t src_data = gguf_get_data_offset(src);
+    const std::string parts = path + PARTS_SUFFIX;
+    const std::string parts_tmp = parts + ".tmp";
+    remove_dir(parts_tmp);
+    bool ok = mkdir(parts_tmp.c_str(), 0755) == 0;
+
+    int in = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    ok = ok && in >= 0;
+    std::vector<char> buf(COPY_CHUNK);
+    uint64_t shared = 0;
+    for (size_t s = 0; ok && s < groups.size(); s++) {
+        gguf_context* dst = gguf_init_empty();
+        if (s == 0) {
+            gguf_set_kv(dst, src);
+        }
+        // The keys llama's split loader checks, as gguf-split writes them
+        gguf_set_val_u16(dst, "split.no", (uint16_t) s);
+        gguf_set_val_u16(dst, "split.count", (uint16_t) groups.size());
+        gguf_set_val_i32(dst, "split.tensors.count", (int32_t) n_tensors);
+        for (int64_t i : groups[s]) {
+            gguf_add_tensor(dst, ggml_get_tensor(meta, gguf_get_tensor_name(src, i)));
+        }
+
+        std::vector<char> header(gguf_get_meta_size(dst));
+        gguf_get_meta_data(dst, header.data());
+        const uint64_t last = groups[s].empty() ? 0 : groups[s].size() - 1;
+        const uint64_t size = header.size() +
+            (groups[s].empty() ? 0 : gguf_get_tensor_offset(dst, last) + gguf_get_tensor_size(dst, last));
+
+        char name[32];
+        snprintf(name, sizeof(name), "/tmp-%d-%05zu.gguf", (int) getpid(), s);
+        const std::string tmp = root + name;
+        int out = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        ok = out >= 0 && ftruncate(out, (off_t) size) == 0 &&
+             pwrite(out, header.data(), header.size(), 0) == (ssize_t) header.size();
+        for (size_t j = 0; ok && j < groups[s].size(); j++) {
+            const int64_t i = groups[s][j];
+            ok = copy_file_bytes(in, out, src_data + gguf_get_tensor_offset(src, i),
+                                 header.size() + gguf_get_tensor_offset(dst, j), gguf_get_tensor_size(src, i), buf);
+        }
+        ok = ok && fsync(out) == 0;
+        if (out >= 0) close(out);
+        gguf_free(dst);
+
+        bool existed = false;
+        const std::string blob = ok ? adopt(tmp, existed) : "";
+        if (!ok || blob.empty()) {
+            unlink(tmp.c_str());
+            ok = false;
+            break;
+        }
+        if (existed) {
+            shared += size;
+        }
+        snprintf(name, sizeof(name), "/%05zu.gguf", s);
+        ok = link(blob.c_str(), (parts_tmp + name).c_str()) == 0;
+    }
+    if (in >= 0) close(in);
+    gguf_free(src);
+    ggml_free(meta);
+
+    if (!ok || rename(parts_tmp.c_str(), parts.c_str()) != 0) {
+        LOGe("Failed to store %s as splits, keeping the file", path.c_str());
+        remove_dir(parts_tmp);
+        collect();
+        return "";
+    }
+    unlink(path.c_str());
+    LOGi("Stored %s as %zu splits, %.1f MB shared with other models", path.c_str(), groups.size(), shared / 1e6);
+    return parts;
+}
+
+std::string TensorStore::store(const std::string& path, bool split) {
+    mkdir(root.c_str(), 0755);
+    if (!stored_model_splits(path).empty()) {
+        return path;
+    }
+    if (split) {
+        GgufLayout layout;
+        if (!read_gguf_layout(path.c_str(), layout)) {
+            return "";
+        }
+        // clip opens unified files by path, they stay whole
+        const bool has_projector = std::any_of(layout.tensors.begin(), layout.tensors.end(),
+                                               [](const GgufTensorSpan& t) { return is_projector_tensor(t.name); });
+        if (!has_projector) {
+            return storeSplit(path);
+        }
+    }
+    return storeWhole(path) ? path : "";
+}
+
+uint64_t TensorStore::collect() {
+    uint64_t freed = 0;
+    DIR* d = opendir(root.c_str());
+    if (!d) {
+        return 0;
+    }
+    while (dirent* e = readdir(d)) {
+        if (e->d_name[0] == '.') {
+            continue;
+        }
+        const std::string blob = root + "/" + e->d_name;
+        struct stat st;
+        // A blob only the store links to belongs to no model, and leftover
+        // temporaries of an interrupted split (from an earlier run) to nothing
+        int pid = 0;
+        const bool orphan = sscanf(e->d_name, "tmp-%d-", &pid) == 1 ? pid != (int) getpid()
+                          : stat(blob.c_str(), &st) == 0 && st.st_nlink == 1;
+        if (orphan && stat(blob.c_str(), &st) == 0 && unlink(blob.c_str()) == 0) {
+            freed += (uint64_t) st.st_size;
+        }
+    }
+    closedir(d);
+    if (freed > 0) {
+        LOGi("Freed %.1f MB of unused blobs", freed / 1e6);
+    }
+    return freed;
+}
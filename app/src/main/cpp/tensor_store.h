@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * Content addressed model storage. Blobs live in one directory, named by
+ * the SHA-256 of their bytes, and models are hard links to them, so two
+ * models with an identical piece share its disk space and, being the same
+ * inode, its page cache.
+ *
+ * Files clip opens (a separate mmproj, unified models) are stored whole.
+ * A separate language model can be split into llama's split GGUF format,
+ * one split per block and per large tensor, in a <model>.parts directory
+ * that llama_model_load_from_splits maps piece by piece. Fine-tunes of the
+ * same base then share every block they didn't change.
+ */
+class TensorStore {
+public:
+    explicit TensorStore(std::string blobs_dir) : root(std::move(blobs_dir)) {}
+
+    // Moves the model at path into the store. Returns the path to load it
+    // from afterwards, empty on failure (the model is left as it was).
+    std::string store(const std::string& path, bool split);
+
+    // Deletes blobs no model links to anymore, returns the bytes freed
+    uint64_t collect();
+
+private:
+    bool storeWhole(const std::string& path);
+    std::string storeSplit(const std::string& path);
+    // Renames tmp to its blob unless that blob exists already, returns the blob
+    std::string adopt(const std::string& tmp, bool& existed);
+
+    std::string root;
+};
+
+// The split files of a <model>.parts directory in load order, empty if
+// path isn't one
+std::vector<std::string> stored_model_splits(const std::string& path);
@@ -0,0 +1,261 @@
+#include "thermal_governor.h"
+#include "ggml.h"
+#include "async_log.h"
+#include <dirent.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <thread>
+
+#undef TAG
+#define TAG "thermal_governor.cpp"
+#define LOGi(...) BW_LOG(BW_LOG_LEVEL_INFO, TAG, __VA_ARGS__)
+#define LOGe(...) BW_LOG(BW_LOG_LEVEL_ERROR, TAG, __VA_ARGS__)
+
+static const char* THERMAL_DIR = "/sys/class/thermal";
+
+// Degrees C where we start backing off, with a few degrees of hysteresis
+static const float WARM_C = 55.0f;
+static const float HOT_C = 65.0f;
+static const float HYSTERESIS_C = 3.0f;
+
+// Decode tok/s relative to the best seen at the same thread count, for
+// devices without readable zones
+static const float WARM_TPS_RATIO = 0.85f;
+static const float HOT_TPS_RATIO = 0.65f;
+
+static const float TPS_EMA_ALPHA = 0.3f;
+
+// Per measured request, so a peak from a cool start fades out over a few
+// dozen requests instead of holding the device HOT for the whole session
+static const float TPS_PEAK_DECAY = 0.98f;
+
+// Requests held at a tok/s level on fewer threads before one goes back to
+// the count it ran at when cool, to see whether the device has recovered
+static const int TPS_PROBE_EVERY = 8;
+
+// Tile size used for the cap, SmolVLM/Idefics3 split images into 512px tiles
+static const int TILE_SIZE = 512;
+
+static const char* level_name(ThermalGovernor::Level level) {
+    switch (level) {
+        case ThermalGovernor::Level::NORMAL: return "normal";
+        case ThermalGovernor::Level::WARM:   return "warm";
+        case ThermalGovernor::Level::HOT:    return "hot";
+    }
+    return "unknown";
+}
+
+void ThermalGovernor::setMaxThreads(int n_threads) {
+    max_threads = std::max(1, n_threads);
+    tps_by_threads.assign(max_threads + 1, 0.0f);
+    peak_by_threads.assign(max_threads + 1, 0.0f);
+    measured_threads = 0;
+    cool_threads = 0;
+    reduced_requests = 0;
+    last.n_threads = max_threads;
+}
+
+void ThermalGovernor::discoverZones() {
+    zones_discovered = true;
+    DIR* dir = opendir(THERMAL_DIR);
+    if (!dir) {
+        LOGe("Cannot open %s, governing on tok/s only", THERMAL_DIR);
+        return;
+    }
+
+    // CPU/SoC sensors are what throttles us, battery/skin/charger zones
+    // lag behind and would only make us react late
+    static const char* preferred[] = { "cpu", "soc", "tsens", "cluster", "x86_pkg", "apc" };
+    std::vector<Zone> all;
+    while (dirent* ent = readdir(dir)) {
+        if (strncmp(ent->d_name, "thermal_zone", 12) != 0) {
+            continue;
+        }
+        std::string base = std::string(THERMAL_DIR) + "/" + ent->d_name;
+        Zone zone;
+        zone.temp_path = base + "/temp";
+        if (FILE* f = fopen((base + "/type").c_str(), "r")) {
+            char type[64] = {0};
+            if (fgets(type, sizeof(type), f)) {
+                type[strcspn(type, "\n")] = 0;
+                zone.type = type;
+            }
+            fclose(f);
+        }
+        all.push_back(zone);
+    }
+    closedir(dir);
+
+    for (const auto& zone : all) {
+        for (const char* p : preferred) {
+            if (zone.type.find(p) != std::string::npos) {
+                zones.push_back(zone);
+                break;
+            }
+        }
+    }
+    if (zones.empty()) {
+        zones = all;
+    }
+    LOGi("Governor watching %zu of %zu thermal zones", zones.size(), all.size());
+}
+
+float ThermalGovernor::readTemperature() {
+    if (!zones_discovered) {
+        discoverZones();
+    }
+
+    float hottest = NAN;
+    for (const auto& zone : zones) {
+        FILE* f = fopen(zone.temp_path.c_str(), "r");
+        if (!f) {
+            continue;
+        }
+        long value = 0;
+        if (fscanf(f, "%ld", &value) == 1) {
+            // Most zones report millidegrees, a few report degrees
+            float temp_c = value > 1000 ? value / 1000.0f : (float) value;
+            if (temp_c > 0.0f && temp_c < 150.0f && !(temp_c <= hottest)) {
+                hottest = temp_c;
+            }
+        }
+        fclose(f);
+    }
+    return hottest;
+}
+
+ThermalGovernor::Level ThermalGovernor::classify(float temp_c, float tps_ratio, bool hold_tps) const {
+    // Only step down a level once we're clearly below its threshold
+    const float hot = last.level == Level::HOT ? HOT_C - HYSTERESIS_C : HOT_C;
+    const float warm = last.level != Level::NORMAL ? WARM_C - HYSTERESIS_C : WARM_C;
+
+    Level by_temp = Level::NORMAL;
+    if (!std::isnan(temp_c)) {
+        by_temp = temp_c >= hot ? Level::HOT : temp_c >= warm ? Level::WARM : Level::NORMAL;
+    }
+
+    Level by_tps = Level::NORMAL;
+    if (tps_ratio > 0.0f) {
+        by_tps = tps_ratio < HOT_TPS_RATIO ? Level::HOT : tps_ratio < WARM_TPS_RATIO ? Level::WARM : Level::NORMAL;
+    }
+    if (hold_tps) {
+        by_tps = std::max(by_tps, last.level);
+    }
+    return std::max(by_temp, by_tps);
+}
+
+ThermalGovernor::Decision ThermalGovernor::beforeRequest() {
+    if (max_threads == 0) {
+        setMaxThreads(4);
+    }
+
+    const float temp_c = readTemperature();
+    // Fewer threads decode slower anyway, so the rate is only compared with
+    // what the same count did before, and stepping down doesn't read as
+    // throttling
+    const int n_measured = measured_threads;
+    const float tps_recent = n_measured > 0 ? tps_by_threads[n_measured] : 0.0f;
+    const float tps_peak = n_measured > 0 ? peak_by_threads[n_measured] : 0.0f;
+    const float tps_ratio = tps_peak > 0.0f ? tps_recent / tps_peak : 0.0f;
+
+    // A steady rate on fewer threads doesn't show the device has cooled,
+    // only a run at the count it had when cool does. Without a temperature
+    // to go by, hold the level for a while, then let a request go back up.
+    const bool reduced = n_measured > 0 && n_measured < (cool_threads > 0 ? cool_threads : max_threads);
+    reduced_requests = reduced ? reduced_requests + 1 : 0;
+    const bool hold_tps = std::isnan(temp_c) && reduced && reduced_requests < TPS_PROBE_EVERY;
+
+    Decision d;
+    d.level = classify(temp_c, tps_ratio, hold_tps);
+    d.probe = std::isnan(temp_c) && reduced && !hold_tps && d.level < last.level;
+
+    // Fewer threads let the remaining cores hold their clocks when throttled.
+    // Among the counts allowed at this level, try each once, then stick with
+    // whichever has sustained the best decode rate.
+    int hi = max_threads;
+    int lo = max_threads;
+    if (d.level == Level::WARM) {
+        lo = std::max(1, max_threads / 2);
+        hi = std::max(lo, max_threads - 1);
+    } else if (d.level == Level::HOT) {
+        lo = hi = std::max(1, max_threads / 2);
+    }
+    d.n_threads = hi;
+    for (int n = hi; n >= lo; n--) {
+        if (tps_by_threads[n] == 0.0f) {
+            d.n_threads = n;
+            break;
+        }
+        if (tps_by_threads[n] > tps_by_threads[d.n_threads]) {
+            d.n_threads = n;
+        }
+    }
+
+    // Back-to-back requests wait a little so the SoC can shed heat,
+    // an idle gap that's already long enough costs nothing
+    const int pacing_ms = d.level == Level::HOT ? 1500 : d.level == Level::WARM ? 300 : 0;
+    const int64_t idle_ms = last_request_end_us > 0 ? (ggml_time_us() - last_request_end_us) / 1000 : INT64_MAX;
+    d.pacing_ms = idle_ms < pacing_ms ? (int) (pacing_ms - idle_ms) : 0;
+
+    d.max_tiles = d.level == Level::HOT ? 1 : d.level == Level::WARM ? 4 : 0;
+
+    LOGi("governor: %.1f C, %.1f tok/s at %d threads (peak %.1f) -> %s%s, %d threads, pacing %d ms, tile cap %d",
+         temp_c, tps_recent, n_measured, tps_peak, level_name(d.level), d.probe ? " (probe)" : "", d.n_threads,
+         d.pacing_ms, d.max_tiles);
+
+    if (d.pacing_ms > 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(d.pacing_ms));
+    }
+
+    last = d;
+    max_tiles = d.max_tiles;
+    return d;
+}
+
+void ThermalGovernor::afterRequest(int32_t n_decode, int64_t decode_us, int n_threads) {
+    last_request_end_us = ggml_time_us();
+    if (n_threads > 0 && n_threads <= max_threads) {
+        last.n_threads = n_threads;
+    }
+
+    // Short answers are dominated by per-request overhead, not throttling
+    if (n_decode < 8 || decode_us <= 0 || last.n_threads <= 0) {
+        return;
+    }
+
+    const float tps = 1e6f * n_decode / decode_us;
+    const int n = last.n_threads;
+    float& ema = tps_by_threads[n];
+    // A rate from before we last switched counts is stale, start over
+    ema = ema == 0.0f || n != measured_threads ? tps : ema + TPS_EMA_ALPHA * (tps - ema);
+    measured_threads = n;
+    if (last.level == Level::NORMAL) {
+        cool_threads = n;
+    }
+    float& peak = peak_by_threads[n];
+    peak = std::max(peak * TPS_PEAK_DECAY, ema);
+}
+
+float tile_cap_scale(int width, int height, int max_tiles, int tile_size) {
+    if (max_tiles <= 0 || width <= 0 || height <= 0) {
+        return 1.0f;
+    }
+    if (tile_size <= 0) {
+        tile_size = TILE_SIZE;
+    }
+
+    auto n_tiles = [&](float scale) {
+        int nx = (int) std::ceil(width * scale / tile_size);
+        int ny = (int) std::ceil(height * scale / tile_size);
+        return nx * ny;
+    };
+
+    float scale = 1.0f;
+    while (n_tiles(scale) > max_tiles && scale > 0.01f) {
+        scale *= 0.9f;
+    }
+    return scale;
+}
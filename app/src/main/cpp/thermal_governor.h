@@ -0,0 +1,92 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+/*
+ * Keeps throughput up over long runs instead of tuning for a cool device.
+ *
+ * Before every request it reads the thermal zones (/sys/class/thermal, same
+ * on Android and Linux) and compares recent decode tok/s against the best
+ * the same thread count has done lately. From that it picks:
+ *   - the thread count, out of the ones allowed at the current thermal level,
+ *     with the best measured tok/s
+ *   - a pause before back-to-back requests, so the SoC gets to shed heat
+ *   - a cap on image tiles, applied when the next image is ingested
+ * Every decision is logged.
+ */
+class ThermalGovernor {
+public:
+    ThermalGovernor(const ThermalGovernor&) = delete;
+    ThermalGovernor& operator=(const ThermalGovernor&) = delete;
+
+    static ThermalGovernor& getInstance() {
+        static ThermalGovernor instance;
+        return instance;
+    }
+
+    enum class Level { NORMAL, WARM, HOT };
+
+    struct Decision {
+        Level level = Level::NORMAL;
+        int n_threads = 0;
+        int pacing_ms = 0;
+        int max_tiles = 0;  // 0 = no cap
+        // Back up to the cool thread count to see whether the device has
+        // recovered, its rate may still be a throttled one
+        bool probe = false;
+    };
+
+    // Thread count the context was tuned for on a cool device
+    void setMaxThreads(int n_threads);
+
+    // Called right before a request starts decoding
+    Decision beforeRequest();
+
+    // Called when a request is done, with its decode phase measurements.
+    // n_threads is what decode actually ran with, if not the decision's.
+    void afterRequest(int32_t n_decode, int64_t decode_us, int n_threads = 0);
+
+    // Tile cap from the last decision, for image ingestion. Bitmaps are
+    // ingested off the inference loop, so it's published on its own.
+    int maxTiles() const { return max_tiles.load(); }
+
+    // Hottest relevant thermal zone in degrees C, NaN if none can be read
+    float readTemperature();
+
+private:
+    ThermalGovernor() = default;
+
+    struct Zone {
+        std::string temp_path;
+        std::string type;
+    };
+    void discoverZones();
+
+    Level classify(float temp_c, float tps_ratio, bool hold_tps) const;
+
+    std::vector<Zone> zones;
+    bool zones_discovered = false;
+
+    int max_threads = 0;
+    // Decode tok/s EMA per thread count, 0 = not measured yet, and the best
+    // each count has sustained, decaying
+    std::vector<float> tps_by_threads;
+    std::vector<float> peak_by_threads;
+    // Thread count of the last measured request, and of the last one that
+    // ran at NORMAL, which the tuner may keep below max_threads
+    int measured_threads = 0;
+    int cool_threads = 0;
+    // Requests in a row decided on a rate measured below cool_threads
+    int reduced_requests = 0;
+
+    Decision last;
+    int64_t last_request_end_us = 0;
+    std::atomic<int> max_tiles{0};
+};
+
+// Scale factor (<= 1) that brings a width x height image down to at most
+// max_tiles tiles of tile_size x tile_size. 1 when max_tiles is 0.
+float tile_cap_scale(int width, int height, int max_tiles, int tile_size);
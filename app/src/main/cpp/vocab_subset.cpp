@@ -0,0 +1,375 @@
+#include "vocab_subset.h"
+#include "async_log.h"
+#include <algorithm>
+#include <iterator>
+#include <unordered_set>
+
+#undef TAG
+#define TAG "vocab_subset.cpp"
+#define LOGi(...) BW_LOG(BW_LOG_LEVEL_INFO, TAG, __VA_ARGS__)
+#define LOGe(...) BW_LOG(BW_LOG_LEVEL_ERROR, TAG, __VA_ARGS__)
+
+struct CodepointRange {
+    uint32_t first;
+    uint32_t last;
+};
+
+struct Script {
+    const char* name;
+    std::vector<CodepointRange> ranges;
+};
+
+static const std::vector<Script>& scripts_table() {
+    static const std::vector<Script> table = {
+        {"latin",      {{0x00C0, 0x024F}, {0x1E00, 0x1EFF}}},
+        {"greek",      {{0x0370, 0x03FF}, {0x1F00, 0x1FFF}}},
+        {"cyrillic",   {{0x0400, 0x052F}}},
+        {"hebrew",     {{0x0590, 0x05FF}}},
+        {"arabic",     {{0x0600, 0x06FF}, {0x0750, 0x077F}}},
+        {"devanagari", {{0x0900, 0x097F}}},
+        {"thai",       {{0x0E00, 0x0E7F}}},
+        {"cjk",        {{0x3000, 0x30FF}, {0x3400, 0x4DBF}, {0x4E00, 0x9FFF}, {0xAC00, 0xD7AF}, {0xFF00, 0xFFEF}}},
+    };
+    return table;
+}
+
+// Shared by every script: ASCII, Latin-1 punctuation and symbols,
+// general punctuation, currency
+static const CodepointRange COMMON_RANGES[] = {
+    {0x0000, 0x007F}, {0x00A0, 0x00BF}, {0x2000, 0x206F}, {0x20A0, 0x20CF},
+};
+
+static bool in_ranges(uint32_t cp, const std::vector<CodepointRange>& ranges) {
+    for (const auto& r : ranges) {
+        if (cp >= r.first && cp <= r.last) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int utf8_len(unsigned char c) {
+    return c < 0x80 ? 1 : (c >> 5) == 0x6 ? 2 : (c >> 4) == 0xE ? 3 : (c >> 3) == 0x1E ? 4 : 0;
+}
+
+static bool is_continuation(unsigned char c) {
+    return (c >> 6) == 0x2;
+}
+
+static int encode_utf8(uint32_t cp, unsigned char* out) {
+    if (cp < 0x80) {
+        out[0] = (unsigned char) cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = 0xC0 | (cp >> 6);
+        out[1] = 0x80 | (cp & 0x3F);
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = 0xE0 | (cp >> 12);
+        out[1] = 0x80 | ((cp >> 6) & 0x3F);
+        out[2] = 0x80 | (cp & 0x3F);
+        return 3;
+    }
+    out[0] = 0xF0 | (cp >> 18);
+    out[1] = 0x80 | ((cp >> 12) & 0x3F);
+    out[2] = 0x80 | ((cp >> 6) & 0x3F);
+    out[3] = 0x80 | (cp & 0x3F);
+    return 4;
+}
+
+// 1-3 bytes and their count in one key
+static uint32_t pack(const unsigned char* p, size_t n) {
+    uint32_t key = 0;
+    for (size_t i = 0; i < n; i++) {
+        key = (key << 8) | p[i];
+    }
+    return key | (uint32_t) n << 24;
+}
+
+// Byte-level BPE and byte fallback tokens often hold part of a character,
+// which the next or previous token completes. These are the parts the
+// allowed characters can be split into.
+struct Utf8Fragments {
+    std::unordered_set<uint32_t> head;   // first bytes of a character
+    std::unordered_set<uint32_t> tail;   // last bytes of one
+    std::unordered_set<uint32_t> inner;  // bytes from its middle
+
+    explicit Utf8Fragments(const std::vector<CodepointRange>& ranges) {
+        unsigned char buf[4];
+        for (const auto& r : ranges) {
+            for (uint32_t cp = std::max<uint32_t>(r.first, 0x80); cp <= r.last; cp++) {
+                const int len = encode_utf8(cp, buf);
+                for (int n = 1; n < len; n++) {
+                    head.insert(pack(buf, n));
+                    tail.insert(pack(buf + len - n, n));
+                    for (int start = 1; start + n < len; start++) {
+                        inner.insert(pack(buf + start, n));
+                    }
+                }
+            }
+        }
+    }
+};
+
+// Whether a token's text could be part of text written in the allowed
+// ranges: whole characters in range, and at either end at most a part of
+// a character that is
+static bool piece_allowed(const std::string& s, const std::vector<CodepointRange>& ranges, const Utf8Fragments& frag) {
+    const unsigned char* p = (const unsigned char*) s.data();
+    const size_t n = s.size();
+
+    // The end of a character an earlier token began
+    size_t i = 0;
+    while (i < n && is_continuation(p[i])) {
+        i++;
+    }
+    if (i > 3) {
+        return false;
+    }
+    if (i > 0) {
+        const uint32_t key = pack(p, i);
+        if (i == n) {
+            return frag.tail.count(key) > 0 || frag.inner.count(key) > 0;
+        }
+        if (frag.tail.count(key) == 0) {
+            return false;
+        }
+    }
+
+    while (i < n) {
+        const int len = utf8_len(p[i]);
+        if (len == 0) {
+            return false;
+        }
+        for (size_t k = i + 1; k < i + len && k < n; k++) {
+            if (!is_continuation(p[k])) {
+                return false;
+            }
+        }
+        // The start of a character a later token finishes
+        if (i + len > n) {
+            return frag.head.count(pack(p + i, n - i)) > 0;
+        }
+        uint32_t cp = len == 1 ? p[i] : p[i] & (0xFF >> (len + 1));
+        for (int k = 1; k < len; k++) {
+            cp = (cp << 6) | (p[i + k] & 0x3F);
+        }
+        if (!in_ranges(cp, ranges)) {
+            return false;
+        }
+        i += len;
+    }
+    return true;
+}
+
+static std::string token_piece(const llama_vocab* vocab, llama_token id) {
+    char buf[256];
+    int32_t n = llama_token_to_piece(vocab, id, buf, sizeof(buf), 0, true);
+    return n > 0 ? std::string(buf, n) : std::string();
+}
+
+VocabSubset::~VocabSubset() {
+    clear();
+}
+
+void VocabSubset::clear() {
+    ids.clear();
+    cur.clear();
+    if (chain) {
+        llama_sampler_free(chain);
+        chain = nullptr;
+    }
+}
+
+size_t VocabSubset::buildFromScripts(const llama_vocab* vocab, const std::vector<std::string>& names) {
+    clear();
+    if (!vocab) {
+        LOGe("Vocab not loaded");
+        return 0;
+    }
+
+    std::vector<CodepointRange> allowed(std::begin(COMMON_RANGES), std::end(COMMON_RANGES));
+    bool recognized = false;
+    for (const auto& name : names) {
+        bool found = false;
+        for (const auto& script : scripts_table()) {
+            if (name == script.name) {
+                allowed.insert(allowed.end(), script.ranges.begin(), script.ranges.end());
+                found = true;
+            }
+        }
+        if (!found) {
+            LOGe("Unknown script %s, ignored", name.c_str());
+        }
+        recognized = recognized || found;
+    }
+    if (!recognized) {
+        return 0;
+    }
+
+    const Utf8Fragments fragments(allowed);
+    const int32_t n_vocab = llama_vocab_n_tokens(vocab);
+    std::vector<bool> keep(n_vocab, false);
+    for (llama_token id = 0; id < n_vocab; id++) {
+        keep[id] = piece_allowed(token_piece(vocab, id), allowed, fragments);
+    }
+
+    finish(vocab, keep);
+    return ids.size();
+}
+
+size_t VocabSubset::buildFromCorpus(const llama_vocab* vocab, const std::string& corpus) {
+    clear();
+    if (!vocab) {
+        LOGe("Vocab not loaded");
+        return 0;
+    }
+
+    const int32_t n_vocab = llama_vocab_n_tokens(vocab);
+    std::vector<bool> keep(n_vocab, false);
+
+    // Usually no more tokens than bytes, llama_tokenize tells us if it needs more
+    std::vector<llama_token> tokens(corpus.size() + 2);
+    int32_t n = llama_tokenize(vocab, corpus.c_str(), (int32_t) corpus.size(),
+                               tokens.data(), (int32_t) tokens.size(), false, false);
+    if (n < 0) {
+        tokens.resize(-n);
+        n = llama_tokenize(vocab, corpus.c_str(), (int32_t) corpus.size(),
+                           tokens.data(), (int32_t) tokens.size(), false, false);
+    }
+    if (n < 0) {
+        LOGe("Failed to tokenize corpus");
+        return 0;
+    }
+    for (int32_t i = 0; i < n; i++) {
+        keep[tokens[i]] = true;
+    }
+
+    finish(vocab, keep);
+    return ids.size();
+}
+
+void VocabSubset::finish(const llama_vocab* vocab, std::vector<bool>& keep) {
+    const int32_t n_vocab = (int32_t) keep.size();
+    for (llama_token id = 0; id < n_vocab; id++) {
+        // Generation has to be able to stop, whatever the subset
+        if (llama_vocab_is_eog(vocab, id) || llama_vocab_is_control(vocab, id)) {
+            keep[id] = true;
+        }
+        if (keep[id]) {
+            ids.push_back(id);
+        }
+    }
+    cur.resize(ids.size());
+    buildChain(vocab);
+
+    LOGi("Vocabulary restricted to %zu of %d tokens (%.1f%%)",
+         ids.size(), n_vocab, 100.0 * ids.size() / n_vocab);
+}
+
+void VocabSubset::setSampling(const common_params_sampling& sampling, int32_t n_ctx) {
+    params = sampling;
+    n_ctx_train = n_ctx;
+}
+
+// Built the way common_sampler_init builds its chain, from the same params,
+// so the subset samples like the full vocabulary would. The grammar isn't
+// applied, it would have to be compiled against the subset.
+void VocabSubset::buildChain(const llama_vocab* vocab) {
+    const size_t min_keep = (size_t) std::max(params.min_keep, 0);
+    chain = llama_sampler_chain_init(llama_sampler_chain_default_params());
+    if (!params.logit_bias.empty()) {
+        llama_sampler_chain_add(chain, llama_sampler_init_logit_bias(llama_vocab_n_tokens(vocab),
+                                                                     (int32_t) params.logit_bias.size(),
+                                                                     params.logit_bias.data()));
+    }
+    if (!params.grammar.empty()) {
+        LOGe("The grammar isn't applied to the vocabulary subset");
+    }
+    if (params.mirostat == 1) {
+        llama_sampler_chain_add(chain, llama_sampler_init_temp(params.temp));
+        llama_sampler_chain_add(chain, llama_sampler_init_mirostat(llama_vocab_n_tokens(vocab), params.seed,
+                                                                   params.mirostat_tau, params.mirostat_eta, 100));
+        return;
+    }
+    if (params.mirostat == 2) {
+        llama_sampler_chain_add(chain, llama_sampler_init_temp(params.temp));
+        llama_sampler_chain_add(chain, llama_sampler_init_mirostat_v2(params.seed, params.mirostat_tau,
+                                                                      params.mirostat_eta));
+        return;
+    }
+    for (const auto type : params.samplers) {
+        switch (type) {
+            case COMMON_SAMPLER_TYPE_DRY: {
+                std::vector<const char*> breakers;
+                for (const auto& b : params.dry_sequence_breakers) {
+                    breakers.push_back(b.c_str());
+                }
+                llama_sampler_chain_add(chain, llama_sampler_init_dry(vocab, n_ctx_train, params.dry_multiplier,
+                                                                      params.dry_base, params.dry_allowed_length,
+                                                                      params.dry_penalty_last_n, breakers.data(),
+                                                                      breakers.size()));
+                break;
+            }
+            case COMMON_SAMPLER_TYPE_TOP_K:
+                llama_sampler_chain_add(chain, llama_sampler_init_top_k(params.top_k));
+                break;
+            case COMMON_SAMPLER_TYPE_TOP_P:
+                llama_sampler_chain_add(chain, llama_sampler_init_top_p(params.top_p, min_keep));
+                break;
+            case COMMON_SAMPLER_TYPE_TOP_N_SIGMA:
+                llama_sampler_chain_add(chain, llama_sampler_init_top_n_sigma(params.top_n_sigma));
+                break;
+            case COMMON_SAMPLER_TYPE_MIN_P:
+                llama_sampler_chain_add(chain, llama_sampler_init_min_p(params.min_p, min_keep));
+                break;
+            case COMMON_SAMPLER_TYPE_XTC:
+                llama_sampler_chain_add(chain, llama_sampler_init_xtc(params.xtc_probability, params.xtc_threshold,
+                                                                      min_keep, params.seed));
+                break;
+            case COMMON_SAMPLER_TYPE_TYPICAL_P:
+                llama_sampler_chain_add(chain, llama_sampler_init_typical(params.typ_p, min_keep));
+                break;
+            case COMMON_SAMPLER_TYPE_TEMPERATURE:
+                llama_sampler_chain_add(chain, llama_sampler_init_temp_ext(params.temp, params.dynatemp_range,
+                                                                           params.dynatemp_exponent));
+                break;
+            case COMMON_SAMPLER_TYPE_PENALTIES:
+                llama_sampler_chain_add(chain, llama_sampler_init_penalties(params.penalty_last_n, params.penalty_repeat,
+                                                                            params.penalty_freq, params.penalty_present));
+                break;
+            default:
+                LOGe("Sampler type %d isn't applied to the vocabulary subset", (int) type);
+                break;
+        }
+    }
+    llama_sampler_chain_add(chain, llama_sampler_init_dist(params.seed));
+}
+
+void VocabSubset::accept(llama_token token) {
+    if (chain) {
+        llama_sampler_accept(chain, token);
+    }
+}
+
+void VocabSubset::reset() {
+    if (chain) {
+        llama_sampler_reset(chain);
+    }
+}
+
+llama_token VocabSubset::sample(llama_context* lctx, int32_t idx, llama_sampler* smpl) {
+    const float* logits = llama_get_logits_ith(lctx, idx);
+    for (size_t i = 0; i < ids.size(); i++) {
+        cur[i] = {ids[i], logits[ids[i]], 0.0f};
+    }
+    llama_token_data_array cur_p = {cur.data(), cur.size(), -1, false};
+    llama_sampler_apply(smpl ? smpl : chain, &cur_p);
+    if (cur_p.selected < 0 || cur_p.selected >= (int64_t) cur_p.size) {
+        LOGe("Sampler chain selected nothing, falling back to the first candidate");
+        return cur_p.data[0].id;
+    }
+    return cur_p.data[cur_p.selected].id;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "llama.h"
+#include "common.h"
+
+/*
+ * Samples from a subset of the vocabulary instead of all of it.
+ *
+ * SmolVLM has ~49k tokens and Qwen2-VL ~152k, while our answers come out in
+ * a handful of scripts. With a subset active, each step only copies the
+ * subset's logits into the candidate array and runs the sampler chain over
+ * those, instead of building and sorting a full-vocabulary array. The chain
+ * is built from the same common_params_sampling as the regular sampler.
+ *
+ * The model's output layer still computes logits for the whole vocabulary.
+ * A pruned lm_head would mean changing the graph llama.cpp builds, which its
+ * API has no hook for, so only the sampling work shrinks.
+ *
+ * The candidates keep their original token ids, so the rest of generation
+ * (detokenizing, EOG checks, antiprompts) doesn't know a subset is in use.
+ * EOG and control tokens are always part of the subset.
+ */
+class VocabSubset {
+public:
+    ~VocabSubset();
+
+    // Tokens whose text is entirely in the given scripts (latin, greek,
+    // cyrillic, arabic, hebrew, devanagari, thai, cjk), plus digits and
+    // punctuation. Byte tokens holding part of such a character count too.
+    // Returns the subset size, 0 if no script was recognized.
+    size_t buildFromScripts(const llama_vocab* vocab, const std::vector<std::string>& scripts);
+
+    // Tokens that show up when tokenizing the corpus text
+    size_t buildFromCorpus(const llama_vocab* vocab, const std::string& corpus);
+
+    // Sampler settings and context length of the loaded model, for the
+    // chain of the next subset built
+    void setSampling(const common_params_sampling& sampling, int32_t n_ctx);
+
+    void clear();
+    bool active() const { return !ids.empty(); }
+    size_t size() const { return ids.size(); }
+    const std::vector<llama_token>& tokens() const { return ids; }
+
+    // Same contract as common_sampler_sample, over the subset only. smpl,
+    // when given, is applied instead of the subset's own chain.
+    llama_token sample(llama_context* lctx, int32_t idx, llama_sampler* smpl = nullptr);
+    // Same as common_sampler_accept and common_sampler_reset
+    void accept(llama_token token);
+    void reset();
+
+private:
+    void finish(const llama_vocab* vocab, std::vector<bool>& keep);
+    void buildChain(const llama_vocab* vocab);
+
+    std::vector<llama_token> ids;
+    std::vector<llama_token_data> cur;
+    llama_sampler* chain = nullptr;
+    common_params_sampling params;
+    int32_t n_ctx_train = 0;
+};
@@ -0,0 +1,92 @@
+package ai.baseweight.baseweightsnap
+
+import android.content.Context
+import android.os.Build
+
+/**
+ * Persisted choice of ggml backends for this device.
+ *
+ * The first start loads every backend plugin and saves the ones worth keeping,
+ * later starts only load those. The profile is tied to the OS build and the app
+ * version, so an OTA or an update with different plugins re-profiles.
+ */
+class BackendProfile(context: Context) {
+    private val prefs = context.getSharedPreferences(PREFS_NAME, Context.MODE_PRIVATE)
+    private val fingerprint = "${Build.FINGERPRINT}/${appVersion(context)}"
+
+    /**
+     * Backends to load at startup, or null when the device hasn't been profiled yet
+     */
+    val backends: List<String>?
+        get() {
+            if (prefs.getString(KEY_FINGERPRINT, null) != fingerprint) {
+                return null
+            }
+            return prefs.getString(KEY_BACKENDS, null)
+                ?.split(",")
+                ?.filter { it.isNotEmpty() }
+                ?.takeIf { it.isNotEmpty() }
+        }
+
+    fun save(backends: List<String>) {
+        prefs.edit()
+            .putString(KEY_FINGERPRINT, fingerprint)
+            .putString(KEY_BACKENDS, backends.joinToString(","))
+            .apply()
+    }
+
+    companion object {
+        private const val PREFS_NAME = "backend_profile"
+        private const val KEY_FINGERPRINT = "fingerprint"
+        private const val KEY_BACKENDS = "backends"
+
+        // Accelerators in order of preference, only the first one found is kept
+        private val PREFERRED_ACCELERATORS = listOf("hexagon", "opencl", "vulkan")
+
+        /**
+         * Pick the backends to keep from the ones that registered a device:
+         * the CPU backend (always needed for host buffers) plus the best accelerator
+         */
+        fun choose(available: List<String>): List<String> {
+            val names = available.map { it.lowercase() }
+            val accelerator = PREFERRED_ACCELERATORS.firstOrNull { it in names }
+            return listOfNotNull("cpu".takeIf { it in names }, accelerator)
+        }
+
+        /**
+         * Run load, and when the model doesn't initialize with the profiled
+         * backends (IllegalStateException), load the remaining ones and try
+         * once more. The widened set is only saved when that retry succeeds,
+         * so failures more backends can't fix don't change the profile. File
+         * errors come as IOException and are passed through untouched.
+         */
+        fun <T> loadWithFallback(
+            profiled: List<String>?,
+            load: () -> T,
+            loadRemaining: () -> List<String>,
+            save: (List<String>) -> Unit,
+        ): T {
+            try {
+                return load()
+            } catch (e: IllegalStateException) {
+                val widened = loadRemaining()
+                val before = profiled.orEmpty().map { it.lowercase() }.toSet()
+                if (widened.all { it.lowercase() in before }) {
+                    // Nothing new was loaded, the retry would fail the same way
+                    throw e
+                }
+                val result = load()
+                save(widened)
+                return result
+            }
+        }
+
+        private fun appVersion(context: Context): Long {
+            return try {
+                context.packageManager.getPackageInfo(context.packageName, 0).longVersionCode
+            } catch (e: Exception) {
+                0L
+            }
+        }
+    }
+}
@@ -1,21 +1,30 @@
 package ai.baseweight.baseweightsnap
 
+import android.app.ActivityManager
+import android.content.ComponentCallbacks2
+import android.content.res.Configuration
 import android.graphics.Bitmap
 import android.util.Log
 import kotlinx.coroutines.CoroutineDispatcher
+import kotlinx.coroutines.CoroutineScope
+import kotlinx.coroutines.Dispatchers
 import kotlinx.coroutines.asCoroutineDispatcher
 import kotlinx.coroutines.cancel
 import kotlinx.coroutines.channels.awaitClose
 import kotlinx.coroutines.channels.onFailure
 import kotlinx.coroutines.flow.Flow
 import kotlinx.coroutines.flow.callbackFlow
+import kotlinx.coroutines.launch
 import kotlinx.coroutines.withContext
+import java.io.File
 import java.nio.ByteBuffer
 import java.util.concurrent.Executors
 import kotlin.concurrent.thread
 
 class MTMD_Android(private val context: android.content.Context) {
     private val tag: String? = this::class.simpleName
+    private val backendProfile = BackendProfile(context)
+    private var backendFallbackDone = false
 
     private val runLoop: CoroutineDispatcher = Executors.newSingleThreadExecutor {
         thread(start = false, name = "Llm-RunLoop") {
@@ -42,10 +51,37 @@ class MTMD_Android(private val context: android.content.Context) {
 
             // Set llama log handler to Android
             log_to_android()
-            backend_init(context.applicationInfo.nativeLibraryDir)
+            // Only load the backends this device was profiled with, the first
+            // start loads all of them and saves the ones worth keeping
+            val profiledBackends = backendProfile.backends
+            val registered = backend_init(context.applicationInfo.nativeLibraryDir, profiledBackends?.toTypedArray())
+            if (profiledBackends == null) {
+                val chosen = BackendProfile.choose(registered.toList())
+                backendProfile.save(chosen)
+                Log.i(tag, "Saved backend profile: $chosen")
+            }
+
+            // Instrumented (PGO_MODE=generate) builds write their profiles here,
+            // scripts/build-pgo.sh pulls them with adb
+            if (pgo_set_profile_dir(File(context.getExternalFilesDir(null), "pgo").absolutePath)) {
+                Log.i(tag, "PGO instrumented build")
+            }
 
             Log.d(tag, system_info())
 
+            // Model pairs switched away from stay loaded, within a quarter
+            // of the device's RAM including the active pair
+            set_model_cache_budget(totalMemoryBytes() / 4)
+
+            // Threads, prompt chunks and text flushing tune themselves per
+            // model on real requests
+            set_tuner_dir(File(context.filesDir, "tuner").absolutePath)
+
+            // Captions generated with a captionId are searchable by keyword
+            if (!open_caption_index(File(context.filesDir, "captions").absolutePath)) {
+                Log.e(tag, "Caption index unavailable, searchCaptions will find nothing")
+            }
+
             it.run()
         }.apply {
             uncaughtExceptionHandler = Thread.UncaughtExceptionHandler { _, exception: Throwable ->
@@ -57,25 +93,220 @@ class MTMD_Android(private val context: android.content.Context) {
     private val nlen: Int = 128
 
     private external fun log_to_android()
-    private external fun backend_init(nativeLibDir: String?)
+    private external fun backend_init(nativeLibDir: String?, backends: Array<String>?): Array<String>
+    private external fun backend_load_remaining(): Array<String>
     private external fun backend_free()
     private external fun system_info(): String
+    private external fun pgo_set_profile_dir(profileDir: String): Boolean
+    private external fun pgo_flush_profile()
+    private external fun metrics_pending(delta: Int)
+    private external fun start_metrics_server(port: Int): Boolean
+    private external fun start_metrics_file(path: String, intervalMs: Int): Boolean
+    private external fun render_metrics(): String
+    private external fun set_kv_compression(keepRatio: Float)
     private external fun load_models(languageModelPath: String, mmprojPath: String): Boolean
+    private external fun set_lazy_projector(enabled: Boolean)
+    private external fun load_pending_projector()
+    private external fun set_tensor_order_recording(enabled: Boolean)
+    private external fun set_layer_streaming(enabled: Boolean)
+    private external fun set_tuner_dir(dir: String?)
+    private external fun set_prefix_cache(slots: Int)
+    private external fun open_caption_index(dir: String): Boolean
+    private external fun set_caption_doc(docId: Long)
+    private external fun index_caption(docId: Long, text: String)
+    private external fun remove_caption(docId: Long)
+    private external fun search_captions(query: String, limit: Int): LongArray
+    private external fun optimize_model_layout(path: String): Boolean
+    private external fun drop_file_cache(path: String)
+    private external fun tensor_manifest(path: String): String?
+    private external fun delta_prepare(localPath: String, manifest: String, outPath: String): LongArray?
+    private external fun delta_commit(localPath: String, manifest: String, outPath: String): Boolean
+    private external fun store_model(path: String, split: Boolean, blobsDir: String): String?
+    private external fun collect_blobs(blobsDir: String): Long
     private external fun free_models()
-    private external fun process_image(image_path: String): Boolean
+    private external fun set_model_cache_budget(bytes: Long)
+    private external fun clear_model_cache()
+    private external fun evict_model(path: String)
     private external fun process_image_from_byteBuff(arr: ByteBuffer, width: Int, height: Int): Boolean
+    private external fun process_bitmap(bitmap: Bitmap): Boolean
+    private external fun benchmark_ingest(bitmap: Bitmap): Boolean
+    private external fun set_max_ingest_edge(edge: Int)
+    private external fun process_region(left: Float, top: Float, right: Float, bottom: Float): Boolean
+    private external fun audio_begin(sampleRate: Int): Boolean
+    private external fun audio_append(pcm: ShortArray, length: Int): Boolean
+    private external fun audio_end(): Boolean
+    private external fun audio_cancel()
+    private external fun restrict_vocab_scripts(scripts: Array<String>): Int
+    private external fun restrict_vocab_corpus(corpus: String): Int
+    private external fun clear_vocab_restriction()
+    private external fun set_greedy(enabled: Boolean, topK: Int)
+    private external fun first_token_top_k_pieces(): Array<String>
+    private external fun first_token_top_k_probs(): FloatArray
     private external fun generate_response(
         prompt: String,
         max_tokens: Int,
         callback: TextGenerationCallback
     ): String
-    private external fun get_token_count(text: String): Int
     private external fun stop_generation()
     private external fun reset_stop_flag()
 
+    // loadModels returns as soon as the language model can answer text
+    // questions. The projector then loads on the run loop after the requests
+    // already queued, so requests made after loadModels wait for it.
+    suspend fun setLazyProjector(enabled: Boolean) {
+        withContext(runLoop) {
+            set_lazy_projector(enabled)
+        }
+    }
+
+    // Record the order the first decode uses the weights in, saved next to
+    // the model as <model>.order for optimizeModelLayout. Set before loadModels.
+    suspend fun setTensorOrderRecording(enabled: Boolean) {
+        withContext(runLoop) {
+            set_tensor_order_recording(enabled)
+        }
+    }
+
+    // For language models bigger than RAM: runs the model on the CPU from
+    // its mmap, reading the next block in while the current one computes
+    // and paging out the blocks already used. Applies from the next loadModels.
+    suspend fun setLayerStreaming(enabled: Boolean) {
+        withContext(runLoop) {
+            set_layer_streaming(enabled)
+        }
+    }
+
+    // Keeps the KV cells of up to `slots` recent prompts, so a request that
+    // shares a start with one of them (template header, preset question,
+    // the same image) only prefills the rest. 0 turns it off.
+    // Applies from the next loadModels.
+    suspend fun setPrefixCache(slots: Int) {
+        withContext(runLoop) {
+            set_prefix_cache(slots)
+        }
+    }
+
+    // On by default. Off, every request runs with all threads, full prompt
+    // chunks and text sent per token. What was learned is kept either way.
+    // Applies from the next loadModels.
+    suspend fun setAutoTuning(enabled: Boolean) {
+        withContext(runLoop) {
+            set_tuner_dir(if (enabled) File(context.filesDir, "tuner").absolutePath else null)
+        }
+    }
+
+    // Rewrites the GGUF once with its tensor data in first-use order (the
+    // recorded trace if there is one, otherwise layer by layer). Reads and
+    // writes the whole file, so it runs off the inference loop.
+    suspend fun optimizeModelLayout(path: String): Boolean {
+        return withContext(Dispatchers.IO) {
+            optimize_model_layout(path)
+        }
+    }
+
+    // Evicts the file from the page cache, so the next loadModels is a cold start
+    suspend fun dropModelCache(path: String) {
+        withContext(Dispatchers.IO) {
+            drop_file_cache(path)
+        }
+    }
+
+    // Per tensor SHA-256 of a local GGUF, cached beside it as <model>.tensors.sha256
+    suspend fun tensorManifest(path: String): String? {
+        return withContext(Dispatchers.IO) {
+            tensor_manifest(path)
+        }
+    }
+
+    // Creates outPath with every tensor the local file shares with the remote
+    // manifest copied into place. Returns the (offset, length) pairs still to
+    // fetch, null if the delta can't be set up.
+    suspend fun deltaPrepare(localPath: String, manifest: String, outPath: String): LongArray? {
+        return withContext(Dispatchers.IO) {
+            delta_prepare(localPath, manifest, outPath)
+        }
+    }
+
+    // Verifies outPath against the manifest and moves it over localPath
+    suspend fun deltaCommit(localPath: String, manifest: String, outPath: String): Boolean {
+        return withContext(Dispatchers.IO) {
+            delta_commit(localPath, manifest, outPath)
+        }
+    }
+
+    // Moves a model into the blob store under blobsDir, sharing any file (or
+    // with split, any block) another model already has. Returns the path to
+    // load it from from now on, null if it was left where it was.
+    suspend fun storeModel(path: String, split: Boolean, blobsDir: String): String? {
+        return withContext(Dispatchers.IO) {
+            store_model(path, split, blobsDir)
+        }
+    }
+
+    // Deletes blobs no model uses anymore, returns the bytes freed
+    suspend fun collectBlobs(blobsDir: String): Long {
+        return withContext(Dispatchers.IO) {
+            collect_blobs(blobsDir)
+        }
+    }
+
+    // Ids of the captions with every word of query, highest id first. The
+    // last word matches as a prefix until it's followed by a space, so this
+    // can run as the user types. Doesn't wait for generation.
+    suspend fun searchCaptions(query: String, limit: Int = 100): LongArray {
+        return withContext(Dispatchers.IO) {
+            search_captions(query, limit)
+        }
+    }
+
+    // For captions that didn't come from generateResponse (imported, edited
+    // by the user). Replaces whatever id had.
+    suspend fun indexCaption(id: Long, text: String) {
+        withContext(Dispatchers.IO) {
+            index_caption(id, text)
+        }
+    }
+
+    suspend fun removeCaption(id: Long) {
+        withContext(Dispatchers.IO) {
+            remove_caption(id)
+        }
+    }
+
     suspend fun loadModels(languageModelPath: String, mmprojPath: String): Boolean {
-        return withContext(runLoop) {
-            load_models(languageModelPath, mmprojPath)
+        val loaded = withContext(runLoop) {
+            if (backendFallbackDone) {
+                return@withContext load_models(languageModelPath, mmprojPath)
+            }
+            // If the profiled backends weren't enough, load the rest, and
+            // remember them if that made the model load, so the next start
+            // doesn't fail the same way
+            val profiled = backendProfile.backends
+            BackendProfile.loadWithFallback(
+                profiled,
+                load = { load_models(languageModelPath, mmprojPath) },
+                loadRemaining = {
+                    Log.w(tag, "Model load failed with backends $profiled, loading the rest")
+                    backendFallbackDone = true
+                    backend_load_remaining().toList()
+                },
+                save = {
+                    Log.i(tag, "Model loaded with backends $it, saved as the backend profile")
+                    backendProfile.save(it)
+                },
+            )
+        }
+        if (loaded) {
+            CoroutineScope(runLoop).launch { load_pending_projector() }
+        }
+        return loaded
+    }
+
+    // Keep only this fraction of image tokens in the KV cache after prefill,
+    // 0 turns it off. Applies from the next loadModels.
+    suspend fun setKvCompression(keepRatio: Float) {
+        withContext(runLoop) {
+            set_kv_compression(keepRatio)
         }
     }
 
@@ -83,14 +314,68 @@ class MTMD_Android(private val context: android.content.Context) {
         stop_generation()
     }
 
+    // Unloads the active pair and frees it. To switch models, call
+    // loadModels directly: it keeps the current pair resident while the
+    // model cache budget allows, so switching back is quick.
     suspend fun unloadModels() {
         withContext(runLoop) {
             free_models()
         }
     }
 
+    // Memory for the model pairs kept loaded after switching away, 0 frees them all
+    suspend fun setModelCacheBudget(bytes: Long) {
+        withContext(runLoop) {
+            set_model_cache_budget(bytes)
+        }
+    }
+
+    suspend fun clearModelCache() {
+        withContext(runLoop) {
+            clear_model_cache()
+        }
+    }
+
+    // Frees resident pairs that use this file, before it's deleted or replaced
+    suspend fun evictModel(path: String) {
+        withContext(runLoop) {
+            evict_model(path)
+        }
+    }
+
+    private fun totalMemoryBytes(): Long {
+        val info = ActivityManager.MemoryInfo()
+        (context.getSystemService(android.content.Context.ACTIVITY_SERVICE) as ActivityManager).getMemoryInfo(info)
+        return info.totalMem
+    }
+
+    init {
+        // Give the parked model pairs back as soon as the system runs low
+        context.registerComponentCallbacks(object : ComponentCallbacks2 {
+            override fun onTrimMemory(level: Int) {
+                if (level >= ComponentCallbacks2.TRIM_MEMORY_RUNNING_LOW) {
+                    CoroutineScope(runLoop).launch { clear_model_cache() }
+                }
+            }
+
+            override fun onConfigurationChanged(newConfig: Configuration) {}
+
+            @Deprecated("Deprecated in Java")
+            override fun onLowMemory() {
+                CoroutineScope(runLoop).launch { clear_model_cache() }
+            }
+        })
+    }
+
     fun processImage(bitmap: Bitmap): Boolean {
-        // Ensure bitmap is in ARGB_8888 format
+        // ARGB_8888, RGB_565, RGBA_F16 and HARDWARE bitmaps of those are
+        // converted natively, straight from the bitmap's pixels
+        if (process_bitmap(bitmap)) {
+            return true
+        }
+
+        // Anything else gets copied to ARGB_8888 first, including HARDWARE
+        // bitmaps whose buffer was allocated without CPU read access
         val config = if (bitmap.config == Bitmap.Config.ARGB_8888) bitmap else bitmap.copy(Bitmap.Config.ARGB_8888, false)
         
         val byteBuffer = ByteBuffer.allocateDirect(config.byteCount)
@@ -99,44 +384,144 @@ class MTMD_Android(private val context: android.content.Context) {
         return process_image_from_byteBuff(byteBuffer, config.width, config.height)
     }
 
-    fun generateResponse(prompt: String, maxTokens: Int): Flow<String> = callbackFlow {
+    // Logs how long converting and downscaling this bitmap takes in one fused
+    // pass versus converting at full size and resizing after, and how far
+    // each raises the peak RSS. Doesn't touch the pending image.
+    fun benchmarkIngest(bitmap: Bitmap): Boolean {
+        return benchmark_ingest(bitmap)
+    }
+
+    // Shrink images whose longest edge is over this while converting them,
+    // 0 (the default) keeps them at full size for the encoder to tile
+    fun setMaxIngestEdge(edge: Int) {
+        set_max_ingest_edge(edge)
+    }
+
+    // Follow-up question about part of the last described image. The edges are
+    // fractions (0..1) of the image's width and height. Call it instead of
+    // processImage before generateResponse. Tiles of the earlier image inside
+    // the region come from the cache, only the rest of the region is encoded.
+    suspend fun processRegion(left: Float, top: Float, right: Float, bottom: Float): Boolean {
+        return withContext(runLoop) {
+            process_region(left, top, right, bottom)
+        }
+    }
+
+    // Voice questions: call beginAudio when recording starts, appendAudio with
+    // each buffer read from the recorder (16-bit mono PCM), and endAudio when
+    // the user stops talking. Segments are encoded as they complete, so
+    // endAudio only has the tail left. The next generateResponse uses the
+    // recording as the question, after any prompt text.
+    suspend fun beginAudio(sampleRate: Int): Boolean {
+        return withContext(runLoop) {
+            audio_begin(sampleRate)
+        }
+    }
+
+    suspend fun appendAudio(pcm: ShortArray, length: Int = pcm.size): Boolean {
+        return withContext(runLoop) {
+            audio_append(pcm, length)
+        }
+    }
+
+    suspend fun endAudio(): Boolean {
+        return withContext(runLoop) {
+            audio_end()
+        }
+    }
+
+    suspend fun cancelAudio() {
+        withContext(runLoop) {
+            audio_cancel()
+        }
+    }
+
+    // Sample only tokens written in these scripts ("latin", "cyrillic", "cjk", ...),
+    // returns the subset size, 0 if none of the scripts is known.
+    // Needs the models loaded, and is dropped when they're unloaded.
+    suspend fun restrictVocabulary(scripts: List<String>): Int {
+        return withContext(runLoop) {
+            restrict_vocab_scripts(scripts.toTypedArray())
+        }
+    }
+
+    // Sample only tokens that appear when tokenizing this text
+    suspend fun restrictVocabularyToCorpus(corpus: String): Int {
+        return withContext(runLoop) {
+            restrict_vocab_corpus(corpus)
+        }
+    }
+
+    suspend fun clearVocabularyRestriction() {
+        withContext(runLoop) {
+            clear_vocab_restriction()
+        }
+    }
+
+    // Argmax decoding for temperature 0 captioning and tagging. With topK > 0
+    // the k best candidates for the first token are kept for firstTokenTopK.
+    suspend fun setGreedy(enabled: Boolean, topK: Int = 0) {
         withContext(runLoop) {
-            reset_stop_flag()  // Reset before starting
-
-            val callback = object : TextGenerationCallback {
-                override fun onTextGenerated(text: String) {
-                    trySend(text).onFailure {
-                        exception: Throwable? ->
-                        Log.e(tag, "Failed to send text to flow", exception)
-                        stop_generation()
-                        close(exception)
+            set_greedy(enabled, topK)
+        }
+    }
+
+    // Candidates for the first token of the last response, best first, with
+    // their probabilities
+    suspend fun firstTokenTopK(): List<Pair<String, Float>> {
+        return withContext(runLoop) {
+            first_token_top_k_pieces().zip(first_token_top_k_probs().asList())
+        }
+    }
+
+    // With a captionId (an image id, say), the response is added to the
+    // caption index under it once it completes. Stopped or failed ones aren't.
+    fun generateResponse(prompt: String, maxTokens: Int, captionId: Long = -1): Flow<String> = callbackFlow {
+        // Counted from here so requests stuck behind the loop show up too
+        metrics_pending(1)
+        try {
+            withContext(runLoop) {
+                reset_stop_flag()  // Reset before starting
+
+                val callback = object : TextGenerationCallback {
+                    override fun onTextGenerated(text: String) {
+                        trySend(text).onFailure {
+                            exception: Throwable? ->
+                            Log.e(tag, "Failed to send text to flow", exception)
+                            stop_generation()
+                            close(exception)
+                        }
                     }
-                }
 
-                override fun onGenerationComplete() {
-                    close()
-                }
+                    override fun onGenerationComplete() {
+                        close()
+                    }
 
-                override fun onGenerationError(error: String) {
-                    cancel("Generation error: $error", null)
-                }
+                    override fun onGenerationError(error: String) {
+                        cancel("Generation error: $error", null)
+                    }
 
-                override fun onProgressUpdate(phase: String, progress: Int) {
-                    trySend("PROGRESS:$phase:$progress").onFailure {
-                        exception: Throwable? ->
-                        Log.e(tag, "Failed to send progress update", exception)
+                    override fun onProgressUpdate(phase: String, progress: Int) {
+                        trySend("PROGRESS:$phase:$progress").onFailure {
+                            exception: Throwable? ->
+                            Log.e(tag, "Failed to send progress update", exception)
+                        }
                     }
                 }
-            }
 
-            try {
-                generate_response(prompt, maxTokens, callback)
-            } catch (e: Exception) {
-                Log.e(tag, "Exception in generateResponse", e)
-                cancel("Error: ${e.message}", null)
-            } finally {
-                reset_stop_flag()
+                try {
+                    set_caption_doc(captionId)
+                    generate_response(prompt, maxTokens, callback)
+                } catch (e: Exception) {
+                    Log.e(tag, "Exception in generateResponse", e)
+                    cancel("Error: ${e.message}", null)
+                } finally {
+                    reset_stop_flag()
+                    pgo_flush_profile()
+                }
             }
+        } finally {
+            metrics_pending(-1)
         }
 
         awaitClose {
@@ -144,6 +529,21 @@ class MTMD_Android(private val context: android.content.Context) {
         }
     }
 
+    // Prometheus text format metrics (request counts, TTFT, throughput, cache
+    // hits, KV use, RSS by component). Either serve them on 127.0.0.1:port,
+    // rewrite a file every intervalMs, or grab the current text directly.
+    fun startMetricsServer(port: Int): Boolean {
+        return start_metrics_server(port)
+    }
+
+    fun startMetricsFile(path: String, intervalMs: Int = 15000): Boolean {
+        return start_metrics_file(path, intervalMs)
+    }
+
+    fun metricsText(): String {
+        return render_metrics()
+    }
+
     companion object {
         // Enforce only one instance of MTMD_Android
         @Volatile
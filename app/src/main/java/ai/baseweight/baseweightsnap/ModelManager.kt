@@ -49,6 +49,8 @@ class ModelManager(private val context: Context) {
     companion object {
         private const val TAG = "ModelManager"
         private const val MODELS_DIR = "models"
+        private const val BLOBS_DIR = "blobs"
+        private const val PARTS_SUFFIX = ".parts"
         const val DEFAULT_MODEL_NAME = "SmolVLM2-256M-VidInstruct"
         const val DEFAULT_HF_REPO = "ggml-org/SmolVLM2-256M-Video-Instruct-GGUF"
 
@@ -143,6 +145,21 @@ class ModelManager(private val context: Context) {
         return File(context.getExternalFilesDir(null), MODELS_DIR)
     }
 
+    private fun getBlobsDirectory(): File {
+        return File(getModelsDirectory(), BLOBS_DIR)
+    }
+
+    // Store separate language models as one split per block, so fine-tunes
+    // of a base we already have only take the blocks they changed on disk.
+    // Identical files are shared either way.
+    var splitModelsIntoBlobs = false
+
+    // A model stored as splits loads from its <model>.parts directory
+    private fun storedPath(path: String): String {
+        val parts = File(path + PARTS_SUFFIX)
+        return if (!File(path).exists() && parts.isDirectory) parts.absolutePath else path
+    }
+
     // Get MTMD model pair by name
     fun getMTMDModel(name: String): MTMDModel? {
         return availableModels.find { it.name == name }
@@ -340,12 +357,14 @@ class ModelManager(private val context: Context) {
         val isUnified = files.isUnified
 
         Log.d(TAG, "Model is ${if (isUnified) "unified" else "separate"} GGUF")
+        // Download the commit we saw, so the saved revision is what's on disk
+        val revision = hfApiClient.getRepoInfo(repo).getOrNull()?.sha?.takeIf { it.isNotEmpty() }
         emit(DownloadProgress(1, 0, totalSize, DownloadStatus.PENDING, "Downloading files..."))
 
         // Step 2: Download language model
         val languageFileName = files.languageFile.path.substringAfterLast("/")
         val languagePath = "${getModelsDirectory()}/${repo.replace("/", "_")}_$languageFileName"
-        val languageUrl = hfApiClient.getDownloadUrl(repo, files.languageFile.path)
+        val languageUrl = hfApiClient.getDownloadUrl(repo, files.languageFile.path, revision ?: "main")
         var lastLanguageProgress = -1
         downloadFile(languageUrl, languagePath, files.languageFile.size).collect { progress ->
             // Skip COMPLETED status from individual file - we'll emit overall COMPLETED at the end
@@ -376,7 +395,7 @@ class ModelManager(private val context: Context) {
         if (!isUnified && files.visionFile != null) {
             visionFileName = files.visionFile.path.substringAfterLast("/")
             visionPath = "${getModelsDirectory()}/${repo.replace("/", "_")}_$visionFileName"
-            val visionUrl = hfApiClient.getDownloadUrl(repo, files.visionFile.path)
+            val visionUrl = hfApiClient.getDownloadUrl(repo, files.visionFile.path, revision ?: "main")
             var lastVisionProgress = -1
             downloadFile(visionUrl, visionPath, files.visionFile.size).collect { progress ->
                 // Skip COMPLETED status from individual file - we'll emit overall COMPLETED at the end
@@ -399,7 +418,24 @@ class ModelManager(private val context: Context) {
             Log.d(TAG, "Unified model detected - using same file for vision and language")
         }
 
-        // Step 4: Save metadata
+        // Step 4: Put the language model's tensors in first-use order so cold
+        // starts read it front to back. Best effort, the file loads either way.
+        emit(DownloadProgress(95, totalSize, totalSize, DownloadStatus.DOWNLOADING, "Optimizing model layout..."))
+        if (!MTMD_Android.instance(context).optimizeModelLayout(languagePath)) {
+            Log.d(TAG, "Kept the downloaded tensor layout of $languagePath")
+        }
+
+        // Move the files into the blob store, sharing whatever another model has already
+        val mtmd = MTMD_Android.instance(context)
+        val blobsDir = getBlobsDirectory().absolutePath
+        if (mtmd.storeModel(languagePath, splitModelsIntoBlobs && !isUnified, blobsDir) == null) {
+            Log.w(TAG, "Couldn't store $languagePath in the blob store, keeping it as a plain file")
+        }
+        if (!isUnified && mtmd.storeModel(visionPath, false, blobsDir) == null) {
+            Log.w(TAG, "Couldn't store $visionPath in the blob store, keeping it as a plain file")
+        }
+
+        // Step 5: Save metadata
         emit(DownloadProgress(97, totalSize, totalSize, DownloadStatus.DOWNLOADING, "Saving metadata..."))
 
         val repoName = repo.substringAfterLast("/")
@@ -411,13 +447,14 @@ class ModelManager(private val context: Context) {
             configFile = null,
             languageSize = files.languageFile.size,
             visionSize = if (isUnified) files.languageFile.size else (files.visionFile?.size ?: 0),
-            isUnified = isUnified
+            isUnified = isUnified,
+            revision = revision
         )
 
         metadataManager.saveMetadata(metadata)
         Log.d(TAG, "Saved metadata for model: ${metadata.id} (unified=${isUnified})")
 
-        // Step 5: Set as default if no other models exist
+        // Step 6: Set as default if no other models exist
         if (metadataManager.getAllModels().size == 1) {
             metadataManager.setDefaultModel(metadata.id)
             Log.d(TAG, "Set as default model: ${metadata.id}")
@@ -426,6 +463,112 @@ class ModelManager(private val context: Context) {
         emit(DownloadProgress(100, totalSize, totalSize, DownloadStatus.COMPLETED, "Download complete!"))
     }.flowOn(Dispatchers.IO)
 
+    /**
+     * Update a downloaded model to the repo's latest revision, fetching only
+     * the tensors that changed. The revision has to publish a
+     * <file>.tensors.sha256 manifest next to each GGUF
+     * (scripts/gguf-tensor-manifest.py), otherwise this reports an error and
+     * the model has to be downloaded again.
+     */
+    fun updateFromHuggingFace(modelId: String): Flow<DownloadProgress> = flow {
+        val metadata = metadataManager.getModelById(modelId)
+        val paths = getHFModelPaths(modelId)
+        if (metadata == null || paths == null) {
+            emit(DownloadProgress(0, 0, 0, DownloadStatus.ERROR, "Model not found"))
+            return@flow
+        }
+        val repo = metadata.hfRepo
+
+        emit(DownloadProgress(0, 0, 0, DownloadStatus.PENDING, "Checking for updates..."))
+        val revision = hfApiClient.getRepoInfo(repo).getOrNull()?.sha?.takeIf { it.isNotEmpty() }
+        if (revision == null) {
+            emit(DownloadProgress(0, 0, 0, DownloadStatus.ERROR, "Couldn't reach the repository"))
+            return@flow
+        }
+        if (revision == metadata.revision) {
+            emit(DownloadProgress(100, 0, 0, DownloadStatus.COMPLETED, "Already up to date"))
+            return@flow
+        }
+        val remoteFiles = hfApiClient.listFiles(repo, revision).getOrNull()
+        if (remoteFiles == null) {
+            emit(DownloadProgress(0, 0, 0, DownloadStatus.ERROR, "Couldn't list the new revision's files"))
+            return@flow
+        }
+
+        if (paths.first.endsWith(PARTS_SUFFIX)) {
+            emit(DownloadProgress(0, 0, 0, DownloadStatus.ERROR, "Models stored as splits have to be downloaded again"))
+            return@flow
+        }
+
+        val targets = mutableListOf(metadata.languageFile to paths.first)
+        if (!metadata.isUnified) {
+            targets.add(metadata.visionFile to paths.second)
+        }
+        val mtmd = MTMD_Android.instance(context)
+        val fetcher = RangeFetcher()
+        var outPath: String? = null
+
+        try {
+            for ((fileName, localPath) in targets) {
+                val remoteFile = remoteFiles.find { it.path.substringAfterLast("/") == fileName }
+                    ?: throw Exception("$fileName isn't in revision $revision")
+                val manifestUrl = hfApiClient.getDownloadUrl(repo, "${remoteFile.path}.tensors.sha256", revision)
+                val manifest = fetcher.fetchText(manifestUrl)
+                    ?: throw Exception("Revision $revision has no tensor manifest for $fileName")
+                // The manifest has to describe the file the hub has, not an older one
+                if (remoteFile.sha256 != null && !manifest.contains("\nfile ${remoteFile.size} ${remoteFile.sha256}\n")) {
+                    throw Exception("Tensor manifest of $fileName doesn't match the file in $revision")
+                }
+
+                emit(DownloadProgress(0, 0, remoteFile.size, DownloadStatus.PENDING, "Comparing $fileName..."))
+                val deltaPath = "$localPath.delta"
+                outPath = deltaPath
+                val ranges = mtmd.deltaPrepare(localPath, manifest, deltaPath)
+                    ?: throw Exception("Couldn't prepare the update of $fileName")
+                val toFetch = (1 until ranges.size step 2).sumOf { ranges[it] }
+                Log.d(TAG, "Updating $fileName to $revision: fetching $toFetch of ${remoteFile.size} bytes")
+
+                val url = hfApiClient.getDownloadUrl(repo, remoteFile.path, revision)
+                var fetched = 0L
+                for (i in ranges.indices step 2) {
+                    fetcher.fetch(url, longArrayOf(ranges[i], ranges[i + 1]), File(deltaPath))
+                    fetched += ranges[i + 1]
+                    val progress = if (toFetch > 0) (fetched * 99 / toFetch).toInt() else 99
+                    emit(DownloadProgress(progress, fetched, toFetch, DownloadStatus.DOWNLOADING, "Updating $fileName..."))
+                }
+
+                if (!mtmd.deltaCommit(localPath, manifest, deltaPath)) {
+                    throw Exception("Updated $fileName failed verification")
+                }
+                outPath = null
+                // A pair kept loaded from the old file mustn't come back
+                mtmd.evictModel(localPath)
+                // The update has the publisher's tensor order, put the language
+                // model back in first-use order like a fresh download
+                if (fileName == metadata.languageFile) {
+                    emit(DownloadProgress(99, 0, 0, DownloadStatus.DOWNLOADING, "Optimizing model layout..."))
+                    if (!mtmd.optimizeModelLayout(localPath)) {
+                        Log.d(TAG, "Kept the updated tensor layout of $localPath")
+                    }
+                }
+                // The updated file is a new inode, share it again if another model has it
+                mtmd.storeModel(localPath, false, getBlobsDirectory().absolutePath)
+            }
+        } catch (e: Exception) {
+            Log.e(TAG, "Delta update of $repo failed: ${e.message}", e)
+            outPath?.let { File(it).delete() }
+            emit(DownloadProgress(0, 0, 0, DownloadStatus.ERROR, e.message ?: "Update failed"))
+            return@flow
+        }
+
+        metadataManager.saveMetadata(metadata.copy(
+            revision = revision,
+            languageSize = File(paths.first).length(),
+            visionSize = File(paths.second).length()
+        ))
+        emit(DownloadProgress(100, 0, 0, DownloadStatus.COMPLETED, "Updated to $revision"))
+    }.flowOn(Dispatchers.IO)
+
     /**
      * Download a single file with progress tracking
      */
@@ -513,6 +656,13 @@ class ModelManager(private val context: Context) {
             val metadata = metadataManager.getModelById(modelId)
                 ?: return@withContext Result.failure(Exception("Model not found: $modelId"))
 
+            // A copy kept resident would hold on to the deleted files' pages
+            val mtmd = MTMD_Android.instance(context)
+            getHFModelPaths(modelId)?.let { (languagePath, visionPath) ->
+                mtmd.evictModel(languagePath)
+                mtmd.evictModel(visionPath)
+            }
+
             // Delete files
             val prefix = metadata.hfRepo.replace("/", "_")
             val modelsDir = getModelsDirectory()
@@ -529,7 +679,11 @@ class ModelManager(private val context: Context) {
             // Delete metadata
             metadataManager.deleteModel(modelId)
 
-            Log.d(TAG, "Deleted model: $modelId (unified=${metadata.isUnified})")
+            File(modelsDir, "${prefix}_${metadata.languageFile}$PARTS_SUFFIX").deleteRecursively()
+            // Blobs other models still link to stay
+            val freed = mtmd.collectBlobs(getBlobsDirectory().absolutePath)
+
+            Log.d(TAG, "Deleted model: $modelId (unified=${metadata.isUnified}, freed $freed blob bytes)")
             Result.success(Unit)
         } catch (e: Exception) {
             Log.e(TAG, "Error deleting model: ${e.message}", e)
@@ -557,7 +711,7 @@ class ModelManager(private val context: Context) {
 
         // Standard HF model path
         val prefix = metadata.hfRepo.replace("/", "_")
-        val languagePath = File(modelsDir, "${prefix}_${metadata.languageFile}").absolutePath
+        val languagePath = storedPath(File(modelsDir, "${prefix}_${metadata.languageFile}").absolutePath)
         
         // For unified models, vision path is the same as language path
         val visionPath = if (metadata.isUnified) {
@@ -28,7 +28,8 @@ data class HFModelMetadata(
     val visionSize: Long,
     val downloadState: DownloadState? = DownloadState.COMPLETED,  // Nullable for backwards compatibility
     val downloadProgress: Int = 100,  // 0-100
-    val isUnified: Boolean = false    // NEW: true if languageFile == visionFile (unified GGUF like Gemma 3)
+    val isUnified: Boolean = false,   // NEW: true if languageFile == visionFile (unified GGUF like Gemma 3)
+    val revision: String? = null      // Commit sha the files were downloaded at, for delta updates
 ) {
     val totalSize: Long get() = if (isUnified) languageSize else languageSize + visionSize
 
@@ -70,7 +71,8 @@ data class HFRepoInfo(
 data class HFFile(
     val path: String,
     val size: Long,
-    val type: String = "file"  // "file" or "directory"
+    val type: String = "file",  // "file" or "directory"
+    val sha256: String? = null  // LFS object id, the SHA-256 of the whole file
 ) {
     val isGGUF: Boolean get() = path.endsWith(".gguf", ignoreCase = true)
     val isMMProj: Boolean get() = path.contains("mmproj", ignoreCase = true) && isGGUF
@@ -62,7 +62,8 @@ class HuggingFaceApiClient {
                 val file = HFFile(
                     path = fileJson.getString("path"),
                     size = fileJson.optLong("size", 0),
-                    type = fileJson.optString("type", "file")
+                    type = fileJson.optString("type", "file"),
+                    sha256 = fileJson.optJSONObject("lfs")?.optString("oid")?.takeIf { it.isNotEmpty() }
                 )
                 files.add(file)
             }
@@ -0,0 +1,100 @@
+package ai.baseweight.baseweightsnap.models
+
+import java.io.File
+import java.io.IOException
+import java.io.RandomAccessFile
+import java.net.HttpURLConnection
+import java.net.URL
+
+/**
+ * Fetches byte ranges of a remote file into the same offsets of a local one,
+ * for delta updates that only download the tensors that changed
+ */
+class RangeFetcher(private val timeoutMs: Int = 30000) {
+
+    /**
+     * Fetches each (offset, length) pair of ranges from url into out.
+     * onBytes gets the running total after every write.
+     */
+    fun fetch(url: String, ranges: LongArray, out: File, onBytes: (Long) -> Unit = {}) {
+        require(ranges.size % 2 == 0) { "ranges must be offset/length pairs" }
+        var total = 0L
+        RandomAccessFile(out, "rw").use { file ->
+            for (i in ranges.indices step 2) {
+                val offset = ranges[i]
+                val length = ranges[i + 1]
+                if (length <= 0) continue
+                total = fetchRange(url, offset, length, file, total, onBytes)
+            }
+            file.fd.sync()
+        }
+    }
+
+    /**
+     * Small text file at url, null if the server doesn't have it
+     */
+    fun fetchText(url: String): String? {
+        val connection = open(url)
+        try {
+            return when (connection.responseCode) {
+                HttpURLConnection.HTTP_OK -> connection.inputStream.bufferedReader().use { it.readText() }
+                HttpURLConnection.HTTP_NOT_FOUND -> null
+                else -> throw IOException("HTTP ${connection.responseCode} fetching $url")
+            }
+        } finally {
+            connection.disconnect()
+        }
+    }
+
+    private fun fetchRange(
+        url: String,
+        offset: Long,
+        length: Long,
+        file: RandomAccessFile,
+        totalBefore: Long,
+        onBytes: (Long) -> Unit
+    ): Long {
+        val last = offset + length - 1
+        val connection = open(url)
+        try {
+            connection.setRequestProperty("Range", "bytes=$offset-$last")
+            // A 200 would be the whole file, which is what we're trying to avoid
+            if (connection.responseCode != HttpURLConnection.HTTP_PARTIAL) {
+                throw IOException("Expected 206 for bytes $offset-$last, got HTTP ${connection.responseCode}")
+            }
+            val contentRange = connection.getHeaderField("Content-Range")
+            if (contentRange == null || !contentRange.startsWith("bytes $offset-$last/")) {
+                throw IOException("Server sent $contentRange for bytes $offset-$last")
+            }
+
+            var total = totalBefore
+            var written = 0L
+            val buffer = ByteArray(64 * 1024)
+            file.seek(offset)
+            connection.inputStream.use { input ->
+                while (written < length) {
+                    val n = input.read(buffer, 0, minOf(buffer.size.toLong(), length - written).toInt())
+                    if (n == -1) break
+                    file.write(buffer, 0, n)
+                    written += n
+                    total += n
+                    onBytes(total)
+                }
+            }
+            if (written != length) {
+                throw IOException("Range $offset-$last ended after $written of $length bytes")
+            }
+            return total
+        } finally {
+            connection.disconnect()
+        }
+    }
+
+    private fun open(url: String): HttpURLConnection {
+        val connection = URL(url).openConnection() as HttpURLConnection
+        connection.connectTimeout = timeoutMs
+        connection.readTimeout = timeoutMs
+        connection.setRequestProperty("User-Agent", "BaseweightSnap/1.0")
+        return connection
+    }
+}
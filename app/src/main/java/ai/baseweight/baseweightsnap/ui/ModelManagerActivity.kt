@@ -370,10 +370,8 @@ class ModelManagerActivity : AppCompatActivity() {
                         return@withContext false
                     }
 
-                    // Unload current models first
-                    vlmRunner.unloadModels()
-
-                    // Load the new models
+                    // Load the new models, the current ones stay resident
+                    // for switching back
                     vlmRunner.loadModels(languagePath, visionPath)
                 }
 
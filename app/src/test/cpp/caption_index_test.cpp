@@ -0,0 +1,205 @@
+#include "caption_index.h"
+#include "metrics.h"
+#include "test_util.h"
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <thread>
+
+typedef std::vector<uint64_t> Ids;
+
+static bool exists(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0;
+}
+
+static void copy_file(const std::string& from, const std::string& to) {
+    std::ifstream in(from, std::ios::binary);
+    std::ofstream out(to, std::ios::binary);
+    out << in.rdbuf();
+}
+
+static bool wait_for_merges(uint64_t n) {
+    for (int i = 0; i < 500; i++) {
+        if (Metrics::getInstance().caption_index_merges.get() >= n) {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return false;
+}
+
+// Batch k is ids k*10 .. k*10+9, each "a cat number <id>"
+static void add_batch(CaptionIndex& index, int k) {
+    for (int id = k * 10; id < k * 10 + 10; id++) {
+        index.add(id, "a cat number " + std::to_string(id));
+    }
+}
+
+static void test_terms() {
+    CHECK(caption_terms("A dog's red Boxes, on the BEACHES.") ==
+          std::vector<std::string>({"dog", "red", "box", "beach"}));
+    CHECK(caption_terms("puppies glasses horses dishes foxes") ==
+          std::vector<std::string>({"puppy", "glass", "horse", "dish", "fox"}));
+    // Words that only look plural stay as they are
+    CHECK(caption_terms("bus dress tennis") == std::vector<std::string>({"bus", "dress", "tennis"}));
+    CHECK(caption_terms("2 cats in 2024") == std::vector<std::string>({"2", "cat", "2024"}));
+    // Non-ASCII letters are part of the word, not separators
+    CHECK(caption_terms("Café au lait") == std::vector<std::string>({"café", "au", "lait"}));
+    CHECK(caption_terms("the of and, a").empty());
+}
+
+static void test_round_trip() {
+    const std::string dir = temp_dir("caption-index");
+    CaptionIndex& index = CaptionIndex::getInstance();
+    CHECK(index.open(dir));
+    index.add(1, "A dog running on the beach");
+    index.add(2, "Two dogs asleep on a sofa");
+    index.add(3, "A red car parked at the beach");
+
+    // From the in-memory table, then from a segment, then after a reopen
+    for (int pass = 0; pass < 3; pass++) {
+        CHECK(index.search("dog", 10) == Ids({2, 1}));
+        CHECK(index.search("dogs beach ", 10) == Ids({1}));
+        CHECK(index.search("bea", 10) == Ids({3, 1}));
+        CHECK(index.search("bea ", 10).empty());
+        CHECK(index.search("beach dog", 1) == Ids({1}));
+        CHECK(index.search("the", 10).empty());
+        CHECK(index.search("cat", 10).empty());
+        if (pass == 0) {
+            index.flush();
+            CHECK(exists(dir + "/seg-1.idx"));
+        } else if (pass == 1) {
+            index.close();
+            CHECK(index.search("dog", 10).empty());
+            CHECK(index.open(dir));
+        }
+    }
+
+    // Replacing and removing, before and after the segment is written
+    index.add(1, "A cat on the beach");
+    CHECK(index.search("dog", 10) == Ids({2}));
+    CHECK(index.search("cat", 10) == Ids({1}));
+    index.remove(3);
+    CHECK(index.search("beach", 10) == Ids({1}));
+    index.close();
+    CHECK(index.open(dir));
+    CHECK(index.search("beach", 10) == Ids({1}));
+    CHECK(index.search("dog", 10) == Ids({2}));
+    index.close();
+}
+
+// Eight flushed batches, which is one merge. Leaves the index closed with
+// the eight segments written (gens 1..8) and the merge not run yet.
+static void write_batches(const std::string& dir) {
+    CaptionIndex& index = CaptionIndex::getInstance();
+    CHECK(index.open(dir));
+    for (int k = 1; k <= 7; k++) {
+        add_batch(index, k);
+        index.flush();
+    }
+    add_batch(index, 8);
+    // close() stops the merge thread before its flush writes the 8th
+    index.close();
+    for (int k = 1; k <= 8; k++) {
+        CHECK(exists(dir + "/seg-" + std::to_string(k) + ".idx"));
+    }
+}
+
+static Ids cat_ids(const Ids& missing) {
+    Ids ids;
+    for (uint64_t id = 89; id >= 10; id--) {
+        if (std::find(missing.begin(), missing.end(), id) == missing.end()) {
+            ids.push_back(id);
+        }
+    }
+    return ids;
+}
+
+static void test_merge() {
+    const std::string dir = temp_dir("caption-merge");
+    write_batches(dir);
+    CaptionIndex& index = CaptionIndex::getInstance();
+    const uint64_t merges = Metrics::getInstance().caption_index_merges.get();
+    CHECK(index.open(dir));
+    index.remove(12);
+    CHECK(wait_for_merges(merges + 1));
+    CHECK(!exists(dir + "/seg-1.idx"));
+    CHECK(exists(dir + "/seg-9.idx"));
+
+    // Removed before the merge, after it, and replaced after it
+    index.remove(47);
+    index.add(55, "a dog number 55");
+    CHECK(index.search("cat", 100) == cat_ids({12, 47, 55}));
+    CHECK(index.search("number 55", 10) == Ids({55}));
+    CHECK(index.search("dog", 10) == Ids({55}));
+    index.flush();
+    index.close();
+    CHECK(index.open(dir));
+    CHECK(index.search("cat", 100) == cat_ids({12, 47, 55}));
+    CHECK(index.search("number 3", 100) == Ids({39, 38, 37, 36, 35, 34, 33, 32, 31, 30}));
+    index.close();
+}
+
+static void test_interrupted_merge() {
+    const std::string dir = temp_dir("caption-crash");
+    const std::string saved = temp_dir("caption-saved");
+    write_batches(dir);
+    for (int k = 1; k <= 8; k++) {
+        copy_file(dir + "/seg-" + std::to_string(k) + ".idx", saved + "/seg-" + std::to_string(k) + ".idx");
+    }
+    CaptionIndex& index = CaptionIndex::getInstance();
+    const uint64_t merges = Metrics::getInstance().caption_index_merges.get();
+    CHECK(index.open(dir));
+    CHECK(wait_for_merges(merges + 1));
+    index.close();
+    CHECK(exists(dir + "/seg-9.idx"));
+
+    // Died after the merged segment was renamed into place, before the
+    // sources went, and one of them got a deletion meanwhile: 35 is
+    // ordinal 5 of batch 3's segment
+    for (int k = 1; k <= 8; k++) {
+        copy_file(saved + "/seg-" + std::to_string(k) + ".idx", dir + "/seg-" + std::to_string(k) + ".idx");
+    }
+    std::ofstream(dir + "/seg-3.del", std::ios::binary) << (char) (1 << 5) << (char) 0;
+    CHECK(index.open(dir));
+    CHECK(index.search("cat", 100) == cat_ids({35}));
+    CHECK(!exists(dir + "/seg-3.idx"));
+    index.close();
+
+    // Died before the rename: the half written merge is dropped, the
+    // sources are all there is
+    const std::string dir2 = temp_dir("caption-crash");
+    for (int k = 1; k <= 8; k++) {
+        copy_file(saved + "/seg-" + std::to_string(k) + ".idx", dir2 + "/seg-" + std::to_string(k) + ".idx");
+    }
+    copy_file(dir + "/seg-9.idx", dir2 + "/seg-9.idx.tmp");
+    CHECK(index.open(dir2));
+    CHECK(!exists(dir2 + "/seg-9.idx.tmp"));
+    CHECK(index.search("cat", 100) == cat_ids({}));
+    index.close();
+
+    // A merged segment that doesn't open doesn't take its sources with it
+    const std::string dir3 = temp_dir("caption-crash");
+    for (int k = 1; k <= 8; k++) {
+        copy_file(saved + "/seg-" + std::to_string(k) + ".idx", dir3 + "/seg-" + std::to_string(k) + ".idx");
+    }
+    copy_file(dir + "/seg-9.idx", dir3 + "/seg-9.idx");
+    CHECK(truncate((dir3 + "/seg-9.idx").c_str(), 100) == 0);
+    CHECK(index.open(dir3));
+    CHECK(index.search("cat", 100) == cat_ids({}));
+    index.close();
+}
+
+int main() {
+    RUN(test_terms);
+    RUN(test_round_trip);
+    RUN(test_merge);
+    RUN(test_interrupted_merge);
+    if (test_failures() > 0) {
+        fprintf(stderr, "%d checks failed\n", test_failures());
+    }
+    return test_failures() > 0 ? 1 : 0;
+}
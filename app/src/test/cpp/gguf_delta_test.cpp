@@ -0,0 +1,347 @@
+#include "gguf_delta.h"
+#include "test_util.h"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <thread>
+
+struct TestTensor {
+    std::string name;
+    std::string data;
+};
+
+static std::string random_bytes(size_t n, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::string out(n, 0);
+    for (auto& c : out) {
+        c = (char) (rng() & 0xff);
+    }
+    return out;
+}
+
+static std::string read_file(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    std::stringstream text;
+    text << in.rdbuf();
+    return text.str();
+}
+
+static bool exists(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0;
+}
+
+// GGUF v3 with one string key and 1-D int8 tensors, data at the default
+// 32 byte alignment
+static void write_gguf(const std::string& path, const std::string& name, const std::vector<TestTensor>& tensors) {
+    std::string out;
+    auto u32 = [&](uint32_t v) { out.append((const char*) &v, 4); };
+    auto u64 = [&](uint64_t v) { out.append((const char*) &v, 8); };
+    auto str = [&](const std::string& s) { u64(s.size()); out += s; };
+    auto pad = [](uint64_t v) { return (v + 31) & ~uint64_t(31); };
+
+    out += "GGUF";
+    u32(3);
+    u64(tensors.size());
+    u64(1);
+    str("general.name");
+    u32(8);   // GGUF_TYPE_STRING
+    str(name);
+    uint64_t offset = 0;
+    for (const auto& t : tensors) {
+        str(t.name);
+        u32(1);
+        u64(t.data.size());
+        u32(24);   // GGML_TYPE_I8
+        u64(offset);
+        offset = pad(offset + t.data.size());
+    }
+    for (const auto& t : tensors) {
+        out.resize(pad(out.size()), 0);
+        out += t.data;
+    }
+    out.resize(pad(out.size()), 0);
+
+    const std::string tmp = path + ".tmp";
+    std::ofstream(tmp, std::ios::binary | std::ios::trunc) << out;
+    CHECK(rename(tmp.c_str(), path.c_str()) == 0);
+}
+
+// Stands in for the hub: serves files over HTTP on 127.0.0.1 and answers
+// Range requests with 206 and Content-Range, one request per connection
+class HubStandIn {
+public:
+    std::map<std::string, std::string> files;
+    // Flips a byte in every range it sends
+    bool corrupt = false;
+    std::atomic<int> n_ranges{0};
+
+    bool start() {
+        listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        if (listen_fd < 0 || bind(listen_fd, (sockaddr*) &addr, sizeof(addr)) != 0 || listen(listen_fd, 8) != 0 ||
+            getsockname(listen_fd, (sockaddr*) &addr, &len) != 0) {
+            return false;
+        }
+        port = ntohs(addr.sin_port);
+        thread = std::thread([this] {
+            for (;;) {
+                int conn = accept(listen_fd, nullptr, nullptr);
+                if (conn < 0) {
+                    return;
+                }
+                serve(conn);
+                close(conn);
+            }
+        });
+        return true;
+    }
+
+    void stop() {
+        shutdown(listen_fd, SHUT_RDWR);
+        thread.join();
+        close(listen_fd);
+    }
+
+    int port = 0;
+
+private:
+    void serve(int conn) {
+        std::string request;
+        char buf[4096];
+        while (request.find("\r\n\r\n") == std::string::npos) {
+            const ssize_t n = recv(conn, buf, sizeof(buf), 0);
+            if (n <= 0) {
+                return;
+            }
+            request.append(buf, (size_t) n);
+        }
+        char path[256] = {};
+        unsigned long long first = 0;
+        unsigned long long last = 0;
+        sscanf(request.c_str(), "GET %255s", path);
+        const size_t range = request.find("\r\nRange: bytes=");
+        const bool ranged = range != std::string::npos &&
+                            sscanf(request.c_str() + range, "\r\nRange: bytes=%llu-%llu", &first, &last) == 2;
+
+        auto it = files.find(path);
+        std::string head;
+        std::string body;
+        if (it == files.end()) {
+            head = "HTTP/1.1 404 Not Found\r\n";
+        } else if (ranged && first <= last && last < it->second.size()) {
+            body = it->second.substr(first, last - first + 1);
+            if (corrupt) {
+                body[body.size() / 2] ^= 1;
+            }
+            n_ranges++;
+            head = "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes " + std::to_string(first) + "-" +
+                   std::to_string(last) + "/" + std::to_string(it->second.size()) + "\r\n";
+        } else {
+            head = "HTTP/1.1 200 OK\r\n";
+            body = it->second;
+        }
+        head += "Content-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n";
+        const std::string response = head + body;
+        for (size_t sent = 0; sent < response.size();) {
+            const ssize_t n = send(conn, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) {
+                return;
+            }
+            sent += (size_t) n;
+        }
+    }
+
+    int listen_fd = -1;
+    std::thread thread;
+};
+
+// Minimal client with RangeFetcher's checks: a ranged request has to come
+// back as 206 with the Content-Range asked for
+static int http_get(int port, const std::string& path, const DeltaRange* range, std::string& body) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((uint16_t) port);
+    if (fd < 0 || connect(fd, (sockaddr*) &addr, sizeof(addr)) != 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    std::string request = "GET " + path + " HTTP/1.1\r\nHost: 127.0.0.1\r\n";
+    std::string expected_range;
+    if (range) {
+        const std::string bytes = std::to_string(range->offset) + "-" + std::to_string(range->offset + range->length - 1);
+        request += "Range: bytes=" + bytes + "\r\n";
+        expected_range = "\r\nContent-Range: bytes " + bytes + "/";
+    }
+    request += "\r\n";
+    send(fd, request.data(), request.size(), MSG_NOSIGNAL);
+
+    std::string response;
+    char buf[65536];
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+        response.append(buf, (size_t) n);
+    }
+    close(fd);
+    const size_t end = response.find("\r\n\r\n");
+    int status = 0;
+    if (end == std::string::npos || sscanf(response.c_str(), "HTTP/1.1 %d", &status) != 1) {
+        return -1;
+    }
+    if (range && (status != 206 || response.find(expected_range) > end)) {
+        return -1;
+    }
+    body = response.substr(end + 4);
+    return status;
+}
+
+// Old and new revision of a model: the new one has different metadata, a
+// changed tensor, a new tensor and the rest in another order. The unchanged
+// tensors are well over the fetch merge gap, so they stay out of the fetch.
+static const std::string OLD_NAME = "test model r1";
+static const std::string NEW_NAME = "test model r2";
+
+static std::vector<TestTensor> old_tensors() {
+    return {{"token_embd.weight", random_bytes(256 << 10, 1)},
+            {"blk.0.attn_q.weight", random_bytes(16 << 10, 2)},
+            {"blk.1.attn_q.weight", random_bytes(128 << 10, 3)},
+            {"output.weight", random_bytes(100 << 10, 4)}};
+}
+
+static std::vector<TestTensor> new_tensors() {
+    auto old = old_tensors();
+    return {{"blk.0.attn_q.weight", random_bytes(16 << 10, 5)},
+            old[0],
+            old[2],
+            {"blk.1.attn_k.weight", random_bytes(4 << 10, 6)},
+            old[3]};
+}
+
+struct DeltaFixture {
+    std::string local;
+    std::string remote;
+    std::string out;
+    std::string new_bytes;
+    HubStandIn hub;
+
+    DeltaFixture() {
+        const std::string dir = temp_dir("gguf-delta");
+        local = dir + "/model.gguf";
+        remote = dir + "/hub-model.gguf";
+        out = local + ".delta";
+        write_gguf(local, OLD_NAME, old_tensors());
+        write_gguf(remote, NEW_NAME, new_tensors());
+        // The publisher's manifest, as scripts/gguf-tensor-manifest.py writes it
+        TensorManifest manifest;
+        CHECK(build_tensor_manifest(remote, manifest));
+        new_bytes = read_file(remote);
+        hub.files["/model.gguf"] = new_bytes;
+        hub.files["/model.gguf.tensors.sha256"] = manifest.toText();
+        CHECK(hub.start());
+    }
+
+    ~DeltaFixture() { hub.stop(); }
+
+    // What updateFromHuggingFace does, with the stand-in as the hub
+    bool update(std::vector<DeltaRange>& fetch) {
+        std::string text;
+        TensorManifest remote_manifest;
+        if (http_get(hub.port, "/model.gguf.tensors.sha256", nullptr, text) != 200 || !remote_manifest.parse(text)) {
+            return false;
+        }
+        if (!delta_prepare(local, remote_manifest, out, fetch)) {
+            return false;
+        }
+        int fd = open(out.c_str(), O_WRONLY | O_CLOEXEC);
+        bool ok = fd >= 0;
+        for (const auto& r : fetch) {
+            std::string body;
+            ok = ok && http_get(hub.port, "/model.gguf", &r, body) == 206 && body.size() == r.length &&
+                 pwrite(fd, body.data(), body.size(), (off_t) r.offset) == (ssize_t) body.size();
+        }
+        if (fd >= 0) close(fd);
+        return ok && delta_commit(local, remote_manifest, out);
+    }
+};
+
+static void test_round_trip() {
+    DeltaFixture f;
+    const std::string old_bytes = read_file(f.local);
+    std::vector<DeltaRange> fetch;
+    CHECK(f.update(fetch));
+
+    // The header with the changed tensor right after it, and the new tensor
+    uint64_t fetched = 0;
+    for (const auto& r : fetch) {
+        fetched += r.length;
+    }
+    CHECK(fetch.size() == 2);
+    CHECK(fetched < (24 << 10) + 1024);
+    CHECK(f.hub.n_ranges == (int) fetch.size());
+
+    CHECK(read_file(f.local) == f.new_bytes);
+    CHECK(read_file(f.local) != old_bytes);
+    CHECK(!exists(f.out));
+
+    // The cached manifest describes the updated file, a second update has
+    // nothing left to fetch but the header
+    TensorManifest cached;
+    TensorManifest remote;
+    CHECK(build_tensor_manifest(f.local, cached));
+    CHECK(remote.parse(f.hub.files["/model.gguf.tensors.sha256"]));
+    CHECK(cached.file_sha256 == remote.file_sha256);
+    CHECK(f.update(fetch));
+    CHECK(fetch.size() == 1 && fetch[0].offset == 0 && fetch[0].length == remote.data_offset);
+}
+
+static void test_corrupt_range() {
+    DeltaFixture f;
+    f.hub.corrupt = true;
+    const std::string old_bytes = read_file(f.local);
+    std::vector<DeltaRange> fetch;
+    CHECK(!f.update(fetch));
+    CHECK(!fetch.empty());
+    CHECK(read_file(f.local) == old_bytes);
+    CHECK(!exists(f.out));
+}
+
+// A file rewritten in place right after its manifest was cached (the layout
+// optimization after an update) is hashed again, not served the stale sidecar
+static void test_rewritten_file_rehashed() {
+    DeltaFixture f;
+    TensorManifest before;
+    CHECK(build_tensor_manifest(f.local, before));
+    auto reordered = old_tensors();
+    std::swap(reordered[0], reordered[3]);
+    write_gguf(f.local, OLD_NAME, reordered);
+
+    TensorManifest after;
+    CHECK(build_tensor_manifest(f.local, after));
+    CHECK(after.file_size == before.file_size);
+    CHECK(after.file_sha256 != before.file_sha256);
+    CHECK(after.tensors.size() == 4 && after.tensors[0].name == "output.weight");
+}
+
+int main() {
+    RUN(test_round_trip);
+    RUN(test_corrupt_range);
+    RUN(test_rewritten_file_rehashed);
+    if (test_failures() > 0) {
+        fprintf(stderr, "%d checks failed\n", test_failures());
+    }
+    return test_failures() > 0 ? 1 : 0;
+}
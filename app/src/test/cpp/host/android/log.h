@@ -0,0 +1,17 @@
+#pragma once
+
+// The part of the NDK's <android/log.h> async_log.cpp uses, host_support.cpp
+// writes it to stderr
+
+enum {
+    ANDROID_LOG_UNKNOWN = 0,
+    ANDROID_LOG_DEFAULT,
+    ANDROID_LOG_VERBOSE,
+    ANDROID_LOG_DEBUG,
+    ANDROID_LOG_INFO,
+    ANDROID_LOG_WARN,
+    ANDROID_LOG_ERROR,
+    ANDROID_LOG_FATAL,
+};
+
+extern "C" int __android_log_write(int prio, const char* tag, const char* text);
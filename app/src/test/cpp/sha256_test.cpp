@@ -0,0 +1,52 @@
+#include "sha256.h"
+#include "test_util.h"
+#include <algorithm>
+#include <string>
+
+static std::string sha256(const std::string& data) {
+    Sha256 hash;
+    hash.update(data.data(), data.size());
+    return hash.hexDigest();
+}
+
+// FIPS 180-2 appendix B and the usual extra vectors
+static void test_known_answers() {
+    CHECK(sha256("") == "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+    CHECK(sha256("abc") == "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+    CHECK(sha256("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq") ==
+          "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+    CHECK(sha256("abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu") ==
+          "cf5b16a778af8380036ce59e7b0492370b249b11e8f07a51afac45037afee9d1");
+    CHECK(sha256(std::string(1000000, 'a')) == "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+}
+
+// Lengths around the block size, where the padding spills into a second block
+static void test_padding_edges() {
+    CHECK(sha256(std::string(55, 'a')) == "9f4390f8d30c2dd92ec9f095b65e2b9ae9b0a925a5258e241c9f1e910f734318");
+    CHECK(sha256(std::string(56, 'a')) == "b35439a4ac6f0948b6d6f9e3c6af0f5f590ce20f1bde7090ef7970686ec6738a");
+    CHECK(sha256(std::string(63, 'a')) == "7d3e74a05d7db15bce4ad9ec0658ea98e3f06eeecf16b4c6fff2da457ddc2f34");
+    CHECK(sha256(std::string(64, 'a')) == "ffe054fe7ae0cb6dc65c3af9b61d5209f439851db43d0ba5997337df154668eb");
+    CHECK(sha256(std::string(65, 'a')) == "635361c48bb9eab14198e76ea8ab7f1a41685d6ad62aa9146d301d4f17eb0ae0");
+}
+
+// hash_file feeds the data in whatever pieces pread returns
+static void test_split_updates() {
+    const std::string data(1000000, 'a');
+    for (size_t piece : {1, 3, 63, 64, 65, 4096, 8191}) {
+        Sha256 hash;
+        for (size_t pos = 0; pos < data.size(); pos += piece) {
+            hash.update(data.data() + pos, std::min(piece, data.size() - pos));
+        }
+        CHECK(hash.hexDigest() == "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+    }
+}
+
+int main() {
+    RUN(test_known_answers);
+    RUN(test_padding_edges);
+    RUN(test_split_updates);
+    if (test_failures() > 0) {
+        fprintf(stderr, "%d checks failed\n", test_failures());
+    }
+    return test_failures() > 0 ? 1 : 0;
+}
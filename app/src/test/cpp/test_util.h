@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+// Just enough of a test harness: CHECK records a failure and carries on,
+// main returns test_failures() so ctest sees it
+
+inline int& test_failures() {
+    static int n = 0;
+    return n;
+}
+
+#define CHECK(cond)                                                             \
+    do {                                                                        \
+        if (!(cond)) {                                                          \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            test_failures()++;                                                  \
+        }                                                                       \
+    } while (0)
+
+#define RUN(test)                          \
+    do {                                   \
+        fprintf(stderr, "%s\n", #test);    \
+        test();                            \
+    } while (0)
+
+// Fresh, empty directory under TMPDIR
+inline std::string temp_dir(const char* name) {
+    const char* tmp = getenv("TMPDIR");
+    std::string dir = std::string(tmp ? tmp : "/tmp") + "/" + name + "-XXXXXX";
+    if (!mkdtemp(&dir[0])) {
+        perror("mkdtemp");
+        exit(2);
+    }
+    return dir;
+}
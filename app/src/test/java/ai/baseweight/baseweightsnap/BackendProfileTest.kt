@@ -0,0 +1,97 @@
+package ai.baseweight.baseweightsnap
+
+import org.junit.Assert.*
+import org.junit.Test
+import java.io.IOException
+
+class BackendProfileTest {
+
+    @Test
+    fun `test hexagon preferred over opencl`() {
+        val chosen = BackendProfile.choose(listOf("cpu", "opencl", "hexagon"))
+        assertEquals(listOf("cpu", "hexagon"), chosen)
+    }
+
+    @Test
+    fun `test opencl used when hexagon has no device`() {
+        val chosen = BackendProfile.choose(listOf("cpu", "opencl"))
+        assertEquals(listOf("cpu", "opencl"), chosen)
+    }
+
+    @Test
+    fun `test builtin registry names are matched case-insensitively`() {
+        val chosen = BackendProfile.choose(listOf("Vulkan", "CPU"))
+        assertEquals(listOf("cpu", "vulkan"), chosen)
+    }
+
+    @Test
+    fun `test cpu only device`() {
+        assertEquals(listOf("cpu"), BackendProfile.choose(listOf("cpu")))
+    }
+
+    @Test
+    fun `test nothing registered`() {
+        assertTrue(BackendProfile.choose(emptyList()).isEmpty())
+    }
+
+    @Test
+    fun `test backend failure widens and saves the profile once the retry loads`() {
+        var attempts = 0
+        val saved = mutableListOf<List<String>>()
+        val loaded = BackendProfile.loadWithFallback(
+            listOf("cpu", "hexagon"),
+            load = { if (++attempts == 1) throw IllegalStateException("Failed to initialize models") else true },
+            loadRemaining = { listOf("CPU", "hexagon", "opencl") },
+            save = { saved.add(it) },
+        )
+        assertTrue(loaded)
+        assertEquals(2, attempts)
+        assertEquals(listOf(listOf("CPU", "hexagon", "opencl")), saved)
+    }
+
+    @Test
+    fun `test failed retry leaves the profile alone`() {
+        var attempts = 0
+        val saved = mutableListOf<List<String>>()
+        assertThrows(IllegalStateException::class.java) {
+            BackendProfile.loadWithFallback(
+                listOf("cpu", "hexagon"),
+                load = { attempts++; throw IllegalStateException("Failed to initialize models") },
+                loadRemaining = { listOf("cpu", "hexagon", "opencl") },
+                save = { saved.add(it) },
+            )
+        }
+        assertEquals(2, attempts)
+        assertTrue(saved.isEmpty())
+    }
+
+    @Test
+    fun `test no retry when there were no other backends`() {
+        var attempts = 0
+        assertThrows(IllegalStateException::class.java) {
+            BackendProfile.loadWithFallback(
+                listOf("cpu", "vulkan"),
+                load = { attempts++; throw IllegalStateException("Failed to initialize models") },
+                loadRemaining = { listOf("CPU", "Vulkan") },
+                save = { fail("nothing should be saved") },
+            )
+        }
+        assertEquals(1, attempts)
+    }
+
+    @Test
+    fun `test file errors are not retried or saved`() {
+        var attempts = 0
+        var loadedRemaining = false
+        assertThrows(IOException::class.java) {
+            BackendProfile.loadWithFallback(
+                listOf("cpu", "hexagon"),
+                load = { attempts++; throw IOException("model.gguf: No such file or directory") },
+                loadRemaining = { loadedRemaining = true; listOf("cpu", "hexagon", "opencl") },
+                save = { fail("nothing should be saved") },
+            )
+        }
+        assertEquals(1, attempts)
+        assertFalse(loadedRemaining)
+    }
+}
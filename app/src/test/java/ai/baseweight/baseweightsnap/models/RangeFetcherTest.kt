@@ -0,0 +1,94 @@
+package ai.baseweight.baseweightsnap.models
+
+import com.sun.net.httpserver.HttpServer
+import org.junit.After
+import org.junit.Assert.*
+import org.junit.Before
+import org.junit.Test
+import java.io.File
+import java.io.IOException
+import java.net.InetSocketAddress
+import kotlin.random.Random
+
+/**
+ * Tests RangeFetcher against a local HTTP server standing in for the hub
+ */
+class RangeFetcherTest {
+
+    private lateinit var server: HttpServer
+    private lateinit var out: File
+    private val remote = Random(42).nextBytes(256 * 1024)
+    private var honorRanges = true
+    private var requests = 0
+
+    @Before
+    fun setUp() {
+        server = HttpServer.create(InetSocketAddress("127.0.0.1", 0), 0)
+        server.createContext("/model.gguf") { exchange ->
+            requests++
+            val range = exchange.requestHeaders.getFirst("Range")
+            val match = range?.let { Regex("bytes=(\\d+)-(\\d+)").matchEntire(it) }
+            if (honorRanges && match != null) {
+                val first = match.groupValues[1].toInt()
+                val last = match.groupValues[2].toInt()
+                exchange.responseHeaders.add("Content-Range", "bytes $first-$last/${remote.size}")
+                exchange.sendResponseHeaders(206, (last - first + 1).toLong())
+                exchange.responseBody.use { it.write(remote, first, last - first + 1) }
+            } else {
+                exchange.sendResponseHeaders(200, remote.size.toLong())
+                exchange.responseBody.use { it.write(remote) }
+            }
+        }
+        server.createContext("/model.gguf.tensors.sha256") { exchange ->
+            val body = "gguf-tensor-manifest 1\n".toByteArray()
+            exchange.sendResponseHeaders(200, body.size.toLong())
+            exchange.responseBody.use { it.write(body) }
+        }
+        server.start()
+        out = File.createTempFile("range-fetcher", ".gguf")
+    }
+
+    @After
+    fun tearDown() {
+        server.stop(0)
+        out.delete()
+    }
+
+    private fun url(path: String) = "http://127.0.0.1:${server.address.port}$path"
+
+    @Test
+    fun `fetched ranges land at their offsets and nothing else is touched`() {
+        out.writeBytes(ByteArray(remote.size))
+        val ranges = longArrayOf(0, 4096, 100_000, 70_000, remote.size - 10L, 10)
+        var progress = 0L
+
+        RangeFetcher().fetch(url("/model.gguf"), ranges, out) { progress = it }
+
+        val local = out.readBytes()
+        for (i in ranges.indices step 2) {
+            val from = ranges[i].toInt()
+            val to = from + ranges[i + 1].toInt()
+            assertArrayEquals(remote.copyOfRange(from, to), local.copyOfRange(from, to))
+        }
+        assertTrue("Gap between ranges stays zero", local.copyOfRange(4096, 100_000).all { it == 0.toByte() })
+        assertEquals(4096L + 70_000 + 10, progress)
+        assertEquals(3, requests)
+    }
+
+    @Test
+    fun `server that ignores Range is rejected instead of downloading everything`() {
+        honorRanges = false
+        out.writeBytes(ByteArray(remote.size))
+
+        assertThrows(IOException::class.java) {
+            RangeFetcher().fetch(url("/model.gguf"), longArrayOf(1000, 10), out)
+        }
+    }
+
+    @Test
+    fun `missing manifest is null, present one is returned`() {
+        val fetcher = RangeFetcher()
+        assertNull(fetcher.fetchText(url("/missing.tensors.sha256")))
+        assertEquals("gguf-tensor-manifest 1\n", fetcher.fetchText(url("/model.gguf.tensors.sha256")))
+    }
+}
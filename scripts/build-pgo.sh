@@ -0,0 +1,67 @@
+#!/bin/bash
+# PGO + ThinLTO build script for BaseweightSnap
+# Run this on your host machine with a device attached over adb
+
+set -e
+
+echo "================================================"
+echo "Building BaseweightSnap with PGO + ThinLTO"
+echo "================================================"
+echo ""
+
+# Configuration
+FLAVOR="${FLAVOR:-Vulkan}"   # Vulkan or Hexagon
+PACKAGE="ai.baseweight.baseweightsnap"
+DEVICE_PGO_DIR="/sdcard/Android/data/$PACKAGE/files/pgo"
+PGO_DIR="app/pgo"
+PROFDATA="$PGO_DIR/baseweightsnap.profdata"
+FLAVOR_LOWER=$(echo "$FLAVOR" | tr '[:upper:]' '[:lower:]')
+
+if [ -z "$ANDROID_NDK_HOME" ]; then
+    echo "❌ ANDROID_NDK_HOME is not set (needed for llvm-profdata)"
+    exit 1
+fi
+LLVM_PROFDATA=$(ls "$ANDROID_NDK_HOME"/toolchains/llvm/prebuilt/*/bin/llvm-profdata | head -n 1)
+
+# Step 1: instrumented build
+echo "🔧 Building instrumented $FLAVOR release..."
+./gradlew clean
+./gradlew "assemble${FLAVOR}Release" -Pbaseweight.pgo=generate -Pbaseweight.lto=true
+adb install -r "app/build/outputs/apk/$FLAVOR_LOWER/release/app-$FLAVOR_LOWER-release.apk"
+adb shell rm -rf "$DEVICE_PGO_DIR"
+
+# Step 2: training workload
+echo ""
+echo "📱 Run the training workload on the device now:"
+echo "   - load the default model"
+echo "   - snap or pick ~10 photos of different sizes"
+echo "   - run 'Describe' on each, and ask one typed question on a few of them"
+echo "   Every finished request flushes a profile to $DEVICE_PGO_DIR"
+echo ""
+read -r -p "Press enter when the workload is done... "
+
+# Step 3: merge the profiles
+mkdir -p "$PGO_DIR/raw"
+rm -f "$PGO_DIR"/raw/*.profraw
+adb pull "$DEVICE_PGO_DIR/." "$PGO_DIR/raw/"
+if ! ls "$PGO_DIR"/raw/*.profraw > /dev/null 2>&1; then
+    echo "❌ No .profraw files found on the device"
+    exit 1
+fi
+"$LLVM_PROFDATA" merge -output="$PROFDATA" "$PGO_DIR"/raw/*.profraw
+echo "✓ Merged profile: $PROFDATA"
+
+# Step 4: optimized build
+echo ""
+echo "🚀 Building optimized $FLAVOR release..."
+./gradlew clean
+./gradlew "assemble${FLAVOR}Release" -Pbaseweight.pgo=use -Pbaseweight.lto=true
+
+echo ""
+echo "================================================"
+echo "✅ PGO + ThinLTO build complete!"
+echo "================================================"
+echo ""
+echo "APK: app/build/outputs/apk/$FLAVOR_LOWER/release/app-$FLAVOR_LOWER-release.apk"
+echo "Compare per-phase numbers against a default build with:"
+echo "  adb logcat -s model_manager.cpp | grep timings"
@@ -0,0 +1,55 @@
+#!/usr/bin/env python3
+# Writes <model>.tensors.sha256 for each GGUF given, the manifest the app
+# uses to update a downloaded model by fetching only the tensors that changed.
+# Upload it next to the GGUF in the same commit.
+#
+# Needs llama.cpp's gguf-py:
+#   pip install -e app/src/main/cpp/llama.cpp/gguf-py
+
+import hashlib
+import sys
+
+from gguf import GGUFReader
+
+CHUNK = 8 << 20
+
+
+def sha256_range(f, begin, end):
+    h = hashlib.sha256()
+    f.seek(begin)
+    remaining = end - begin
+    while remaining > 0:
+        data = f.read(min(CHUNK, remaining))
+        if not data:
+            raise IOError("unexpected end of file")
+        h.update(data)
+        remaining -= len(data)
+    return h.hexdigest()
+
+
+def manifest(path):
+    reader = GGUFReader(path)
+    tensors = sorted(reader.tensors, key=lambda t: t.data_offset)
+    with open(path, "rb") as f:
+        f.seek(0, 2)
+        size = f.tell()
+        lines = [
+            "gguf-tensor-manifest 1",
+            f"file {size} {sha256_range(f, 0, size)}",
+            f"header {reader.data_offset} {sha256_range(f, 0, reader.data_offset)}",
+        ]
+        for t in tensors:
+            begin = int(t.data_offset)
+            end = begin + int(t.n_bytes)
+            lines.append(f"tensor {begin} {end - begin} {sha256_range(f, begin, end)} {t.name}")
+    return "\n".join(lines) + "\n"
+
+
+if __name__ == "__main__":
+    if len(sys.argv) < 2:
+        print(f"usage: {sys.argv[0]} model.gguf [...]", file=sys.stderr)
+        sys.exit(1)
+    for path in sys.argv[1:]:
+        with open(path + ".tensors.sha256", "w") as out:
+            out.write(manifest(path))
+        print(f"wrote {path}.tensors.sha256")